@@ -0,0 +1,929 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "openssl/ssl.h"
+#include "openssl/err.h"
+
+// Simulated viewers for sizing hardware and catching regressions. Opens
+// streams, stills, static files and reconnect storms against a running
+// hawkeye, all from one poll() loop, and prints what they got and what it
+// cost the server as JSON.
+
+#define MAX_CLIENTS 8192
+#define READ_SIZE 64*1024
+#define MAX_HEADER_SIZE 4096
+#define CONNECT_WAIT 10.0           // Seconds to wait for the server to come up
+#define RETRY_DELAY 0.5             // Before a client that failed connects again
+#define POLL_INTERVAL 10            // Milliseconds, for clients that are throttled or waiting
+
+#define KIND_STREAM 0               // /stream/N?timestamps=1, read as fast as it comes
+#define KIND_SLOW 1                 // The same, read at slow_rate
+#define KIND_STILL 2                // /still/N every interval
+#define KIND_STATIC 3               // static_path every interval
+#define KIND_STORM 4                // /stream/N until the first frame, then again
+#define KIND_COUNT 5
+
+#define STATE_IDLE 0                // Waiting for start_at
+#define STATE_CONNECTING 1
+#define STATE_HANDSHAKE 2
+#define STATE_REQUEST 3
+#define STATE_HEADER 4              // Of the response, or of a part
+#define STATE_BODY 5                // Of the response, or of a part
+
+#define REQUEST_TMPL "GET %s HTTP/1.1\r\n" \
+    "Host: %s:%d\r\n" \
+    "User-Agent: hawkeye-loadgen\r\n" \
+    "Accept: */*\r\n" \
+    "Connection: close\r\n" \
+    "\r\n"
+
+struct samples {
+    double *values;
+    size_t count;
+    size_t size;
+};
+
+struct client {
+    int kind;                       // KIND_*
+    int camera;
+    int sock;
+    SSL *ssl;
+    SSL_SESSION *session;           // Of the last connection, offered again with -R
+    int state;                      // STATE_*
+    int ssl_want;                   // SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE
+
+    char request[256];
+    size_t request_len;
+    size_t request_pos;
+
+    char header[MAX_HEADER_SIZE];
+    size_t header_len;
+    short got_response;             // Past the response header, onto the parts
+    long body_left;                 // -1 until the connection closes
+    double part_timestamp;
+
+    double start_at;
+    double connected_at;            // When the request was started
+    double started_reading_at;      // For slow readers
+    unsigned long read_since_start;
+
+    unsigned long frames;
+    unsigned long requests;
+    unsigned long bytes;
+    unsigned long errors;
+    unsigned long handshakes;       // Over TLS
+    unsigned long resumed;          // Handshakes that resumed a session
+    struct samples latencies;       // Of this client's frames, for streams
+};
+
+struct kind_stats {
+    const char *name;
+    int clients;
+    struct samples latencies;       // Of frames for streams, of responses otherwise
+};
+
+struct server_sample {
+    double at;
+    double cpu;                     // Seconds of user and system time
+    long rss_kb;
+    long peak_rss_kb;
+};
+
+static void print_usage(const char *program);
+static double gettime();
+static void add_sample(struct samples *s, double value);
+static int compare_doubles(const void *a, const void *b);
+static double percentile(struct samples *s, double p);
+static short sample_server(pid_t pid, struct server_sample *sample);
+static int resolve(const char *host, int port, struct sockaddr_storage *addr, socklen_t *addr_len);
+static short wait_for_server(struct sockaddr_storage *addr, socklen_t addr_len);
+static void start_request(struct client *c, double now);
+static void close_client(struct client *c, double again_at);
+static void fail_client(struct client *c, double now);
+static void finish_request(struct client *c, double now);
+static ssize_t client_recv(struct client *c, void *buf, size_t len);
+static ssize_t client_send(struct client *c, const void *buf, size_t len);
+static short parse_header(struct client *c, double now);
+static void consume(struct client *c, char *buf, size_t len, double now);
+static void handle_client(struct client *c, short revents, double now);
+static size_t read_allowance(struct client *c, double now);
+static void print_kind(struct kind_stats *k, struct client *clients, int client_count, double duration, short last);
+
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+static SSL_CTX *ssl_ctx = NULL;
+static const char *host = "127.0.0.1";
+static int port = 8000;
+static const char *static_path = "/index.html";
+static double slow_rate = 32 * 1024;
+static double interval = 1.0;
+static short resume_tls = 0;
+static short measuring = 0;
+
+static struct kind_stats kinds[KIND_COUNT] = {
+    {"stream"}, {"slow"}, {"still"}, {"static"}, {"storm"}
+};
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-t] [-P server-pid] [-d seconds]\n", program);
+    fprintf(stderr, "       [-w warmup-seconds] [-c cameras] [-n stream-clients] [-s slow-clients]\n");
+    fprintf(stderr, "       [-S slow-rate-KB/s] [-g still-clients] [-f static-clients]\n");
+    fprintf(stderr, "       [-u static-path] [-i interval] [-r storm-clients] [-N name] [-R]\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-t connects over TLS, and with -R each client resumes the session of its\n");
+    fprintf(stderr, "last connection, as browsers do. -i is the seconds between the requests of\n");
+    fprintf(stderr, "each still and static client. With -P, the CPU time and memory of that\n");
+    fprintf(stderr, "process are reported too.\n");
+}
+
+static double gettime() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + ((double) tv.tv_usec) / 1000 / 1000;
+}
+
+static void add_sample(struct samples *s, double value) {
+    if (!measuring) {
+        return;
+    }
+
+    if (s->count == s->size) {
+        s->size = (s->size > 0) ? 2 * s->size : 1024;
+        s->values = realloc(s->values, s->size * sizeof(double));
+        if (s->values == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    s->values[s->count++] = value;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank, the samples must have been sorted
+static double percentile(struct samples *s, double p) {
+    size_t rank;
+
+    if (s->count == 0) {
+        return 0;
+    }
+
+    rank = (size_t) (p / 100 * s->count + 0.5);
+    rank = (rank < 1) ? 1 : (rank > s->count) ? s->count : rank;
+    return s->values[rank - 1];
+}
+
+// Reads the CPU time and memory of the server from /proc
+static short sample_server(pid_t pid, struct server_sample *sample) {
+    char path[64], buf[4096], *p;
+    unsigned long utime, stime;
+    FILE *f;
+    size_t len;
+
+    sample->at = gettime();
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    if ((f = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+
+    len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+
+    // The command name may contain spaces, the fields start after it
+    if ((p = strrchr(buf, ')')) == NULL ||
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return 0;
+    }
+
+    sample->cpu = (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+    if ((f = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        if (strncmp(buf, "VmRSS:", strlen("VmRSS:")) == 0) {
+            sample->rss_kb = atol(&buf[strlen("VmRSS:")]);
+        }
+        else if (strncmp(buf, "VmHWM:", strlen("VmHWM:")) == 0) {
+            sample->peak_rss_kb = atol(&buf[strlen("VmHWM:")]);
+        }
+    }
+
+    fclose(f);
+    return 1;
+}
+
+static int resolve(const char *host, int port, struct sockaddr_storage *addr, socklen_t *addr_len) {
+    struct addrinfo hints, *res;
+    char service[16];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        return -1;
+    }
+
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+// The server may only just have been started
+static short wait_for_server(struct sockaddr_storage *addr, socklen_t addr_len) {
+    double give_up_at = gettime() + CONNECT_WAIT;
+    int sock;
+
+    while (gettime() < give_up_at) {
+        sock = socket(addr->ss_family, SOCK_STREAM, 0);
+        if (connect(sock, (struct sockaddr *) addr, addr_len) == 0) {
+            close(sock);
+            return 1;
+        }
+
+        close(sock);
+        usleep(100 * 1000);
+    }
+
+    return 0;
+}
+
+static void start_request(struct client *c, double now) {
+    char path[128];
+    int one = 1;
+
+    switch (c->kind) {
+        case KIND_STREAM:
+        case KIND_SLOW:
+        case KIND_STORM:
+            snprintf(path, sizeof(path), "/stream/%d?timestamps=1", c->camera);
+            break;
+        case KIND_STILL:
+            snprintf(path, sizeof(path), "/still/%d", c->camera);
+            break;
+        default:
+            snprintf(path, sizeof(path), "%s", static_path);
+            break;
+    }
+
+    c->request_len = snprintf(c->request, sizeof(c->request), REQUEST_TMPL, path, host, port);
+    c->request_pos = 0;
+    c->header_len = 0;
+    c->got_response = 0;
+    c->body_left = 0;
+    c->part_timestamp = 0;
+    c->connected_at = now;
+    c->started_reading_at = now;
+    c->read_since_start = 0;
+
+    c->sock = socket(server_addr.ss_family, SOCK_STREAM, 0);
+    if (c->sock < 0) {
+        fail_client(c, now);
+        return;
+    }
+
+    fcntl(c->sock, F_SETFL, fcntl(c->sock, F_GETFL) | O_NONBLOCK);
+    setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // Slow readers take what they are sent through a small window, as a
+    // viewer on a poor link would
+    if (c->kind == KIND_SLOW) {
+        int rcvbuf = (int) slow_rate;
+        setsockopt(c->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+
+    c->state = STATE_CONNECTING;
+    if (connect(c->sock, (struct sockaddr *) &server_addr, server_addr_len) < 0 && errno != EINPROGRESS) {
+        fail_client(c, now);
+    }
+}
+
+static void close_client(struct client *c, double again_at) {
+    SSL_SESSION *session;
+
+    if (c->ssl != NULL) {
+        // Sessions of connections that were not shut down cannot be resumed.
+        // With TLS 1.3 the session only becomes resumable once a ticket has
+        // come in after the handshake, so the last one that was is kept.
+        if (resume_tls && c->state >= STATE_REQUEST) {
+            SSL_shutdown(c->ssl);
+            session = SSL_get1_session(c->ssl);
+            if (session != NULL && SSL_SESSION_is_resumable(session)) {
+                SSL_SESSION_free(c->session);
+                c->session = session;
+            }
+            else {
+                SSL_SESSION_free(session);
+            }
+        }
+
+        SSL_free(c->ssl);
+        c->ssl = NULL;
+    }
+
+    if (c->sock >= 0) {
+        close(c->sock);
+        c->sock = -1;
+    }
+
+    c->state = STATE_IDLE;
+    c->start_at = again_at;
+}
+
+static void fail_client(struct client *c, double now) {
+    if (measuring) {
+        c->errors++;
+    }
+
+    close_client(c, now + RETRY_DELAY);
+}
+
+// A still, a static file or a storm's first frame has come in
+static void finish_request(struct client *c, double now) {
+    add_sample(&kinds[c->kind].latencies, now - c->connected_at);
+    if (measuring) {
+        c->requests++;
+    }
+
+    // Stills and static files come back at their interval, storms at once
+    close_client(c, (c->kind == KIND_STORM) ? now : c->connected_at + interval);
+}
+
+// Both return the number of bytes, 0 if the call would block and -1 if the
+// connection is gone
+static ssize_t client_recv(struct client *c, void *buf, size_t len) {
+    ssize_t ret;
+
+    if (c->ssl != NULL) {
+        if ((ret = SSL_read(c->ssl, buf, len)) <= 0) {
+            c->ssl_want = SSL_get_error(c->ssl, ret);
+            return (c->ssl_want == SSL_ERROR_WANT_READ || c->ssl_want == SSL_ERROR_WANT_WRITE) ? 0 : -1;
+        }
+        return ret;
+    }
+
+    ret = recv(c->sock, buf, len, 0);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+
+    return (ret == 0) ? -1 : ret;
+}
+
+static ssize_t client_send(struct client *c, const void *buf, size_t len) {
+    ssize_t ret;
+
+    if (c->ssl != NULL) {
+        if ((ret = SSL_write(c->ssl, buf, len)) <= 0) {
+            c->ssl_want = SSL_get_error(c->ssl, ret);
+            return (c->ssl_want == SSL_ERROR_WANT_READ || c->ssl_want == SSL_ERROR_WANT_WRITE) ? 0 : -1;
+        }
+        return ret;
+    }
+
+    ret = send(c->sock, buf, len, MSG_NOSIGNAL);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+
+    return ret;
+}
+
+// Handles a complete response or part header. Returns 0 if the client
+// failed.
+static short parse_header(struct client *c, double now) {
+    char *line, *save = NULL;
+    short ok = 1;
+
+    c->header[c->header_len] = '\0';
+    c->body_left = -1;
+
+    if (!c->got_response) {
+        // HTTP/1.x 200
+        ok = strncmp(c->header, "HTTP/1.", strlen("HTTP/1.")) == 0 && atoi(&c->header[strlen("HTTP/1.x ")]) == 200;
+    }
+
+    for (line = strtok_r(c->header, "\r\n", &save); line != NULL; line = strtok_r(NULL, "\r\n", &save)) {
+        if (strncasecmp(line, "Content-Length:", strlen("Content-Length:")) == 0) {
+            c->body_left = atol(&line[strlen("Content-Length:")]);
+        }
+        else if (strncasecmp(line, "X-Timestamp:", strlen("X-Timestamp:")) == 0) {
+            c->part_timestamp = atof(&line[strlen("X-Timestamp:")]);
+        }
+    }
+
+    c->header_len = 0;
+    if (!ok) {
+        return 0;
+    }
+
+    if (!c->got_response) {
+        c->got_response = 1;
+
+        // A stream carries on with the header of the first part
+        if (c->kind == KIND_STREAM || c->kind == KIND_SLOW || c->kind == KIND_STORM) {
+            c->state = STATE_HEADER;
+            return 1;
+        }
+    }
+
+    c->state = STATE_BODY;
+    return 1;
+}
+
+// Takes in what was read, which may span any number of headers and bodies
+static void consume(struct client *c, char *buf, size_t len, double now) {
+    size_t n;
+    char *end;
+
+    if (measuring) {
+        c->bytes += len;
+    }
+
+    while (len > 0 && c->state >= STATE_HEADER) {
+        if (c->state == STATE_HEADER) {
+            n = (len < MAX_HEADER_SIZE - 1 - c->header_len) ? len : MAX_HEADER_SIZE - 1 - c->header_len;
+            memcpy(&c->header[c->header_len], buf, n);
+            c->header[c->header_len + n] = '\0';
+
+            if ((end = strstr(c->header, "\r\n\r\n")) == NULL) {
+                if (c->header_len + n >= MAX_HEADER_SIZE - 1) {
+                    fail_client(c, now);
+                    return;
+                }
+
+                c->header_len += n;
+                return;
+            }
+
+            // Only up to the end of the header belongs to it
+            n = end + 4 - &c->header[c->header_len];
+            c->header_len = end + 4 - c->header;
+            buf += n;
+            len -= n;
+
+            if (!parse_header(c, now)) {
+                fail_client(c, now);
+                return;
+            }
+        }
+        else {
+            n = (c->body_left >= 0 && (size_t) c->body_left < len) ? (size_t) c->body_left : len;
+            buf += n;
+            len -= n;
+
+            if (c->body_left < 0) {
+                continue; // Until the connection closes
+            }
+
+            c->body_left -= n;
+            if (c->body_left > 0) {
+                continue;
+            }
+
+            if (!(c->kind == KIND_STREAM || c->kind == KIND_SLOW || c->kind == KIND_STORM)) {
+                finish_request(c, now);
+                return;
+            }
+
+            // A whole frame. Its capture time is the server's, which is
+            // fine as long as both run on the same machine or are in sync.
+            if (c->part_timestamp > 0 && c->kind != KIND_STORM) {
+                add_sample(&kinds[c->kind].latencies, now - c->part_timestamp);
+                add_sample(&c->latencies, now - c->part_timestamp);
+            }
+
+            if (measuring) {
+                c->frames++;
+            }
+
+            if (c->kind == KIND_STORM) {
+                finish_request(c, now);
+                return;
+            }
+
+            c->part_timestamp = 0;
+            c->state = STATE_HEADER;
+        }
+    }
+}
+
+// How much a slow reader may read now
+static size_t read_allowance(struct client *c, double now) {
+    double allowed;
+
+    if (c->kind != KIND_SLOW) {
+        return READ_SIZE;
+    }
+
+    allowed = (now - c->started_reading_at) * slow_rate - c->read_since_start;
+    return (allowed <= 0) ? 0 : (allowed > READ_SIZE) ? READ_SIZE : (size_t) allowed;
+}
+
+static void handle_client(struct client *c, short revents, double now) {
+    static char buf[READ_SIZE];
+    socklen_t err_len = sizeof(int);
+    size_t allowed;
+    ssize_t n;
+    int err = 0, ret;
+
+    if (revents & (POLLERR | POLLHUP | POLLNVAL) && c->state == STATE_CONNECTING) {
+        fail_client(c, now);
+        return;
+    }
+
+    switch (c->state) {
+        case STATE_CONNECTING:
+            if (!(revents & POLLOUT)) {
+                return;
+            }
+
+            if (getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0) {
+                fail_client(c, now);
+                return;
+            }
+
+            if (ssl_ctx == NULL) {
+                c->state = STATE_REQUEST;
+                break;
+            }
+
+            c->ssl = SSL_new(ssl_ctx);
+            SSL_set_fd(c->ssl, c->sock);
+            SSL_set_connect_state(c->ssl);
+            if (c->session != NULL) {
+                SSL_set_session(c->ssl, c->session);
+            }
+            c->state = STATE_HANDSHAKE;
+            // Fall through to start the handshake
+
+        case STATE_HANDSHAKE:
+            if ((ret = SSL_do_handshake(c->ssl)) != 1) {
+                c->ssl_want = SSL_get_error(c->ssl, ret);
+                if (c->ssl_want != SSL_ERROR_WANT_READ && c->ssl_want != SSL_ERROR_WANT_WRITE) {
+                    fail_client(c, now);
+                }
+                return;
+            }
+
+            if (measuring) {
+                c->handshakes++;
+                c->resumed += SSL_session_reused(c->ssl);
+            }
+
+            c->state = STATE_REQUEST;
+            break;
+    }
+
+    if (c->state == STATE_REQUEST) {
+        n = client_send(c, &c->request[c->request_pos], c->request_len - c->request_pos);
+        if (n < 0) {
+            fail_client(c, now);
+            return;
+        }
+
+        c->request_pos += n;
+        if (c->request_pos < c->request_len) {
+            return;
+        }
+
+        c->state = STATE_HEADER;
+        c->started_reading_at = now;
+        return;
+    }
+
+    // Anything already decrypted is read even if the socket has nothing more
+    while (c->state >= STATE_HEADER && (allowed = read_allowance(c, now)) > 0) {
+        n = client_recv(c, buf, allowed);
+        if (n == 0) {
+            return;
+        }
+
+        if (n < 0) {
+            // The end of a response without a length
+            if (c->state == STATE_BODY && c->body_left < 0 && c->kind != KIND_STREAM && c->kind != KIND_SLOW) {
+                finish_request(c, now);
+            }
+            else {
+                fail_client(c, now);
+            }
+            return;
+        }
+
+        c->read_since_start += n;
+        consume(c, buf, n, now);
+    }
+}
+
+static void print_kind(struct kind_stats *k, struct client *clients, int client_count, double duration, short last) {
+    unsigned long frames = 0, requests = 0, bytes = 0, errors = 0, handshakes = 0, resumed = 0;
+    double fps, min_fps = -1, max_fps = 0, p99, min_p99 = -1, max_p99 = 0;
+    short is_stream = (k == &kinds[KIND_STREAM] || k == &kinds[KIND_SLOW]);
+    int i, n = 0;
+
+    qsort(k->latencies.values, k->latencies.count, sizeof(double), compare_doubles);
+
+    printf("    \"%s\": {\n", k->name);
+    printf("      \"clients\": %d,\n", k->clients);
+
+    if (is_stream) {
+        printf("      \"fps\": [");
+    }
+
+    for (i = 0; i < client_count; i++) {
+        if (&kinds[clients[i].kind] != k) {
+            continue;
+        }
+
+        frames += clients[i].frames;
+        requests += clients[i].requests;
+        bytes += clients[i].bytes;
+        errors += clients[i].errors;
+        handshakes += clients[i].handshakes;
+        resumed += clients[i].resumed;
+
+        if (is_stream) {
+            fps = clients[i].frames / duration;
+            min_fps = (min_fps < 0 || fps < min_fps) ? fps : min_fps;
+            max_fps = (fps > max_fps) ? fps : max_fps;
+            printf("%s%.2f", (n++ > 0) ? ", " : "", fps);
+        }
+    }
+
+    if (is_stream) {
+        printf("],\n");
+        printf("      \"fps_min\": %.2f,\n", (min_fps < 0) ? 0 : min_fps);
+        printf("      \"fps_avg\": %.2f,\n", (k->clients > 0) ? frames / duration / k->clients : 0);
+        printf("      \"fps_max\": %.2f,\n", max_fps);
+        printf("      \"frames\": %lu,\n", frames);
+        printf("      \"latency_p50_ms\": %.1f,\n", 1000 * percentile(&k->latencies, 50));
+        printf("      \"latency_p99_ms\": %.1f,\n", 1000 * percentile(&k->latencies, 99));
+
+        // Whether some viewers fare worse than others
+        printf("      \"client_latency_p99_ms\": [");
+        for (i = 0, n = 0; i < client_count; i++) {
+            if (&kinds[clients[i].kind] != k) {
+                continue;
+            }
+
+            qsort(clients[i].latencies.values, clients[i].latencies.count, sizeof(double), compare_doubles);
+            p99 = percentile(&clients[i].latencies, 99);
+            min_p99 = (min_p99 < 0 || p99 < min_p99) ? p99 : min_p99;
+            max_p99 = (p99 > max_p99) ? p99 : max_p99;
+            printf("%s%.1f", (n++ > 0) ? ", " : "", 1000 * p99);
+        }
+        printf("],\n");
+        printf("      \"client_latency_p99_ms_min\": %.1f,\n", 1000 * ((min_p99 < 0) ? 0 : min_p99));
+        printf("      \"client_latency_p99_ms_max\": %.1f,\n", 1000 * max_p99);
+    }
+    else {
+        // Time to the whole response, or to a storm's first frame
+        printf("      \"requests\": %lu,\n", requests);
+        printf("      \"requests_per_second\": %.2f,\n", requests / duration);
+        printf("      \"response_p50_ms\": %.1f,\n", 1000 * percentile(&k->latencies, 50));
+        printf("      \"response_p99_ms\": %.1f,\n", 1000 * percentile(&k->latencies, 99));
+    }
+
+    printf("      \"tls_handshakes\": %lu,\n", handshakes);
+    printf("      \"tls_resumed\": %lu,\n", resumed);
+    printf("      \"megabits_per_second\": %.2f,\n", bytes * 8 / duration / 1000 / 1000);
+    printf("      \"errors\": %lu\n", errors);
+    printf("    }%s\n", last ? "" : ",");
+}
+
+int main(int argc, char *argv[]) {
+    struct server_sample first = {0}, last = {0};
+    struct client *clients;
+    struct pollfd *pfds;
+    short have_server = 0, use_tls = 0;
+    const char *name = "";
+    double duration = 10, warmup = 2, now, started_at, measure_from, cpu, events, bytes, handshakes;
+    int cameras = 1, client_count = 0, viewers, timeout, opt, i, k;
+    pid_t pid = 0;
+
+    while ((opt = getopt(argc, argv, "H:p:tP:d:w:c:n:s:S:g:f:u:i:r:N:Rh")) != -1) {
+        switch (opt) {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 't': use_tls = 1; break;
+            case 'P': pid = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'w': warmup = atof(optarg); break;
+            case 'c': cameras = atoi(optarg); break;
+            case 'n': kinds[KIND_STREAM].clients = atoi(optarg); break;
+            case 's': kinds[KIND_SLOW].clients = atoi(optarg); break;
+            case 'S': slow_rate = atof(optarg) * 1024; break;
+            case 'g': kinds[KIND_STILL].clients = atoi(optarg); break;
+            case 'f': kinds[KIND_STATIC].clients = atoi(optarg); break;
+            case 'u': static_path = optarg; break;
+            case 'i': interval = atof(optarg); break;
+            case 'r': kinds[KIND_STORM].clients = atoi(optarg); break;
+            case 'N': name = optarg; break;
+            case 'R': resume_tls = 1; break;
+            default:
+                print_usage(argv[0]);
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    for (k = 0; k < KIND_COUNT; k++) {
+        client_count += kinds[k].clients;
+    }
+
+    if (client_count <= 0 || client_count > MAX_CLIENTS || cameras < 1 || duration <= 0 || slow_rate <= 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (resolve(host, port, &server_addr, &server_addr_len) < 0) {
+        fprintf(stderr, "Could not resolve %s\n", host);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!wait_for_server(&server_addr, server_addr_len)) {
+        fprintf(stderr, "Could not connect to %s:%d\n", host, port);
+        exit(EXIT_FAILURE);
+    }
+
+    if (use_tls) {
+        // The certificate is not checked, test servers use self-signed ones
+        ssl_ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+    }
+
+    clients = calloc(client_count, sizeof(struct client));
+    pfds = calloc(client_count, sizeof(struct pollfd));
+    if (clients == NULL || pfds == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // Clients of each kind are spread over the cameras, and connect over
+    // the first tenth of a second rather than all at once
+    started_at = gettime();
+    for (k = 0, i = 0; k < KIND_COUNT; k++) {
+        int j;
+        for (j = 0; j < kinds[k].clients; j++, i++) {
+            clients[i].kind = k;
+            clients[i].camera = j % cameras;
+            clients[i].sock = -1;
+            clients[i].start_at = started_at + 0.1 * i / client_count;
+        }
+    }
+
+    measure_from = started_at + warmup;
+    while ((now = gettime()) < measure_from + duration) {
+        if (!measuring && now >= measure_from) {
+            measuring = 1;
+            measure_from = now;
+            have_server = pid > 0 && sample_server(pid, &first);
+        }
+
+        timeout = 1000;
+        for (i = 0; i < client_count; i++) {
+            struct client *c = &clients[i];
+
+            pfds[i].fd = -1;
+            pfds[i].events = 0;
+
+            if (c->state == STATE_IDLE) {
+                if (now >= c->start_at) {
+                    start_request(c, now);
+                }
+                else {
+                    timeout = POLL_INTERVAL;
+                    continue;
+                }
+            }
+
+            if (c->state == STATE_IDLE) {
+                continue;
+            }
+
+            pfds[i].fd = c->sock;
+            if (c->state == STATE_CONNECTING || (c->state == STATE_REQUEST && c->ssl == NULL)) {
+                pfds[i].events = POLLOUT;
+            }
+            else if (c->ssl != NULL && c->state != STATE_REQUEST && c->state != STATE_HANDSHAKE && SSL_pending(c->ssl) > 0) {
+                pfds[i].events = POLLIN;
+                timeout = 0;
+            }
+            else if (c->ssl != NULL && c->state != STATE_HEADER && c->state != STATE_BODY) {
+                pfds[i].events = (c->ssl_want == SSL_ERROR_WANT_WRITE) ? POLLOUT : POLLIN;
+                if (c->state == STATE_REQUEST) {
+                    pfds[i].events |= POLLOUT;
+                }
+            }
+            else if (read_allowance(c, now) > 0) {
+                pfds[i].events = POLLIN;
+            }
+            else {
+                pfds[i].fd = -1;
+                timeout = POLL_INTERVAL;
+            }
+        }
+
+        if (poll(pfds, client_count, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        now = gettime();
+        for (i = 0; i < client_count; i++) {
+            struct client *c = &clients[i];
+            short pending = c->ssl != NULL && c->state >= STATE_HEADER && SSL_pending(c->ssl) > 0;
+
+            if (pfds[i].fd >= 0 && (pfds[i].revents || pending)) {
+                handle_client(c, pfds[i].revents | (pending ? POLLIN : 0), now);
+            }
+        }
+    }
+
+    if (have_server) {
+        have_server = sample_server(pid, &last);
+    }
+
+    now = gettime();
+    duration = now - measure_from;
+    viewers = client_count;
+    cpu = have_server ? (last.cpu - first.cpu) / (last.at - first.at) * 100 : 0;
+    events = bytes = handshakes = 0;
+    for (i = 0; i < client_count; i++) {
+        events += clients[i].frames + clients[i].requests;
+        bytes += clients[i].bytes;
+        handshakes += clients[i].handshakes;
+    }
+
+    printf("{\n");
+    printf("  \"name\": \"%s\",\n", name);
+    printf("  \"tls\": %s,\n", use_tls ? "true" : "false");
+    printf("  \"tls_resume\": %s,\n", (use_tls && resume_tls) ? "true" : "false");
+    printf("  \"cameras\": %d,\n", cameras);
+    printf("  \"duration\": %.2f,\n", duration);
+    printf("  \"viewers\": %d,\n", viewers);
+    printf("  \"handshakes_per_sec\": %.2f,\n", handshakes / duration);
+    printf("  \"server\": {\n");
+    if (have_server) {
+        printf("    \"pid\": %d,\n", (int) pid);
+        printf("    \"cpu_percent\": %.2f,\n", cpu);
+        printf("    \"cpu_percent_per_viewer\": %.3f,\n", cpu / viewers);
+        printf("    \"cpu_us_per_delivery\": %.1f,\n", (events > 0) ? (last.cpu - first.cpu) / events * 1000 * 1000 : 0);
+        printf("    \"mbytes_per_sec_per_core\": %.2f,\n", (last.cpu > first.cpu) ? bytes / 1000 / 1000 / (last.cpu - first.cpu) : 0);
+        printf("    \"rss_kb\": %ld,\n", last.rss_kb);
+        printf("    \"peak_rss_kb\": %ld\n", last.peak_rss_kb);
+    }
+    printf("  },\n");
+    printf("  \"clients\": {\n");
+    for (k = 0; k < KIND_COUNT; k++) {
+        print_kind(&kinds[k], clients, client_count, duration, k == KIND_COUNT - 1);
+    }
+    printf("  }\n");
+    printf("}\n");
+
+    for (i = 0; i < client_count; i++) {
+        close_client(&clients[i], 0);
+        SSL_SESSION_free(clients[i].session);
+        free(clients[i].latencies.values);
+    }
+
+    for (k = 0; k < KIND_COUNT; k++) {
+        free(kinds[k].latencies.values);
+    }
+
+    free(clients);
+    free(pfds);
+    if (ssl_ctx != NULL) {
+        SSL_CTX_free(ssl_ctx);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,499 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "frames.h"
+#include "http.h"
+#include "jpeg_utils.h"
+#include "utils.h"
+#include "v4l2uvc.h"
+
+// Times the functions every frame and request goes through, on fixed inputs,
+// so that changes to them can be measured. Linked against hawkeye's own
+// objects, see the Makefile.
+
+#define MIN_TIME 0.5                // Seconds each benchmark runs for at least
+#define MAX_BENCHMARKS 128
+#define MAX_CAPTURES 8              // Frames taken from each -m recording
+#define JPEG_QUALITY 80             // As hawkeye's default
+
+struct benchmark {
+    char name[64];
+    void (*run)(struct benchmark *b, unsigned long n);
+    size_t bytes;                   // Processed per op, 0 if that means nothing
+
+    unsigned char *data;
+    size_t len;
+    unsigned int width;
+    unsigned int height;
+    struct frame_buffer *fb;
+
+    double ns_per_op;
+    double allocs_per_op;
+};
+
+static void print_usage(const char *program);
+static double monotonic_time();
+static unsigned char *make_scene(unsigned int width, unsigned int height);
+static size_t strip_huffman_tables(unsigned char *dst, unsigned char *src, size_t len);
+static size_t huffman_scan_length(unsigned char *jpeg);
+static struct benchmark *add_benchmark(const char *name, void (*run)(struct benchmark *b, unsigned long n), size_t bytes);
+static void add_jpeg_benchmarks(const char *label, unsigned char *jpeg, size_t len);
+static void load_captures(const char *path);
+static void run_compress(struct benchmark *b, unsigned long n);
+static void run_is_huffman(struct benchmark *b, unsigned long n);
+static void run_copy_frame(struct benchmark *b, unsigned long n);
+static void run_add_frame(struct benchmark *b, unsigned long n);
+static void run_get_frame(struct benchmark *b, unsigned long n);
+static void run_parse_request(struct benchmark *b, unsigned long n);
+static void run_base64_encode(struct benchmark *b, unsigned long n);
+static void measure(struct benchmark *b, double min_time);
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t num, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+static const struct resolution resolutions[] = {
+    {320, 240}, {640, 480}, {1280, 720}, {1920, 1080}
+};
+
+// What browsers, players and scripts send, as captured from each
+static const char *requests[][2] = {
+    {"chrome-stream",
+        "GET /stream/0 HTTP/1.1\r\n"
+        "Host: 192.168.1.20:8000\r\n"
+        "Connection: keep-alive\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Accept-Language: en-US,en;q=0.9\r\n"
+        "\r\n"},
+    {"firefox-still-auth",
+        "GET /still/1?t=1700000000123 HTTP/1.1\r\n"
+        "Host: cameras.example.org\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:121.0) Gecko/20100101 Firefox/121.0\r\n"
+        "Accept: image/avif,image/webp,*/*\r\n"
+        "Accept-Language: en-GB,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Authorization: Basic YWRtaW46c2VjcmV0\r\n"
+        "Connection: keep-alive\r\n"
+        "Referer: https://cameras.example.org/\r\n"
+        "Sec-Fetch-Dest: image\r\n"
+        "Sec-Fetch-Mode: no-cors\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "\r\n"},
+    {"safari-hls",
+        "GET /hls/0/index.m3u8 HTTP/1.1\r\n"
+        "Host: 10.0.0.5:8000\r\n"
+        "X-Playback-Session-Id: 6C1E2F9A-3B8D-4E57-9A0C-2D4F6B8E1A3C\r\n"
+        "Accept: */*\r\n"
+        "Accept-Language: en-US,en;q=0.9\r\n"
+        "Connection: keep-alive\r\n"
+        "Accept-Encoding: identity\r\n"
+        "User-Agent: AppleCoreMedia/1.0.0.21C62 (iPhone; U; CPU OS 17_2 like Mac OS X; en_us)\r\n"
+        "\r\n"},
+    {"chrome-websocket",
+        "GET /ws/stream/2 HTTP/1.1\r\n"
+        "Host: 192.168.1.20:8000\r\n"
+        "Connection: Upgrade\r\n"
+        "Pragma: no-cache\r\n"
+        "Cache-Control: no-cache\r\n"
+        "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+        "Upgrade: websocket\r\n"
+        "Origin: http://192.168.1.20:8000\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Accept-Language: en-US,en;q=0.9\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+        "\r\n"},
+    {"curl-stats",
+        "GET /stats HTTP/1.1\r\n"
+        "Host: localhost:8000\r\n"
+        "User-Agent: curl/8.5.0\r\n"
+        "Accept: */*\r\n"
+        "\r\n"}
+};
+
+// Credentials as given to auth, relays and push URLs
+static const char *base64_inputs[][2] = {
+    {"short", "admin:secret"},
+    {"long", "surveillance-operator@example.org:Tr0ub4dor&3-correct-horse-battery"}
+};
+
+static struct benchmark benchmarks[MAX_BENCHMARKS];
+static int benchmark_count = 0;
+static unsigned char *out;          // Where compress_yuyv_to_jpeg() and copy_frame() write
+static size_t out_size;
+static char request_buf[4096];
+static volatile size_t sink;        // Keeps results from being optimised away
+static unsigned long allocations = 0;
+
+// Every allocation, hawkeye's and libjpeg's alike, goes through these, see
+// "Replacing malloc" in the glibc manual
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+    allocations++;
+    return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-t seconds] [-m recording.mjpeg]... [-f filter] [-j]\n", program);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "-t is how long each benchmark runs for at least, -m adds the frames of an\n");
+    fprintf(stderr, "MJPEG recording, such as one captured from a camera, -f runs only the\n");
+    fprintf(stderr, "benchmarks whose name contains filter and -j prints JSON.\n");
+}
+
+static double monotonic_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Colour bars with a soft gradient and a little sensor noise over them, so
+// that they compress about as well as a camera picture does
+static unsigned char *make_scene(unsigned int width, unsigned int height) {
+    static const unsigned char bars[8][3] = {
+        {235, 128, 128}, {210, 16, 146}, {170, 166, 16}, {145, 54, 34},
+        {106, 202, 222}, {81, 90, 240}, {41, 240, 110}, {16, 128, 128}
+    };
+    unsigned char *yuyv = malloc(width * height * 2), *p = yuyv;
+    unsigned int seed = 1, x, y, bar;
+    int luma, i;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x += 2) {
+            bar = x * 8 / width;
+            for (i = 0; i < 2; i++) {
+                seed = seed * 1103515245 + 12345;
+                luma = bars[bar][0] + (int) (y * 32 / height) - 16 + (int) ((seed >> 16) % 9) - 4;
+                *p++ = max(16, min(235, luma));
+                *p++ = bars[bar][1 + i];
+            }
+        }
+    }
+
+    return yuyv;
+}
+
+// UVC cameras leave out the Huffman tables to save bandwidth, and
+// copy_frame() puts the standard ones back in
+static size_t strip_huffman_tables(unsigned char *dst, unsigned char *src, size_t len) {
+    size_t pos = 2, out_len = 2, seg_len;
+
+    memcpy(dst, src, 2);
+    while (pos + 4 <= len && src[pos] == 0xff && src[pos + 1] != 0xda) {
+        seg_len = 2 + ((src[pos + 2] << 8) | src[pos + 3]);
+        if (src[pos + 1] != 0xc4) {
+            memcpy(&dst[out_len], &src[pos], seg_len);
+            out_len += seg_len;
+        }
+        pos += seg_len;
+    }
+
+    memcpy(&dst[out_len], &src[pos], len - pos);
+    return out_len + len - pos;
+}
+
+// How far is_huffman() looks into a frame
+static size_t huffman_scan_length(unsigned char *jpeg) {
+    size_t pos;
+
+    for (pos = 0; pos <= 2048; pos++) {
+        if (((jpeg[pos] << 8) | jpeg[pos + 1]) == 0xffda || ((jpeg[pos] << 8) | jpeg[pos + 1]) == 0xffc4) {
+            break;
+        }
+    }
+
+    return pos + 2;
+}
+
+static struct benchmark *add_benchmark(const char *name, void (*run)(struct benchmark *b, unsigned long n), size_t bytes) {
+    struct benchmark *b;
+
+    if (benchmark_count == MAX_BENCHMARKS) {
+        fprintf(stderr, "Too many benchmarks\n");
+        exit(EXIT_FAILURE);
+    }
+
+    b = &benchmarks[benchmark_count++];
+    snprintf(b->name, sizeof(b->name), "%s", name);
+    b->run = run;
+    b->bytes = bytes;
+    return b;
+}
+
+// The functions a camera's MJPEG frames go through on their way to viewers
+static void add_jpeg_benchmarks(const char *label, unsigned char *jpeg, size_t len) {
+    char name[64];
+    struct benchmark *b;
+
+    snprintf(name, sizeof(name), "is_huffman %s", label);
+    b = add_benchmark(name, run_is_huffman, huffman_scan_length(jpeg));
+    b->data = jpeg;
+
+    snprintf(name, sizeof(name), "copy_frame %s", label);
+    b = add_benchmark(name, run_copy_frame, len);
+    b->data = jpeg;
+    b->len = len;
+
+    snprintf(name, sizeof(name), "add_frame %s", label);
+    b = add_benchmark(name, run_add_frame, len);
+    b->data = jpeg;
+    b->len = len;
+    b->fb = calloc(1, sizeof(struct frame_buffer));
+    create_frame_buffer(b->fb, FRAME_BUFFER_LENGTH);
+}
+
+// Takes frames from a recording, split the way file sources split them
+static void load_captures(const char *path) {
+    unsigned char *data, *start, *end, *jpeg;
+    char label[64];
+    const char *base = strrchr(path, '/');
+    struct stat st;
+    int count = 0, width, height;
+    FILE *f;
+
+    if ((f = fopen(path, "r")) == NULL || fstat(fileno(f), &st) < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    data = malloc(st.st_size);
+    if (fread(data, 1, st.st_size, f) != st.st_size) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+
+    base = (base != NULL) ? base + 1 : path;
+    for (start = data; count < MAX_CAPTURES && start + 4 <= data + st.st_size; start = end) {
+        // Frames run up to the start of the next, found as in recordings
+        // played as cameras (see next_frame_size() in filesource.c), since
+        // FF D8 alone also starts the thumbnails inside EXIF data
+        end = memmem(start + 2, data + st.st_size - start - 2, "\xff\xd9\xff\xd8", 4);
+        end = (end != NULL) ? end + 2 : data + st.st_size;
+
+        if (!jpeg_dimensions(start, end - start, &width, &height)) {
+            fprintf(stderr, "%s: frame %d is not a JPEG\n", path, count);
+            exit(EXIT_FAILURE);
+        }
+
+        // Frames are read from the start of a buffer, as they are captured
+        jpeg = malloc(end - start + 2048);
+        memcpy(jpeg, start, end - start);
+        snprintf(label, sizeof(label), "%.24s#%d %dx%d", base, count++, width, height);
+        add_jpeg_benchmarks(label, jpeg, end - start);
+    }
+}
+
+static void run_compress(struct benchmark *b, unsigned long n) {
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        sink = compress_yuyv_to_jpeg(out, out_size, b->data, b->len, b->width, b->height, JPEG_QUALITY);
+    }
+}
+
+static void run_is_huffman(struct benchmark *b, unsigned long n) {
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        sink = is_huffman(b->data);
+    }
+}
+
+static void run_copy_frame(struct benchmark *b, unsigned long n) {
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        sink = copy_frame(out, out_size, b->data, b->len);
+    }
+}
+
+static void run_add_frame(struct benchmark *b, unsigned long n) {
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        add_frame(b->fb, b->data, b->len, 0);
+    }
+}
+
+// Looks up each of the buffered frames in turn, as viewers at different
+// distances behind the camera do
+static void run_get_frame(struct benchmark *b, unsigned long n) {
+    unsigned long i, newest = b->fb->current_frame;
+
+    for (i = 0; i < n; i++) {
+        sink = (size_t) get_frame(b->fb, newest - i % (FRAME_BUFFER_LENGTH - 1));
+    }
+}
+
+// The parser writes into the request, so each op starts from a fresh copy
+static void run_parse_request(struct benchmark *b, unsigned long n) {
+    struct http_request req;
+    unsigned long i;
+
+    for (i = 0; i < n; i++) {
+        memcpy(request_buf, b->data, b->len + 1);
+        parse_request(request_buf, &req);
+        sink = (size_t) req.path;
+    }
+}
+
+static void run_base64_encode(struct benchmark *b, unsigned long n) {
+    unsigned long i;
+    char *encoded;
+
+    for (i = 0; i < n; i++) {
+        encoded = base64_encode(b->data);
+        sink = (size_t) encoded;
+        free(encoded);
+    }
+}
+
+// Doubles the number of ops until they take min_time, after one round to
+// warm up caches and let buffers grow
+static void measure(struct benchmark *b, double min_time) {
+    unsigned long n, allocated;
+    double started_at, elapsed;
+
+    b->run(b, 1);
+
+    for (n = 1; ; n *= 2) {
+        allocated = allocations;
+        started_at = monotonic_time();
+        b->run(b, n);
+        elapsed = monotonic_time() - started_at;
+
+        if (elapsed >= min_time) {
+            break;
+        }
+    }
+
+    b->ns_per_op = elapsed / n * 1e9;
+    b->allocs_per_op = (double) (allocations - allocated) / n;
+}
+
+int main(int argc, char *argv[]) {
+    struct benchmark *b;
+    struct frame_buffer *fb = NULL;
+    unsigned char *yuyv, *jpeg, *stripped;
+    const char *filter = NULL;
+    double min_time = MIN_TIME;
+    short json = 0, first = 1;
+    char name[64];
+    size_t len;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "t:m:f:jh")) != -1) {
+        switch (opt) {
+            case 't': min_time = atof(optarg); break;
+            case 'm': load_captures(optarg); break;
+            case 'f': filter = optarg; break;
+            case 'j': json = 1; break;
+            default:
+                print_usage(argv[0]);
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    out_size = MAX_FRAME_SIZE + MAX_HEADER_LEN;
+    out = malloc(out_size);
+
+    // Frames of each resolution, straight from YUYV and as a camera sends
+    // them, without Huffman tables
+    for (i = 0; i < sizeof(resolutions) / sizeof(resolutions[0]); i++) {
+        yuyv = make_scene(resolutions[i].width, resolutions[i].height);
+
+        snprintf(name, sizeof(name), "compress_yuyv_to_jpeg %ux%u", resolutions[i].width, resolutions[i].height);
+        b = add_benchmark(name, run_compress, resolutions[i].width * resolutions[i].height * 2);
+        b->data = yuyv;
+        b->len = resolutions[i].width * resolutions[i].height * 2;
+        b->width = resolutions[i].width;
+        b->height = resolutions[i].height;
+
+        jpeg = malloc(out_size);
+        len = compress_yuyv_to_jpeg(jpeg, out_size, yuyv, b->len, b->width, b->height, JPEG_QUALITY);
+        stripped = malloc(len + 2048);
+        len = strip_huffman_tables(stripped, jpeg, len);
+        free(jpeg);
+
+        snprintf(name, sizeof(name), "uvc %ux%u", resolutions[i].width, resolutions[i].height);
+        add_jpeg_benchmarks(name, stripped, len);
+        fb = benchmarks[benchmark_count - 1].fb;
+    }
+
+    // Fills the buffer of the last add_frame benchmark first
+    for (i = 0; i < FRAME_BUFFER_LENGTH; i++) {
+        add_frame(fb, stripped, len, 0);
+    }
+    b = add_benchmark("get_frame", run_get_frame, 0);
+    b->fb = fb;
+
+    for (i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+        snprintf(name, sizeof(name), "parse_request %s", requests[i][0]);
+        b = add_benchmark(name, run_parse_request, strlen(requests[i][1]));
+        b->data = (unsigned char *) requests[i][1];
+        b->len = strlen(requests[i][1]);
+    }
+
+    for (i = 0; i < sizeof(base64_inputs) / sizeof(base64_inputs[0]); i++) {
+        snprintf(name, sizeof(name), "base64_encode %s", base64_inputs[i][0]);
+        b = add_benchmark(name, run_base64_encode, strlen(base64_inputs[i][1]));
+        b->data = (unsigned char *) base64_inputs[i][1];
+    }
+
+    if (json) {
+        printf("[\n");
+    }
+    else {
+        printf("%-44s %14s %10s %10s\n", "benchmark", "ns/op", "MB/s", "allocs/op");
+    }
+
+    for (i = 0; i < benchmark_count; i++) {
+        b = &benchmarks[i];
+        if (filter != NULL && strstr(b->name, filter) == NULL) {
+            continue;
+        }
+
+        measure(b, min_time);
+
+        if (json) {
+            printf("%s  {\"name\": \"%s\", \"ns_per_op\": %.1f, \"mb_per_s\": %.1f, \"allocs_per_op\": %.2f}",
+                first ? "" : ",\n", b->name, b->ns_per_op, b->bytes / b->ns_per_op * 1e9 / 1e6, b->allocs_per_op);
+        }
+        else if (b->bytes > 0) {
+            printf("%-44s %14.1f %10.1f %10.2f\n", b->name, b->ns_per_op, b->bytes / b->ns_per_op * 1e9 / 1e6, b->allocs_per_op);
+        }
+        else {
+            printf("%-44s %14.1f %10s %10.2f\n", b->name, b->ns_per_op, "-", b->allocs_per_op);
+        }
+
+        fflush(stdout);
+        first = 0;
+    }
+
+    if (json) {
+        printf("\n]\n");
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+#!/bin/sh
+# Runs hawkeye on test patterns or an MJPEG recording under each of a set of
+# loads, a fresh server for each, and writes what loadgen measured to
+# results.json as an array.
+#
+# DURATION, WARMUP, WIDTH, HEIGHT, FPS, PORT and RESULTS can be set in the
+# environment, HAWKEYE to test another build, and RECORDING to play frames
+# captured from a real camera in the recording runs.
+
+set -e
+cd "$(dirname "$0")"
+
+HAWKEYE=${HAWKEYE:-../src/hawkeye}
+PORT=${PORT:-8090}
+DURATION=${DURATION:-10}
+WARMUP=${WARMUP:-2}
+WIDTH=${WIDTH:-640}
+HEIGHT=${HEIGHT:-480}
+FPS=${FPS:-15}
+RESULTS=${RESULTS:-results.json}
+RECORDING=${RECORDING:-}
+
+TMP=$(mktemp -d)
+SERVER=
+
+cleanup() {
+    [ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null || true
+    rm -rf "$TMP"
+}
+trap cleanup EXIT INT TERM
+
+# A self-signed certificate for the TLS runs
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+    -keyout "$TMP/key.pem" -out "$TMP/cert.pem" 2>/dev/null
+
+# Without a RECORDING, stills of the pattern make one, a frame apart, which
+# is played without the encoding the pattern takes
+if [ -z "$RECORDING" ]; then
+    RECORDING=$TMP/pattern.mjpeg
+    "$HAWKEYE" -c /dev/null -p "$PORT" -D pattern -F "$FPS" -W "$WIDTH" -G "$HEIGHT" -l "$TMP/hawkeye.log" &
+    SERVER=$!
+
+    frames=0
+    tries=0
+    while [ $frames -lt $((FPS * 2)) ] && [ $tries -lt $((FPS * 10)) ]; do
+        if curl -sf "http://127.0.0.1:$PORT/still/0" >> "$RECORDING"; then
+            frames=$((frames + 1))
+        fi
+        tries=$((tries + 1))
+        sleep "$(awk "BEGIN { print 1 / $FPS }")"
+    done
+
+    kill "$SERVER"
+    wait "$SERVER" 2>/dev/null || true
+    SERVER=
+
+    [ -s "$RECORDING" ] || { echo "Could not record the pattern" >&2; exit 1; }
+fi
+
+# scenario name cameras flags loadgen-options...
+#
+# flags is a space separated list of:
+#   tls        serve and connect over TLS
+#   ktls       with kernel TLS, where the kernel has it
+#   resume     resume TLS sessions on reconnecting
+#   720p       cameras of 1280x720, whose frames are larger than a write budget
+#   recording  cameras that play RECORDING rather than the pattern
+scenario() {
+    name=$1 cameras=$2 flags=$3
+    shift 3
+
+    source=pattern
+    case " $flags " in
+        *" recording "*) source=$RECORDING ;;
+    esac
+
+    devices=$source
+    i=1
+    while [ $i -lt "$cameras" ]; do
+        devices=$devices:$source
+        i=$((i + 1))
+    done
+
+    server_options="-W $WIDTH -G $HEIGHT"
+    set -- "$@" -c "$cameras" -d "$DURATION" -w "$WARMUP" -p "$PORT" -N "$name"
+    for flag in $flags; do
+        case $flag in
+            tls)
+                server_options="$server_options -C $TMP/cert.pem -k $TMP/key.pem"
+                set -- "$@" -t
+                ;;
+            ktls)
+                server_options="$server_options -K"
+                ;;
+            resume)
+                set -- "$@" -R
+                ;;
+            720p)
+                server_options="$server_options -W 1280 -G 720"
+                ;;
+        esac
+    done
+
+    "$HAWKEYE" -c /dev/null -p "$PORT" -D "$devices" -F "$FPS" -w ../www -l "$TMP/hawkeye.log" $server_options &
+    SERVER=$!
+
+    echo "$name..." >&2
+    [ -s "$TMP/results" ] && echo "," >> "$TMP/results"
+    ./loadgen -P "$SERVER" "$@" >> "$TMP/results"
+
+    kill "$SERVER"
+    wait "$SERVER" 2>/dev/null || true
+    SERVER=
+}
+
+: > "$TMP/results"
+scenario stream-10 1 "" -n 10
+scenario stream-100 4 "" -n 100
+# Every viewer should see about the same latency, see client_latency_p99_ms
+scenario fairness-720p 1 "720p" -n 40
+scenario slow-readers 1 "" -n 10 -s 10 -S 32
+scenario stills-and-static 2 "" -g 50 -f 20 -i 0.5
+scenario reconnect-storm 1 "" -n 10 -r 20
+scenario tls-stream-50 2 "tls" -n 50
+scenario tls-stream-50-ktls 2 "tls ktls" -n 50
+scenario tls-static 1 "tls" -f 20 -i 0.1
+scenario tls-static-ktls 1 "tls ktls" -f 20 -i 0.1
+scenario tls-reconnect-storm 1 "tls" -n 10 -r 20
+scenario tls-reconnect-storm-resumed 1 "tls resume" -n 10 -r 20
+scenario recording-stream-100 4 "recording" -n 100
+scenario recording-tls-stream-50 2 "recording tls" -n 50
+scenario recording-reconnect-storm 1 "recording" -n 10 -r 20
+scenario mixed 4 "" -n 40 -s 10 -g 20 -f 10 -r 5
+
+{ echo "["; cat "$TMP/results"; echo "]"; } > "$RESULTS"
+echo "Results written to $RESULTS" >&2
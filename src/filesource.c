@@ -0,0 +1,301 @@
+#define _GNU_SOURCE // memmem()
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+#include "logger.h"
+#include "utils.h"
+#include "h264.h"
+#include "frames.h"
+#include "jpeg_utils.h"
+#include "filesource.h"
+
+static int map_file(struct video_device *vd);
+static int open_h264(struct video_device *vd);
+static int open_mjpeg(struct video_device *vd);
+static int open_yuyv(struct video_device *vd);
+static int open_pattern(struct video_device *vd);
+static size_t next_frame_size(struct video_device *vd);
+static void draw_pattern(struct video_device *vd, unsigned long n);
+
+// Colour bars of the pattern source, as Y, U and V at 75%
+static const unsigned char pattern_bars[][3] = {
+    {180, 128, 128}, // White
+    {162, 44, 142},  // Yellow
+    {131, 156, 44},  // Cyan
+    {112, 72, 58},   // Green
+    {84, 184, 198},  // Magenta
+    {65, 100, 212},  // Red
+    {35, 212, 114},  // Blue
+};
+
+// The pattern, or anything that is a regular file rather than a device
+short is_file_source(const char *device) {
+    struct stat st;
+
+    if (strcmp(device, PATTERN_SOURCE) == 0) {
+        return 1;
+    }
+
+    return stat(device, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// Tells recordings apart by what they start with, except for raw YUYV,
+// which has nothing to tell it by but its .yuv or .yuyv name
+int open_file_source(struct video_device *vd) {
+    const char *ext = strrchr(vd->device_filename, '.');
+    int ret;
+
+    vd->file_pos = 0;
+
+    if (strcmp(vd->device_filename, PATTERN_SOURCE) == 0) {
+        ret = open_pattern(vd);
+    }
+    else if (map_file(vd) < 0) {
+        return -1;
+    }
+    else if (vd->file_size >= 2 && vd->file_data[0] == 0xff && vd->file_data[1] == 0xd8) {
+        ret = open_mjpeg(vd);
+    }
+    else if (vd->file_size >= 4 && (memcmp(vd->file_data, "\0\0\1", 3) == 0 || memcmp(vd->file_data, "\0\0\0\1", 4) == 0)) {
+        ret = open_h264(vd);
+    }
+    else if (ext != NULL && (strcmp(ext, ".yuv") == 0 || strcmp(ext, ".yuyv") == 0)) {
+        ret = open_yuyv(vd);
+    }
+    else {
+        log_itf(LOG_ERROR, "%s is not an H.264 or MJPEG recording, nor a .yuv file of raw YUYV frames.", vd->device_filename);
+        ret = -1;
+    }
+
+    if (ret < 0) {
+        if (vd->file_data != NULL) {
+            close_file_source(vd);
+        }
+        return -1;
+    }
+
+    vd->next_frame_at = gettime();
+    vd->streaming_state = STREAMING_ON;
+
+    log_itf(LOG_INFO, "Playing %s, %dx%d, at %d fps.", vd->device_filename, vd->width, vd->height, vd->fps);
+
+    return 0;
+}
+
+// Maps the whole recording into memory
+static int map_file(struct video_device *vd) {
+    if ((vd->fd = open(vd->device_filename, O_RDONLY)) < 0) {
+        log_itf(LOG_ERROR, "Could not open %s: %s", vd->device_filename, strerror(errno));
+        return -1;
+    }
+
+    vd->file_size = file_size(vd->device_filename);
+    if (vd->file_size == 0 || (vd->file_data = mmap(NULL, vd->file_size, PROT_READ, MAP_PRIVATE, vd->fd, 0)) == MAP_FAILED) {
+        log_itf(LOG_ERROR, "Could not read %s.", vd->device_filename);
+        vd->file_data = NULL;
+        close(vd->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int open_h264(struct video_device *vd) {
+    struct h264_params params;
+    size_t pos, len, largest = 0;
+    short keyframe;
+    unsigned char *tmp;
+
+    vd->file_type = FILE_SOURCE_H264;
+    vd->format_in = V4L2_PIX_FMT_H264;
+
+    // The picture size comes from the stream, and the buffer has to fit the
+    // largest frame in it
+    memset(&params, 0, sizeof(params));
+    for (pos = 0; pos < vd->file_size; pos += len) {
+        len = h264_access_unit_size(&vd->file_data[pos], vd->file_size - pos);
+        largest = max(largest, len);
+
+        if (params.sps_len == 0) {
+            tmp = malloc(len + len / 4 + H264_LENGTH_SIZE);
+            h264_to_avcc(tmp, len + len / 4 + H264_LENGTH_SIZE, &vd->file_data[pos], len, &params, &keyframe);
+            free(tmp);
+        }
+    }
+
+    if (params.sps_len == 0) {
+        log_itf(LOG_ERROR, "%s has no H.264 sequence parameter set.", vd->device_filename);
+        return -1;
+    }
+
+    vd->width = params.width;
+    vd->height = params.height;
+    vd->framebuffer_size = largest;
+    vd->framebuffer = malloc(vd->framebuffer_size);
+
+    return 0;
+}
+
+// JPEGs back to back, as e.g. ffmpeg -f mjpeg writes them. The picture size
+// comes from the first one.
+static int open_mjpeg(struct video_device *vd) {
+    size_t pos, len, largest = 0;
+
+    vd->file_type = FILE_SOURCE_MJPEG;
+    vd->format_in = V4L2_PIX_FMT_MJPEG;
+
+    for (pos = 0; pos < vd->file_size; pos += len) {
+        vd->file_pos = pos;
+        len = next_frame_size(vd);
+        largest = max(largest, len);
+    }
+    vd->file_pos = 0;
+
+    if (!jpeg_dimensions(vd->file_data, vd->file_size, &vd->width, &vd->height) || largest > MAX_FRAME_SIZE) {
+        log_itf(LOG_ERROR, "%s does not start with a JPEG hawkeye can serve.", vd->device_filename);
+        return -1;
+    }
+
+    // With room for the Huffman tables copy_frame() may add
+    vd->framebuffer_size = largest + 1024;
+    vd->framebuffer = malloc(vd->framebuffer_size);
+
+    return 0;
+}
+
+// Frames of the width and height asked for, one after another
+static int open_yuyv(struct video_device *vd) {
+    vd->file_type = FILE_SOURCE_YUYV;
+    vd->format_in = V4L2_PIX_FMT_YUYV;
+    vd->framebuffer_size = vd->width * vd->height * 2;
+
+    if (vd->file_size < vd->framebuffer_size) {
+        log_itf(LOG_ERROR, "%s is smaller than a single %dx%d YUYV frame.", vd->device_filename, vd->width, vd->height);
+        return -1;
+    }
+
+    if (vd->file_size % vd->framebuffer_size != 0) {
+        log_itf(LOG_WARNING, "%s does not hold a whole number of %dx%d YUYV frames, the rest is skipped.", vd->device_filename, vd->width, vd->height);
+    }
+
+    vd->framebuffer = malloc(vd->framebuffer_size);
+
+    return 0;
+}
+
+// Colour bars of the width and height asked for, kept in file_data, with a
+// box drawn across them that moves a little every frame
+static int open_pattern(struct video_device *vd) {
+    unsigned char *p;
+    const unsigned char *bar;
+    int x, y;
+
+    vd->file_type = FILE_SOURCE_PATTERN;
+    vd->format_in = V4L2_PIX_FMT_YUYV;
+    vd->fd = -1;
+    vd->width &= ~1; // Pixels come in pairs
+    vd->framebuffer_size = vd->width * vd->height * 2;
+    vd->framebuffer = malloc(vd->framebuffer_size);
+    vd->file_size = vd->framebuffer_size;
+    vd->file_data = malloc(vd->file_size);
+
+    for (y = 0; y < vd->height; y++) {
+        for (x = 0; x < vd->width; x += 2) {
+            bar = pattern_bars[x * 7 / vd->width];
+            p = &vd->file_data[(y * vd->width + x) * 2];
+            p[0] = bar[0];
+            p[1] = bar[1];
+            p[2] = bar[0];
+            p[3] = bar[2];
+        }
+    }
+
+    return 0;
+}
+
+static void draw_pattern(struct video_device *vd, unsigned long n) {
+    int size = max(2, vd->height / 4) & ~1;
+    int left = (n * 4) % max(2, vd->width - size) & ~1;
+    int top = (vd->height - size) / 2;
+    int x, y;
+    unsigned char *p;
+
+    memcpy(vd->framebuffer, vd->file_data, vd->framebuffer_size);
+
+    // White
+    for (y = top; y < top + size && y < vd->height; y++) {
+        for (x = left; x < left + size && x < vd->width; x += 2) {
+            p = &vd->framebuffer[(y * vd->width + x) * 2];
+            p[0] = p[2] = 235;
+            p[1] = p[3] = 128;
+        }
+    }
+}
+
+// Of the frame at file_pos, looping back to the start after the last one
+static size_t next_frame_size(struct video_device *vd) {
+    unsigned char *next;
+
+    if (vd->file_pos >= vd->file_size) {
+        vd->file_pos = 0; // Loop
+    }
+
+    switch (vd->file_type) {
+        case FILE_SOURCE_MJPEG:
+            // Runs up to the start of the next image. A tail too short to
+            // hold one is a frame of its own.
+            next = NULL;
+            if (vd->file_size - vd->file_pos > 4) {
+                next = memmem(&vd->file_data[vd->file_pos + 2], vd->file_size - vd->file_pos - 2, "\xff\xd9\xff\xd8", 4);
+            }
+            return (next != NULL) ? next + 2 - &vd->file_data[vd->file_pos] : vd->file_size - vd->file_pos;
+        case FILE_SOURCE_YUYV:
+            if (vd->file_size - vd->file_pos < vd->framebuffer_size) {
+                vd->file_pos = 0;
+            }
+            return vd->framebuffer_size;
+        default:
+            return h264_access_unit_size(&vd->file_data[vd->file_pos], vd->file_size - vd->file_pos);
+    }
+}
+
+// Like dequeuing a buffer from a camera that is opened non-blocking, returns
+// 0 until the next frame is due at next_frame_at
+size_t read_file_frame(struct video_device *vd) {
+    double now = gettime();
+    size_t len;
+
+    if (vd->next_frame_at > now) {
+        return 0;
+    }
+    vd->next_frame_at = max(vd->next_frame_at, now) + 1.0 / vd->fps;
+
+    if (vd->file_type == FILE_SOURCE_PATTERN) {
+        draw_pattern(vd, vd->file_pos++);
+        vd->captured_at = gettime();
+        return vd->framebuffer_size;
+    }
+
+    len = next_frame_size(vd);
+    memcpy(vd->framebuffer, &vd->file_data[vd->file_pos], len);
+    vd->file_pos += len;
+    vd->captured_at = gettime();
+
+    return len;
+}
+
+void close_file_source(struct video_device *vd) {
+    if (vd->file_type == FILE_SOURCE_PATTERN) {
+        free(vd->file_data);
+    }
+    else {
+        munmap(vd->file_data, vd->file_size);
+        close(vd->fd);
+    }
+    vd->file_data = NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef __FILESOURCE_H
+#define __FILESOURCE_H
+
+#include "v4l2uvc.h"
+
+// Recordings played back in a loop in place of a camera, paced at the
+// frame rate asked for, so that everything can be run without hardware.
+// The pattern source draws moving colour bars instead.
+
+#define PATTERN_SOURCE "pattern"
+
+#define FILE_SOURCE_H264 0      // Annex B byte stream, e.g. a .h264 file from ffmpeg
+#define FILE_SOURCE_MJPEG 1     // One JPEG, or several back to back
+#define FILE_SOURCE_YUYV 2      // Raw .yuv frames of width x height
+#define FILE_SOURCE_PATTERN 3
+
+short is_file_source(const char *device);
+int open_file_source(struct video_device *vd);
+size_t read_file_frame(struct video_device *vd);
+void close_file_source(struct video_device *vd);
+
+#endif
@@ -5,9 +5,13 @@
 #include "server.h"
 #include "memory.h"
 #include "logger.h"
+#include "utils.h"
 
 #include "frames.h"
 
+static void record_latency(struct frame_buffer *fb, double captured_at);
+static void repeat_newest(struct frame_buffer *fb);
+
 void create_frame_buffer(struct frame_buffer *fb, size_t n) {
     int i;
 
@@ -15,11 +19,26 @@ void create_frame_buffer(struct frame_buffer *fb, size_t n) {
     fb->current_frame = -1;
     fb->frames = calloc(n, sizeof(struct frame));
     fb->vd = NULL;
+    fb->stream_clients = 0;
+    fb->wanted_at = gettime();
+    fb->still_requests = 0;
+    fb->paused_frame = -1;
+    fb->capture_latency = 0;
+    fb->capture_latency_avg = 0;
+    fb->frame_added_at = 0;
+    fb->renditions = NULL;
+    memset(fb->rendition_clients, 0, sizeof(fb->rendition_clients));
+    fb->h264 = 0;
+    memset(&fb->h264_params, 0, sizeof(fb->h264_params));
+    fb->hls = NULL;
+    memset(&fb->spare, 0, sizeof(fb->spare));
 
     for (i = 0; i < fb->buffer_size; i++) {
         fb->frames[i].data = malloc(MIN_FRAME_SIZE);
         fb->frames[i].data_len = 0;
         fb->frames[i].data_buf_len = MIN_FRAME_SIZE;
+        fb->frames[i].captured_at = 0;
+        fb->frames[i].keyframe = 0;
     }
 }
 
@@ -31,9 +50,28 @@ void destroy_frame_buffer(struct frame_buffer *fb) {
     }
 
     free(fb->frames);
+    free(fb->spare.data);
+
+    if (fb->renditions != NULL) {
+        for (i = 0; i < RENDITION_COUNT - 1; i++) {
+            destroy_frame_buffer(&fb->renditions[i]);
+        }
+        free(fb->renditions);
+    }
+
+    if (fb->hls != NULL) {
+        destroy_hls(fb->hls);
+    }
 }
 
-void add_frame(struct frame_buffer *fb, void *data, size_t data_len) {
+static void record_latency(struct frame_buffer *fb, double captured_at) {
+    fb->frame_added_at = gettime();
+    fb->capture_latency = max(0.0, fb->frame_added_at - captured_at);
+    fb->capture_latency_avg = (fb->capture_latency_avg == 0) ? fb->capture_latency :
+        LATENCY_SMOOTHING * fb->capture_latency + (1 - LATENCY_SMOOTHING) * fb->capture_latency_avg;
+}
+
+void add_frame(struct frame_buffer *fb, void *data, size_t data_len, double captured_at) {
     unsigned long frame_num;
     struct frame *f;
     size_t total_data_len;
@@ -59,14 +97,119 @@ void add_frame(struct frame_buffer *fb, void *data, size_t data_len) {
     memcpy(&f->data[strlen(FRAME_HEADER)], data, data_len);
     memcpy(&f->data[data_len + strlen(FRAME_HEADER)], FRAME_FOOTER, strlen(FRAME_FOOTER));
     f->data_len = total_data_len;
+    f->captured_at = captured_at;
+    record_latency(fb, captured_at);
+}
+
+// Adds an access unit given as an Annex B byte stream. It is stored with a
+// length in front of each NAL unit, as MP4 has it, so that it can be sent as
+// it is, and handed on to HLS. One with nothing to keep, e.g. only an access
+// unit delimiter, leaves the ring as it was.
+void add_h264_frame(struct frame_buffer *fb, void *data, size_t data_len, double captured_at) {
+    struct frame *f;
+    struct frame spare;
+    size_t need = data_len + data_len / 4 + H264_LENGTH_SIZE; // A length may take a byte more than its start code
+
+    if (data_len > MAX_FRAME_SIZE) {
+        log_itf(LOG_WARNING, "Dropping H.264 frame larger than MAX_FRAME_SIZE: data_len = %d", data_len);
+        return;
+    }
+
+    if (fb->spare.data_buf_len < need) {
+        fb->spare.data = realloc(fb->spare.data, need);
+        fb->spare.data_buf_len = need;
+    }
+
+    fb->spare.data_len = h264_to_avcc((unsigned char *) fb->spare.data, fb->spare.data_buf_len, data, data_len, &fb->h264_params, &fb->spare.keyframe);
+    if (fb->spare.data_len == 0) {
+        return;
+    }
+    fb->spare.captured_at = captured_at;
+
+    // The oldest frame's buffer becomes the spare one
+    fb->current_frame++;
+    f = &fb->frames[fb->current_frame % fb->buffer_size];
+    spare = *f;
+    *f = fb->spare;
+    fb->spare = spare;
+    record_latency(fb, captured_at);
+
+    if (fb->hls != NULL) {
+        hls_add_frame(fb->hls, f);
+    }
+}
+
+// Adds the newest frame again, as it is and with the time it was captured,
+// so that viewers of a camera that has stopped do not give up on it. Each
+// rendition being watched gets its newest frame again too.
+void repeat_frame(struct frame_buffer *fb) {
+    struct frame_buffer *rb;
+    int r;
+
+    repeat_newest(fb);
+
+    for (r = RENDITION_FULL + 1; fb->renditions != NULL && r < RENDITION_COUNT; r++) {
+        rb = get_rendition(fb, r);
+        if (fb->rendition_clients[r] > 0 && rb->current_frame == fb->current_frame - 1) {
+            repeat_newest(rb);
+        }
+    }
+}
+
+static void repeat_newest(struct frame_buffer *fb) {
+    struct frame *f = &fb->frames[fb->current_frame % fb->buffer_size];
+    struct frame *next = &fb->frames[(fb->current_frame + 1) % fb->buffer_size];
+
+    if (next->data_buf_len < f->data_len) {
+        next->data = realloc(next->data, f->data_len);
+        next->data_buf_len = f->data_len;
+    }
+
+    memcpy(next->data, f->data, f->data_len);
+    next->data_len = f->data_len;
+    next->captured_at = f->captured_at;
+    next->keyframe = f->keyframe;
+
+    fb->current_frame++;
+    fb->frame_added_at = gettime();
 }
 
+// Returns the frame at index if it is still in the ring, NULL if it has been
+// overwritten or has not been captured yet. Before the first frame clients
+// are at -1, which comes in here as ULONG_MAX.
 struct frame *get_frame(struct frame_buffer *fb, unsigned long index) {
 
-    if (index <= fb->current_frame - fb->buffer_size) {
+    if ((long) index < 0 || (long) index > fb->current_frame || (long) index <= fb->current_frame - (long) fb->buffer_size) {
         return NULL;
     }
 
     return &fb->frames[index % fb->buffer_size];
 }
 
+
+void create_renditions(struct frame_buffer *fb) {
+    int i;
+
+    fb->renditions = calloc(RENDITION_COUNT - 1, sizeof(struct frame_buffer));
+    for (i = 0; i < RENDITION_COUNT - 1; i++) {
+        create_frame_buffer(&fb->renditions[i], fb->buffer_size);
+    }
+}
+
+struct frame_buffer *get_rendition(struct frame_buffer *fb, int rendition) {
+
+    if (rendition == RENDITION_FULL || fb->renditions == NULL) {
+        return fb;
+    }
+
+    return &fb->renditions[rendition - 1];
+}
+
+// Adds the reduced copy of the frame fb just captured, under the same number
+void add_rendition_frame(struct frame_buffer *fb, int rendition, void *data, size_t data_len) {
+    struct frame_buffer *rb = get_rendition(fb, rendition);
+
+    // Numbered and timed like the full size frame
+    rb->current_frame = fb->current_frame - 1;
+    add_frame(rb, data, data_len, fb->frames[fb->current_frame % fb->buffer_size].captured_at);
+}
@@ -3,15 +3,30 @@
 #define __FRAMES_H
 
 #include "v4l2uvc.h"
+#include "ratelimit.h"
+#include "h264.h"
+#include "hls.h"
 
 #define MIN_FRAME_SIZE 8*1024
 #define MAX_FRAME_SIZE 1024*1024
 #define MAX_HEADER_LEN 1024
+#define FRAME_BUFFER_LENGTH 8 // Frames kept of each camera
+#define LATENCY_SMOOTHING 0.1 // Weight of the newest frame in the average capture latency
+#define STALE_FRAME_INTERVAL 1.0 // Seconds between repeats of the last frame of a camera that stopped
+
+// Renditions of a camera, largest first. Reduced ones are only encoded while
+// someone is watching them.
+#define RENDITION_FULL 0
+#define RENDITION_MEDIUM 1
+#define RENDITION_LOW 2
+#define RENDITION_COUNT 3
 
 struct frame {
     char *data;
     size_t data_len;
     size_t data_buf_len;
+    double captured_at;
+    short keyframe;     // H.264 only, the frame can be decoded on its own
 };
 
 struct frame_buffer {
@@ -19,6 +34,31 @@ struct frame_buffer {
     long current_frame;
     size_t buffer_size;
     struct video_device *vd;
+    int stream_clients; // Number of clients currently streaming from this buffer
+    struct token_bucket egress; // Shared by all clients of this camera
+
+    // Cameras nobody watches are paused after idle-timeout
+    double wanted_at;   // Last time anyone watched it
+    int still_requests; // Clients waiting for a paused camera to take a still
+    long paused_frame;  // Newest frame when it was last paused, -1 if never
+
+    // From the driver filling a buffer to the frame being published, in
+    // seconds. Includes encoding YUYV and, for relays, the trip from upstream.
+    double capture_latency;     // Of the newest frame
+    double capture_latency_avg;
+    double frame_added_at;      // When the newest frame was added
+
+    // Reduced renditions, RENDITION_COUNT - 1 of them starting at
+    // RENDITION_MEDIUM. Their frames are numbered like the ones above.
+    struct frame_buffer *renditions;
+    int rendition_clients[RENDITION_COUNT];
+
+    // H.264 cameras keep access units rather than JPEGs, with a length in
+    // front of each NAL unit, and are only served as MP4 and HLS
+    short h264;
+    struct h264_params h264_params;
+    struct hls *hls;
+    struct frame spare; // Access units are converted here, then swapped into the ring
 };
 
 struct frame_buffers {
@@ -28,7 +68,12 @@ struct frame_buffers {
 
 void create_frame_buffer(struct frame_buffer *fb, size_t n);
 void destroy_frame_buffer(struct frame_buffer *fb);
-void add_frame(struct frame_buffer *fb, void *data, size_t data_len);
+void add_frame(struct frame_buffer *fb, void *data, size_t data_len, double captured_at);
+void add_h264_frame(struct frame_buffer *fb, void *data, size_t data_len, double captured_at);
+void repeat_frame(struct frame_buffer *fb);
 struct frame *get_frame(struct frame_buffer *fb, unsigned long index);
+void create_renditions(struct frame_buffer *fb);
+struct frame_buffer *get_rendition(struct frame_buffer *fb, int rendition);
+void add_rendition_frame(struct frame_buffer *fb, int rendition, void *data, size_t data_len);
 
 #endif
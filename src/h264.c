@@ -0,0 +1,291 @@
+
+#include <string.h>
+
+#include "h264.h"
+
+// Reads the RBSP of a NAL unit bit by bit, emulation prevention removed
+struct bit_reader {
+    unsigned char buf[H264_MAX_PARAM_SET_SIZE];
+    size_t len;
+    size_t pos;     // In bits
+    short error;    // Set by an Exp-Golomb code too long for 32 bits
+};
+
+static void bit_reader_init(struct bit_reader *br, const unsigned char *nal, size_t len);
+static unsigned int read_bits(struct bit_reader *br, int n);
+static unsigned int read_ue(struct bit_reader *br);
+static int read_se(struct bit_reader *br);
+static void skip_scaling_list(struct bit_reader *br, int size);
+static short starts_access_unit(const unsigned char *nal, size_t len);
+
+static void bit_reader_init(struct bit_reader *br, const unsigned char *nal, size_t len) {
+    size_t i, zeros = 0;
+
+    br->len = 0;
+    br->pos = 0;
+    br->error = 0;
+
+    // 00 00 03 stands for 00 00 in the RBSP
+    for (i = 0; i < len && br->len < sizeof(br->buf); i++) {
+        if (zeros >= 2 && nal[i] == 0x03) {
+            zeros = 0;
+            continue;
+        }
+        zeros = (nal[i] == 0) ? zeros + 1 : 0;
+        br->buf[br->len++] = nal[i];
+    }
+}
+
+// Past the end reads as zeros, which the caller notices as nonsense sizes
+static unsigned int read_bits(struct bit_reader *br, int n) {
+    unsigned int value = 0;
+
+    while (n-- > 0) {
+        value <<= 1;
+        if (br->pos / 8 < br->len) {
+            value |= (br->buf[br->pos / 8] >> (7 - br->pos % 8)) & 1;
+        }
+        br->pos++;
+    }
+
+    return value;
+}
+
+// Exp-Golomb coded unsigned integer. Values need at most 31 leading zeros,
+// more (such as a run past the end) sets br->error and reads as 0.
+static unsigned int read_ue(struct bit_reader *br) {
+    int zeros = 0;
+
+    while (read_bits(br, 1) == 0) {
+        if (++zeros > 31) {
+            br->error = 1;
+            return 0;
+        }
+    }
+
+    return (1U << zeros) - 1 + read_bits(br, zeros);
+}
+
+static int read_se(struct bit_reader *br) {
+    unsigned int value = read_ue(br);
+
+    return (value & 1) ? (int) ((value + 1) / 2) : -(int) (value / 2);
+}
+
+static void skip_scaling_list(struct bit_reader *br, int size) {
+    int i, last_scale = 8, next_scale = 8;
+
+    for (i = 0; i < size; i++) {
+        if (next_scale != 0) {
+            next_scale = (last_scale + read_se(br) + 256) % 256;
+        }
+        last_scale = (next_scale == 0) ? last_scale : next_scale;
+    }
+}
+
+// Finds the next NAL unit at or after *pos in an Annex B byte stream and
+// moves *pos past it. Returns NULL once there are no more.
+const unsigned char *h264_next_nal(const unsigned char *buf, size_t len, size_t *pos, size_t *nal_len) {
+    size_t i = *pos, start;
+
+    for (; i + 3 <= len && !(buf[i] == 0 && buf[i + 1] == 0 && buf[i + 2] == 1); i++) {}
+    if (i + 3 > len) {
+        *pos = len;
+        return NULL;
+    }
+    start = i + 3;
+
+    for (i = start; i + 3 <= len && !(buf[i] == 0 && buf[i + 1] == 0 && buf[i + 2] <= 1); i++) {}
+    if (i + 3 > len) {
+        i = len;
+    }
+
+    // Zeros in front of the next start code are not part of this unit
+    *pos = i;
+    while (i > start && buf[i - 1] == 0) {
+        i--;
+    }
+
+    *nal_len = i - start;
+    return &buf[start];
+}
+
+// Whether a NAL unit that follows a picture begins the next access unit
+static short starts_access_unit(const unsigned char *nal, size_t len) {
+    int type = nal[0] & 0x1f;
+
+    if (type == H264_NAL_SLICE || type == H264_NAL_IDR) {
+        return len > 1 && (nal[1] & 0x80); // first_mb_in_slice is 0
+    }
+
+    return type == H264_NAL_SEI || type == H264_NAL_SPS || type == H264_NAL_PPS || type == H264_NAL_AUD || (type >= 14 && type <= 18);
+}
+
+// Length of the access unit, i.e. one picture with whatever goes with it,
+// at the start of an Annex B byte stream. The last one runs to the end.
+size_t h264_access_unit_size(const unsigned char *buf, size_t len) {
+    const unsigned char *nal;
+    size_t pos = 0, nal_len, boundary;
+    short have_picture = 0;
+    int type;
+
+    while ((nal = h264_next_nal(buf, len, &pos, &nal_len)) != NULL) {
+        if (nal_len == 0) {
+            continue;
+        }
+
+        if (have_picture && starts_access_unit(nal, nal_len)) {
+            // Back to the start code, all zeros of it
+            for (boundary = nal - buf - 3; boundary > 0 && buf[boundary - 1] == 0; boundary--) {}
+            return boundary;
+        }
+
+        type = nal[0] & 0x1f;
+        if (type == H264_NAL_SLICE || type == H264_NAL_IDR) {
+            have_picture = 1;
+        }
+    }
+
+    return len;
+}
+
+// Gets the picture size and sample format out of a sequence parameter set,
+// NAL header included, into params. Returns -1 if it does not make sense.
+int h264_parse_sps(const unsigned char *sps, size_t len, struct h264_params *params) {
+    struct bit_reader br;
+    unsigned int profile, chroma_format = 1, bit_depth_luma = 8, bit_depth_chroma = 8;
+    unsigned int width_mbs, height_map_units, frame_mbs_only, i, n;
+    int width, height;
+    unsigned int crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0, crop_x, crop_y;
+
+    if (len < 4) {
+        return -1;
+    }
+
+    bit_reader_init(&br, sps + 1, len - 1);
+    profile = read_bits(&br, 8);
+    read_bits(&br, 16); // Constraint flags and level
+    read_ue(&br); // seq_parameter_set_id
+
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 144 || profile == 244 || profile == 44 || profile == 83 ||
+            profile == 86 || profile == 118 || profile == 128 || profile == 138 || profile == 139 || profile == 134 || profile == 135) {
+        chroma_format = read_ue(&br);
+        if (chroma_format == 3) {
+            read_bits(&br, 1); // separate_colour_plane_flag
+        }
+        bit_depth_luma = read_ue(&br) + 8;
+        bit_depth_chroma = read_ue(&br) + 8;
+        read_bits(&br, 1);
+
+        if (read_bits(&br, 1)) { // seq_scaling_matrix_present_flag
+            for (i = 0; i < (chroma_format != 3 ? 8 : 12); i++) {
+                if (read_bits(&br, 1)) {
+                    skip_scaling_list(&br, i < 6 ? 16 : 64);
+                }
+            }
+        }
+    }
+
+    read_ue(&br); // log2_max_frame_num_minus4
+    switch (read_ue(&br)) { // pic_order_cnt_type
+        case 0:
+            read_ue(&br);
+            break;
+        case 1:
+            read_bits(&br, 1);
+            read_se(&br);
+            read_se(&br);
+            for (i = 0, n = read_ue(&br); i < n && i < 256; i++) {
+                read_se(&br);
+            }
+            break;
+    }
+
+    read_ue(&br); // max_num_ref_frames
+    read_bits(&br, 1);
+    width_mbs = read_ue(&br) + 1;
+    height_map_units = read_ue(&br) + 1;
+    frame_mbs_only = read_bits(&br, 1);
+    if (!frame_mbs_only) {
+        read_bits(&br, 1);
+    }
+    read_bits(&br, 1); // direct_8x8_inference_flag
+
+    if (read_bits(&br, 1)) { // frame_cropping_flag
+        crop_left = read_ue(&br);
+        crop_right = read_ue(&br);
+        crop_top = read_ue(&br);
+        crop_bottom = read_ue(&br);
+    }
+
+    crop_x = (chroma_format == 1 || chroma_format == 2) ? 2 : 1;
+    crop_y = (chroma_format == 1 ? 2 : 1) * (2 - frame_mbs_only);
+
+    width = width_mbs * 16 - crop_x * (crop_left + crop_right);
+    height = (2 - frame_mbs_only) * height_map_units * 16 - crop_y * (crop_top + crop_bottom);
+
+    if (br.error || br.pos > br.len * 8 || width <= 0 || height <= 0 || width > 8192 || height > 8192 ||
+            chroma_format > 3 || bit_depth_luma > 14 || bit_depth_chroma > 14) {
+        return -1;
+    }
+
+    params->width = width;
+    params->height = height;
+    params->chroma_format = chroma_format;
+    params->bit_depth_luma = bit_depth_luma;
+    params->bit_depth_chroma = bit_depth_chroma;
+
+    return 0;
+}
+
+// Rewrites an Annex B access unit with a length in front of each NAL unit
+// instead of a start code, leaving out access unit delimiters. Parameter
+// sets found along the way are kept in params. Returns the new length, or
+// 0 if dst is too small.
+size_t h264_to_avcc(unsigned char *dst, size_t dst_size, const unsigned char *src, size_t len, struct h264_params *params, short *keyframe) {
+    const unsigned char *nal;
+    size_t pos = 0, nal_len, out = 0;
+    int type;
+
+    *keyframe = 0;
+
+    while ((nal = h264_next_nal(src, len, &pos, &nal_len)) != NULL) {
+        if (nal_len == 0) {
+            continue;
+        }
+
+        type = nal[0] & 0x1f;
+        if (type == H264_NAL_AUD) {
+            continue;
+        }
+
+        if (type == H264_NAL_IDR) {
+            *keyframe = 1;
+        }
+        else if (type == H264_NAL_SPS && nal_len <= H264_MAX_PARAM_SET_SIZE) {
+            if (nal_len != params->sps_len || memcmp(nal, params->sps, nal_len) != 0) {
+                if (h264_parse_sps(nal, nal_len, params) == 0) {
+                    memcpy(params->sps, nal, nal_len);
+                    params->sps_len = nal_len;
+                }
+            }
+        }
+        else if (type == H264_NAL_PPS && nal_len <= H264_MAX_PARAM_SET_SIZE) {
+            memcpy(params->pps, nal, nal_len);
+            params->pps_len = nal_len;
+        }
+
+        if (out + H264_LENGTH_SIZE + nal_len > dst_size) {
+            return 0;
+        }
+
+        dst[out] = nal_len >> 24;
+        dst[out + 1] = (nal_len >> 16) & 0xff;
+        dst[out + 2] = (nal_len >> 8) & 0xff;
+        dst[out + 3] = nal_len & 0xff;
+        memcpy(&dst[out + H264_LENGTH_SIZE], nal, nal_len);
+        out += H264_LENGTH_SIZE + nal_len;
+    }
+
+    return out;
+}
@@ -0,0 +1,39 @@
+#ifndef __H264_H
+#define __H264_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// H.264 (ISO/IEC 14496-10) bitstreams, as far as passing them through needs:
+// finding access units and parameter sets in Annex B byte streams and
+// rewriting NAL units with length prefixes as MP4 stores them
+
+#define H264_NAL_SLICE 1
+#define H264_NAL_IDR 5
+#define H264_NAL_SEI 6
+#define H264_NAL_SPS 7
+#define H264_NAL_PPS 8
+#define H264_NAL_AUD 9
+
+#define H264_MAX_PARAM_SET_SIZE 256
+#define H264_LENGTH_SIZE 4 // Bytes in front of each NAL unit once converted
+
+// The newest SPS and PPS of a stream, which decoders need before any frame
+struct h264_params {
+    unsigned char sps[H264_MAX_PARAM_SET_SIZE];
+    size_t sps_len;
+    unsigned char pps[H264_MAX_PARAM_SET_SIZE];
+    size_t pps_len;
+    int width;
+    int height;
+    int chroma_format;      // chroma_format_idc, 1 is 4:2:0
+    int bit_depth_luma;
+    int bit_depth_chroma;
+};
+
+const unsigned char *h264_next_nal(const unsigned char *buf, size_t len, size_t *pos, size_t *nal_len);
+size_t h264_access_unit_size(const unsigned char *buf, size_t len);
+int h264_parse_sps(const unsigned char *sps, size_t len, struct h264_params *params);
+size_t h264_to_avcc(unsigned char *dst, size_t dst_size, const unsigned char *src, size_t len, struct h264_params *params, short *keyframe);
+
+#endif
@@ -0,0 +1,170 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "memory.h"
+#include "logger.h"
+#include "utils.h"
+#include "frames.h"
+#include "hls.h"
+
+static uint64_t to_ticks(struct hls *h, double t);
+static void finish_segment(struct hls *h, double end);
+
+struct hls *create_hls() {
+    struct hls *h = calloc(1, sizeof(struct hls));
+
+    h->stream_started_at = -1;
+    return h;
+}
+
+void destroy_hls(struct hls *h) {
+    int i;
+
+    for (i = 0; i < HLS_SEGMENT_COUNT; i++) {
+        free(h->segments[i].data);
+    }
+
+    free(h->data);
+    free(h->samples);
+    free(h->sample_times);
+    free(h);
+}
+
+// Sample times are rounded from the capture times rather than added up, so
+// that they do not drift
+static uint64_t to_ticks(struct hls *h, double t) {
+    return (uint64_t) ((t - h->stream_started_at) * MP4_TIMESCALE + 0.5);
+}
+
+// Turns the samples collected so far into a segment that ends at end
+static void finish_segment(struct hls *h, double end) {
+    struct hls_segment *seg = &h->segments[h->next_sequence % HLS_SEGMENT_COUNT];
+    size_t need = mp4_fragment_header_size(h->sample_count) + h->data_len;
+    uint64_t t, next;
+    int i;
+
+    for (i = 0; i < h->sample_count; i++) {
+        t = to_ticks(h, h->sample_times[i]);
+        next = to_ticks(h, (i + 1 < h->sample_count) ? h->sample_times[i + 1] : end);
+        h->samples[i].duration = (next > t) ? next - t : 1;
+    }
+
+    if (seg->size < need) {
+        seg->data = realloc(seg->data, need);
+        seg->size = need;
+    }
+
+    seg->len = mp4_fragment_header(seg->data, seg->size, h->next_sequence + 1, to_ticks(h, h->sample_times[0]), h->samples, h->sample_count);
+    memcpy(&seg->data[seg->len], h->data, h->data_len);
+    seg->len += h->data_len;
+    seg->sequence = h->next_sequence;
+    seg->duration = end - h->sample_times[0];
+
+    h->next_sequence++;
+    h->data_len = 0;
+    h->sample_count = 0;
+}
+
+// Adds a frame of the camera. A segment is finished once a keyframe comes
+// along after HLS_TARGET_DURATION, so that each one can be played on its own.
+void hls_add_frame(struct hls *h, struct frame *f) {
+    double elapsed;
+
+    if (h->sample_count == 0 && !f->keyframe) {
+        return; // Nothing to decode it from
+    }
+
+    if (h->stream_started_at < 0) {
+        h->stream_started_at = f->captured_at;
+    }
+
+    // Capture times jitter, so a keyframe within half a frame of the target
+    // duration is on time
+    elapsed = (h->sample_count > 0) ? f->captured_at - h->sample_times[0] : 0;
+    if (h->sample_count > 0 && ((f->keyframe && elapsed + elapsed / h->sample_count / 2 >= HLS_TARGET_DURATION) || h->data_len + f->data_len > HLS_MAX_SEGMENT_SIZE)) {
+        finish_segment(h, f->captured_at);
+
+        if (!f->keyframe) {
+            log_it(LOG_WARNING, "HLS segment grew too large, the camera may not be sending keyframes.");
+            return;
+        }
+    }
+
+    if (h->sample_count == h->sample_size) {
+        h->sample_size = max(2 * h->sample_size, 64);
+        h->samples = realloc(h->samples, h->sample_size * sizeof(struct mp4_sample));
+        h->sample_times = realloc(h->sample_times, h->sample_size * sizeof(double));
+    }
+
+    if (h->data_len + f->data_len > h->data_size) {
+        h->data_size = max(2 * h->data_size, h->data_len + f->data_len);
+        h->data = realloc(h->data, h->data_size);
+    }
+
+    h->samples[h->sample_count].size = f->data_len;
+    h->samples[h->sample_count].keyframe = f->keyframe;
+    h->sample_times[h->sample_count] = f->captured_at;
+    h->sample_count++;
+
+    memcpy(&h->data[h->data_len], f->data, f->data_len);
+    h->data_len += f->data_len;
+}
+
+// Throws away the segment being collected, e.g. when the camera is paused,
+// so that no segment spans the gap
+void hls_drop_pending(struct hls *h) {
+    h->data_len = 0;
+    h->sample_count = 0;
+}
+
+// Returns NULL if the segment has not been finished yet or is gone
+struct hls_segment *hls_get_segment(struct hls *h, unsigned long sequence) {
+    if (sequence >= h->next_sequence || sequence + HLS_SEGMENT_COUNT < h->next_sequence) {
+        return NULL;
+    }
+
+    return &h->segments[sequence % HLS_SEGMENT_COUNT];
+}
+
+// Writes the media playlist listing the newest segments. Returns its length,
+// or 0 if there are no segments yet.
+size_t hls_playlist(struct hls *h, char *buf, size_t size) {
+    unsigned long first, seq;
+    double longest = 0;
+    size_t len;
+    int target;
+
+    if (h->next_sequence == 0) {
+        return 0;
+    }
+
+    first = (h->next_sequence > HLS_PLAYLIST_SEGMENTS) ? h->next_sequence - HLS_PLAYLIST_SEGMENTS : 0;
+    for (seq = first; seq < h->next_sequence; seq++) {
+        longest = max(longest, hls_get_segment(h, seq)->duration);
+    }
+
+    // Whole seconds rounded up, so that no segment is longer, and never 0,
+    // which is not a valid target
+    target = (int) longest;
+    if (target < longest) {
+        target++;
+    }
+    target = max(target, 1);
+
+    len = snprintf(buf, size,
+        "#EXTM3U\n"
+        "#EXT-X-VERSION:7\n"
+        "#EXT-X-TARGETDURATION:%d\n"
+        "#EXT-X-MEDIA-SEQUENCE:%lu\n"
+        "#EXT-X-INDEPENDENT-SEGMENTS\n"
+        "#EXT-X-MAP:URI=\"init.mp4\"\n",
+        target, first);
+
+    for (seq = first; seq < h->next_sequence && len < size; seq++) {
+        len += snprintf(&buf[len], size - len, "#EXTINF:%.3f,\n%lu.m4s\n", hls_get_segment(h, seq)->duration, seq);
+    }
+
+    return min(len, size - 1);
+}
@@ -0,0 +1,49 @@
+#ifndef __HLS_H
+#define __HLS_H
+
+#include <sys/types.h>
+
+#include "mp4.h"
+
+// HTTP Live Streaming of an H.264 camera. Frames are collected into
+// fragmented MP4 segments in memory, each starting at a keyframe.
+
+#define HLS_TARGET_DURATION 2.0 // Segments are cut at the first keyframe after this many seconds
+#define HLS_MAX_SEGMENT_SIZE (16 * 1024 * 1024) // A segment this large is cut short
+#define HLS_PLAYLIST_SEGMENTS 4 // Segments listed in the playlist
+#define HLS_SEGMENT_COUNT 8 // Segments kept, so that slow downloads of old ones can finish
+#define HLS_MAX_PLAYLIST_SIZE 1024
+
+struct frame;
+
+struct hls_segment {
+    unsigned long sequence;
+    double duration;
+    unsigned char *data;    // moof, mdat and the samples
+    size_t len;
+    size_t size;
+};
+
+struct hls {
+    struct hls_segment segments[HLS_SEGMENT_COUNT]; // By sequence number
+    unsigned long next_sequence;    // Of the segment being collected
+    double stream_started_at;       // Capture time at decode time 0
+
+    // Segment being collected
+    unsigned char *data;
+    size_t data_len;
+    size_t data_size;
+    struct mp4_sample *samples;
+    double *sample_times;           // Capture times
+    int sample_count;
+    int sample_size;
+};
+
+struct hls *create_hls();
+void destroy_hls(struct hls *h);
+void hls_add_frame(struct hls *h, struct frame *f);
+void hls_drop_pending(struct hls *h);
+struct hls_segment *hls_get_segment(struct hls *h, unsigned long sequence);
+size_t hls_playlist(struct hls *h, char *buf, size_t size);
+
+#endif
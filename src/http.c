@@ -5,11 +5,33 @@
 
 #include "mime.h"
 #include "utils.h"
+#include "websocket.h"
 #include "http.h"
 
-static void normalize_request(char *lines);
-static void extract_header(char *line, const char *header, char **val);
-static void extract_request_line(char *line, char **method, char **path, char **query_string, char **protocol, char **protocol_version);
+#define HTTP_STATE_METHOD 0
+#define HTTP_STATE_PATH 1
+#define HTTP_STATE_QUERY_STRING 2
+#define HTTP_STATE_PROTOCOL 3
+#define HTTP_STATE_PROTOCOL_VERSION 4
+#define HTTP_STATE_LINE_START 5
+#define HTTP_STATE_HEADER_NAME 6
+#define HTTP_STATE_HEADER_VALUE_START 7
+#define HTTP_STATE_HEADER_VALUE 8
+#define HTTP_STATE_DONE 9
+#define HTTP_STATE_ERROR 10
+
+// Indexed by HTTP_HEADER_*
+static const char *HTTP_HEADER_NAMES[HTTP_HEADER_COUNT] = {
+    "host",
+    "authorization",
+    "connection",
+    "upgrade",
+    "sec-websocket-key",
+    "sec-websocket-version",
+};
+
+static int lookup_header(const char *name, size_t len);
+static char *terminate_span(char *buf, struct http_span *span);
 
 // Returns 1 if user is authorized, 0 otherwise.
 // Note that if desired_password is NULL, the user is authorized.
@@ -56,144 +78,304 @@ char *get_mime_type(char *filename) {
     return "application/octet";
 }
 
-static void normalize_request(char *lines) {
-    char *c, *c1, *end;
-    ssize_t len;
+// Returns 1 if the comma separated header value contains token.
+short http_header_has_token(const char *value, const char *token) {
+    size_t len = strlen(token);
 
-    end = &lines[strstr(lines, "\r\n\r\n") - lines];
-    
-    // Convert \r\n to \0\n
-    for (c = lines; c < end + 3; c++) {
-        if (*c == '\r' && *(c + 1) == '\n') {
-            *c = '\0';
+    while (value != NULL && *value != '\0') {
+        for (; is_lws(*value) || *value == ','; value++) {}
+
+        if (strncasecmp(value, token, len) == 0 && (value[len] == '\0' || value[len] == ',' || is_lws(value[len]))) {
+            return 1;
         }
+
+        value = strchr(value, ',');
     }
 
-    // Concat multi-line headers
-    for (c = lines; c < end - 2; c++) {
-        if (*c == '\0' && *(c + 1) == '\n' && is_lws(*(c + 2))) {
-            for (c1 = c + 3; is_lws(*c1); c1++) {}
-            len = strlen(c1);
-            memmove(c, c1, end - c);
-            c[len] = '\0';
+    return 0;
+}
 
-            end -= c1 - c;
-            c = c1 + len;
-        }
+// Returns 1 if the connection should stay open after the response.
+// HTTP/1.1 connections are persistent unless the client says otherwise,
+// HTTP/1.0 ones only if the client asks for it.
+short http_keep_alive(struct http_request *req) {
+    if (http_header_has_token(req->connection, "close")) {
+        return 0;
     }
 
+    if (http_header_has_token(req->connection, "keep-alive")) {
+        return 1;
+    }
+
+    return strcmp(req->protocol_version, "1.1") >= 0;
 }
 
-static void extract_header(char *line, const char *header, char **val) {
-    size_t len;
-    
-    if (*val != NULL) {
-        return;
+// Whether req asks to switch to a WebSocket (RFC 6455, section 4.2.1)
+short http_websocket_upgrade(struct http_request *req) {
+    return http_header_has_token(req->connection, "upgrade") &&
+        http_header_has_token(req->upgrade, "websocket") &&
+        req->websocket_key != NULL &&
+        req->websocket_version != NULL && strcmp(req->websocket_version, WS_VERSION) == 0;
+}
+
+// Copies the value of the query string parameter called name into value.
+// Returns 1 if the parameter was found. Values are not URL decoded.
+short http_query_param(const char *query_string, const char *name, char *value, size_t value_len) {
+    const char *c, *end;
+    size_t len = strlen(name);
+
+    for (c = query_string; c != NULL && *c != '\0'; c = strchr(c, '&')) {
+        if (*c == '&') {
+            c++;
+        }
+
+        if (strncmp(c, name, len) == 0 && (c[len] == '=' || c[len] == '&' || c[len] == '\0')) {
+            c += len;
+            c += (*c == '=');
+
+            for (end = c; *end != '\0' && *end != '&'; end++) {}
+
+            snprintf(value, value_len, "%.*s", (int) (end - c), c);
+            return 1;
+        }
     }
 
-    len = strlen(header);
-    
-    if (strncasecmp(line, header, len) == 0) {
-        *val = line + len;
-        trim(*val);
+    return 0;
+}
+
+static int lookup_header(const char *name, size_t len) {
+    int i;
+
+    for (i = 0; i < HTTP_HEADER_COUNT; i++) {
+        if (strlen(HTTP_HEADER_NAMES[i]) == len && strncasecmp(name, HTTP_HEADER_NAMES[i], len) == 0) {
+            return i;
+        }
     }
 
+    return HTTP_HEADER_NONE;
 }
 
-// Long and horrible, but it works
-static void extract_request_line(char *line, char **method, char **path, char **query_string, char **protocol, char **protocol_version) {
-    char *c, *start, *end;
+// The byte following every span is a delimiter the parser has already
+// consumed, so it can be overwritten with a NUL in place.
+static char *terminate_span(char *buf, struct http_span *span) {
+    buf[span->start + span->len] = '\0';
+    return &buf[span->start];
+}
 
-    end = line + strlen(line) - 1;
-    start = line;
+void http_parser_init(struct http_parser *p) {
+    memset(p, 0, sizeof(struct http_parser));
+    p->state = HTTP_STATE_METHOD;
+    p->header = HTTP_HEADER_NONE;
+}
 
-    for (c = line; c < end; c++) {
+// Examines buf[p->pos..len) and returns one of HTTP_PARSE_*. Once the
+// request is complete p->pos is the length of the request head; anything
+// past it belongs to the next request.
+int http_parser_execute(struct http_parser *p, const char *buf, size_t len) {
+    char c;
+
+    for (; p->pos < len; p->pos++) {
+        c = buf[p->pos];
+
+        switch (p->state) {
+            case HTTP_STATE_METHOD:
+                if (is_lws(c)) {
+                    if (p->pos == p->mark) {
+                        p->state = HTTP_STATE_ERROR;
+                        return HTTP_PARSE_ERROR;
+                    }
+                    p->method.start = p->mark;
+                    p->method.len = p->pos - p->mark;
+                    p->mark = p->pos + 1;
+                    p->state = HTTP_STATE_PATH;
+                }
+                else if (c == '\r' || c == '\n') {
+                    p->state = HTTP_STATE_ERROR;
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
 
-        if (*method == NULL) {
-            if (is_lws(*c)) {
-                *c = '\0';
-                *method = start;
-                c++;
+            case HTTP_STATE_PATH:
+                if (is_lws(c) && p->pos == p->mark) {
+                    p->mark++;
+                }
+                else if (is_lws(c) || c == '?') {
+                    p->path.start = p->mark;
+                    p->path.len = p->pos - p->mark;
+                    p->mark = p->pos + 1;
+                    p->has_query_string = (c == '?');
+                    p->state = p->has_query_string ? HTTP_STATE_QUERY_STRING : HTTP_STATE_PROTOCOL;
+                }
+                else if (c == '\r' || c == '\n') {
+                    p->state = HTTP_STATE_ERROR;
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
 
-                for (; is_lws(*c); c++) {}
+            case HTTP_STATE_QUERY_STRING:
+                if (is_lws(c)) {
+                    p->query_string.start = p->mark;
+                    p->query_string.len = p->pos - p->mark;
+                    p->mark = p->pos + 1;
+                    p->state = HTTP_STATE_PROTOCOL;
+                }
+                else if (c == '\r' || c == '\n') {
+                    p->state = HTTP_STATE_ERROR;
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
 
-                start = c;
-            }
-            continue;
-        }
+            case HTTP_STATE_PROTOCOL:
+                if (is_lws(c) && p->pos == p->mark) {
+                    p->mark++;
+                }
+                else if (c == '/') {
+                    p->protocol.start = p->mark;
+                    p->protocol.len = p->pos - p->mark;
+                    p->mark = p->end = p->pos + 1;
+                    p->state = HTTP_STATE_PROTOCOL_VERSION;
+                }
+                else if (is_lws(c) || c == '\r' || c == '\n') {
+                    p->state = HTTP_STATE_ERROR;
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
 
-        if (*path == NULL) {
-            if (is_lws(*c) || *c == '?') {
-                *path = start;
+            case HTTP_STATE_PROTOCOL_VERSION:
+                if (c == '\n') {
+                    p->protocol_version.start = p->mark;
+                    p->protocol_version.len = p->end - p->mark;
+                    p->state = HTTP_STATE_LINE_START;
+                }
+                else if (!is_blank(c)) {
+                    p->end = p->pos + 1;
+                }
+                break;
 
-                if (*c != '?') {
-                    *query_string = "";
+            case HTTP_STATE_LINE_START:
+                if (c == '\r') {
+                    break;
+                }
+                else if (c == '\n') {
+                    p->pos++;
+                    p->state = HTTP_STATE_DONE;
+                    return HTTP_PARSE_DONE;
+                }
+                else if (is_lws(c)) {
+                    // Folded header: the value continues on this line
+                    p->state = HTTP_STATE_HEADER_VALUE;
+                }
+                else {
+                    p->mark = p->pos;
+                    p->state = HTTP_STATE_HEADER_NAME;
                 }
-                *c = '\0';
-                c++;
+                break;
 
-                for (; is_lws(*c); c++) {}
-                start = c;
-            }
-        }
-        
-        if (*query_string == NULL) {
-            if (is_lws(*c)) {
-                *c = '\0';
-                c++;
-                *query_string = start;
-
-                for (; is_lws(*c); c++) {}
+            case HTTP_STATE_HEADER_NAME:
+                if (c == ':') {
+                    p->header = lookup_header(&buf[p->mark], p->pos - p->mark);
+
+                    // Only the first occurrence of a header counts
+                    if (p->header != HTTP_HEADER_NONE && p->has_header[p->header]) {
+                        p->header = HTTP_HEADER_NONE;
+                    }
+                    p->state = HTTP_STATE_HEADER_VALUE_START;
+                }
+                else if (c == '\r' || c == '\n') {
+                    p->state = HTTP_STATE_ERROR;
+                    return HTTP_PARSE_ERROR;
+                }
                 break;
-            }
-        }
-        else {
-            break;
+
+            case HTTP_STATE_HEADER_VALUE_START:
+                if (c == '\n') {
+                    p->mark = p->end = p->pos;
+                    if (p->header != HTTP_HEADER_NONE) {
+                        p->headers[p->header].start = p->mark;
+                        p->headers[p->header].len = 0;
+                        p->has_header[p->header] = 1;
+                    }
+                    p->state = HTTP_STATE_LINE_START;
+                }
+                else if (!is_blank(c)) {
+                    p->mark = p->pos;
+                    p->end = p->pos + 1;
+                    p->state = HTTP_STATE_HEADER_VALUE;
+                }
+                break;
+
+            case HTTP_STATE_HEADER_VALUE:
+                if (c == '\n') {
+                    if (p->header != HTTP_HEADER_NONE) {
+                        p->headers[p->header].start = p->mark;
+                        p->headers[p->header].len = p->end - p->mark;
+                        p->has_header[p->header] = 1;
+                    }
+                    p->state = HTTP_STATE_LINE_START;
+                }
+                else if (!is_blank(c)) {
+                    p->end = p->pos + 1;
+                }
+                break;
+
+            case HTTP_STATE_DONE:
+                return HTTP_PARSE_DONE;
+
+            default:
+                return HTTP_PARSE_ERROR;
         }
     }
-        
-    *protocol = c;
-    
-    for (; c < end; c++) {
-        if (*c == '/') {
-            *c = '\0';
-            c++;
-            *protocol_version = c;
-            trim(*protocol_version);
-            break;
+
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+// Points req at the spans found by a completed parse. The strings live in
+// buf, which gets NUL terminators (and spaces in place of folded line
+// breaks) written into it. Bytes past the request head are not touched.
+void http_parser_fill_request(struct http_parser *p, char *buf, struct http_request *req) {
+    int i;
+    char *c, *headers[HTTP_HEADER_COUNT];
+
+    req->method = terminate_span(buf, &p->method);
+    req->path = terminate_span(buf, &p->path);
+    req->query_string = p->has_query_string ? terminate_span(buf, &p->query_string) : "";
+    req->protocol = terminate_span(buf, &p->protocol);
+    req->protocol_version = terminate_span(buf, &p->protocol_version);
+
+    for (i = 0; i < HTTP_HEADER_COUNT; i++) {
+        headers[i] = NULL;
+
+        if (p->has_header[i]) {
+            headers[i] = terminate_span(buf, &p->headers[i]);
+
+            for (c = headers[i]; *c != '\0'; c++) {
+                if (*c == '\r' || *c == '\n') {
+                    *c = ' ';
+                }
+            }
         }
     }
+
+    req->host = headers[HTTP_HEADER_HOST];
+    req->authorization = headers[HTTP_HEADER_AUTHORIZATION];
+    req->connection = headers[HTTP_HEADER_CONNECTION];
+    req->upgrade = headers[HTTP_HEADER_UPGRADE];
+    req->websocket_key = headers[HTTP_HEADER_SEC_WEBSOCKET_KEY];
+    req->websocket_version = headers[HTTP_HEADER_SEC_WEBSOCKET_VERSION];
 }
 
-// This function re-uses the request string and modifies it severely.
+// Parses a complete request head in one go.
+// This function writes NUL terminators into the request string.
 // Make a copy if you still need it.
 void parse_request(char *lines, struct http_request *req) {
-    char *line;
-    ssize_t len;
-    
-    req->method = NULL;
-    req->path = NULL;
-    req->query_string = NULL;
-    req->protocol = NULL;
-    req->protocol_version = NULL;
-    req->host = NULL;
-    req->authorization = NULL;
-    
-    normalize_request(lines);
-
-    line = lines;
-    len = strlen(line);
-    
-    extract_request_line(line, &req->method, &req->path, &req->query_string, &req->protocol, &req->protocol_version);
-
-    line += len + 2;
-    len = strlen(line);
-    while (len) {
-        extract_header(line, "host:", &req->host);
-        extract_header(line, "authorization:", &req->authorization);
-
-        line += len + 2;
-        len = strlen(line);
+    struct http_parser p;
+
+    http_parser_init(&p);
+
+    if (http_parser_execute(&p, lines, strlen(lines)) != HTTP_PARSE_DONE) {
+        memset(req, 0, sizeof(struct http_request));
+        return;
     }
-}
 
+    http_parser_fill_request(&p, lines, req);
+}
@@ -1,8 +1,25 @@
 #ifndef __HTTP_H
 #define __HTTP_H
 
+#include <sys/types.h>
+
 #define INDEX_FILE_NAME "index.html"
 
+// Return values of http_parser_execute()
+#define HTTP_PARSE_INCOMPLETE 0
+#define HTTP_PARSE_DONE 1
+#define HTTP_PARSE_ERROR 2
+
+// Headers the parser keeps track of
+#define HTTP_HEADER_NONE -1
+#define HTTP_HEADER_HOST 0
+#define HTTP_HEADER_AUTHORIZATION 1
+#define HTTP_HEADER_CONNECTION 2
+#define HTTP_HEADER_UPGRADE 3
+#define HTTP_HEADER_SEC_WEBSOCKET_KEY 4
+#define HTTP_HEADER_SEC_WEBSOCKET_VERSION 5
+#define HTTP_HEADER_COUNT 6
+
 struct http_request {
     char *method;
     char *path;
@@ -12,10 +29,48 @@ struct http_request {
 
     char *host;
     char *authorization;
+    char *connection;
+    char *upgrade;
+    char *websocket_key;
+    char *websocket_version;
+};
+
+// A token inside the buffer being parsed. Offsets rather than pointers
+// so that the buffer may be refilled without invalidating anything.
+struct http_span {
+    size_t start;
+    size_t len;
+};
+
+// Incremental request parser. Feed it the same buffer as more data
+// arrives and it resumes where it left off; nothing is copied.
+struct http_parser {
+    int state;
+    size_t pos;     // Offset of the next byte to look at
+    size_t mark;    // Offset where the current token starts
+    size_t end;     // Offset just past the last non-blank byte of the current token
+    int header;     // HTTP_HEADER_* of the header line being parsed
+
+    struct http_span method;
+    struct http_span path;
+    struct http_span query_string;
+    struct http_span protocol;
+    struct http_span protocol_version;
+    struct http_span headers[HTTP_HEADER_COUNT];
+    short has_query_string;
+    short has_header[HTTP_HEADER_COUNT];
 };
 
 short check_http_auth(char *auth, char *desired_password);
 char *get_mime_type(char *filename);
+short http_header_has_token(const char *value, const char *token);
+short http_keep_alive(struct http_request *req);
+short http_websocket_upgrade(struct http_request *req);
+short http_query_param(const char *query_string, const char *name, char *value, size_t value_len);
+
+void http_parser_init(struct http_parser *p);
+int http_parser_execute(struct http_parser *p, const char *buf, size_t len);
+void http_parser_fill_request(struct http_parser *p, char *buf, struct http_request *req);
 void parse_request(char *lines, struct http_request *req);
 
 #endif
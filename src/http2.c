@@ -0,0 +1,512 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "http2.h"
+
+#define HPACK_STATIC_TABLE_SIZE 61
+#define HPACK_ENTRY_OVERHEAD 32
+#define HUFFMAN_MAX_CODE_LEN 30
+
+static void build_huffman_decoder();
+static long huffman_decode(const unsigned char *src, size_t len, char *dst);
+static int get_int(const unsigned char **p, const unsigned char *end, int prefix_bits, uint32_t *value);
+static int get_string(const unsigned char **p, const unsigned char *end, char **out);
+static size_t put_int(unsigned char *buf, int prefix_bits, int flags, uint32_t value);
+static size_t put_string(unsigned char *buf, const char *s);
+static short table_get(struct hpack_table *t, uint32_t index, const char **name, const char **value);
+static void table_evict(struct hpack_table *t, size_t max_size);
+static void table_add(struct hpack_table *t, char *name, char *value);
+
+// RFC 7541 appendix A
+static const char *hpack_static_table[HPACK_STATIC_TABLE_SIZE][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// RFC 7541 appendix B, without EOS which only ever shows up as padding
+static const uint32_t huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const uint8_t huffman_code_lens[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+// The code is canonical: the codes of each length are consecutive and
+// ordered by symbol. So a code of len bits is symbol number
+// code - huffman_first_code[len] of that length.
+static uint32_t huffman_first_code[HUFFMAN_MAX_CODE_LEN + 1];
+static int huffman_first_symbol[HUFFMAN_MAX_CODE_LEN + 1];
+static int huffman_count[HUFFMAN_MAX_CODE_LEN + 1];
+static uint8_t huffman_symbols[256];
+static short huffman_ready = 0;
+
+static void build_huffman_decoder() {
+    int len, sym, n = 0;
+
+    for (len = 1; len <= HUFFMAN_MAX_CODE_LEN; len++) {
+        huffman_first_symbol[len] = n;
+        huffman_count[len] = 0;
+
+        for (sym = 0; sym < 256; sym++) {
+            if (huffman_code_lens[sym] != len) {
+                continue;
+            }
+
+            if (huffman_count[len] == 0) {
+                huffman_first_code[len] = huffman_codes[sym];
+            }
+            huffman_symbols[n++] = sym;
+            huffman_count[len]++;
+        }
+    }
+
+    huffman_ready = 1;
+}
+
+// dst must hold len * 8 / 5 bytes, the most a string of len bytes can
+// decode to. Returns the decoded length or -1 if the string is malformed.
+static long huffman_decode(const unsigned char *src, size_t len, char *dst) {
+    uint32_t code = 0;
+    int bits = 0, bit;
+    size_t i;
+    long n = 0;
+
+    if (!huffman_ready) {
+        build_huffman_decoder();
+    }
+
+    for (i = 0; i < len; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            code = (code << 1) | ((src[i] >> bit) & 1);
+            bits++;
+
+            if (huffman_count[bits] > 0 && code >= huffman_first_code[bits] && code - huffman_first_code[bits] < huffman_count[bits]) {
+                dst[n++] = huffman_symbols[huffman_first_symbol[bits] + code - huffman_first_code[bits]];
+                code = 0;
+                bits = 0;
+            }
+            else if (bits == HUFFMAN_MAX_CODE_LEN) {
+                return -1; // EOS, which must not be sent
+            }
+        }
+    }
+
+    // Padding is the start of EOS, i.e. up to seven 1 bits
+    if (bits > 7 || code != (1u << bits) - 1) {
+        return -1;
+    }
+
+    return n;
+}
+
+// Reads an integer with an N-bit prefix (RFC 7541 section 5.1)
+static int get_int(const unsigned char **p, const unsigned char *end, int prefix_bits, uint32_t *value) {
+    uint32_t mask = (1 << prefix_bits) - 1;
+    int shift = 0;
+
+    if (*p >= end) {
+        return -1;
+    }
+
+    *value = *(*p)++ & mask;
+    if (*value < mask) {
+        return 0;
+    }
+
+    while (*p < end && shift <= 21) {
+        *value += (uint32_t) (**p & 0x7f) << shift;
+        shift += 7;
+
+        if ((*(*p)++ & 0x80) == 0) {
+            return 0;
+        }
+    }
+
+    return -1; // Truncated, or larger than anything we would accept
+}
+
+// Reads a string literal into a new NUL terminated buffer
+static int get_string(const unsigned char **p, const unsigned char *end, char **out) {
+    short huffman;
+    uint32_t len;
+    long n;
+
+    if (*p >= end) {
+        return -1;
+    }
+
+    huffman = (**p & 0x80) != 0;
+    if (get_int(p, end, 7, &len) < 0 || len > end - *p) {
+        return -1;
+    }
+
+    if (huffman) {
+        *out = malloc(len * 8 / 5 + 1);
+        if ((n = huffman_decode(*p, len, *out)) < 0) {
+            free(*out);
+            return -1;
+        }
+    }
+    else {
+        *out = malloc(len + 1);
+        memcpy(*out, *p, len);
+        n = len;
+    }
+
+    (*out)[n] = '\0';
+    *p += len;
+    return 0;
+}
+
+static size_t put_int(unsigned char *buf, int prefix_bits, int flags, uint32_t value) {
+    uint32_t mask = (1 << prefix_bits) - 1;
+    size_t n = 1;
+
+    if (value < mask) {
+        buf[0] = flags | value;
+        return 1;
+    }
+
+    buf[0] = flags | mask;
+    value -= mask;
+    while (value >= 0x80) {
+        buf[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    buf[n++] = value;
+
+    return n;
+}
+
+// Without Huffman coding, which would hardly shorten our few short values
+static size_t put_string(unsigned char *buf, const char *s) {
+    size_t len = strlen(s), n;
+
+    n = put_int(buf, 7, 0x00, len);
+    memcpy(&buf[n], s, len);
+
+    return n + len;
+}
+
+// Looks up an index into the static table followed by the dynamic table
+static short table_get(struct hpack_table *t, uint32_t index, const char **name, const char **value) {
+    struct hpack_entry *e;
+
+    if (index == 0) {
+        return 0;
+    }
+
+    if (index <= HPACK_STATIC_TABLE_SIZE) {
+        *name = hpack_static_table[index - 1][0];
+        *value = hpack_static_table[index - 1][1];
+        return 1;
+    }
+
+    index -= HPACK_STATIC_TABLE_SIZE + 1;
+    if (index >= t->count) {
+        return 0;
+    }
+
+    e = &t->entries[(t->first + index) % t->capacity];
+    *name = e->name;
+    *value = e->value;
+    return 1;
+}
+
+// Drops the oldest entries until the table fits in max_size
+static void table_evict(struct hpack_table *t, size_t max_size) {
+    struct hpack_entry *e;
+
+    while (t->count > 0 && t->size > max_size) {
+        e = &t->entries[(t->first + t->count - 1) % t->capacity];
+        t->size -= e->size;
+        free(e->name);
+        free(e->value);
+        t->count--;
+    }
+}
+
+// Takes ownership of name and value
+static void table_add(struct hpack_table *t, char *name, char *value) {
+    size_t size = strlen(name) + strlen(value) + HPACK_ENTRY_OVERHEAD;
+    struct hpack_entry *e;
+
+    if (size > t->max_size) {
+        // Too large to ever fit, which empties the table
+        table_evict(t, 0);
+        free(name);
+        free(value);
+        return;
+    }
+
+    table_evict(t, t->max_size - size);
+
+    t->first = (t->first + t->capacity - 1) % t->capacity;
+    e = &t->entries[t->first];
+    e->name = name;
+    e->value = value;
+    e->size = size;
+    t->size += size;
+    t->count++;
+}
+
+void h2_parse_frame_header(const unsigned char *buf, struct h2_frame *f) {
+    f->length = (buf[0] << 16) | (buf[1] << 8) | buf[2];
+    f->type = buf[3];
+    f->flags = buf[4];
+    f->stream_id = h2_get_uint32(&buf[5]) & 0x7fffffff;
+}
+
+// Writes H2_FRAME_HEADER_SIZE bytes
+size_t h2_put_frame_header(unsigned char *buf, uint32_t length, int type, int flags, uint32_t stream_id) {
+    buf[0] = (length >> 16) & 0xff;
+    buf[1] = (length >> 8) & 0xff;
+    buf[2] = length & 0xff;
+    buf[3] = type;
+    buf[4] = flags;
+    h2_put_uint32(&buf[5], stream_id & 0x7fffffff);
+
+    return H2_FRAME_HEADER_SIZE;
+}
+
+uint32_t h2_get_uint32(const unsigned char *buf) {
+    return ((uint32_t) buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+void h2_put_uint32(unsigned char *buf, uint32_t value) {
+    buf[0] = (value >> 24) & 0xff;
+    buf[1] = (value >> 16) & 0xff;
+    buf[2] = (value >> 8) & 0xff;
+    buf[3] = value & 0xff;
+}
+
+// limit is the SETTINGS_HEADER_TABLE_SIZE advertised to the peer
+void hpack_table_init(struct hpack_table *t, size_t limit) {
+    t->capacity = limit / HPACK_ENTRY_OVERHEAD + 1;
+    t->entries = calloc(t->capacity, sizeof(struct hpack_entry));
+    t->count = 0;
+    t->first = 0;
+    t->size = 0;
+    t->max_size = limit;
+    t->limit = limit;
+}
+
+void hpack_table_free(struct hpack_table *t) {
+    table_evict(t, 0);
+    free(t->entries);
+    t->entries = NULL;
+}
+
+// Decodes a complete header block, calling cb for each field in order.
+// Returns 0 on success and -1 on a compression error, after which the
+// table is out of sync with the peer and the connection must be closed.
+int hpack_decode(struct hpack_table *t, const unsigned char *buf, size_t len, hpack_header_cb cb, void *arg) {
+    const unsigned char *p = buf, *end = buf + len;
+    const char *name, *value;
+    char *new_name, *new_value;
+    uint32_t index;
+    short add;
+
+    while (p < end) {
+        // Indexed header field
+        if (*p & 0x80) {
+            if (get_int(&p, end, 7, &index) < 0 || !table_get(t, index, &name, &value)) {
+                return -1;
+            }
+            cb(arg, name, value);
+            continue;
+        }
+
+        // Dynamic table size update
+        if ((*p & 0xe0) == 0x20) {
+            if (get_int(&p, end, 5, &index) < 0 || index > t->limit) {
+                return -1;
+            }
+            t->max_size = index;
+            table_evict(t, t->max_size);
+            continue;
+        }
+
+        // Literal header field, with incremental indexing (6-bit prefix) or
+        // without/never indexed (4-bit prefix)
+        add = (*p & 0x40) != 0;
+        if (get_int(&p, end, add ? 6 : 4, &index) < 0) {
+            return -1;
+        }
+
+        if (index == 0) {
+            if (get_string(&p, end, &new_name) < 0) {
+                return -1;
+            }
+        }
+        else {
+            if (!table_get(t, index, &name, &value)) {
+                return -1;
+            }
+            new_name = strdup(name);
+        }
+
+        if (get_string(&p, end, &new_value) < 0) {
+            free(new_name);
+            return -1;
+        }
+
+        cb(arg, new_name, new_value);
+
+        if (add) {
+            table_add(t, new_name, new_value);
+        }
+        else {
+            free(new_name);
+            free(new_value);
+        }
+    }
+
+    return 0;
+}
+
+// Appends a literal header field without indexing. Names must be lower
+// case. Returns the bytes written, or 0 if they would not fit in size.
+size_t hpack_put_header(unsigned char *buf, size_t size, const char *name, const char *value) {
+    int i;
+    size_t n = 0;
+
+    if (2 * 6 + strlen(name) + strlen(value) > size) {
+        return 0;
+    }
+
+    for (i = 0; i < HPACK_STATIC_TABLE_SIZE; i++) {
+        if (strcmp(hpack_static_table[i][0], name) == 0) {
+            break;
+        }
+    }
+
+    if (i < HPACK_STATIC_TABLE_SIZE) {
+        n += put_int(buf, 4, 0x00, i + 1);
+    }
+    else {
+        n += put_int(buf, 4, 0x00, 0);
+        n += put_string(&buf[n], name);
+    }
+
+    n += put_string(&buf[n], value);
+
+    return n;
+}
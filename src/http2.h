@@ -0,0 +1,97 @@
+#ifndef __HTTP2_H
+#define __HTTP2_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// HTTP/2 framing (RFC 7540) and HPACK header compression (RFC 7541), just
+// enough of both for a server that answers GET requests
+
+#define H2_ALPN "h2"
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_SIZE 24
+
+#define H2_FRAME_HEADER_SIZE 9
+#define H2_DEFAULT_MAX_FRAME_SIZE 16384
+#define H2_MAX_FRAME_SIZE 16777215
+#define H2_DEFAULT_WINDOW_SIZE 65535
+#define H2_MAX_WINDOW_SIZE 0x7fffffff
+#define H2_DEFAULT_HEADER_TABLE_SIZE 4096
+
+// Frame types
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+// Frame flags
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+// SETTINGS parameters
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+#define H2_SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+
+// Error codes for RST_STREAM and GOAWAY
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_CANCEL 0x8
+#define H2_COMPRESSION_ERROR 0x9
+#define H2_ENHANCE_YOUR_CALM 0xb
+
+struct h2_frame {
+    uint32_t length;
+    int type;
+    int flags;
+    uint32_t stream_id;
+};
+
+struct hpack_entry {
+    char *name;
+    char *value;
+    size_t size;        // As counted against the table size: name, value and 32
+};
+
+// Dynamic table of an HPACK decoder. A ring with the newest entry at first.
+struct hpack_table {
+    struct hpack_entry *entries;
+    int capacity;
+    int count;
+    int first;
+    size_t size;
+    size_t max_size;    // Current limit, as set by the encoder
+    size_t limit;       // What we advertised, the most max_size may be set to
+};
+
+// Called for each header field hpack_decode() finds
+typedef void (*hpack_header_cb)(void *arg, const char *name, const char *value);
+
+void h2_parse_frame_header(const unsigned char *buf, struct h2_frame *f);
+size_t h2_put_frame_header(unsigned char *buf, uint32_t length, int type, int flags, uint32_t stream_id);
+uint32_t h2_get_uint32(const unsigned char *buf);
+void h2_put_uint32(unsigned char *buf, uint32_t value);
+
+void hpack_table_init(struct hpack_table *t, size_t limit);
+void hpack_table_free(struct hpack_table *t);
+int hpack_decode(struct hpack_table *t, const unsigned char *buf, size_t len, hpack_header_cb cb, void *arg);
+size_t hpack_put_header(unsigned char *buf, size_t size, const char *name, const char *value);
+
+#endif
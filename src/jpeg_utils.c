@@ -24,6 +24,7 @@
 *******************************************************************************/
 
 #include <stdio.h>
+#include <setjmp.h>
 #include <jpeglib.h>
 #include <stdlib.h>
 #include <string.h>
@@ -199,3 +200,230 @@ size_t compress_yuyv_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char*
     return (written);
 }
 
+
+// Turns libjpeg's fatal errors into a longjmp() back to the caller, whose
+// default would be to exit()
+struct jmp_error_mgr {
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+};
+
+METHODDEF(void) jmp_error_exit(j_common_ptr cinfo) {
+    struct jmp_error_mgr *err = (struct jmp_error_mgr *) cinfo->err;
+
+    longjmp(err->setjmp_buffer, 1);
+}
+
+/******************************************************************************
+Description.: Re-encodes a JPEG at 1/scale_denom of its size and the given
+              quality. Scaling happens during decoding (DCT scaling), which
+              is much cheaper than decoding at full size.
+Input Value.: scale_denom is 1, 2, 4 or 8. dst must be at least src_size
+              bytes, which any rendition smaller than the source fits in.
+Return Value: size of the new JPEG, 0 if src could not be decoded or the
+              new one could not be encoded
+******************************************************************************/
+size_t scale_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, size_t src_size, int scale_denom, int quality) {
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_compress_struct cinfo;
+    struct jmp_error_mgr err;
+    JSAMPROW row_pointer[1];
+    unsigned char *volatile line_buffer = NULL;
+    volatile short compressing = 0;
+    int written;
+
+    // Both sides share the error manager, an error in either ends both
+    dinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = jmp_error_exit;
+    if (setjmp(err.setjmp_buffer)) {
+        if (compressing) {
+            jpeg_destroy_compress(&cinfo);
+        }
+        jpeg_destroy_decompress(&dinfo);
+        free(line_buffer);
+        return 0;
+    }
+
+    jpeg_create_decompress(&dinfo);
+    jpeg_mem_src(&dinfo, src, src_size);
+    jpeg_read_header(&dinfo, TRUE);
+
+    dinfo.scale_num = 1;
+    dinfo.scale_denom = scale_denom;
+    dinfo.out_color_space = JCS_RGB;
+    dinfo.dct_method = JDCT_IFAST;
+    jpeg_start_decompress(&dinfo);
+
+    line_buffer = calloc(dinfo.output_width * dinfo.output_components, 1);
+
+    cinfo.err = &err.pub;
+    jpeg_create_compress(&cinfo);
+    compressing = 1;
+    dest_buffer(&cinfo, dst, dst_size, &written);
+
+    cinfo.image_width = dinfo.output_width;
+    cinfo.image_height = dinfo.output_height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+
+    jpeg_start_compress(&cinfo, TRUE);
+
+    while (dinfo.output_scanline < dinfo.output_height) {
+        row_pointer[0] = line_buffer;
+        jpeg_read_scanlines(&dinfo, row_pointer, 1);
+        jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_decompress(&dinfo);
+
+    free(line_buffer);
+
+    return (written);
+}
+
+/******************************************************************************
+Description.: Decodes a JPEG straight into a tile_width x tile_height region
+              of an RGB canvas, stretching it to fill the tile. Decoding uses
+              the largest DCT scaling that still leaves at least the tile's
+              resolution, so small tiles cost little.
+Input Value.: canvas points at the top left pixel of the tile, stride is the
+              length of a canvas row in bytes
+Return Value: 1 on success, 0 if src could not be decoded
+******************************************************************************/
+short decode_jpeg_to_tile(unsigned char *src, size_t src_size, unsigned char *canvas, size_t stride, unsigned int tile_width, unsigned int tile_height) {
+    struct jpeg_decompress_struct dinfo;
+    struct jmp_error_mgr derr;
+    JSAMPROW row_pointer[1];
+    unsigned char *volatile line_buffer = NULL;
+    unsigned int line, ty, tx, sx;
+    int denom;
+
+    dinfo.err = jpeg_std_error(&derr.pub);
+    derr.pub.error_exit = jmp_error_exit;
+    if (setjmp(derr.setjmp_buffer)) {
+        jpeg_destroy_decompress(&dinfo);
+        free(line_buffer);
+        return 0;
+    }
+
+    jpeg_create_decompress(&dinfo);
+    jpeg_mem_src(&dinfo, src, src_size);
+    jpeg_read_header(&dinfo, TRUE);
+
+    for (denom = 8; denom > 1; denom /= 2) {
+        if (dinfo.image_width / denom >= tile_width && dinfo.image_height / denom >= tile_height) {
+            break;
+        }
+    }
+
+    dinfo.scale_num = 1;
+    dinfo.scale_denom = denom;
+    dinfo.out_color_space = JCS_RGB;
+    dinfo.dct_method = JDCT_IFAST;
+    jpeg_start_decompress(&dinfo);
+
+    line_buffer = calloc(dinfo.output_width * dinfo.output_components, 1);
+
+    ty = 0;
+    while (dinfo.output_scanline < dinfo.output_height) {
+        line = dinfo.output_scanline;
+        row_pointer[0] = line_buffer;
+        jpeg_read_scanlines(&dinfo, row_pointer, 1);
+
+        // Nearest neighbour: emit every tile row that samples this line
+        for (; ty < tile_height && (unsigned long) ty * dinfo.output_height / tile_height == line; ty++) {
+            for (tx = 0; tx < tile_width; tx++) {
+                sx = (unsigned long) tx * dinfo.output_width / tile_width;
+                memcpy(&canvas[ty * stride + tx * 3], &line_buffer[sx * 3], 3);
+            }
+        }
+    }
+
+    jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_decompress(&dinfo);
+
+    free(line_buffer);
+
+    return 1;
+}
+
+size_t compress_rgb_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, unsigned int width, unsigned int height, int quality) {
+    struct jpeg_compress_struct cinfo;
+    struct jmp_error_mgr err;
+    JSAMPROW row_pointer[1];
+    int written;
+
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = jmp_error_exit;
+    if (setjmp(err.setjmp_buffer)) {
+        jpeg_destroy_compress(&cinfo);
+        return 0;
+    }
+
+    jpeg_create_compress(&cinfo);
+    dest_buffer(&cinfo, dst, dst_size, &written);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+
+    jpeg_start_compress(&cinfo, TRUE);
+
+    while (cinfo.next_scanline < height) {
+        row_pointer[0] = &src[cinfo.next_scanline * width * 3];
+        jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    return (written);
+}
+
+/******************************************************************************
+Description.: Reads the picture size from the start of frame segment, walking
+              the markers rather than decoding anything
+Input Value.: src is a complete JPEG
+Return Value: 1 on success, 0 if there is no start of frame
+******************************************************************************/
+short jpeg_dimensions(const unsigned char *src, size_t src_size, int *width, int *height) {
+    size_t pos = 2;
+    unsigned char marker;
+
+    if (src_size < 4 || src[0] != 0xff || src[1] != 0xd8) {
+        return 0;
+    }
+
+    while (pos + 4 <= src_size && src[pos] == 0xff) {
+        marker = src[pos + 1];
+
+        // Any SOFn, but not DHT, JPG or DAC which share the range
+        if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+            if (pos + 9 > src_size) {
+                return 0;
+            }
+            *height = (src[pos + 5] << 8) | src[pos + 6];
+            *width = (src[pos + 7] << 8) | src[pos + 8];
+            return 1;
+        }
+
+        if (marker == 0xda) {
+            return 0; // The scan, nothing more to find
+        }
+
+        pos += 2 + ((src[pos + 2] << 8) | src[pos + 3]);
+    }
+
+    return 0;
+}
@@ -3,5 +3,9 @@
 #define JPEG_UTILS_H
 
 size_t compress_yuyv_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char* src, size_t src_size, unsigned int width, unsigned int height, int quality);
+size_t scale_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, size_t src_size, int scale_denom, int quality);
+short decode_jpeg_to_tile(unsigned char *src, size_t src_size, unsigned char *canvas, size_t stride, unsigned int tile_width, unsigned int tile_height);
+size_t compress_rgb_to_jpeg(unsigned char *dst, size_t dst_size, unsigned char *src, unsigned int width, unsigned int height, int quality);
+short jpeg_dimensions(const unsigned char *src, size_t src_size, int *width, int *height);
 
 #endif
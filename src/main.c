@@ -8,6 +8,7 @@
 #include <netinet/in.h>
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
 #include <openssl/ssl.h>
 
 #include "memory.h"
@@ -19,11 +20,23 @@
 #include "utils.h"
 #include "daemon.h"
 #include "settings.h"
+#include "mosaic.h"
+#include "rtsp.h"
+#include "push.h"
 
-#define FRAME_BUFFER_LENGTH 8
-#define HTTP_TIMEOUT 0.01
 
 static int is_running = 1;
+static struct mosaic *mosaic = NULL;
+
+// How each rendition is derived from the captured frame
+static const int rendition_scale_denom[RENDITION_COUNT] = {1, 2, 4};
+static const int rendition_quality[RENDITION_COUNT] = {0, 60, 50};
+
+// What grab_frame() encodes into, grown to the largest camera's frame.
+// Frames of a few megabytes would not fit on the stack.
+static unsigned char *frame_buf = NULL;
+static unsigned char *rendition_buf = NULL;
+static size_t frame_buf_size = 0;
 
 static void signal_handler(int sig){
     switch (sig) {
@@ -75,7 +88,7 @@ double get_real_fps(struct video_device *vd, unsigned int rounds) {
 }
 */
 
-struct frame_buffers *init_frame_buffers(size_t device_count, char *device_names[]) {
+struct frame_buffers *init_frame_buffers(size_t device_count, char *device_names[], int buffer_counts[]) {
     int i;
     struct frame_buffer *fb;
     struct frame_buffers *fbs;
@@ -88,10 +101,16 @@ struct frame_buffers *init_frame_buffers(size_t device_count, char *device_names
         fb = &fbs->buffers[i];
 
         create_frame_buffer(fb, FRAME_BUFFER_LENGTH);
-        if ((fb->vd = create_video_device(device_names[i], settings.width, settings.height, settings.fps, settings.v4l2_format, settings.jpeg_quality)) == NULL) {
+        create_renditions(fb);
+        if ((fb->vd = create_video_device(device_names[i], settings.width, settings.height, settings.fps, settings.v4l2_format, settings.jpeg_quality, buffer_counts[i], settings.fresh_capture)) == NULL) {
             user_panic("Could not initialize video device.");
         }
 
+        if (fb->vd->format_in == V4L2_PIX_FMT_H264) {
+            fb->h264 = 1;
+            fb->hls = create_hls();
+        }
+
         fbs->count++;
     }
 
@@ -113,33 +132,180 @@ void destroy_frame_buffers(struct frame_buffers *fbs) {
     free(fbs);
 }
 
-void grab_frame(struct frame_buffer *fb) {
-    unsigned char buf[fb->vd->framebuffer_size];
-    size_t frame_size = 0;
+void grab_frame(struct frame_buffer *fb, int index) {
+    size_t frame_size = 0, rendition_size;
+    int r;
+
+    if (frame_buf_size < fb->vd->framebuffer_size) {
+        frame_buf_size = fb->vd->framebuffer_size;
+        frame_buf = realloc(frame_buf, frame_buf_size);
+        rendition_buf = realloc(rendition_buf, frame_buf_size);
+    }
 
     frame_size = capture_frame(fb->vd);
 
-    if (frame_size <= 0) {
-        log_it(LOG_ERROR, "Could not capture frame.");
+    // Errors come back as -1. Nothing at all is no frame this time round,
+    // e.g. from an upstream that is down or a camera that was not ready.
+    if (frame_size == 0 || frame_size > fb->vd->framebuffer_size) {
+        if (frame_size != 0) {
+            log_it(LOG_ERROR, "Could not capture frame.");
+        }
+        requeue_device_buffer(fb->vd);
+        return;
+    }
+
+    switch (fb->vd->format_in) {
+        case V4L2_PIX_FMT_MJPEG:
+            frame_size = copy_frame(frame_buf, frame_buf_size, fb->vd->framebuffer, frame_size);
+            if (mosaic != NULL && mosaic_wanted(mosaic)) {
+                mosaic_submit(mosaic, index, MOSAIC_INPUT_JPEG, frame_buf, frame_size, fb->vd->width, fb->vd->height);
+            }
+            break;
+        case V4L2_PIX_FMT_YUYV:
+            // The mosaic samples the raw frame rather than decode our JPEG
+            if (mosaic != NULL && mosaic_wanted(mosaic)) {
+                mosaic_submit(mosaic, index, MOSAIC_INPUT_YUYV, fb->vd->framebuffer, frame_size, fb->vd->width, fb->vd->height);
+            }
+            frame_size = compress_yuyv_to_jpeg(frame_buf, frame_buf_size, fb->vd->framebuffer, frame_size, fb->vd->width, fb->vd->height, fb->vd->jpeg_quality);
+            break;
+        default:
+            panic("Video device is using unknown format.");
+            break;
     }
-    else {
 
-        switch (fb->vd->format_in) {
-            case V4L2_PIX_FMT_MJPEG:
-                frame_size = copy_frame(buf, sizeof(buf), fb->vd->framebuffer, frame_size);
-                break;
-            case V4L2_PIX_FMT_YUYV:
-                frame_size = compress_yuyv_to_jpeg(buf, sizeof(buf), fb->vd->framebuffer, frame_size, fb->vd->width, fb->vd->height, fb->vd->jpeg_quality);
-                break;
-            default:
-                panic("Video device is using unknown format.");
-                break;
+    requeue_device_buffer(fb->vd);
+
+    add_frame(fb, frame_buf, frame_size, fb->vd->captured_at);
+
+    // Encode each reduced rendition once, however many clients watch it
+    for (r = RENDITION_MEDIUM; r < RENDITION_COUNT && frame_size > 0; r++) {
+        if (fb->rendition_clients[r] > 0) {
+            rendition_size = scale_jpeg(rendition_buf, frame_buf_size, frame_buf, frame_size, rendition_scale_denom[r], rendition_quality[r]);
+            if (rendition_size > 0) {
+                add_rendition_frame(fb, r, rendition_buf, rendition_size);
+            }
         }
     }
+}
+
+// H.264 is passed through as it is, there is nothing to decode it with
+void grab_h264_frame(struct frame_buffer *fb) {
+    size_t frame_size = capture_frame(fb->vd);
+
+    // Errors come back as -1
+    if (frame_size > fb->vd->framebuffer_size) {
+        log_it(LOG_ERROR, "Could not capture frame.");
+    }
+    else if (frame_size > 0) {
+        add_h264_frame(fb, fb->vd->framebuffer, frame_size, fb->vd->captured_at);
+    }
 
     requeue_device_buffer(fb->vd);
+}
+
+// Pauses the cameras nobody has watched for idle-timeout and resumes the
+// ones wanted again
+void pause_idle_cameras(struct frame_buffers *fbs, struct push *push) {
+    int i;
+    struct frame_buffer *fb;
+    double now = gettime();
+    short needed;
 
-    add_frame(fb, buf, frame_size);
+    for (i = 0; i < fbs->count; i++) {
+        fb = &fbs->buffers[i];
+
+        if (fb->stream_clients > 0 || (!fb->h264 && ((mosaic != NULL && mosaic_wanted(mosaic)) || push != NULL))) {
+            fb->wanted_at = now;
+        }
+        needed = now - fb->wanted_at <= settings.idle_timeout || fb->still_requests > 0;
+
+        if (needed && fb->vd->streaming_state == STREAMING_PAUSED) {
+            log_itf(LOG_INFO, "Resuming camera %d.", i);
+            if (resume_video_device(fb->vd) < 0) {
+                log_itf(LOG_ERROR, "Could not resume camera %d.", i);
+            }
+        }
+        else if (!needed && fb->vd->streaming_state == STREAMING_ON) {
+            log_itf(LOG_INFO, "Pausing camera %d, nobody has watched it for %d seconds.", i, settings.idle_timeout);
+            pause_video_device(fb->vd);
+            fb->paused_frame = fb->current_frame;
+            if (fb->hls != NULL) {
+                hls_drop_pending(fb->hls);
+            }
+        }
+    }
+}
+
+// Cameras that have stopped, e.g. while the watchdog restarts them or their
+// upstream is down, keep sending their last frame now and then. Those that
+// are merely slow, however slow, are left alone.
+void repeat_stale_frames(struct frame_buffers *fbs) {
+    int i;
+    struct frame_buffer *fb;
+    double now = gettime();
+
+    for (i = 0; i < fbs->count; i++) {
+        fb = &fbs->buffers[i];
+
+        if (fb->h264 || fb->current_frame < 0 || fb->stream_clients == 0 || !capture_stopped(fb->vd)) {
+            continue;
+        }
+
+        if (now - fb->frame_added_at >= STALE_FRAME_INTERVAL) {
+            repeat_frame(fb);
+        }
+    }
+}
+
+// Waits up to timeout for any camera to have a frame, so that each one is
+// read as soon as it has one, at its own rate, rather than in turn, or for
+// clients, RTSP or the uplink to have something to do, so that they are not
+// held to the rate of the cameras. Sets ready for the cameras to read.
+void wait_for_events(struct frame_buffers *fbs, short ready[], struct server *s, struct rtsp_server *rtsp, struct push *push, double timeout) {
+    int i, n;
+    struct pollfd pfds[fbs->count + SERVER_MAX_POLLFDS + RTSP_MAX_POLLFDS + 1];
+    double due_at[fbs->count], other_due_at;
+    double now = gettime(), wake_at = now + timeout;
+
+    for (i = 0; i < fbs->count; i++) {
+        if (fbs->buffers[i].vd->streaming_state == STREAMING_PAUSED) {
+            pfds[i].fd = -1;
+            due_at[i] = -1;
+            continue;
+        }
+
+        capture_pollfd(fbs->buffers[i].vd, &pfds[i], &due_at[i]);
+        if (due_at[i] >= 0) {
+            wake_at = min(wake_at, due_at[i]);
+        }
+    }
+
+    // The others only need waking, serve_clients(), rtsp_serve() and
+    // push_frames() find out for themselves what there is to do
+    n = fbs->count + server_pollfds(s, &pfds[fbs->count], &other_due_at);
+    if (other_due_at >= 0) {
+        wake_at = min(wake_at, other_due_at);
+    }
+
+    if (rtsp != NULL) {
+        n += rtsp_pollfds(rtsp, &pfds[n]);
+    }
+
+    if (push != NULL) {
+        push_pollfd(push, &pfds[n++], &other_due_at);
+        if (other_due_at >= 0) {
+            wake_at = min(wake_at, other_due_at);
+        }
+    }
+
+    if (poll(pfds, n, (int) (max(0.0, wake_at - now) * 1000) + (wake_at > now)) < 0 && errno != EINTR) {
+        panic("poll() failed");
+    }
+
+    now = gettime();
+    for (i = 0; i < fbs->count; i++) {
+        ready[i] = (pfds[i].fd >= 0 && pfds[i].revents != 0) || (due_at[i] >= 0 && due_at[i] <= now);
+    }
 }
 
 int main(int argc, char *argv[]) {
@@ -147,9 +313,10 @@ int main(int argc, char *argv[]) {
     struct frame_buffers *fbs;
     struct frame_buffer *fb;
     struct server *s;
-    struct timespec ts;
-
-    double delta;
+    struct rtsp_server *rtsp = NULL;
+    struct push *push = NULL;
+    struct server_limits limits;
+    short *ready;
 
     init_settings(argc, argv);
 
@@ -165,7 +332,7 @@ int main(int argc, char *argv[]) {
 
     open_log(settings.log_file, settings.log_level);
 
-    fbs = init_frame_buffers(settings.video_device_count, settings.video_device_files);
+    fbs = init_frame_buffers(settings.video_device_count, settings.video_device_files, settings.capture_buffers);
 
     if (strlen(settings.log_file) > 0) {
         nchown(settings.log_file, settings.user, settings.group);
@@ -173,28 +340,90 @@ int main(int argc, char *argv[]) {
 
     log_it(LOG_INFO, "Starting server.");
 
+    limits.backlog = settings.backlog;
+    limits.max_clients = settings.max_clients;
+    limits.max_clients_per_ip = settings.max_clients_per_ip;
+    limits.max_streams_per_camera = settings.max_streams_per_camera;
+    limits.egress_limit = settings.egress_limit * 1024.0;
+    limits.client_egress_limit = settings.client_egress_limit * 1024.0;
+    limits.camera_egress_limit = settings.camera_egress_limit * 1024.0;
+    limits.low_latency = settings.low_latency;
+    limits.adaptive_quality = !settings.fixed_quality;
+
+    if (strlen(settings.mosaic_layout) > 0) {
+        mosaic = create_mosaic(fbs->count, settings.mosaic_layout, settings.mosaic_width, settings.mosaic_height, settings.mosaic_fps);
+    }
+
     SSL_library_init();
-    s = create_server(settings.host, settings.port, fbs, settings.static_root, settings.auth, settings.ssl_cert_file, settings.ssl_key_file);
+    s = create_server(settings.host, settings.port, fbs, settings.static_root, settings.auth, settings.ssl_cert_file, settings.ssl_key_file, settings.ssl_ktls, settings.http2, &limits);
+    s->mosaic = (mosaic != NULL) ? &mosaic->fb : NULL;
+
+    if (settings.rtsp_port > 0) {
+        rtsp = create_rtsp_server(settings.host, settings.rtsp_port, settings.rtp_port, settings.rtsp_multicast, settings.auth, fbs, s->mosaic);
+    }
+
+    if (strlen(settings.push_url) > 0) {
+        push = create_push(settings.push_url, settings.push_backlog, fbs);
+    }
+    s->push = push;
 
     drop_privileges(settings.user, settings.group);
 
+    ready = calloc(fbs->count, sizeof(short));
+
     while (is_running) {
-        delta = gettime();
+        if (settings.idle_timeout > 0) {
+            pause_idle_cameras(fbs, push);
+        }
+
+        // Never longer than a frame interval, so that paced and throttled
+        // clients get their turns even while no camera has anything
+        wait_for_events(fbs, ready, s, rtsp, push, 1.0 / settings.fps);
+
         for (i = 0; i < fbs->count; i++) {
             fb = &fbs->buffers[i];
-            grab_frame(fb);
+            if (!ready[i]) {
+                continue;
+            }
+
+            if (fb->h264) {
+                grab_h264_frame(fb);
+            }
+            else {
+                grab_frame(fb, i);
+            }
         }
+        repeat_stale_frames(fbs);
+
+        if (mosaic != NULL) {
+            mosaic_collect(mosaic);
+        }
+
+        serve_clients(s, fbs, 0);
 
-        serve_clients(s, fbs, HTTP_TIMEOUT);
+        if (rtsp != NULL) {
+            rtsp_serve(rtsp);
+        }
 
-        delta = gettime() - delta;
-        if (delta > 0) {
-            double_to_timespec(delta, &ts);
-            nanosleep(&ts, NULL);
+        if (push != NULL) {
+            push_frames(push, fbs);
         }
     }
 
+    free(ready);
+    free(frame_buf);
+    free(rendition_buf);
+
     destroy_server(s);
+    if (rtsp != NULL) {
+        destroy_rtsp_server(rtsp);
+    }
+    if (push != NULL) {
+        destroy_push(push);
+    }
+    if (mosaic != NULL) {
+        destroy_mosaic(mosaic);
+    }
     destroy_frame_buffers(fbs);
     EVP_cleanup();
 
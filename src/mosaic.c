@@ -0,0 +1,249 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "memory.h"
+#include "logger.h"
+#include "utils.h"
+#include "jpeg_utils.h"
+
+#include "mosaic.h"
+
+static void *mosaic_worker(void *arg);
+static void compose(struct mosaic *m);
+static void yuyv_to_tile(struct mosaic_input *in, unsigned char *canvas, size_t stride, unsigned int tile_width, unsigned int tile_height);
+static void blank_tile(unsigned char *canvas, size_t stride, unsigned int tile_width, unsigned int tile_height);
+
+// layout is "COLSxROWS", or "auto" for the smallest square grid that fits
+// every camera.
+struct mosaic *create_mosaic(int count, const char *layout, unsigned int width, unsigned int height, int fps) {
+    struct mosaic *m = calloc(1, sizeof(struct mosaic));
+
+    if (strcmp(layout, "auto") == 0) {
+        for (m->cols = 1; m->cols * m->cols < count; m->cols++) {}
+        m->rows = (count + m->cols - 1) / m->cols;
+    }
+    else if (sscanf(layout, "%dx%d", &m->cols, &m->rows) != 2 || m->cols < 1 || m->rows < 1) {
+        user_panic("Invalid mosaic layout '%s', expected COLSxROWS, e.g. 3x2.", layout);
+    }
+
+    m->width = max(width - width % (m->cols * 2), (unsigned int) m->cols * 2); // Even sized tiles
+    m->height = max(height - height % (m->rows * 2), (unsigned int) m->rows * 2);
+    m->interval = 1.0 / max(fps, 1);
+    m->count = count;
+
+    m->inputs = calloc(count, sizeof(struct mosaic_input));
+    m->work = calloc(count, sizeof(struct mosaic_input));
+    m->canvas = calloc(m->width * m->height, 3);
+    m->output_size = m->width * m->height * 3;
+    m->output = malloc(m->output_size);
+
+    create_frame_buffer(&m->fb, MOSAIC_BUFFER_LENGTH);
+    token_bucket_init(&m->fb.egress, 0, 0);
+
+    pthread_mutex_init(&m->lock, NULL);
+    m->running = 1;
+
+    if (pthread_create(&m->thread, NULL, mosaic_worker, m) != 0) {
+        panic("Could not start mosaic thread");
+    }
+
+    log_itf(LOG_INFO, "Composing a %dx%d mosaic at %ux%u.", m->cols, m->rows, m->width, m->height);
+
+    return m;
+}
+
+void destroy_mosaic(struct mosaic *m) {
+    int i;
+
+    pthread_mutex_lock(&m->lock);
+    m->running = 0;
+    pthread_mutex_unlock(&m->lock);
+    pthread_join(m->thread, NULL);
+    pthread_mutex_destroy(&m->lock);
+
+    for (i = 0; i < m->count; i++) {
+        free(m->inputs[i].data);
+        free(m->work[i].data);
+    }
+
+    free(m->inputs);
+    free(m->work);
+    free(m->canvas);
+    free(m->output);
+    destroy_frame_buffer(&m->fb);
+    free(m);
+}
+
+// Whether the capture loop should bother handing frames over
+short mosaic_wanted(struct mosaic *m) {
+    return m->fb.stream_clients > 0;
+}
+
+// Called by the capture loop with the latest frame of a camera. Only copies;
+// the expensive work happens on the worker thread.
+void mosaic_submit(struct mosaic *m, int index, int format, unsigned char *data, size_t len, unsigned int width, unsigned int height) {
+    struct mosaic_input *in = &m->inputs[index];
+
+    if (index >= m->cols * m->rows) {
+        return; // Does not fit the layout
+    }
+
+    pthread_mutex_lock(&m->lock);
+
+    if (in->size < len) {
+        in->data = realloc(in->data, len);
+        in->size = len;
+    }
+
+    memcpy(in->data, data, len);
+    in->len = len;
+    in->format = format;
+    in->width = width;
+    in->height = height;
+    in->fresh = 1;
+
+    pthread_mutex_unlock(&m->lock);
+}
+
+// Called by the main loop. Moves a finished composite into m->fb, where
+// clients stream it like any camera.
+void mosaic_collect(struct mosaic *m) {
+    pthread_mutex_lock(&m->lock);
+
+    m->active = mosaic_wanted(m);
+
+    if (m->output_ready) {
+        add_frame(&m->fb, m->output, m->output_len, gettime());
+        m->output_ready = 0;
+    }
+
+    pthread_mutex_unlock(&m->lock);
+}
+
+static void *mosaic_worker(void *arg) {
+    struct mosaic *m = arg;
+    struct mosaic_input tmp;
+    struct timespec ts;
+    unsigned char *jpeg;
+    size_t jpeg_len;
+    short running = 1, active, fresh;
+    double next = gettime(), now;
+    int i;
+
+    jpeg = malloc(m->output_size);
+
+    while (running) {
+        now = gettime();
+        if (next > now) {
+            double_to_timespec(next - now, &ts);
+            nanosleep(&ts, NULL);
+        }
+        next = max(next + m->interval, gettime());
+
+        // Take over whatever the cameras delivered since the last tick.
+        // Swapping buffers keeps the lock short.
+        pthread_mutex_lock(&m->lock);
+        running = m->running;
+        active = m->active;
+        fresh = 0;
+        for (i = 0; active && i < m->count; i++) {
+            if (m->inputs[i].fresh) {
+                tmp = m->work[i];
+                m->work[i] = m->inputs[i];
+                m->inputs[i] = tmp;
+                m->work[i].fresh = 0;
+                fresh = 1;
+            }
+        }
+        pthread_mutex_unlock(&m->lock);
+
+        if (!running || !active || !fresh) {
+            continue;
+        }
+
+        compose(m);
+        if ((jpeg_len = compress_rgb_to_jpeg(jpeg, m->output_size, m->canvas, m->width, m->height, MOSAIC_QUALITY)) == 0) {
+            log_it(LOG_WARNING, "Could not encode the mosaic.");
+            continue;
+        }
+
+        pthread_mutex_lock(&m->lock);
+        memcpy(m->output, jpeg, jpeg_len);
+        m->output_len = jpeg_len;
+        m->output_ready = 1;
+        pthread_mutex_unlock(&m->lock);
+    }
+
+    free(jpeg);
+
+    return NULL;
+}
+
+static void compose(struct mosaic *m) {
+    unsigned int tile_width = m->width / m->cols, tile_height = m->height / m->rows;
+    size_t stride = m->width * 3;
+    unsigned char *tile;
+    struct mosaic_input *in;
+    int i;
+
+    for (i = 0; i < m->cols * m->rows; i++) {
+        tile = &m->canvas[(i / m->cols) * tile_height * stride + (i % m->cols) * tile_width * 3];
+        in = (i < m->count) ? &m->work[i] : NULL;
+
+        if (in == NULL || in->format == MOSAIC_INPUT_NONE) {
+            blank_tile(tile, stride, tile_width, tile_height);
+        }
+        else if (in->format == MOSAIC_INPUT_YUYV) {
+            yuyv_to_tile(in, tile, stride, tile_width, tile_height);
+        }
+        else if (!decode_jpeg_to_tile(in->data, in->len, tile, stride, tile_width, tile_height)) {
+            blank_tile(tile, stride, tile_width, tile_height);
+        }
+    }
+}
+
+// Samples the raw YUYV frame directly, so only the pixels that end up in the
+// tile are ever converted
+static void yuyv_to_tile(struct mosaic_input *in, unsigned char *canvas, size_t stride, unsigned int tile_width, unsigned int tile_height) {
+    unsigned int tx, ty, sx, sy;
+    unsigned char *src, *dst;
+    int y, u, v, r, g, b;
+
+    if (in->len < (size_t) in->width * in->height * 2) {
+        return blank_tile(canvas, stride, tile_width, tile_height);
+    }
+
+    for (ty = 0; ty < tile_height; ty++) {
+        sy = (unsigned long) ty * in->height / tile_height;
+        dst = &canvas[ty * stride];
+
+        for (tx = 0; tx < tile_width; tx++) {
+            sx = (unsigned long) tx * in->width / tile_width;
+            src = &in->data[(sy * in->width + (sx & ~1u)) * 2]; // Y0 U Y1 V
+
+            y = src[(sx & 1) ? 2 : 0] << 8;
+            u = src[1] - 128;
+            v = src[3] - 128;
+
+            r = (y + (359 * v)) >> 8;
+            g = (y - (88 * u) - (183 * v)) >> 8;
+            b = (y + (454 * u)) >> 8;
+
+            *(dst++) = (r > 255) ? 255 : ((r < 0) ? 0 : r);
+            *(dst++) = (g > 255) ? 255 : ((g < 0) ? 0 : g);
+            *(dst++) = (b > 255) ? 255 : ((b < 0) ? 0 : b);
+        }
+    }
+}
+
+static void blank_tile(unsigned char *canvas, size_t stride, unsigned int tile_width, unsigned int tile_height) {
+    unsigned int ty;
+
+    for (ty = 0; ty < tile_height; ty++) {
+        memset(&canvas[ty * stride], 0, tile_width * 3);
+    }
+}
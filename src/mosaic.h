@@ -0,0 +1,60 @@
+
+#ifndef __MOSAIC_H
+#define __MOSAIC_H
+
+#include <pthread.h>
+
+#include "frames.h"
+
+#define MOSAIC_INPUT_NONE 0
+#define MOSAIC_INPUT_JPEG 1
+#define MOSAIC_INPUT_YUYV 2
+
+#define MOSAIC_QUALITY 70
+#define MOSAIC_BUFFER_LENGTH 4
+
+// Latest frame of one camera, as handed over by the capture loop
+struct mosaic_input {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+    int format;             // MOSAIC_INPUT_*
+    unsigned int width;
+    unsigned int height;
+    short fresh;            // Not yet picked up by the worker
+};
+
+// A grid of the latest frame of every camera, composed on a worker thread
+// at a fixed rate. One encode per tick is shared by all viewers.
+struct mosaic {
+    int cols;
+    int rows;
+    unsigned int width;
+    unsigned int height;
+    double interval;
+    int count;                      // Number of cameras
+
+    pthread_t thread;
+    pthread_mutex_t lock;           // Guards inputs, output and the flags below
+    short running;
+    short active;                   // Somebody is watching, so compose
+
+    struct mosaic_input *inputs;    // Filled by the capture loop
+    struct mosaic_input *work;      // The worker's own, swapped with inputs
+    unsigned char *canvas;          // RGB, width x height
+
+    unsigned char *output;          // Latest composite JPEG
+    size_t output_len;
+    size_t output_size;
+    short output_ready;
+
+    struct frame_buffer fb;         // Composites for clients; main thread only
+};
+
+struct mosaic *create_mosaic(int count, const char *layout, unsigned int width, unsigned int height, int fps);
+void destroy_mosaic(struct mosaic *m);
+short mosaic_wanted(struct mosaic *m);
+void mosaic_submit(struct mosaic *m, int index, int format, unsigned char *data, size_t len, unsigned int width, unsigned int height);
+void mosaic_collect(struct mosaic *m);
+
+#endif
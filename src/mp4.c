@@ -0,0 +1,319 @@
+
+#include <string.h>
+
+#include "mp4.h"
+
+#define SAMPLE_FLAGS_SYNC 0x02000000 // Depends on no other sample
+#define SAMPLE_FLAGS_NON_SYNC 0x01010000 // Depends on others, not a sync sample
+
+// Boxes are written front to back. Their sizes are filled in once their
+// contents are known.
+struct box_writer {
+    unsigned char *buf;
+    size_t size;
+    size_t pos;
+    short overflow;
+};
+
+static void put_bytes(struct box_writer *w, const void *data, size_t len);
+static void put_zeros(struct box_writer *w, size_t len);
+static void put_u8(struct box_writer *w, uint8_t value);
+static void put_u16(struct box_writer *w, uint16_t value);
+static void put_u32(struct box_writer *w, uint32_t value);
+static void put_u64(struct box_writer *w, uint64_t value);
+static void put_matrix(struct box_writer *w);
+static size_t begin_box(struct box_writer *w, const char *type);
+static size_t begin_full_box(struct box_writer *w, const char *type, uint8_t version, uint32_t flags);
+static void end_box(struct box_writer *w, size_t start);
+
+static void put_bytes(struct box_writer *w, const void *data, size_t len) {
+    if (w->pos + len > w->size) {
+        w->overflow = 1;
+        return;
+    }
+
+    memcpy(&w->buf[w->pos], data, len);
+    w->pos += len;
+}
+
+static void put_zeros(struct box_writer *w, size_t len) {
+    if (w->pos + len > w->size) {
+        w->overflow = 1;
+        return;
+    }
+
+    memset(&w->buf[w->pos], 0, len);
+    w->pos += len;
+}
+
+static void put_u8(struct box_writer *w, uint8_t value) {
+    put_bytes(w, &value, 1);
+}
+
+static void put_u16(struct box_writer *w, uint16_t value) {
+    unsigned char b[2] = {value >> 8, value & 0xff};
+
+    put_bytes(w, b, sizeof(b));
+}
+
+static void put_u32(struct box_writer *w, uint32_t value) {
+    unsigned char b[4] = {value >> 24, (value >> 16) & 0xff, (value >> 8) & 0xff, value & 0xff};
+
+    put_bytes(w, b, sizeof(b));
+}
+
+static void put_u64(struct box_writer *w, uint64_t value) {
+    put_u32(w, value >> 32);
+    put_u32(w, value & 0xffffffff);
+}
+
+// The identity transformation, in 16.16 and 2.30 fixed point
+static void put_matrix(struct box_writer *w) {
+    static const uint32_t matrix[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+    int i;
+
+    for (i = 0; i < 9; i++) {
+        put_u32(w, matrix[i]);
+    }
+}
+
+static size_t begin_box(struct box_writer *w, const char *type) {
+    size_t start = w->pos;
+
+    put_u32(w, 0);
+    put_bytes(w, type, 4);
+    return start;
+}
+
+static size_t begin_full_box(struct box_writer *w, const char *type, uint8_t version, uint32_t flags) {
+    size_t start = begin_box(w, type);
+
+    put_u32(w, (version << 24) | flags);
+    return start;
+}
+
+static void end_box(struct box_writer *w, size_t start) {
+    size_t len = w->pos - start;
+
+    if (w->overflow) {
+        return;
+    }
+
+    w->buf[start] = len >> 24;
+    w->buf[start + 1] = (len >> 16) & 0xff;
+    w->buf[start + 2] = (len >> 8) & 0xff;
+    w->buf[start + 3] = len & 0xff;
+}
+
+// Writes ftyp and moov for a track described by params. Returns the length,
+// or 0 if buf is too small.
+size_t mp4_init_segment(unsigned char *buf, size_t size, struct h264_params *params) {
+    struct box_writer w = {buf, size, 0, 0};
+    size_t moov, trak, mdia, minf, dinf, dref, stbl, stsd, avc1, avcc, box, mvex;
+
+    box = begin_box(&w, "ftyp");
+    put_bytes(&w, "isom", 4);
+    put_u32(&w, 0x200);
+    put_bytes(&w, "isomiso6avc1mp41", 16);
+    end_box(&w, box);
+
+    moov = begin_box(&w, "moov");
+
+    box = begin_full_box(&w, "mvhd", 0, 0);
+    put_u32(&w, 0); // Creation and modification time
+    put_u32(&w, 0);
+    put_u32(&w, 1000); // Timescale
+    put_u32(&w, 0); // Duration, unknown for a live stream
+    put_u32(&w, 0x00010000); // Rate
+    put_u16(&w, 0x0100); // Volume
+    put_zeros(&w, 10);
+    put_matrix(&w);
+    put_zeros(&w, 24);
+    put_u32(&w, 2); // Next track ID
+    end_box(&w, box);
+
+    trak = begin_box(&w, "trak");
+
+    box = begin_full_box(&w, "tkhd", 0, 0x3); // Enabled, in movie
+    put_u32(&w, 0);
+    put_u32(&w, 0);
+    put_u32(&w, 1); // Track ID
+    put_u32(&w, 0);
+    put_u32(&w, 0); // Duration
+    put_zeros(&w, 8);
+    put_u16(&w, 0); // Layer
+    put_u16(&w, 0); // Alternate group
+    put_u16(&w, 0); // Volume
+    put_u16(&w, 0);
+    put_matrix(&w);
+    put_u32(&w, params->width << 16);
+    put_u32(&w, params->height << 16);
+    end_box(&w, box);
+
+    mdia = begin_box(&w, "mdia");
+
+    box = begin_full_box(&w, "mdhd", 0, 0);
+    put_u32(&w, 0);
+    put_u32(&w, 0);
+    put_u32(&w, MP4_TIMESCALE);
+    put_u32(&w, 0);
+    put_u16(&w, 0x55c4); // "und"
+    put_u16(&w, 0);
+    end_box(&w, box);
+
+    box = begin_full_box(&w, "hdlr", 0, 0);
+    put_u32(&w, 0);
+    put_bytes(&w, "vide", 4);
+    put_zeros(&w, 12);
+    put_bytes(&w, "VideoHandler", strlen("VideoHandler") + 1);
+    end_box(&w, box);
+
+    minf = begin_box(&w, "minf");
+
+    box = begin_full_box(&w, "vmhd", 0, 1);
+    put_zeros(&w, 8); // Graphics mode and colour
+    end_box(&w, box);
+
+    dinf = begin_box(&w, "dinf");
+    dref = begin_full_box(&w, "dref", 0, 0);
+    put_u32(&w, 1);
+    box = begin_full_box(&w, "url ", 0, 1); // Samples are in this file
+    end_box(&w, box);
+    end_box(&w, dref);
+    end_box(&w, dinf);
+
+    stbl = begin_box(&w, "stbl");
+
+    stsd = begin_full_box(&w, "stsd", 0, 0);
+    put_u32(&w, 1);
+
+    avc1 = begin_box(&w, "avc1");
+    put_zeros(&w, 6);
+    put_u16(&w, 1); // Data reference index
+    put_zeros(&w, 16);
+    put_u16(&w, params->width);
+    put_u16(&w, params->height);
+    put_u32(&w, 0x00480000); // 72 dpi
+    put_u32(&w, 0x00480000);
+    put_u32(&w, 0);
+    put_u16(&w, 1); // Frames per sample
+    put_zeros(&w, 32); // Compressor name
+    put_u16(&w, 0x0018); // Depth
+    put_u16(&w, 0xffff);
+
+    avcc = begin_box(&w, "avcC");
+    put_u8(&w, 1);
+    put_u8(&w, params->sps[1]); // Profile, constraints and level, as in the SPS
+    put_u8(&w, params->sps[2]);
+    put_u8(&w, params->sps[3]);
+    put_u8(&w, 0xfc | (H264_LENGTH_SIZE - 1));
+    put_u8(&w, 0xe0 | 1); // One SPS
+    put_u16(&w, params->sps_len);
+    put_bytes(&w, params->sps, params->sps_len);
+    put_u8(&w, 1); // One PPS
+    put_u16(&w, params->pps_len);
+    put_bytes(&w, params->pps, params->pps_len);
+
+    // The High profiles also give the sample format (ISO/IEC 14496-15 5.3.3.1)
+    if (params->sps[1] == 100 || params->sps[1] == 110 || params->sps[1] == 122 || params->sps[1] == 144) {
+        put_u8(&w, 0xfc | params->chroma_format);
+        put_u8(&w, 0xf8 | (params->bit_depth_luma - 8));
+        put_u8(&w, 0xf8 | (params->bit_depth_chroma - 8));
+        put_u8(&w, 0); // No SPS extensions
+    }
+    end_box(&w, avcc);
+
+    end_box(&w, avc1);
+    end_box(&w, stsd);
+
+    // Empty sample tables, the samples come in fragments
+    box = begin_full_box(&w, "stts", 0, 0);
+    put_u32(&w, 0);
+    end_box(&w, box);
+    box = begin_full_box(&w, "stsc", 0, 0);
+    put_u32(&w, 0);
+    end_box(&w, box);
+    box = begin_full_box(&w, "stsz", 0, 0);
+    put_u32(&w, 0);
+    put_u32(&w, 0);
+    end_box(&w, box);
+    box = begin_full_box(&w, "stco", 0, 0);
+    put_u32(&w, 0);
+    end_box(&w, box);
+
+    end_box(&w, stbl);
+    end_box(&w, minf);
+    end_box(&w, mdia);
+    end_box(&w, trak);
+
+    mvex = begin_box(&w, "mvex");
+    box = begin_full_box(&w, "trex", 0, 0);
+    put_u32(&w, 1); // Track ID
+    put_u32(&w, 1); // Sample description index
+    put_u32(&w, 0);
+    put_u32(&w, 0);
+    put_u32(&w, 0);
+    end_box(&w, box);
+    end_box(&w, mvex);
+
+    end_box(&w, moov);
+
+    return w.overflow ? 0 : w.pos;
+}
+
+// Writes moof for count samples and the header of the mdat that follows
+// it. The samples themselves go right after, in order. Returns the length,
+// or 0 if buf is too small.
+size_t mp4_fragment_header(unsigned char *buf, size_t size, uint32_t sequence, uint64_t decode_time, const struct mp4_sample *samples, int count) {
+    struct box_writer w = {buf, size, 0, 0};
+    size_t moof, traf, box, data_offset_pos;
+    uint32_t mdat_size = 8;
+    int i;
+
+    moof = begin_box(&w, "moof");
+
+    box = begin_full_box(&w, "mfhd", 0, 0);
+    put_u32(&w, sequence);
+    end_box(&w, box);
+
+    traf = begin_box(&w, "traf");
+
+    box = begin_full_box(&w, "tfhd", 0, 0x020000); // Offsets are from the start of moof
+    put_u32(&w, 1);
+    end_box(&w, box);
+
+    box = begin_full_box(&w, "tfdt", 1, 0);
+    put_u64(&w, decode_time);
+    end_box(&w, box);
+
+    // Data offset, then duration, size and flags of each sample
+    box = begin_full_box(&w, "trun", 0, 0x000701);
+    put_u32(&w, count);
+    data_offset_pos = w.pos;
+    put_u32(&w, 0);
+    for (i = 0; i < count; i++) {
+        put_u32(&w, samples[i].duration);
+        put_u32(&w, samples[i].size);
+        put_u32(&w, samples[i].keyframe ? SAMPLE_FLAGS_SYNC : SAMPLE_FLAGS_NON_SYNC);
+        mdat_size += samples[i].size;
+    }
+    end_box(&w, box);
+
+    end_box(&w, traf);
+    end_box(&w, moof);
+
+    put_u32(&w, mdat_size);
+    put_bytes(&w, "mdat", 4);
+
+    if (w.overflow) {
+        return 0;
+    }
+
+    // The first sample starts right after the mdat header
+    buf[data_offset_pos] = w.pos >> 24;
+    buf[data_offset_pos + 1] = (w.pos >> 16) & 0xff;
+    buf[data_offset_pos + 2] = (w.pos >> 8) & 0xff;
+    buf[data_offset_pos + 3] = w.pos & 0xff;
+
+    return w.pos;
+}
@@ -0,0 +1,28 @@
+#ifndef __MP4_H
+#define __MP4_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "h264.h"
+
+// Fragmented MP4 (ISO/IEC 14496-12) with a single H.264 video track: an
+// initialization segment describing the track, then fragments of samples
+
+#define MP4_TIMESCALE 90000 // Ticks per second of sample times
+#define MP4_MAX_INIT_SEGMENT_SIZE 1024
+
+// Length of a fragment header, i.e. moof and the mdat header, for n samples
+#define mp4_fragment_header_size(n) (96 + 12 * (n))
+
+// One access unit of a fragment, stored as H.264 NAL units with lengths
+struct mp4_sample {
+    uint32_t size;
+    uint32_t duration;      // In MP4_TIMESCALE ticks
+    short keyframe;
+};
+
+size_t mp4_init_segment(unsigned char *buf, size_t size, struct h264_params *params);
+size_t mp4_fragment_header(unsigned char *buf, size_t size, uint32_t sequence, uint64_t decode_time, const struct mp4_sample *samples, int count);
+
+#endif
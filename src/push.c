@@ -0,0 +1,449 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include "openssl/err.h"
+
+#include "memory.h"
+#include "logger.h"
+#include "utils.h"
+#include "server.h"
+#include "security.h"
+#include "push.h"
+
+static void push_connect(struct push *p, double now);
+static void push_connect_next(struct push *p, const char *reason, double now);
+static void push_disconnect(struct push *p, const char *reason, double now);
+static void push_handshake(struct push *p, struct frame_buffers *fbs, double now);
+static void start_request(struct push *p, struct frame_buffers *fbs, double now);
+static short select_frame(struct push *p, struct frame_buffers *fbs);
+static ssize_t push_write(struct push *p, const void *buf, size_t len, short more);
+static int unsent_bytes(struct push *p);
+static void read_response(struct push *p, double now);
+static void send_frames(struct push *p, struct frame_buffers *fbs, double now);
+
+struct push *create_push(const char *url, int backlog, struct frame_buffers *fbs) {
+    struct push *p = calloc(1, sizeof(struct push));
+
+    if (parse_http_url(url, &p->url) < 0) {
+        user_panic("%s is not a URL of the form http[s]://[user:pass@]host[:port]/path.", url);
+    }
+
+    if (p->url.tls) {
+        p->ssl_ctx = ssl_create_client_ctx();
+    }
+
+    // The frame on its way out must not be overwritten in the ring, so
+    // leave it room
+    p->backlog = max(1, min(backlog, FRAME_BUFFER_LENGTH / 2));
+
+    p->sock = -1;
+    p->state = PUSH_DISCONNECTED;
+    p->camera = -1;
+    p->next_frames = calloc(max((size_t) 1, fbs->count), sizeof(unsigned long));
+    p->last_camera = -1;
+    p->backoff = PUSH_MIN_BACKOFF;
+    p->reconnect_at = 0;
+
+    log_itf(LOG_INFO, "Pushing to %s.", p->url.display);
+
+    return p;
+}
+
+void destroy_push(struct push *p) {
+    stop_resolving(&p->resolver);
+    if (p->ssl != NULL) {
+        SSL_free(p->ssl);
+    }
+    if (p->sock >= 0) {
+        close(p->sock);
+    }
+    if (p->ssl_ctx != NULL) {
+        SSL_CTX_free(p->ssl_ctx);
+    }
+
+    free(p->next_frames);
+    free(p->url.auth);
+    free(p);
+}
+
+// Looks the ingest server up, without waiting for the answer
+static void push_connect(struct push *p, double now) {
+    start_resolving(&p->resolver, p->url.host, p->url.port);
+    p->state = PUSH_RESOLVING;
+    p->last_progress_at = now;
+}
+
+// Connects to the next address of the ingest server, without waiting for
+// the connection to be made. Gives up for now with reason once none is left.
+static void push_connect_next(struct push *p, const char *reason, double now) {
+    if (p->sock >= 0) {
+        close(p->sock);
+    }
+
+    if ((p->sock = connect_next_address(&p->resolver)) < 0) {
+        return push_disconnect(p, reason != NULL ? reason : strerror(errno), now);
+    }
+
+    p->state = PUSH_CONNECTING;
+    p->last_progress_at = now;
+}
+
+// Tries again later, waiting longer after each failure in a row. Servers
+// may refuse the request only once they have read some of it, so only a
+// request that went on for a while ends a row of failures. Whatever was
+// queued is dropped, the next connection starts at the newest frames.
+static void push_disconnect(struct push *p, const char *reason, double now) {
+    if (p->connected_at > 0 && now - p->connected_at >= PUSH_HEALTHY_AFTER) {
+        p->backoff = PUSH_MIN_BACKOFF;
+    }
+
+    stop_resolving(&p->resolver);
+    if (p->ssl != NULL) {
+        SSL_free(p->ssl);
+        p->ssl = NULL;
+    }
+    if (p->sock >= 0) {
+        close(p->sock);
+    }
+    p->sock = -1;
+    p->state = PUSH_DISCONNECTED;
+    p->connected_at = 0;
+    p->camera = -1;
+    p->out_len = p->out_pos = 0;
+    p->reconnect_at = now + p->backoff;
+    p->reconnects++;
+
+    log_itf(LOG_WARNING, "Ingest server %s: %s. Trying again in %.1f seconds.", p->url.display, reason, p->backoff);
+    p->backoff = min(2 * p->backoff, PUSH_MAX_BACKOFF);
+}
+
+// Finishes connecting, and the TLS handshake for https://
+static void push_handshake(struct push *p, struct frame_buffers *fbs, double now) {
+    struct pollfd pfd = {p->sock, POLLOUT, 0};
+    int err = 0, ret;
+    socklen_t err_len = sizeof(err);
+
+    if (p->state == PUSH_CONNECTING) {
+        if (poll(&pfd, 1, 0) <= 0) {
+            return;
+        }
+
+        if (getsockopt(p->sock, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0) {
+            return push_connect_next(p, strerror(err ? err : errno), now);
+        }
+        stop_resolving(&p->resolver);
+
+        if (p->ssl_ctx == NULL) {
+            return start_request(p, fbs, now);
+        }
+
+        p->ssl = SSL_new(p->ssl_ctx);
+        SSL_set_fd(p->ssl, p->sock);
+        SSL_set_tlsext_host_name(p->ssl, p->url.host);
+        if (!X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(p->ssl), p->url.host)) {
+            SSL_set1_host(p->ssl, p->url.host);
+        }
+        p->state = PUSH_HANDSHAKE;
+    }
+
+    ERR_clear_error();
+    if ((ret = SSL_connect(p->ssl)) == 1) {
+        return start_request(p, fbs, now);
+    }
+
+    err = SSL_get_error(p->ssl, ret);
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+        if (SSL_get_verify_result(p->ssl) != X509_V_OK) {
+            return push_disconnect(p, X509_verify_cert_error_string(SSL_get_verify_result(p->ssl)), now);
+        }
+        return push_disconnect(p, "TLS handshake failed", now);
+    }
+}
+
+// Queues the request header along with the first boundary. Each camera
+// starts at its newest frame.
+static void start_request(struct push *p, struct frame_buffers *fbs, double now) {
+    char host[sizeof(p->url.host) + sizeof(p->url.port) + 3];
+    int i;
+
+    http_url_host_header(&p->url, host, sizeof(host));
+    p->out_len = snprintf(p->out, sizeof(p->out), PUSH_REQUEST_TMPL "%lx\r\n--" BOUNDARY "\r\n", p->url.path, host,
+        p->url.auth ? "Authorization: Basic " : "", p->url.auth ? p->url.auth : "", p->url.auth ? "\r\n" : "",
+        (unsigned long) strlen("--" BOUNDARY "\r\n"));
+    p->out_pos = 0;
+    p->chunk_open = 1;
+
+    if (p->out_len >= sizeof(p->out)) {
+        return push_disconnect(p, "URL too long", now);
+    }
+
+    for (i = 0; i < fbs->count; i++) {
+        p->next_frames[i] = max(fbs->buffers[i].current_frame, 0L);
+    }
+
+    p->state = PUSH_STREAMING;
+    p->connected_at = now;
+}
+
+// Picks the next frame to send, taking turns between the cameras that have
+// one. Frames past the backlog are dropped, oldest first. Returns 0 if
+// there is nothing to send.
+static short select_frame(struct push *p, struct frame_buffers *fbs) {
+    char part_header[MAX_HEADER_LEN];
+    struct frame_buffer *fb;
+    struct frame *f;
+    unsigned long newest;
+    int n, i, part_len;
+
+    for (n = 1; n <= fbs->count; n++) {
+        i = (p->last_camera + n) % fbs->count;
+        fb = &fbs->buffers[i];
+
+        // H.264 is not JPEG, and only goes out as MP4 and HLS
+        if (fb->h264 || fb->current_frame < 0 || p->next_frames[i] > fb->current_frame) {
+            continue;
+        }
+
+        newest = fb->current_frame;
+        if (newest - p->next_frames[i] >= p->backlog) {
+            p->frames_dropped += newest - p->next_frames[i] - p->backlog + 1;
+            p->next_frames[i] = newest - p->backlog + 1;
+        }
+
+        if ((f = get_frame(fb, p->next_frames[i])) == NULL) {
+            continue;
+        }
+
+        part_len = snprintf(part_header, sizeof(part_header), MUX_PART_HEADER_TMPL, i, f->captured_at,
+            (long) (f->data_len - strlen(FRAME_HEADER) - strlen(FRAME_FOOTER)));
+
+        // One chunk per part. The frame in the ring already carries its
+        // content type and the next boundary.
+        p->out_len = snprintf(p->out, sizeof(p->out), "%s%lx\r\n%s", p->chunk_open ? "\r\n" : "",
+            (unsigned long) (part_len + f->data_len), part_header);
+        p->out_pos = 0;
+        p->chunk_open = 1;
+
+        p->camera = i;
+        p->frame = p->next_frames[i];
+        p->frame_pos = 0;
+        p->last_camera = i;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Returns the number of bytes written, 0 if the socket is full and -1 on
+// errors
+static ssize_t push_write(struct push *p, const void *buf, size_t len, short more) {
+    ssize_t n;
+    int err;
+
+    if (p->ssl != NULL) {
+        ERR_clear_error();
+        if ((n = SSL_write(p->ssl, buf, len)) > 0) {
+            return n;
+        }
+        err = SSL_get_error(p->ssl, n);
+        return (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) ? 0 : -1;
+    }
+
+    if ((n = send(p->sock, buf, len, MSG_NOSIGNAL | (more ? MSG_MORE : 0))) < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+
+    return n;
+}
+
+// Bytes in the socket that have not gone out yet
+static int unsent_bytes(struct push *p) {
+    int unsent = 0;
+
+#ifdef SIOCOUTQNSD
+    if (ioctl(p->sock, SIOCOUTQNSD, &unsent) < 0) {
+        return 0;
+    }
+#endif
+
+    return unsent;
+}
+
+// The ingest server only answers if something is wrong, or once it is done
+// with us
+static void read_response(struct push *p, double now) {
+    char buf[512];
+    ssize_t n;
+    int status, err;
+
+    if (p->ssl != NULL) {
+        ERR_clear_error();
+        if ((n = SSL_read(p->ssl, buf, sizeof(buf) - 1)) <= 0) {
+            err = SSL_get_error(p->ssl, n);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+                return;
+            }
+            return push_disconnect(p, "closed the connection", now);
+        }
+    }
+    else if ((n = recv(p->sock, buf, sizeof(buf) - 1, 0)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        return push_disconnect(p, strerror(errno), now);
+    }
+    else if (n == 0) {
+        return push_disconnect(p, "closed the connection", now);
+    }
+
+    buf[n] = '\0';
+    if (sscanf(buf, "HTTP/%*s %d", &status) == 1 && status >= 300) {
+        log_itf(LOG_ERROR, "Ingest server %s answered %.*s.", p->url.display, (int) strcspn(buf, "\r\n"), buf);
+        return push_disconnect(p, "request refused", now);
+    }
+}
+
+// Sends until the socket is full or there is nothing left to send
+static void send_frames(struct push *p, struct frame_buffers *fbs, double now) {
+    struct frame *f;
+    ssize_t n;
+
+    for (;;) {
+        if (p->out_pos < p->out_len) {
+            if ((n = push_write(p, &p->out[p->out_pos], p->out_len - p->out_pos, p->camera >= 0)) < 0) {
+                return push_disconnect(p, strerror(errno), now);
+            }
+            if (n == 0) {
+                return;
+            }
+            p->out_pos += n;
+            p->last_progress_at = now;
+            continue;
+        }
+
+        if (p->camera >= 0) {
+            f = get_frame(&fbs->buffers[p->camera], p->frame);
+            if ((n = push_write(p, &f->data[p->frame_pos], f->data_len - p->frame_pos, 0)) < 0) {
+                return push_disconnect(p, strerror(errno), now);
+            }
+            if (n == 0) {
+                return;
+            }
+            p->frame_pos += n;
+            p->last_progress_at = now;
+
+            if (p->frame_pos == f->data_len) {
+                p->next_frames[p->camera] = p->frame + 1;
+                p->camera = -1;
+                p->frames_sent++;
+                p->last_frame_len = f->data_len;
+                p->last_progress_at = now;
+            }
+            continue;
+        }
+
+        // Frames are only dropped while they wait in the ring, so keep
+        // them from piling up in the socket instead. About a frame of each
+        // camera keeps the link busy until the next round.
+        if (unsent_bytes(p) > fbs->count * p->last_frame_len || !select_frame(p, fbs)) {
+            return;
+        }
+    }
+}
+
+// Called on every pass of the main loop. Never blocks.
+void push_frames(struct push *p, struct frame_buffers *fbs) {
+    double now = gettime();
+
+    switch (p->state) {
+        case PUSH_DISCONNECTED:
+            if (now >= p->reconnect_at) {
+                push_connect(p, now);
+            }
+            return;
+        case PUSH_RESOLVING:
+            if (!resolving_done(&p->resolver)) {
+                break;
+            }
+            if (p->resolver.error != 0) {
+                return push_disconnect(p, gai_strerror(p->resolver.error), now);
+            }
+            push_connect_next(p, NULL, now);
+            return;
+        case PUSH_CONNECTING:
+            if (now - p->last_progress_at > PUSH_CONNECT_TIMEOUT) {
+                push_connect_next(p, "could not connect in time", now);
+                return;
+            }
+            // Fall through
+
+        case PUSH_HANDSHAKE:
+            push_handshake(p, fbs, now);
+            break;
+    }
+
+    if (p->state != PUSH_STREAMING) {
+        if (p->state != PUSH_DISCONNECTED && now - p->last_progress_at > PUSH_STALL_TIMEOUT) {
+            push_disconnect(p, "timed out", now);
+        }
+        return;
+    }
+
+    // The ring only holds so many frames. Once the one on its way out is
+    // overwritten there is no finishing it.
+    if (p->camera >= 0 && get_frame(&fbs->buffers[p->camera], p->frame) == NULL) {
+        return push_disconnect(p, "fell too far behind", now);
+    }
+
+    read_response(p, now);
+    if (p->state != PUSH_STREAMING) {
+        return;
+    }
+
+    send_frames(p, fbs, now);
+
+    // Waiting for frames is not stalling
+    if (p->state == PUSH_STREAMING && now - p->last_progress_at > PUSH_STALL_TIMEOUT && (p->camera >= 0 || p->out_pos < p->out_len || unsent_bytes(p) > 0)) {
+        push_disconnect(p, "timed out", now);
+    }
+}
+
+// What push_frames() would wait for, like capture_pollfd(). Frames go out
+// when the cameras have them, so a socket that has room is only waited on
+// while a write could not finish.
+void push_pollfd(struct push *p, struct pollfd *pfd, double *due_at) {
+    pfd->fd = p->sock;
+    pfd->events = POLLIN;
+    pfd->revents = 0;
+    *due_at = p->last_progress_at + PUSH_STALL_TIMEOUT;
+
+    switch (p->state) {
+        case PUSH_DISCONNECTED:
+            pfd->fd = -1;
+            *due_at = p->reconnect_at;
+            break;
+        case PUSH_RESOLVING:
+            pfd->fd = resolver_fd(&p->resolver);
+            break;
+        case PUSH_CONNECTING:
+            pfd->events = POLLOUT;
+            *due_at = p->last_progress_at + PUSH_CONNECT_TIMEOUT;
+            break;
+        case PUSH_HANDSHAKE:
+            pfd->events = SSL_want_write(p->ssl) ? POLLOUT : POLLIN;
+            break;
+        case PUSH_STREAMING:
+            if (p->out_pos < p->out_len || p->camera >= 0) {
+                pfd->events |= POLLOUT;
+            }
+            break;
+    }
+}
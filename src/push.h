@@ -0,0 +1,75 @@
+#ifndef __PUSH_H
+#define __PUSH_H
+
+#include <poll.h>
+#include "openssl/ssl.h"
+
+#include "frames.h"
+#include "utils.h"
+#include "resolver.h"
+
+// Pushes the cameras out to an ingest server, for sites that viewers cannot
+// connect in to. A single long POST carries every camera as a chunked
+// multipart/mixed body made of the same parts as /streams.
+
+#define PUSH_MIN_BACKOFF 0.5        // Seconds before reconnecting, doubled after each failure
+#define PUSH_MAX_BACKOFF 30.0
+#define PUSH_STALL_TIMEOUT 10.0     // Seconds without progress before giving up on a connection
+#define PUSH_CONNECT_TIMEOUT 3.0    // Seconds before trying the next address of the ingest server
+#define PUSH_HEALTHY_AFTER 60.0     // Seconds a request must last for the backoff to start over
+#define PUSH_MAX_HEADER_SIZE 2048   // Of the request, and of each chunk and part
+
+#define PUSH_DISCONNECTED 0
+#define PUSH_RESOLVING 1
+#define PUSH_CONNECTING 2
+#define PUSH_HANDSHAKE 3            // TLS
+#define PUSH_STREAMING 4
+
+#define PUSH_REQUEST_TMPL "POST %s HTTP/1.1\r\n" \
+    "Host: %s\r\n" \
+    "User-Agent: hawkeye\r\n" \
+    "Content-Type: multipart/mixed;boundary=" BOUNDARY "\r\n" \
+    "Transfer-Encoding: chunked\r\n" \
+    "%s%s%s" \
+    "\r\n"
+
+struct push {
+    struct http_url url;
+    struct resolver resolver;
+    SSL_CTX *ssl_ctx;           // NULL for http://
+    SSL *ssl;
+    int sock;
+    int state;                  // PUSH_*
+
+    // Request, or chunk and part header, sent ahead of the frame
+    char out[PUSH_MAX_HEADER_SIZE];
+    size_t out_len;
+    size_t out_pos;
+    short chunk_open;           // The CRLF that ends the last chunk is still due
+
+    // Frame being sent, straight out of the ring of its camera
+    int camera;                 // -1 if none
+    unsigned long frame;
+    size_t frame_pos;
+
+    unsigned long *next_frames; // Per camera
+    int last_camera;            // Cameras with new frames take turns
+    int backlog;                // Frames a camera may queue before the oldest are dropped
+    size_t last_frame_len;
+
+    double backoff;
+    double reconnect_at;
+    double connected_at;        // Of the request that is streaming, 0 if none
+    double last_progress_at;
+
+    unsigned long frames_sent;
+    unsigned long frames_dropped;
+    unsigned long reconnects;
+};
+
+struct push *create_push(const char *url, int backlog, struct frame_buffers *fbs);
+void push_frames(struct push *p, struct frame_buffers *fbs);
+void push_pollfd(struct push *p, struct pollfd *pfd, double *due_at);
+void destroy_push(struct push *p);
+
+#endif
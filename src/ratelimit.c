@@ -0,0 +1,45 @@
+
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "utils.h"
+
+#include "ratelimit.h"
+
+static void token_bucket_refill(struct token_bucket *tb, double now);
+
+// burst_seconds is how much unused allowance may be saved up, in seconds
+// worth of rate.
+void token_bucket_init(struct token_bucket *tb, double rate, double burst_seconds) {
+    tb->rate = rate;
+    tb->burst = max(rate * burst_seconds, (double) MIN_BUCKET_BURST);
+    tb->tokens = tb->burst;
+    tb->last_refill = 0;
+}
+
+static void token_bucket_refill(struct token_bucket *tb, double now) {
+    if (tb->last_refill > 0 && now > tb->last_refill) {
+        tb->tokens = min(tb->burst, tb->tokens + (now - tb->last_refill) * tb->rate);
+    }
+
+    tb->last_refill = now;
+}
+
+// Returns how many of the wanted bytes may be sent right now.
+size_t token_bucket_allowance(struct token_bucket *tb, size_t want, double now) {
+    if (token_bucket_unlimited(tb)) {
+        return want;
+    }
+
+    token_bucket_refill(tb, now);
+
+    return min(want, (size_t) tb->tokens);
+}
+
+void token_bucket_consume(struct token_bucket *tb, size_t n) {
+    if (token_bucket_unlimited(tb)) {
+        return;
+    }
+
+    tb->tokens = max(0.0, tb->tokens - n);
+}
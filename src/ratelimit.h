@@ -0,0 +1,23 @@
+
+#ifndef __RATELIMIT_H
+#define __RATELIMIT_H
+
+#include <sys/types.h>
+
+#define MIN_BUCKET_BURST 16*1024
+
+// Token bucket for shaping egress. One token is one byte.
+struct token_bucket {
+    double rate;        // Tokens added per second. 0 means unlimited
+    double burst;       // Most tokens the bucket can hold
+    double tokens;
+    double last_refill;
+};
+
+void token_bucket_init(struct token_bucket *tb, double rate, double burst_seconds);
+size_t token_bucket_allowance(struct token_bucket *tb, size_t want, double now);
+void token_bucket_consume(struct token_bucket *tb, size_t n);
+
+#define token_bucket_unlimited(tb) ((tb)->rate <= 0)
+
+#endif
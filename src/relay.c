@@ -0,0 +1,402 @@
+#define _GNU_SOURCE // memmem()
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "memory.h"
+#include "logger.h"
+#include "utils.h"
+#include "frames.h"
+#include "jpeg_utils.h"
+#include "relay.h"
+
+static void relay_connect(struct video_device *vd, double now);
+static void relay_connect_next(struct video_device *vd, const char *reason, double now);
+static void relay_disconnect(struct video_device *vd, const char *reason, double now);
+static void relay_send_request(struct video_device *vd, double now);
+static long relay_receive(struct video_device *vd, double now);
+static long relay_parse(struct video_device *vd, double now);
+static int relay_parse_header(struct video_device *vd, const unsigned char *header, size_t len);
+
+short is_relay_source(const char *device) {
+    return strncmp(device, RELAY_URL_PREFIX, strlen(RELAY_URL_PREFIX)) == 0;
+}
+
+// Upstreams always send JPEGs, whatever the format of the cameras here
+int open_relay_source(struct video_device *vd) {
+    struct relay *r = calloc(1, sizeof(struct relay));
+
+    if (parse_http_url(vd->device_filename, &r->url) < 0 || r->url.tls) {
+        log_itf(LOG_ERROR, "%s is not a URL of the form http://[user:pass@]host[:port]/path.", vd->device_filename);
+        free(r->url.auth);
+        free(r);
+        return -1;
+    }
+
+    r->sock = -1;
+    r->state = RELAY_DISCONNECTED;
+    r->backoff = RELAY_MIN_BACKOFF;
+    r->reconnect_at = 0;
+
+    // Room for the largest frame along with the headers around it
+    r->size = MAX_FRAME_SIZE + 2 * RELAY_MAX_HEADER_SIZE + RELAY_READ_SIZE;
+    r->buf = malloc(r->size);
+    r->len = 0;
+
+    vd->relay = r;
+    vd->format_in = V4L2_PIX_FMT_MJPEG;
+    vd->framebuffer_size = MAX_FRAME_SIZE;
+    vd->framebuffer = malloc(vd->framebuffer_size);
+    vd->streaming_state = STREAMING_ON;
+
+    log_itf(LOG_INFO, "Relaying %s.", r->url.display);
+
+    return 0;
+}
+
+// Looks the upstream up, without waiting for the answer
+static void relay_connect(struct video_device *vd, double now) {
+    struct relay *r = vd->relay;
+
+    start_resolving(&r->resolver, r->url.host, r->url.port);
+    r->state = RELAY_RESOLVING;
+    r->len = 0;
+    r->last_data_at = now;
+}
+
+// Connects to the next address of the upstream, without waiting for the
+// connection to be made. Gives up for now with reason once none is left.
+static void relay_connect_next(struct video_device *vd, const char *reason, double now) {
+    struct relay *r = vd->relay;
+
+    if (r->sock >= 0) {
+        close(r->sock);
+    }
+
+    if ((r->sock = connect_next_address(&r->resolver)) < 0) {
+        return relay_disconnect(vd, reason != NULL ? reason : strerror(errno), now);
+    }
+
+    r->state = RELAY_CONNECTING;
+    r->last_data_at = now;
+}
+
+// Tries again later, waiting longer after each failure in a row
+static void relay_disconnect(struct video_device *vd, const char *reason, double now) {
+    struct relay *r = vd->relay;
+
+    stop_resolving(&r->resolver);
+    if (r->sock >= 0) {
+        close(r->sock);
+    }
+    r->sock = -1;
+    r->state = RELAY_DISCONNECTED;
+    r->reconnect_at = now + r->backoff;
+
+    log_itf(LOG_WARNING, "Upstream %s: %s. Trying again in %.1f seconds.", r->url.display, reason, r->backoff);
+    r->backoff = min(2 * r->backoff, RELAY_MAX_BACKOFF);
+}
+
+static void relay_send_request(struct video_device *vd, double now) {
+    struct relay *r = vd->relay;
+    char request[MAX_URL_PATH + 1024], host[sizeof(r->url.host) + sizeof(r->url.port) + 3];
+    int err = 0, len;
+    socklen_t err_len = sizeof(err);
+
+    if (getsockopt(r->sock, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0) {
+        return relay_connect_next(vd, strerror(err ? err : errno), now);
+    }
+    stop_resolving(&r->resolver);
+
+    // Ask for timestamps, which hawkeye tags each part with and other
+    // servers ignore
+    http_url_host_header(&r->url, host, sizeof(host));
+    len = snprintf(request, sizeof(request), RELAY_REQUEST_TMPL, r->url.path, strchr(r->url.path, '?') ? "&" : "?", host,
+        r->url.auth ? "Authorization: Basic " : "", r->url.auth ? r->url.auth : "", r->url.auth ? "\r\n" : "");
+
+    // A fresh connection takes a request this small in one go
+    if (len >= sizeof(request) || send(r->sock, request, len, MSG_NOSIGNAL) != len) {
+        return relay_disconnect(vd, "could not send the request", now);
+    }
+
+    r->state = RELAY_RESPONSE;
+}
+
+// Returns the length of the newest frame that came in, 0 if none did
+static long relay_receive(struct video_device *vd, double now) {
+    struct relay *r = vd->relay;
+    ssize_t n;
+    long frame_len;
+
+    if ((n = recv(r->sock, &r->buf[r->len], min(r->size - r->len, (size_t) RELAY_READ_SIZE), 0)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        relay_disconnect(vd, strerror(errno), now);
+        return 0;
+    }
+
+    if (n == 0) {
+        relay_disconnect(vd, "closed the connection", now);
+        return 0;
+    }
+
+    r->len += n;
+    r->last_data_at = now;
+
+    if ((frame_len = relay_parse(vd, now)) < 0) {
+        relay_disconnect(vd, "not an MJPEG stream hawkeye understands", now);
+        return 0;
+    }
+
+    return frame_len;
+}
+
+// Goes through what has been received, copying the newest complete frame to
+// the frame buffer. Parts either say how long they are or run to the next
+// boundary. Returns the frame's length, 0 if none was completed, or -1 if
+// the upstream does not make sense.
+static long relay_parse(struct video_device *vd, double now) {
+    struct relay *r = vd->relay;
+    size_t pos = 0, end;
+    unsigned char *p;
+    long frame_len = 0;
+
+    for (;;) {
+        if (r->state == RELAY_RESPONSE || r->state == RELAY_PART_HEADER) {
+            if ((p = memmem(&r->buf[pos], r->len - pos, "\r\n\r\n", 4)) == NULL) {
+                if (r->len - pos > RELAY_MAX_HEADER_SIZE) {
+                    return -1;
+                }
+                break;
+            }
+
+            end = p - r->buf + 4;
+            if (relay_parse_header(vd, &r->buf[pos], end - pos) < 0) {
+                return -1;
+            }
+            pos = end;
+            continue;
+        }
+
+        if (r->part_len >= 0) {
+            if (r->len - pos < r->part_len) {
+                break;
+            }
+            end = pos + r->part_len;
+        }
+        else if ((p = memmem(&r->buf[pos], r->len - pos, r->boundary, strlen(r->boundary))) != NULL) {
+            end = p - r->buf;
+        }
+        else if (r->len - pos > vd->framebuffer_size + strlen(r->boundary)) {
+            return -1; // Already too big for the frame buffer
+        }
+        else {
+            break;
+        }
+
+        // Parts without a Content-Length are only bounded by the buffer
+        if (end - pos > vd->framebuffer_size) {
+            return -1;
+        }
+
+        if (end > pos) {
+            memcpy(vd->framebuffer, &r->buf[pos], end - pos);
+            frame_len = end - pos;
+
+            // Capture times are kept, as long as the clocks roughly agree
+            vd->captured_at = (r->part_timestamp > 0) ? min(r->part_timestamp, now) : now;
+            jpeg_dimensions(vd->framebuffer, frame_len, &vd->width, &vd->height);
+            r->backoff = RELAY_MIN_BACKOFF;
+        }
+
+        pos = end;
+        r->state = RELAY_PART_HEADER;
+    }
+
+    memmove(r->buf, &r->buf[pos], r->len - pos);
+    r->len -= pos;
+
+    // A part that does not fit will never be completed
+    return (r->len == r->size) ? -1 : frame_len;
+}
+
+// The response header, which has to announce a multipart stream, or the
+// header of a part
+static int relay_parse_header(struct video_device *vd, const unsigned char *header, size_t len) {
+    struct relay *r = vd->relay;
+    char buf[RELAY_MAX_HEADER_SIZE + 1], *line, *saveptr, *boundary;
+    int status = 0;
+
+    if (len > RELAY_MAX_HEADER_SIZE) {
+        return -1;
+    }
+
+    memcpy(buf, header, len);
+    buf[len] = '\0';
+
+    if (r->state == RELAY_RESPONSE) {
+        if (sscanf(buf, "HTTP/%*s %d", &status) != 1 || status != 200) {
+            log_itf(LOG_ERROR, "Upstream %s answered %.*s.", r->url.display, (int) strcspn(buf, "\r\n"), buf);
+            return -1;
+        }
+
+        r->boundary[0] = '\0';
+        for (line = strtok_r(buf, "\r\n", &saveptr); line != NULL; line = strtok_r(NULL, "\r\n", &saveptr)) {
+            if (strncasecmp(line, "Content-Type:", strlen("Content-Type:")) == 0 && (boundary = strstr(line, "boundary=")) != NULL) {
+                boundary += strlen("boundary=");
+                boundary[strcspn(boundary, "; \t")] = '\0';
+                if (*boundary == '"') {
+                    boundary++;
+                    boundary[strcspn(boundary, "\"")] = '\0';
+                }
+                snprintf(r->boundary, sizeof(r->boundary), "\r\n--%s", boundary);
+            }
+        }
+
+        if (r->boundary[0] == '\0') {
+            return -1;
+        }
+
+        log_itf(LOG_INFO, "Connected to upstream %s.", r->url.display);
+        r->state = RELAY_PART_HEADER;
+        return 0;
+    }
+
+    r->part_len = -1;
+    r->part_timestamp = 0;
+    for (line = strtok_r(buf, "\r\n", &saveptr); line != NULL; line = strtok_r(NULL, "\r\n", &saveptr)) {
+        if (strncasecmp(line, "Content-Length:", strlen("Content-Length:")) == 0) {
+            r->part_len = atol(&line[strlen("Content-Length:")]);
+        }
+        else if (strncasecmp(line, "X-Timestamp:", strlen("X-Timestamp:")) == 0) {
+            r->part_timestamp = atof(&line[strlen("X-Timestamp:")]);
+        }
+    }
+
+    if (r->part_len > (long) vd->framebuffer_size) {
+        return -1;
+    }
+
+    r->state = RELAY_PART_BODY;
+    return 0;
+}
+
+// What the main loop waits on for the relay: its socket, and when the next
+// connection attempt or the stall timeout is due
+void relay_pollfd(struct video_device *vd, struct pollfd *pfd, double *due_at) {
+    struct relay *r = vd->relay;
+
+    pfd->fd = (r->state == RELAY_RESOLVING) ? resolver_fd(&r->resolver) : r->sock;
+    pfd->events = (r->state == RELAY_CONNECTING) ? POLLOUT : POLLIN;
+
+    if (r->state == RELAY_DISCONNECTED) {
+        *due_at = r->reconnect_at;
+    }
+    else if (r->state == RELAY_CONNECTING) {
+        *due_at = r->last_data_at + RELAY_CONNECT_TIMEOUT;
+    }
+    else {
+        *due_at = r->last_data_at + RELAY_STALL_TIMEOUT;
+    }
+}
+
+// Whether the upstream is sending parts, rather than being connected to or
+// waited for after a failure
+short relay_receiving(struct video_device *vd) {
+    return vd->relay->state >= RELAY_PART_HEADER;
+}
+
+// Like dequeuing a buffer from a camera that is opened non-blocking, reads
+// whatever has arrived without waiting and keeps only the newest frame.
+// Returns 0 if there is none yet, e.g. while the upstream is down.
+size_t read_relay_frame(struct video_device *vd) {
+    struct relay *r = vd->relay;
+    double now = gettime();
+    struct pollfd pfd;
+    long len, frame_len = 0;
+    int ready;
+
+    if (r->state == RELAY_DISCONNECTED && now >= r->reconnect_at) {
+        relay_connect(vd, now);
+    }
+    else if (r->state == RELAY_CONNECTING && now - r->last_data_at > RELAY_CONNECT_TIMEOUT) {
+        relay_connect_next(vd, "could not connect in time", now);
+    }
+    else if (r->state != RELAY_DISCONNECTED && now - r->last_data_at > RELAY_STALL_TIMEOUT) {
+        relay_disconnect(vd, "no data for too long", now);
+    }
+
+    if (r->state == RELAY_RESOLVING) {
+        if (!resolving_done(&r->resolver)) {
+            return 0;
+        }
+        if (r->resolver.error != 0) {
+            relay_disconnect(vd, gai_strerror(r->resolver.error), now);
+            return 0;
+        }
+        relay_connect_next(vd, NULL, now);
+    }
+
+    while (r->state != RELAY_DISCONNECTED) {
+        pfd.fd = r->sock;
+        pfd.events = (r->state == RELAY_CONNECTING) ? POLLOUT : POLLIN;
+        pfd.revents = 0;
+
+        if ((ready = poll(&pfd, 1, 0)) < 0 && errno != EINTR) {
+            panic("poll() failed");
+        }
+
+        if (ready <= 0) {
+            break;
+        }
+        now = gettime();
+
+        if (r->state == RELAY_CONNECTING) {
+            relay_send_request(vd, now);
+        }
+        else if ((len = relay_receive(vd, now)) > 0) {
+            frame_len = len;
+        }
+    }
+
+    return frame_len;
+}
+
+// Hangs up on the upstream while nobody watches. The next read connects
+// again straight away.
+void pause_relay_source(struct video_device *vd) {
+    struct relay *r = vd->relay;
+
+    stop_resolving(&r->resolver);
+    if (r->sock >= 0) {
+        close(r->sock);
+    }
+    r->sock = -1;
+    r->state = RELAY_DISCONNECTED;
+    r->len = 0;
+    r->backoff = RELAY_MIN_BACKOFF;
+    r->reconnect_at = 0;
+}
+
+void close_relay_source(struct video_device *vd) {
+    struct relay *r = vd->relay;
+
+    stop_resolving(&r->resolver);
+    if (r->sock >= 0) {
+        close(r->sock);
+    }
+
+    free(r->buf);
+    free(r->url.auth);
+    free(r);
+    vd->relay = NULL;
+}
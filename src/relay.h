@@ -0,0 +1,61 @@
+#ifndef __RELAY_H
+#define __RELAY_H
+
+#include "v4l2uvc.h"
+#include "utils.h"
+#include "resolver.h"
+
+// Another hawkeye's /stream/N, or any other multipart MJPEG stream over
+// HTTP, in place of a camera. It is pulled once and served from here to
+// everyone, so that a remote site's uplink only carries it once.
+
+#define RELAY_URL_PREFIX "http://"
+#define RELAY_MAX_HEADER_SIZE 4096   // Of the response and of each part
+#define RELAY_READ_SIZE 64*1024
+#define RELAY_MIN_BACKOFF 0.5        // Seconds before reconnecting, doubled after each failure
+#define RELAY_MAX_BACKOFF 30.0
+#define RELAY_STALL_TIMEOUT 10.0     // Seconds without data before giving up on a connection
+#define RELAY_CONNECT_TIMEOUT 3.0    // Seconds before trying the next address of the upstream
+
+#define RELAY_DISCONNECTED 0
+#define RELAY_RESOLVING 1
+#define RELAY_CONNECTING 2
+#define RELAY_RESPONSE 3             // Waiting for the response header
+#define RELAY_PART_HEADER 4
+#define RELAY_PART_BODY 5
+
+#define RELAY_REQUEST_TMPL "GET %s%stimestamps=1 HTTP/1.0\r\n" \
+    "Host: %s\r\n" \
+    "User-Agent: hawkeye\r\n" \
+    "%s%s%s" \
+    "\r\n"
+
+struct relay {
+    struct http_url url;
+    struct resolver resolver;
+
+    int sock;
+    int state;                  // RELAY_*
+    char boundary[80];          // With the leading "--"
+
+    unsigned char *buf;         // Received and not parsed yet
+    size_t len;
+    size_t size;
+
+    long part_len;              // From Content-Length, -1 if the part has none
+    double part_timestamp;      // From X-Timestamp, 0 if the part has none
+
+    double backoff;
+    double reconnect_at;
+    double last_data_at;
+};
+
+short is_relay_source(const char *device);
+int open_relay_source(struct video_device *vd);
+void relay_pollfd(struct video_device *vd, struct pollfd *pfd, double *due_at);
+short relay_receiving(struct video_device *vd);
+size_t read_relay_frame(struct video_device *vd);
+void pause_relay_source(struct video_device *vd);
+void close_relay_source(struct video_device *vd);
+
+#endif
@@ -0,0 +1,162 @@
+#define _GNU_SOURCE // pipe2()
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "memory.h"
+#include "resolver.h"
+
+static void *resolve_worker(void *arg);
+static void free_job(struct resolve_job *job);
+
+static void *resolve_worker(void *arg) {
+    struct resolve_job *job = arg;
+    struct addrinfo hints, *addrs = NULL;
+    int error;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    error = getaddrinfo(job->host, job->port, &hints, &addrs);
+
+    pthread_mutex_lock(&job->lock);
+    job->done = 1;
+    job->error = error;
+    job->addrs = addrs;
+
+    if (job->abandoned) {
+        pthread_mutex_unlock(&job->lock);
+        free_job(job);
+        return NULL;
+    }
+
+    if (write(job->pipe[1], "", 1) < 0) {
+        // The main loop still sees done on its next pass
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+static void free_job(struct resolve_job *job) {
+    if (job->addrs != NULL) {
+        freeaddrinfo(job->addrs);
+    }
+    close(job->pipe[0]);
+    close(job->pipe[1]);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+}
+
+// Starts looking up host, dropping whatever the last lookup found
+void start_resolving(struct resolver *res, const char *host, const char *port) {
+    struct resolve_job *job = calloc(1, sizeof(struct resolve_job));
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    stop_resolving(res);
+
+    snprintf(job->host, sizeof(job->host), "%s", host);
+    snprintf(job->port, sizeof(job->port), "%s", port);
+    if (pipe2(job->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        panic("Could not create a pipe for a lookup");
+    }
+    pthread_mutex_init(&job->lock, NULL);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, resolve_worker, job) != 0) {
+        panic("Could not start lookup thread");
+    }
+    pthread_attr_destroy(&attr);
+
+    res->job = job;
+}
+
+// What to poll for the end of the lookup, -1 if there is none going on
+int resolver_fd(struct resolver *res) {
+    return (res->job != NULL) ? res->job->pipe[0] : -1;
+}
+
+// Whether the lookup has finished. If so, error is set or the addresses are
+// ready for connect_next_address().
+short resolving_done(struct resolver *res) {
+    struct resolve_job *job = res->job;
+    short done;
+
+    if (job == NULL) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    done = job->done;
+    if (done) {
+        res->error = job->error;
+        res->addrs = res->next = job->addrs;
+        job->addrs = NULL;
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    if (done) {
+        free_job(job);
+        res->job = NULL;
+    }
+
+    return done;
+}
+
+// Starts a non-blocking connection to the next address. Returns the socket,
+// or -1 with errno set once no address is left that a socket could be made
+// for.
+int connect_next_address(struct resolver *res) {
+    struct addrinfo *ai;
+    int sock;
+
+    errno = EHOSTUNREACH;
+    while ((ai = res->next) != NULL) {
+        res->next = ai->ai_next;
+
+        if ((sock = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+            continue;
+        }
+
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS) {
+            return sock;
+        }
+
+        close(sock);
+    }
+
+    return -1;
+}
+
+// Drops the addresses, and a lookup still going on, which the thread then
+// cleans up after itself
+void stop_resolving(struct resolver *res) {
+    struct resolve_job *job = res->job;
+
+    if (job != NULL) {
+        pthread_mutex_lock(&job->lock);
+        if (!job->done) {
+            job->abandoned = 1;
+            pthread_mutex_unlock(&job->lock);
+        }
+        else {
+            pthread_mutex_unlock(&job->lock);
+            free_job(job);
+        }
+        res->job = NULL;
+    }
+
+    if (res->addrs != NULL) {
+        freeaddrinfo(res->addrs);
+    }
+    res->addrs = res->next = NULL;
+}
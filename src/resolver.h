@@ -0,0 +1,37 @@
+#ifndef __RESOLVER_H
+#define __RESOLVER_H
+
+#include <pthread.h>
+#include <netdb.h>
+
+// Host name lookups for outgoing connections. getaddrinfo() takes as long
+// as the DNS server likes, so it runs on a thread of its own while the main
+// loop goes on, and the connection then tries each address in turn.
+
+// A lookup in progress. The thread frees it if nobody waits for it any more.
+struct resolve_job {
+    char host[256];
+    char port[8];
+    int pipe[2];                // The thread writes a byte to [1] once done
+
+    pthread_mutex_t lock;       // Guards the fields below
+    short done;
+    short abandoned;
+    int error;                  // From getaddrinfo(), 0 if it worked
+    struct addrinfo *addrs;
+};
+
+struct resolver {
+    struct resolve_job *job;    // NULL unless looking up
+    struct addrinfo *addrs;     // Of the last lookup, NULL once used up
+    struct addrinfo *next;      // Address to connect to next
+    int error;                  // Of the last lookup
+};
+
+void start_resolving(struct resolver *res, const char *host, const char *port);
+int resolver_fd(struct resolver *res);
+short resolving_done(struct resolver *res);
+int connect_next_address(struct resolver *res);
+void stop_resolving(struct resolver *res);
+
+#endif
@@ -0,0 +1,299 @@
+
+#include <string.h>
+#include <openssl/rand.h>
+
+#include "utils.h"
+#include "huffman.h"
+#include "rtp.h"
+
+static uint16_t get_be16(const unsigned char *buf);
+static void put_be16(unsigned char *buf, uint16_t value);
+static void put_be32(unsigned char *buf, uint32_t value);
+static short is_unsupported_sof(int marker);
+static size_t dht_table_len(const unsigned char *table, size_t len);
+static short is_standard_dht(const unsigned char *seg, size_t seg_len);
+
+static uint16_t get_be16(const unsigned char *buf) {
+    return (buf[0] << 8) | buf[1];
+}
+
+static void put_be16(unsigned char *buf, uint16_t value) {
+    buf[0] = value >> 8;
+    buf[1] = value & 0xff;
+}
+
+static void put_be32(unsigned char *buf, uint32_t value) {
+    buf[0] = value >> 24;
+    buf[1] = (value >> 16) & 0xff;
+    buf[2] = (value >> 8) & 0xff;
+    buf[3] = value & 0xff;
+}
+
+// Progressive, lossless, arithmetic coded and so on. DHT (0xc4), JPG (0xc8)
+// and DAC (0xcc) share the range but are not frame headers.
+static short is_unsupported_sof(int marker) {
+    return marker >= 0xc1 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+}
+
+// Length of the Huffman table at the start of a DHT segment: class and id,
+// 16 counts of codes by length and the symbols. 0 if it runs past len.
+static size_t dht_table_len(const unsigned char *table, size_t len) {
+    size_t n = 17;
+    int i;
+
+    if (len < n) {
+        return 0;
+    }
+
+    for (i = 1; i <= 16; i++) {
+        n += table[i];
+    }
+
+    return n <= len ? n : 0;
+}
+
+// Whether every table in a DHT segment is the one of the same class and id
+// among the standard tables of the JPEG spec (K.3), which are all that
+// RFC 2435 receivers know
+static short is_standard_dht(const unsigned char *seg, size_t seg_len) {
+    const unsigned char *standard;
+    size_t pos = 0, n, spos, sn;
+
+    while (pos < seg_len) {
+        if ((n = dht_table_len(&seg[pos], seg_len - pos)) == 0) {
+            return 0;
+        }
+
+        standard = NULL;
+        for (spos = 4; spos < sizeof(dht_data); spos += sn) {
+            sn = dht_table_len(&dht_data[spos], sizeof(dht_data) - spos);
+            if (dht_data[spos] == seg[pos]) {
+                standard = &dht_data[spos];
+                break;
+            }
+        }
+
+        if (standard == NULL || sn != n || memcmp(standard, &seg[pos], n) != 0) {
+            return 0;
+        }
+
+        pos += n;
+    }
+
+    return 1;
+}
+
+// Finds what RFC 2435 needs in a JPEG. Returns -1 if the JPEG cannot be sent
+// that way: it must be baseline, YUV 4:2:2 or 4:2:0 with the luma table for
+// Y and the chroma table for U and V, and at most 2040 pixels each way.
+// Huffman tables are not sent, receivers assume the standard ones, so any
+// other tables and scans that pick tables other than those also rule it out.
+int rtp_parse_jpeg(const unsigned char *data, size_t len, struct rtp_jpeg *j) {
+    size_t pos = 2, seg_len, i, end;
+    const unsigned char *seg;
+    int marker, tables = 0, have_sof = 0;
+
+    memset(j, 0, sizeof(struct rtp_jpeg));
+
+    if (len < 4 || data[0] != 0xff || data[1] != 0xd8) {
+        return -1;
+    }
+
+    while (pos + 4 <= len) {
+        if (data[pos] != 0xff) {
+            return -1;
+        }
+
+        marker = data[pos + 1];
+        if (marker == 0xff) {
+            pos++; // Fill byte
+            continue;
+        }
+
+        seg_len = get_be16(&data[pos + 2]);
+        if (seg_len < 2 || pos + 2 + seg_len > len) {
+            return -1;
+        }
+        seg = &data[pos + 4];
+        seg_len -= 2;
+
+        if (is_unsupported_sof(marker)) {
+            return -1;
+        }
+
+        switch (marker) {
+            case 0xdb: // DQT, possibly several tables
+                for (i = 0; i + 65 <= seg_len; i += 65) {
+                    if ((seg[i] >> 4) != 0 || (seg[i] & 0x0f) > 1) {
+                        return -1; // 16-bit or a third table
+                    }
+                    memcpy(&j->qtables[(seg[i] & 0x0f) * 64], &seg[i + 1], 64);
+                    tables |= 1 << (seg[i] & 0x0f);
+                }
+                break;
+
+            case 0xc0: // SOF0
+                if (seg_len < 15 || seg[0] != 8 || seg[5] != 3) {
+                    return -1;
+                }
+
+                j->height = get_be16(&seg[1]);
+                j->width = get_be16(&seg[3]);
+
+                if (seg[8] != 0 || seg[10] != 0x11 || seg[11] != 1 || seg[13] != 0x11 || seg[14] != 1) {
+                    return -1;
+                }
+
+                if (seg[7] == 0x21) {
+                    j->type = RTP_JPEG_TYPE_422;
+                }
+                else if (seg[7] == 0x22) {
+                    j->type = RTP_JPEG_TYPE_420;
+                }
+                else {
+                    return -1;
+                }
+                have_sof = 1;
+                break;
+
+            case 0xdd: // DRI
+                if (seg_len >= 2) {
+                    j->restart_interval = get_be16(seg);
+                }
+                break;
+
+            case 0xc4: // DHT
+                if (!is_standard_dht(seg, seg_len)) {
+                    return -1;
+                }
+                break;
+
+            case 0xda: // SOS, the scan runs from here to EOI
+                if (!have_sof || tables != 3 || j->width <= 0 || j->width > 2040 || j->height <= 0 || j->height > 2040) {
+                    return -1;
+                }
+
+                // Tables 0 for Y, tables 1 for U and V
+                if (seg_len < 7 || seg[0] != 3 || seg[2] != 0x00 || seg[4] != 0x11 || seg[6] != 0x11) {
+                    return -1;
+                }
+
+                pos += 4 + seg_len;
+                for (end = len; end >= pos + 2 && !(data[end - 2] == 0xff && data[end - 1] == 0xd9); end--) {}
+                if (end < pos + 2) {
+                    return -1;
+                }
+
+                j->scan = &data[pos];
+                j->scan_len = end - 2 - pos;
+
+                if (j->restart_interval > 0) {
+                    j->type += RTP_JPEG_TYPE_RESTART;
+                }
+                return 0;
+
+            default:
+                break; // APPn, COM and the like
+        }
+
+        pos += 4 + seg_len;
+    }
+
+    return -1;
+}
+
+void rtp_stream_init(struct rtp_stream *st) {
+    memset(st, 0, sizeof(struct rtp_stream));
+    RAND_bytes((unsigned char *) &st->ssrc, sizeof(st->ssrc));
+    RAND_bytes((unsigned char *) &st->seq, sizeof(st->seq));
+    st->last_frame = -1;
+}
+
+// RTP time of a moment, so that all streams share the same clock
+uint32_t rtp_timestamp(double t) {
+    return (uint32_t) (uint64_t) (t * RTP_CLOCK_RATE);
+}
+
+// Splits a frame into packets of at most RTP_MAX_PACKET_SIZE. The first one
+// carries the quantization tables, the last one has the marker bit set.
+void rtp_send_jpeg(struct rtp_stream *st, struct rtp_jpeg *j, uint32_t timestamp, rtp_send_cb cb, void *arg) {
+    unsigned char packet[RTP_MAX_PACKET_SIZE];
+    size_t offset = 0, n, chunk;
+
+    while (offset < j->scan_len) {
+        n = RTP_HEADER_SIZE;
+
+        packet[n] = 0; // Type-specific
+        packet[n + 1] = (offset >> 16) & 0xff;
+        put_be16(&packet[n + 2], offset & 0xffff);
+        packet[n + 4] = j->type;
+        packet[n + 5] = RTP_JPEG_Q_DYNAMIC;
+        packet[n + 6] = (j->width + 7) / 8;
+        packet[n + 7] = (j->height + 7) / 8;
+        n += RTP_JPEG_HEADER_SIZE;
+
+        if (j->type & RTP_JPEG_TYPE_RESTART) {
+            // Packets do not line up with restart intervals, which the
+            // all-ones first/last/count fields say
+            put_be16(&packet[n], j->restart_interval);
+            put_be16(&packet[n + 2], 0xffff);
+            n += RTP_RESTART_HEADER_SIZE;
+        }
+
+        if (offset == 0) {
+            packet[n] = 0; // MBZ
+            packet[n + 1] = 0; // 8-bit tables
+            put_be16(&packet[n + 2], sizeof(j->qtables));
+            memcpy(&packet[n + RTP_QTABLE_HEADER_SIZE], j->qtables, sizeof(j->qtables));
+            n += RTP_QTABLE_HEADER_SIZE + sizeof(j->qtables);
+        }
+
+        chunk = min(j->scan_len - offset, sizeof(packet) - n);
+
+        packet[0] = RTP_VERSION << 6;
+        packet[1] = RTP_PAYLOAD_TYPE_JPEG | (offset + chunk == j->scan_len ? 0x80 : 0);
+        put_be16(&packet[2], st->seq++);
+        put_be32(&packet[4], timestamp);
+        put_be32(&packet[8], st->ssrc);
+
+        memcpy(&packet[n], &j->scan[offset], chunk);
+        cb(arg, packet, n + chunk);
+
+        st->packets_sent++;
+        st->octets_sent += n - RTP_HEADER_SIZE + chunk;
+        offset += chunk;
+    }
+
+    st->timestamp = timestamp;
+}
+
+// Writes a sender report followed by our CNAME into buf, which must hold
+// RTCP_MAX_PACKET_SIZE bytes. Returns the length of the compound packet.
+size_t rtcp_sender_report(struct rtp_stream *st, unsigned char *buf, double now) {
+    size_t n, sdes;
+    uint64_t ntp = (uint64_t) ((now + NTP_UNIX_OFFSET) * 4294967296.0);
+
+    buf[0] = RTP_VERSION << 6;
+    buf[1] = RTCP_SR;
+    put_be16(&buf[2], 6); // Length in 32-bit words, minus one
+    put_be32(&buf[4], st->ssrc);
+    put_be32(&buf[8], ntp >> 32);
+    put_be32(&buf[12], ntp & 0xffffffff);
+    put_be32(&buf[16], rtp_timestamp(now));
+    put_be32(&buf[20], st->packets_sent);
+    put_be32(&buf[24], st->octets_sent);
+    n = 28;
+
+    // SSRC, CNAME item, end of list, padded to 32 bits
+    sdes = (4 + 2 + strlen(RTCP_CNAME) + 1 + 3) & ~3;
+    memset(&buf[n], 0, 4 + sdes);
+    buf[n] = (RTP_VERSION << 6) | 1;
+    buf[n + 1] = RTCP_SDES;
+    put_be16(&buf[n + 2], sdes / 4);
+    put_be32(&buf[n + 4], st->ssrc);
+    buf[n + 8] = RTCP_SDES_CNAME;
+    buf[n + 9] = strlen(RTCP_CNAME);
+    memcpy(&buf[n + 10], RTCP_CNAME, strlen(RTCP_CNAME));
+
+    return n + 4 + sdes;
+}
@@ -0,0 +1,61 @@
+#ifndef __RTP_H
+#define __RTP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// RTP (RFC 3550) carrying JPEG as described in RFC 2435
+
+#define RTP_VERSION 2
+#define RTP_PAYLOAD_TYPE_JPEG 26
+#define RTP_CLOCK_RATE 90000
+#define RTP_HEADER_SIZE 12
+#define RTP_JPEG_HEADER_SIZE 8
+#define RTP_RESTART_HEADER_SIZE 4
+#define RTP_QTABLE_HEADER_SIZE 4
+#define RTP_MAX_PACKET_SIZE 1400 // Keeps packets clear of the usual MTU
+
+#define RTP_JPEG_TYPE_422 0
+#define RTP_JPEG_TYPE_420 1
+#define RTP_JPEG_TYPE_RESTART 64 // Added to the type if there are restart markers
+#define RTP_JPEG_Q_DYNAMIC 255 // Quantization tables travel with each frame
+
+#define RTCP_SR 200
+#define RTCP_SDES 202
+#define RTCP_SDES_CNAME 1
+#define RTCP_CNAME "hawkeye"
+#define RTCP_MAX_PACKET_SIZE 64
+#define NTP_UNIX_OFFSET 2208988800UL // Seconds from 1900 to 1970
+
+// What RFC 2435 needs to know about a baseline JPEG
+struct rtp_jpeg {
+    int type;                       // RTP_JPEG_TYPE_*, plus RTP_JPEG_TYPE_RESTART if applicable
+    int width;                      // In pixels
+    int height;
+    unsigned short restart_interval;
+    unsigned char qtables[128];     // Luma then chroma, 8-bit, in zigzag order
+    const unsigned char *scan;      // Entropy coded data, without EOI
+    size_t scan_len;
+};
+
+// State of one outgoing RTP stream
+struct rtp_stream {
+    uint32_t ssrc;
+    uint16_t seq;
+    uint32_t packets_sent;
+    uint32_t octets_sent;   // Payload only, for sender reports
+    uint32_t timestamp;     // Of the last frame sent
+    long last_frame;        // Frame number last sent, -1 if none
+    double rtcp_at;         // When the next sender report is due
+};
+
+// Called for each packet of a frame
+typedef void (*rtp_send_cb)(void *arg, const unsigned char *packet, size_t len);
+
+int rtp_parse_jpeg(const unsigned char *data, size_t len, struct rtp_jpeg *j);
+void rtp_stream_init(struct rtp_stream *st);
+uint32_t rtp_timestamp(double t);
+void rtp_send_jpeg(struct rtp_stream *st, struct rtp_jpeg *j, uint32_t timestamp, rtp_send_cb cb, void *arg);
+size_t rtcp_sender_report(struct rtp_stream *st, unsigned char *buf, double now);
+
+#endif
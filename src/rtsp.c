@@ -0,0 +1,724 @@
+#define _GNU_SOURCE // accept4(), memmem()
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <openssl/rand.h>
+
+#include "memory.h"
+#include "logger.h"
+#include "utils.h"
+#include "http.h"
+#include "server.h"
+#include "rtsp.h"
+
+#define is_transient_error() (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+
+// Where the packets of one RTP stream go
+struct rtsp_target {
+    struct rtsp_server *r;
+    struct rtsp_client *c;          // Interleaved client, NULL for UDP
+    struct sockaddr_in *rtp_addr;
+    struct sockaddr_in *rtcp_addr;
+};
+
+static int open_socket(const char *host, unsigned short port, int socktype);
+static void accept_rtsp_clients(struct rtsp_server *r);
+static void remove_rtsp_client(struct rtsp_server *r, struct rtsp_client *c);
+static void read_rtsp(struct rtsp_server *r, struct rtsp_client *c);
+static size_t process_rtsp(struct rtsp_server *r, struct rtsp_client *c);
+static void handle_rtsp_request(struct rtsp_server *r, struct rtsp_client *c, const char *method, const char *url, const char *headers);
+static short rtsp_header(const char *headers, const char *name, char *value, size_t value_len);
+static struct frame_buffer *find_stream(struct rtsp_server *r, const char *url, int *camera);
+static void rtsp_setup(struct rtsp_server *r, struct rtsp_client *c, int cseq, const char *url, const char *headers);
+static void rtsp_play(struct rtsp_server *r, struct rtsp_client *c, int cseq, const char *url);
+static void rtsp_stop(struct rtsp_server *r, struct rtsp_client *c);
+static void rtsp_respond(struct rtsp_client *c, const char *status, int cseq, const char *fmt, ...);
+static void rtsp_queue(struct rtsp_client *c, const void *data, size_t len);
+static void rtsp_write(struct rtsp_server *r, struct rtsp_client *c);
+static void send_rtp(void *arg, const unsigned char *packet, size_t len);
+static void send_rtcp(struct rtsp_target *t, const unsigned char *packet, size_t len);
+static void send_newest(struct frame_buffer *fb, struct rtp_stream *st, struct rtsp_target *t, double now);
+static void send_frames(struct rtsp_server *r);
+static void read_rtcp(struct rtsp_server *r);
+
+static int open_socket(const char *host, unsigned short port, int socktype) {
+    struct addrinfo hints, *res;
+    char port_str[8];
+    int sock, sockoptval = 1, flags;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = socktype;
+
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    if (getaddrinfo(strlen(host) ? host : NULL, port_str, &hints, &res) != 0) {
+        return -1;
+    }
+
+    sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sock >= 0) {
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &sockoptval, sizeof(int));
+
+        if (bind(sock, res->ai_addr, res->ai_addrlen) < 0 || (socktype == SOCK_STREAM && listen(sock, RTSP_BACKLOG) < 0)) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(res);
+
+    if (sock >= 0 && ((flags = fcntl(sock, F_GETFL, 0)) < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)) {
+        panic("Could not make RTSP socket non-blocking.");
+    }
+
+    return sock;
+}
+
+static void accept_rtsp_clients(struct rtsp_server *r) {
+    struct rtsp_client *c;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    char cbuf[INET_ADDRSTRLEN];
+    int sock;
+
+    while ((sock = accept4(r->sock, (struct sockaddr *) &addr, &addr_len, SOCK_NONBLOCK)) >= 0) {
+        if (sock >= FD_SETSIZE) {
+            close(sock);
+            continue;
+        }
+
+        c = calloc(1, sizeof(struct rtsp_client));
+        c->sock = sock;
+        c->addr = addr;
+        c->last_communication = gettime();
+        r->clients[sock] = c;
+
+        log_itf(LOG_INFO, "RTSP client connected from %s.", inet_ntop(AF_INET, &addr.sin_addr, cbuf, sizeof(cbuf)));
+        addr_len = sizeof(addr);
+    }
+}
+
+static void remove_rtsp_client(struct rtsp_server *r, struct rtsp_client *c) {
+    char cbuf[INET_ADDRSTRLEN];
+
+    log_itf(LOG_INFO, "Disconnecting RTSP client from %s.", inet_ntop(AF_INET, &c->addr.sin_addr, cbuf, sizeof(cbuf)));
+
+    rtsp_stop(r, c);
+    r->clients[c->sock] = NULL;
+    close(c->sock);
+    free(c->out);
+    free(c);
+}
+
+static void read_rtsp(struct rtsp_server *r, struct rtsp_client *c) {
+    ssize_t len;
+    size_t consumed;
+
+    len = recv(c->sock, &c->request[c->request_len], sizeof(c->request) - c->request_len, 0);
+    if (len < 1) {
+        if (len < 0 && is_transient_error()) {
+            return;
+        }
+        return remove_rtsp_client(r, c);
+    }
+    c->last_communication = gettime();
+    c->request_len += len;
+
+    while (c->request_len > 0 && !c->closing && (consumed = process_rtsp(r, c)) > 0) {
+        memmove(c->request, &c->request[consumed], c->request_len - consumed);
+        c->request_len -= consumed;
+    }
+
+    if (c->request_len == sizeof(c->request) && !c->closing) {
+        log_it(LOG_INFO, "Closing RTSP connection after an oversized request.");
+        remove_rtsp_client(r, c);
+    }
+}
+
+// Handles the request or interleaved packet at the start of the buffer.
+// Returns the bytes it took up, or 0 if it is not complete yet or the
+// connection is to be closed.
+static size_t process_rtsp(struct rtsp_server *r, struct rtsp_client *c) {
+    char method[16], url[1024], value[16];
+    char *end, *value_end;
+    size_t len;
+    long body;
+
+    // Interleaved RTCP receiver reports, which only matter as a sign of life
+    if (c->request[0] == '$') {
+        if (c->request_len < 4) {
+            return 0;
+        }
+        len = 4 + (((unsigned char) c->request[2] << 8) | (unsigned char) c->request[3]);
+        return (c->request_len >= len) ? len : 0;
+    }
+
+    if ((end = memmem(c->request, c->request_len, "\r\n\r\n", 4)) == NULL) {
+        return 0;
+    }
+    *end = '\0';
+    len = end + 4 - c->request;
+
+    // Bodies, e.g. of SET_PARAMETER, are skipped. One that cannot be told
+    // apart from the next request, or could never fit, ends the connection.
+    if (rtsp_header(c->request, "Content-Length", value, sizeof(value))) {
+        body = strtol(value, &value_end, 10);
+        if (value_end == value || *value_end != '\0' || body < 0 || (size_t) body > sizeof(c->request) - len) {
+            log_it(LOG_INFO, "Closing RTSP connection after a bad Content-Length.");
+            rtsp_respond(c, "400 Bad Request", 0, "\r\n");
+            c->closing = 1;
+            return 0;
+        }
+        len += body;
+        if (c->request_len < len) {
+            *end = '\r';
+            return 0;
+        }
+    }
+
+    if (sscanf(c->request, "%15s %1023s RTSP/1.0", method, url) != 2) {
+        rtsp_respond(c, "400 Bad Request", 0, "\r\n");
+        return len;
+    }
+
+    handle_rtsp_request(r, c, method, url, c->request);
+    return len;
+}
+
+static void handle_rtsp_request(struct rtsp_server *r, struct rtsp_client *c, const char *method, const char *url, const char *headers) {
+    char value[256], sdp[512], local[INET_ADDRSTRLEN], cbuf[INET_ADDRSTRLEN];
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int cseq = 0, camera;
+
+    if (rtsp_header(headers, "CSeq", value, sizeof(value))) {
+        cseq = atoi(value);
+    }
+
+    log_itf(LOG_INFO, "RTSP client at %s requested %s %s.", inet_ntop(AF_INET, &c->addr.sin_addr, cbuf, sizeof(cbuf)), method, url);
+
+    if (strcmp(method, "OPTIONS") == 0) {
+        return rtsp_respond(c, "200 OK", cseq, "Public: " RTSP_PUBLIC "\r\n\r\n");
+    }
+
+    if (!check_http_auth(rtsp_header(headers, "Authorization", value, sizeof(value)) ? value : NULL, r->auth)) {
+        return rtsp_respond(c, "401 Unauthorized", cseq, "WWW-Authenticate: Basic realm=\"Hawkeye\"\r\n\r\n");
+    }
+
+    if (strcmp(method, "DESCRIBE") == 0) {
+        if (find_stream(r, url, &camera) == NULL) {
+            return rtsp_respond(c, "404 Not Found", cseq, "\r\n");
+        }
+
+        getsockname(c->sock, (struct sockaddr *) &addr, &addr_len);
+        inet_ntop(AF_INET, &addr.sin_addr, local, sizeof(local));
+
+        snprintf(sdp, sizeof(sdp),
+            "v=0\r\n"
+            "o=- %u 1 IN IP4 %s\r\n"
+            "s=hawkeye\r\n"
+            "c=IN IP4 0.0.0.0\r\n"
+            "t=0 0\r\n"
+            "m=video 0 RTP/AVP %d\r\n"
+            "a=control:trackID=0\r\n",
+            (unsigned int) gettime(), local, RTP_PAYLOAD_TYPE_JPEG);
+
+        return rtsp_respond(c, "200 OK", cseq, "Content-Base: %s/\r\nContent-Type: application/sdp\r\nContent-Length: %d\r\n\r\n%s", url, (int) strlen(sdp), sdp);
+    }
+
+    if (strcmp(method, "SETUP") == 0) {
+        return rtsp_setup(r, c, cseq, url, headers);
+    }
+
+    if (strcmp(method, "PLAY") == 0 || strcmp(method, "PAUSE") == 0 || strcmp(method, "TEARDOWN") == 0) {
+        if (c->session == 0 || !rtsp_header(headers, "Session", value, sizeof(value)) || strtoul(value, NULL, 16) != c->session) {
+            return rtsp_respond(c, "454 Session Not Found", cseq, "\r\n");
+        }
+
+        if (method[0] == 'P' && method[1] == 'L') {
+            return rtsp_play(r, c, cseq, url);
+        }
+
+        rtsp_stop(r, c);
+        rtsp_respond(c, "200 OK", cseq, "Session: %08X\r\n\r\n", c->session);
+        if (method[0] == 'T') {
+            c->session = 0;
+        }
+        return;
+    }
+
+    // Keep-alives
+    if (strcmp(method, "GET_PARAMETER") == 0 || strcmp(method, "SET_PARAMETER") == 0) {
+        return rtsp_respond(c, "200 OK", cseq, "\r\n");
+    }
+
+    rtsp_respond(c, "501 Not Implemented", cseq, "\r\n");
+}
+
+// Copies the value of a header, matched case-insensitively, into value
+static short rtsp_header(const char *headers, const char *name, char *value, size_t value_len) {
+    const char *line, *end;
+    size_t len = strlen(name);
+
+    for (line = strstr(headers, "\r\n"); line != NULL; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, len) != 0 || line[len] != ':') {
+            continue;
+        }
+
+        for (line += len + 1; is_lws(*line); line++) {}
+        if ((end = strstr(line, "\r\n")) == NULL) {
+            end = line + strlen(line);
+        }
+
+        snprintf(value, value_len, "%.*s", (int) (end - line), line);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Maps rtsp://host:port/stream/N or /mosaic, with or without a track, to a
+// frame buffer. camera is the index of the group it multicasts to.
+static struct frame_buffer *find_stream(struct rtsp_server *r, const char *url, int *camera) {
+    const char *path = url;
+    char *end;
+    long index;
+
+    if (strncmp(path, "rtsp://", strlen("rtsp://")) == 0 && (path = strchr(path + strlen("rtsp://"), '/')) == NULL) {
+        return NULL;
+    }
+
+    if (strncmp(path, "/mosaic", strlen("/mosaic")) == 0 && r->mosaic != NULL) {
+        *camera = r->fbs->count;
+        return r->mosaic;
+    }
+
+    if (strncmp(path, "/stream/", strlen("/stream/")) != 0) {
+        return NULL;
+    }
+
+    index = strtol(path + strlen("/stream/"), &end, 10);
+    if (end == path + strlen("/stream/") || index < 0 || index >= r->fbs->count || r->fbs->buffers[index].h264) {
+        return NULL;
+    }
+
+    *camera = index;
+    return &r->fbs->buffers[index];
+}
+
+static void rtsp_setup(struct rtsp_server *r, struct rtsp_client *c, int cseq, const char *url, const char *headers) {
+    char transport[256], destination[INET_ADDRSTRLEN];
+    struct frame_buffer *fb;
+    const char *p;
+    int camera, port_a, port_b;
+
+    if ((fb = find_stream(r, url, &camera)) == NULL) {
+        return rtsp_respond(c, "404 Not Found", cseq, "\r\n");
+    }
+
+    if (!rtsp_header(headers, "Transport", transport, sizeof(transport))) {
+        return rtsp_respond(c, "461 Unsupported Transport", cseq, "\r\n");
+    }
+
+    rtsp_stop(r, c);
+
+    if (strstr(transport, "RTP/AVP/TCP") != NULL) {
+        c->transport = RTSP_TRANSPORT_TCP;
+        c->rtp_channel = 0;
+        c->rtcp_channel = 1;
+        if ((p = strstr(transport, "interleaved=")) != NULL && sscanf(p, "interleaved=%d-%d", &port_a, &port_b) == 2) {
+            c->rtp_channel = port_a;
+            c->rtcp_channel = port_b;
+        }
+    }
+    else if (strstr(transport, "multicast") != NULL) {
+        if (r->groups == NULL) {
+            return rtsp_respond(c, "461 Unsupported Transport", cseq, "\r\n");
+        }
+        c->transport = RTSP_TRANSPORT_MULTICAST;
+    }
+    else {
+        if ((p = strstr(transport, "client_port=")) == NULL || sscanf(p, "client_port=%d-%d", &port_a, &port_b) != 2) {
+            return rtsp_respond(c, "461 Unsupported Transport", cseq, "\r\n");
+        }
+
+        c->transport = RTSP_TRANSPORT_UDP;
+        c->rtp_addr = c->addr;
+        c->rtp_addr.sin_port = htons(port_a);
+        c->rtcp_addr = c->addr;
+        c->rtcp_addr.sin_port = htons(port_b);
+    }
+
+    c->fb = fb;
+    c->camera = camera;
+    rtp_stream_init(&c->rtp);
+    while (c->session == 0) {
+        RAND_bytes((unsigned char *) &c->session, sizeof(c->session));
+    }
+
+    switch (c->transport) {
+        case RTSP_TRANSPORT_TCP:
+            return rtsp_respond(c, "200 OK", cseq, "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d;ssrc=%08X\r\nSession: %08X;timeout=%d\r\n\r\n",
+                c->rtp_channel, c->rtcp_channel, c->rtp.ssrc, c->session, RTSP_SESSION_TIMEOUT);
+        case RTSP_TRANSPORT_MULTICAST:
+            inet_ntop(AF_INET, &r->groups[camera].rtp_addr.sin_addr, destination, sizeof(destination));
+            return rtsp_respond(c, "200 OK", cseq, "Transport: RTP/AVP;multicast;destination=%s;port=%d-%d;ttl=%d\r\nSession: %08X;timeout=%d\r\n\r\n",
+                destination, ntohs(r->groups[camera].rtp_addr.sin_port), ntohs(r->groups[camera].rtcp_addr.sin_port), RTSP_MULTICAST_TTL, c->session, RTSP_SESSION_TIMEOUT);
+        default:
+            return rtsp_respond(c, "200 OK", cseq, "Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d;ssrc=%08X\r\nSession: %08X;timeout=%d\r\n\r\n",
+                port_a, port_b, r->rtp_port, r->rtp_port + 1, c->rtp.ssrc, c->session, RTSP_SESSION_TIMEOUT);
+    }
+}
+
+static void rtsp_play(struct rtsp_server *r, struct rtsp_client *c, int cseq, const char *url) {
+    struct rtp_stream *st = (c->transport == RTSP_TRANSPORT_MULTICAST) ? &r->groups[c->camera].rtp : &c->rtp;
+
+    if (!c->playing) {
+        c->playing = 1;
+        c->fb->stream_clients++;
+        if (c->transport == RTSP_TRANSPORT_MULTICAST) {
+            r->groups[c->camera].viewers++;
+        }
+    }
+
+    rtsp_respond(c, "200 OK", cseq, "Session: %08X\r\nRange: npt=0.000-\r\nRTP-Info: url=%s;seq=%u;rtptime=%u\r\n\r\n",
+        c->session, url, st->seq, rtp_timestamp(gettime()));
+}
+
+static void rtsp_stop(struct rtsp_server *r, struct rtsp_client *c) {
+    if (!c->playing) {
+        return;
+    }
+
+    c->playing = 0;
+    c->fb->stream_clients--;
+    if (c->transport == RTSP_TRANSPORT_MULTICAST) {
+        r->groups[c->camera].viewers--;
+    }
+}
+
+// Queues a response. fmt supplies any further headers, the blank line and
+// the body.
+static void rtsp_respond(struct rtsp_client *c, const char *status, int cseq, const char *fmt, ...) {
+    char buf[RTSP_MAX_REQUEST_SIZE];
+    va_list args;
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "RTSP/1.0 %s\r\nCSeq: %d\r\nServer: hawkeye\r\n", status, cseq);
+
+    va_start(args, fmt);
+    len += vsnprintf(&buf[len], sizeof(buf) - len, fmt, args);
+    va_end(args);
+
+    rtsp_queue(c, buf, min((size_t) len, sizeof(buf) - 1));
+}
+
+static void rtsp_queue(struct rtsp_client *c, const void *data, size_t len) {
+    size_t need;
+
+    if (c->out_pos == c->out_len) {
+        c->out_pos = c->out_len = 0;
+    }
+
+    need = c->out_len + len;
+    if (need > c->out_size) {
+        c->out_size = max(need, c->out_size * 2);
+        c->out = realloc(c->out, c->out_size);
+    }
+
+    memcpy(&c->out[c->out_len], data, len);
+    c->out_len += len;
+}
+
+static void rtsp_write(struct rtsp_server *r, struct rtsp_client *c) {
+    ssize_t len;
+
+    if (c->out_pos < c->out_len) {
+        if ((len = send(c->sock, &c->out[c->out_pos], c->out_len - c->out_pos, MSG_NOSIGNAL)) < 0) {
+            if (is_transient_error()) {
+                return;
+            }
+            return remove_rtsp_client(r, c);
+        }
+
+        c->out_pos += len;
+    }
+
+    if (c->closing && c->out_pos == c->out_len) {
+        return remove_rtsp_client(r, c);
+    }
+}
+
+static void send_rtp(void *arg, const unsigned char *packet, size_t len) {
+    struct rtsp_target *t = arg;
+    unsigned char header[4];
+
+    if (t->c != NULL) {
+        header[0] = '$';
+        header[1] = t->c->rtp_channel;
+        header[2] = len >> 8;
+        header[3] = len & 0xff;
+        rtsp_queue(t->c, header, sizeof(header));
+        rtsp_queue(t->c, packet, len);
+        return;
+    }
+
+    // Dropped if the socket buffer is full, RTP copes with loss
+    sendto(t->r->rtp_sock, packet, len, 0, (struct sockaddr *) t->rtp_addr, sizeof(struct sockaddr_in));
+}
+
+static void send_rtcp(struct rtsp_target *t, const unsigned char *packet, size_t len) {
+    unsigned char header[4];
+
+    if (t->c != NULL) {
+        header[0] = '$';
+        header[1] = t->c->rtcp_channel;
+        header[2] = len >> 8;
+        header[3] = len & 0xff;
+        rtsp_queue(t->c, header, sizeof(header));
+        rtsp_queue(t->c, packet, len);
+        return;
+    }
+
+    sendto(t->r->rtcp_sock, packet, len, 0, (struct sockaddr *) t->rtcp_addr, sizeof(struct sockaddr_in));
+}
+
+// Sends the newest frame of fb if it has not been sent on this stream yet.
+// Frames that came and went in between are skipped.
+static void send_newest(struct frame_buffer *fb, struct rtp_stream *st, struct rtsp_target *t, double now) {
+    unsigned char report[RTCP_MAX_PACKET_SIZE];
+    struct rtp_jpeg j;
+    struct frame *f;
+
+    if (fb->current_frame <= st->last_frame || (f = get_frame(fb, fb->current_frame)) == NULL) {
+        return;
+    }
+    st->last_frame = fb->current_frame;
+
+    if (rtp_parse_jpeg((unsigned char *) &f->data[strlen(FRAME_HEADER)], f->data_len - (strlen(FRAME_HEADER) + strlen(FRAME_FOOTER)), &j) < 0) {
+        log_it(LOG_DEBUG, "Frame cannot be sent over RTP, it is not a baseline YUV 4:2:x JPEG.");
+        return;
+    }
+
+    rtp_send_jpeg(st, &j, rtp_timestamp(f->captured_at), send_rtp, t);
+
+    if (now >= st->rtcp_at) {
+        send_rtcp(t, report, rtcp_sender_report(st, report, now));
+        st->rtcp_at = now + RTCP_INTERVAL;
+    }
+}
+
+static void send_frames(struct rtsp_server *r) {
+    struct rtsp_client *c;
+    struct rtsp_target t;
+    double now = gettime();
+    int i;
+
+    memset(&t, 0, sizeof(t));
+    t.r = r;
+
+    for (i = 0; i < FD_SETSIZE; i++) {
+        if ((c = r->clients[i]) == NULL || !c->playing || c->transport == RTSP_TRANSPORT_MULTICAST) {
+            continue;
+        }
+
+        if (c->transport == RTSP_TRANSPORT_TCP) {
+            // Behind already, so wait and then send whatever is newest
+            if (c->out_len - c->out_pos > RTSP_MAX_QUEUED) {
+                continue;
+            }
+            t.c = c;
+        }
+        else {
+            t.c = NULL;
+            t.rtp_addr = &c->rtp_addr;
+            t.rtcp_addr = &c->rtcp_addr;
+        }
+
+        send_newest(c->fb, &c->rtp, &t, now);
+    }
+
+    // One send per frame for however many multicast viewers there are
+    for (i = 0; r->groups != NULL && i <= r->fbs->count; i++) {
+        if (r->groups[i].viewers > 0) {
+            t.c = NULL;
+            t.rtp_addr = &r->groups[i].rtp_addr;
+            t.rtcp_addr = &r->groups[i].rtcp_addr;
+            send_newest(i < r->fbs->count ? &r->fbs->buffers[i] : r->mosaic, &r->groups[i].rtp, &t, now);
+        }
+    }
+}
+
+// Receiver reports keep UDP sessions alive
+static void read_rtcp(struct rtsp_server *r) {
+    unsigned char buf[1500];
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    struct rtsp_client *c;
+    int i;
+
+    while (recvfrom(r->rtcp_sock, buf, sizeof(buf), 0, (struct sockaddr *) &addr, &addr_len) >= 0) {
+        for (i = 0; i < FD_SETSIZE; i++) {
+            if ((c = r->clients[i]) != NULL && c->session != 0 && c->addr.sin_addr.s_addr == addr.sin_addr.s_addr) {
+                c->last_communication = gettime();
+            }
+        }
+        addr_len = sizeof(addr);
+    }
+}
+
+// multicast is the group address to use, or "" to not offer multicast.
+// Camera N multicasts to rtp_port + 2 + 2N, the mosaic after the last camera.
+struct rtsp_server *create_rtsp_server(const char *host, unsigned short port, unsigned short rtp_port, const char *multicast, const char *auth, struct frame_buffers *fbs, struct frame_buffer *mosaic) {
+    struct rtsp_server *r = calloc(1, sizeof(struct rtsp_server));
+    unsigned char ttl = RTSP_MULTICAST_TTL;
+    struct in_addr group;
+    int i;
+
+    r->fbs = fbs;
+    r->mosaic = mosaic;
+    r->rtp_port = rtp_port;
+    r->auth = strlen(auth) ? base64_encode((unsigned char *) auth) : NULL;
+
+    if ((r->sock = open_socket(host, port, SOCK_STREAM)) < 0) {
+        panic("Could not bind to RTSP socket.");
+    }
+
+    if ((r->rtp_sock = open_socket(host, rtp_port, SOCK_DGRAM)) < 0 || (r->rtcp_sock = open_socket(host, rtp_port + 1, SOCK_DGRAM)) < 0) {
+        panic("Could not bind to RTP ports.");
+    }
+
+    log_itf(LOG_INFO, "RTSP listening on port %d, RTP on ports %d-%d.", port, rtp_port, rtp_port + 1);
+
+    if (strlen(multicast)) {
+        if (inet_pton(AF_INET, multicast, &group) != 1 || !IN_MULTICAST(ntohl(group.s_addr))) {
+            user_panic("%s is not an IPv4 multicast address.", multicast);
+        }
+
+        setsockopt(r->rtp_sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        setsockopt(r->rtcp_sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+        r->groups = calloc(fbs->count + 1, sizeof(struct rtsp_group));
+        for (i = 0; i <= fbs->count; i++) {
+            r->groups[i].rtp_addr.sin_family = AF_INET;
+            r->groups[i].rtp_addr.sin_addr = group;
+            r->groups[i].rtp_addr.sin_port = htons(rtp_port + 2 + 2 * i);
+            r->groups[i].rtcp_addr = r->groups[i].rtp_addr;
+            r->groups[i].rtcp_addr.sin_port = htons(rtp_port + 3 + 2 * i);
+            rtp_stream_init(&r->groups[i].rtp);
+        }
+    }
+
+    return r;
+}
+
+// Does whatever can be done without blocking: accepts clients, answers
+// requests and sends the newest frames to those that are playing
+void rtsp_serve(struct rtsp_server *r) {
+    fd_set read_set, write_set;
+    struct timeval timeout = {0, 0};
+    struct rtsp_client *c;
+    int sock, highest_sock_num = max(max(r->sock, r->rtp_sock), r->rtcp_sock);
+    double now = gettime();
+
+    FD_ZERO(&read_set);
+    FD_ZERO(&write_set);
+    FD_SET(r->sock, &read_set);
+    FD_SET(r->rtcp_sock, &read_set);
+
+    for (sock = 0; sock < FD_SETSIZE; sock++) {
+        if ((c = r->clients[sock]) != NULL) {
+            FD_SET(sock, &read_set);
+            if (c->out_pos < c->out_len) {
+                FD_SET(sock, &write_set);
+            }
+            highest_sock_num = max(highest_sock_num, sock);
+        }
+    }
+
+    if (select(highest_sock_num + 1, &read_set, &write_set, NULL, &timeout) < 0) {
+        if (errno == EINTR) {
+            return;
+        }
+        panic("select() failed");
+    }
+
+    if (FD_ISSET(r->sock, &read_set)) {
+        accept_rtsp_clients(r);
+    }
+
+    if (FD_ISSET(r->rtcp_sock, &read_set)) {
+        read_rtcp(r);
+    }
+
+    for (sock = 0; sock < FD_SETSIZE; sock++) {
+        if ((c = r->clients[sock]) != NULL && FD_ISSET(sock, &read_set)) {
+            read_rtsp(r, c);
+        }
+    }
+
+    send_frames(r);
+
+    for (sock = 0; sock < FD_SETSIZE; sock++) {
+        if ((c = r->clients[sock]) == NULL) {
+            continue;
+        }
+
+        rtsp_write(r, c);
+
+        // Interleaved sessions live as long as their connection
+        if ((c = r->clients[sock]) != NULL && !(c->playing && c->transport == RTSP_TRANSPORT_TCP) && now - c->last_communication > RTSP_SESSION_TIMEOUT) {
+            log_it(LOG_INFO, "RTSP session timed out.");
+            remove_rtsp_client(r, c);
+        }
+    }
+}
+
+// What rtsp_serve() would wait for, for the main loop to wait on along with
+// the cameras. Frames go out when the cameras have them. Returns the number
+// of pollfds filled in, at most RTSP_MAX_POLLFDS.
+int rtsp_pollfds(struct rtsp_server *r, struct pollfd *pfds) {
+    struct rtsp_client *c;
+    int sock, n = 0;
+
+    pfds[n].fd = r->sock;
+    pfds[n++].events = POLLIN;
+    pfds[n].fd = r->rtcp_sock;
+    pfds[n++].events = POLLIN;
+
+    for (sock = 0; sock < FD_SETSIZE; sock++) {
+        if ((c = r->clients[sock]) != NULL) {
+            pfds[n].fd = sock;
+            pfds[n++].events = POLLIN | (c->out_pos < c->out_len ? POLLOUT : 0);
+        }
+    }
+
+    return n;
+}
+
+void destroy_rtsp_server(struct rtsp_server *r) {
+    int i;
+
+    for (i = 0; i < FD_SETSIZE; i++) {
+        if (r->clients[i] != NULL) {
+            remove_rtsp_client(r, r->clients[i]);
+        }
+    }
+
+    close(r->sock);
+    close(r->rtp_sock);
+    close(r->rtcp_sock);
+    free(r->groups);
+    free(r->auth);
+    free(r);
+}
@@ -0,0 +1,80 @@
+#ifndef __RTSP_H
+#define __RTSP_H
+
+#include <sys/select.h>
+#include <poll.h>
+#include <netinet/in.h>
+
+#include "frames.h"
+#include "rtp.h"
+
+#define RTSP_MAX_REQUEST_SIZE 4096
+#define RTSP_BACKLOG 16
+#define RTSP_SESSION_TIMEOUT 60 // Seconds a UDP session lives without hearing from the client
+#define RTSP_MAX_QUEUED (512 * 1024) // Interleaved clients skip frames while more than this is queued
+#define RTSP_MULTICAST_TTL 1 // Multicast stays on the local network
+#define RTCP_INTERVAL 5.0 // Seconds between sender reports
+#define RTSP_MAX_POLLFDS (FD_SETSIZE + 2) // See rtsp_pollfds()
+
+#define RTSP_TRANSPORT_UDP 0
+#define RTSP_TRANSPORT_TCP 1 // Interleaved in the RTSP connection
+#define RTSP_TRANSPORT_MULTICAST 2
+
+#define RTSP_PUBLIC "OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER, SET_PARAMETER"
+
+// One RTSP connection. It may set up a single session, i.e. one camera.
+struct rtsp_client {
+    int sock;
+    struct sockaddr_in addr;
+    double last_communication;
+
+    char request[RTSP_MAX_REQUEST_SIZE];
+    size_t request_len;
+
+    // Responses, and the packets of interleaved sessions
+    unsigned char *out;
+    size_t out_size;
+    size_t out_len;
+    size_t out_pos;
+    short closing;                  // Closed once out has been sent, nothing more is read
+
+    unsigned int session;           // Session id, 0 before SETUP
+    struct frame_buffer *fb;
+    int camera;                     // Index of fb, fbs->count for the mosaic
+    int transport;                  // RTSP_TRANSPORT_*
+    short playing;
+    struct sockaddr_in rtp_addr;    // Where UDP unicast packets go
+    struct sockaddr_in rtcp_addr;
+    int rtp_channel;                // Interleaved channels
+    int rtcp_channel;
+    struct rtp_stream rtp;
+};
+
+// Multicast of one camera, shared by every client that asks for it
+struct rtsp_group {
+    struct sockaddr_in rtp_addr;
+    struct sockaddr_in rtcp_addr;
+    int viewers;                    // Sessions playing it
+    struct rtp_stream rtp;
+};
+
+struct rtsp_server {
+    int sock;
+    int rtp_sock;                   // UDP, bound to rtp-port
+    int rtcp_sock;                  // UDP, bound to rtp-port + 1
+    unsigned short rtp_port;
+
+    struct rtsp_client *clients[FD_SETSIZE];
+    struct rtsp_group *groups;      // One per camera, then the mosaic. NULL without multicast
+
+    struct frame_buffers *fbs;
+    struct frame_buffer *mosaic;
+    char *auth;
+};
+
+struct rtsp_server *create_rtsp_server(const char *host, unsigned short port, unsigned short rtp_port, const char *multicast, const char *auth, struct frame_buffers *fbs, struct frame_buffer *mosaic);
+void rtsp_serve(struct rtsp_server *r);
+int rtsp_pollfds(struct rtsp_server *r, struct pollfd *pfds);
+void destroy_rtsp_server(struct rtsp_server *r);
+
+#endif
@@ -1,13 +1,28 @@
 
+#include <string.h>
 #include "openssl/ssl.h"
 #include "openssl/err.h"
 
 #include "memory.h"
+#include "logger.h"
+#include "http2.h"
 #include "security.h"
 
 #define ssl_panic(err) user_panic("SSL error: \"%s\": %s\n", err, ERR_error_string(ERR_get_error(), NULL));
 
-SSL_CTX* ssl_create_ctx() {
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg);
+
+// Picks the first of our protocols that the client offers. Clients that
+// offer none of them carry on without ALPN, i.e. with HTTP/1.1.
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg) {
+    if (SSL_select_next_proto((unsigned char **) out, outlen, (const unsigned char *) SSL_ALPN_PROTOCOLS, strlen(SSL_ALPN_PROTOCOLS), in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
+    return SSL_TLSEXT_ERR_OK;
+}
+
+SSL_CTX* ssl_create_ctx(short enable_ktls, short enable_http2) {
     SSL_CTX *ctx;
 
     OpenSSL_add_all_algorithms();
@@ -19,11 +34,73 @@ SSL_CTX* ssl_create_ctx() {
     }
 
     SSL_CTX_set_cipher_list(ctx, SSL_CIPHERS);
-    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    // Let reconnecting clients resume their session instead of doing a full
+    // handshake, either from the server side cache or from a session ticket.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, SSL_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, SSL_SESSION_TIMEOUT);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *) SSL_SESSION_ID_CONTEXT, strlen(SSL_SESSION_ID_CONTEXT));
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+
+    if (enable_ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+        log_it(LOG_WARNING, "Kernel TLS was requested but this OpenSSL does not support it.");
+#endif
+    }
+
+    if (enable_http2) {
+        SSL_CTX_set_alpn_select_cb(ctx, select_alpn, NULL);
+    }
 
     return ctx;
 }
 
+// For connections we make ourselves, e.g. to an ingest server. The server's
+// certificate is checked against the system's CAs.
+SSL_CTX* ssl_create_client_ctx() {
+    SSL_CTX *ctx;
+
+    ctx = SSL_CTX_new(TLS_client_method());
+
+    if (ctx == NULL) {
+        ssl_panic("Could not initialize SSL_CTX");
+    }
+
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+    if (SSL_CTX_set_default_verify_paths(ctx) != 1) {
+        log_it(LOG_WARNING, "Could not load the system's CA certificates.");
+    }
+
+    return ctx;
+}
+
+// Returns 1 if the client agreed to speak HTTP/2. Only meaningful once the
+// handshake is done.
+short ssl_http2_negotiated(SSL *ssl) {
+    const unsigned char *proto;
+    unsigned int len;
+
+    SSL_get0_alpn_selected(ssl, &proto, &len);
+
+    return len == strlen(H2_ALPN) && memcmp(proto, H2_ALPN, len) == 0;
+}
+
+// Returns 1 if records sent on this connection are encrypted by the kernel.
+// Only meaningful once the handshake is done.
+short ssl_ktls_send_enabled(SSL *ssl) {
+#ifdef SSL_OP_ENABLE_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+#else
+    return 0;
+#endif
+}
+
 void ssl_load_certs(SSL_CTX* ctx, const char *cert_file, char *key_file) {
     if (SSL_CTX_use_certificate_file(ctx, cert_file, SSL_FILETYPE_PEM) <= 0) {
         ssl_panic("Could not load public certificate");
@@ -5,7 +5,17 @@
 
 #define SSL_CIPHERS "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:DHE-RSA-AES128-GCM-SHA256:DHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-AES128-SHA256:ECDHE-RSA-AES128-SHA256:ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES256-SHA384:ECDHE-RSA-AES128-SHA:ECDHE-ECDSA-AES256-SHA384:ECDHE-ECDSA-AES256-SHA:ECDHE-RSA-AES256-SHA:DHE-RSA-AES128-SHA256:DHE-RSA-AES128-SHA:DHE-RSA-AES256-SHA256:DHE-RSA-AES256-SHA:ECDHE-ECDSA-DES-CBC3-SHA:ECDHE-RSA-DES-CBC3-SHA:EDH-RSA-DES-CBC3-SHA:AES128-GCM-SHA256:AES256-GCM-SHA384:AES128-SHA256:AES256-SHA256:AES128-SHA:AES256-SHA:DES-CBC3-SHA:!DSS"
 
-SSL_CTX* ssl_create_ctx();
+#define SSL_SESSION_CACHE_SIZE 1024
+#define SSL_SESSION_TIMEOUT 3600 // Seconds a session may be resumed for
+#define SSL_SESSION_ID_CONTEXT "hawkeye"
+
+// Protocols offered through ALPN when HTTP/2 is enabled, in order of preference
+#define SSL_ALPN_PROTOCOLS "\x02h2\x08http/1.1"
+
+SSL_CTX* ssl_create_ctx(short enable_ktls, short enable_http2);
+SSL_CTX* ssl_create_client_ctx();
 void ssl_load_certs(SSL_CTX* ctx, const char *cert_file, char *key_file);
+short ssl_ktls_send_enabled(SSL *ssl);
+short ssl_http2_negotiated(SSL *ssl);
 
 #endif
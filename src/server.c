@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // accept4()
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -10,7 +11,14 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <limits.h>
+#include <stdint.h>
 #include <sys/stat.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
 #include "openssl/ssl.h"
 #include "openssl/err.h"
 
@@ -20,9 +28,12 @@
 #include "utils.h"
 #include "http.h"
 #include "security.h"
+#include "push.h"
 
 #include "server.h"
 
+#define is_transient_error() (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+
 #define serrchk(err) {\
     if (errno == EINTR) {\
         return;\
@@ -33,15 +44,73 @@
 }
 
 static char* ntop(struct sockaddr_storage *addr, char *cbuf, size_t cbuf_len);
-static int open_sock(const char *hostname, unsigned short port, int family, int socktype);
+static int open_sock(const char *hostname, unsigned short port, int family, int socktype, int backlog);
+static int set_nonblocking(int sock);
+static int ssl_set_errno(SSL *ssl, int ret);
+static short same_address(struct sockaddr_storage *a, struct sockaddr_storage *b);
+static short admit_client(struct server *s, int sock, struct sockaddr_storage *addr);
+static void accept_clients(struct server *s, int listen_sock, struct frame_buffers *fbs);
 static void add_client(struct server *s, int sock, struct sockaddr_storage *addr, struct frame_buffers *fbs);
+static void continue_handshake(struct server *s, struct client *c);
 static void remove_client(struct server *s, struct client *c);
 static void reset_client(struct client *c);
-static size_t client_read(struct client *c, void *buf, const size_t len);
+static void finish_response(struct server *s, struct client *c, struct frame_buffers *fbs);
+static ssize_t client_read(struct client *c, void *buf, const size_t len);
+static ssize_t client_sendfile(struct client *c, int fd, off_t *offset, size_t len);
 static ssize_t client_write(struct client *c, const void *buf, const size_t len);
 static void read_request(struct server *s, struct client *c, struct frame_buffers *fbs);
+static void process_request(struct server *s, struct client *c, struct frame_buffers *fbs);
+static void set_client_response(struct client *c, int request, char *response);
+static void set_client_responsef(struct client *c, int request, const char *fmt, ...);
+static void set_client_response_data(struct client *c, int request, const char *head, const void *body, size_t len);
 static void handle_request(struct server *s, struct client *c, struct frame_buffers *fbs);
-static void respond_to_client(struct server *s, struct client *c);
+static void respond_to_client(struct server *s, struct client *c, struct frame_buffers *fbs);
+static void start_still(struct client *c, struct frame_buffer *fb);
+static void parse_stream_options(struct server *s, struct client *c, struct http_request *req);
+static short parse_quality(const char *value, short *adaptive);
+static void set_target_rendition(struct client *c, short target);
+static void start_stream(struct server *s, struct client *c, struct frame_buffer *fb, struct http_request *req);
+static short resuming(struct frame_buffer *fb);
+static void ws_read(struct server *s, struct client *c);
+static void ws_handle_message(struct server *s, struct client *c, struct ws_frame *f, unsigned char *payload);
+static void ws_set_options(struct client *c, const unsigned char *payload, size_t len);
+static void ws_queue(struct client *c, int opcode, const void *payload, size_t len, struct ws_meta *meta);
+static void ws_respond(struct server *s, struct client *c);
+static short start_mux(struct server *s, struct client *c, struct frame_buffers *fbs, struct http_request *req);
+static void mux_respond(struct server *s, struct client *c);
+static void start_mp4(struct client *c, struct frame_buffer *fb);
+static long find_keyframe(struct frame_buffer *fb, long after);
+static void mp4_respond(struct server *s, struct client *c);
+static void handle_hls_request(struct client *c, struct frame_buffer *fb, const char *name);
+static void hls_respond(struct server *s, struct client *c, struct frame_buffers *fbs);
+static void h2_start(struct client *c);
+static void h2_free(struct client *c);
+static void h2_read(struct server *s, struct client *c, struct frame_buffers *fbs);
+static uint32_t h2_handle_frame(struct server *s, struct client *c, struct frame_buffers *fbs, struct h2_frame *f, unsigned char *payload);
+static uint32_t h2_end_headers(struct server *s, struct client *c, struct frame_buffers *fbs);
+static void h2_on_header(void *arg, const char *name, const char *value);
+static void h2_handle_request(struct server *s, struct client *c, struct frame_buffers *fbs, uint32_t id, struct h2_request *req);
+static void h2_add_header(struct h2_stream *st, const char *name, const char *value);
+static void h2_set_response(struct h2_stream *st, const char *status, const char *content_type, const void *body, size_t len);
+static void h2_start_stream(struct h2_stream *st, struct frame_buffer *fb, const char *query_string);
+static struct h2_stream *h2_find_stream(struct h2_session *h2, uint32_t id);
+static void h2_close_stream(struct h2_session *h2, int n);
+static void h2_queue(struct h2_session *h2, int type, int flags, uint32_t id, const void *payload, size_t len);
+static void h2_goaway(struct h2_session *h2, uint32_t error);
+static short h2_next_frame(struct client *c, struct h2_stream *st, double now);
+static void h2_fill(struct client *c);
+static void h2_respond(struct server *s, struct client *c);
+static short find_static_file(struct server *s, const char *path, char *filename);
+static void enable_low_latency(struct client *c);
+static int unsent_bytes(struct client *c);
+static void adapt_rendition(struct client *c, double now);
+static void select_next_frame(struct client *c, double now);
+static size_t egress_allowance(struct server *s, struct client *c, size_t want);
+static void egress_consume(struct server *s, struct client *c, size_t sent);
+static size_t send_allowance(struct server *s, struct client *c, size_t want);
+static ssize_t client_send(struct server *s, struct client *c, const void *buf, const size_t len);
+static void appendf(char **buf, size_t *len, size_t *size, const char *fmt, ...);
+static char *build_stats(struct server *s, struct frame_buffers *fbs);
 
 static char* ntop(struct sockaddr_storage *addr, char *cbuf, size_t cbuf_len) {
     switch (addr->ss_family) {
@@ -57,7 +126,7 @@ static char* ntop(struct sockaddr_storage *addr, char *cbuf, size_t cbuf_len) {
     }
 }
 
-static int open_sock(const char *hostname, unsigned short port, int family, int socktype) {
+static int open_sock(const char *hostname, unsigned short port, int family, int socktype, int backlog) {
     struct addrinfo hints, *res, *ressave;
     int n, sock;
     int sockoptval = 1;
@@ -112,9 +181,14 @@ static int open_sock(const char *hostname, unsigned short port, int family, int
     }
 
     if (sock >= 0) {
-        if (listen(sock, MAX_SERVER_SOCKET_BACKLOG) < 0) {
+        if (listen(sock, backlog) < 0) {
             panic("listen() failed.");
         }
+
+        // Lets serve_clients() accept until the backlog is drained
+        if (set_nonblocking(sock) < 0) {
+            panic("Could not make listening socket non-blocking.");
+        }
     }
 
     freeaddrinfo(ressave);
@@ -122,24 +196,266 @@ static int open_sock(const char *hostname, unsigned short port, int family, int
     return sock;
 }
 
+static int set_nonblocking(int sock) {
+    int flags;
+
+    if ((flags = fcntl(sock, F_GETFL, 0)) < 0) {
+        return -1;
+    }
+
+    return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Translates the result of a failed SSL_read()/SSL_write() into errno so
+// that callers can treat TLS and plain sockets alike. Returns 0 if the
+// peer closed the TLS session cleanly and -1 otherwise.
+static int ssl_set_errno(SSL *ssl, int ret) {
+    switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0) {
+                errno = EPIPE;
+            }
+            return -1;
+        default:
+            errno = EPROTO;
+            return -1;
+    }
+}
+
 static ssize_t client_write(struct client *c, const void *buf, const size_t len) {
+    int ret;
+
     if (c->ssl != NULL) {
-        return SSL_write(c->ssl, buf, len);
+        ERR_clear_error();
+        if ((ret = SSL_write(c->ssl, buf, len)) <= 0) {
+            // OpenSSL has taken a record of len bytes and insists on being
+            // handed at least as much again, see send_allowance()
+            if (SSL_get_error(c->ssl, ret) == SSL_ERROR_WANT_WRITE || SSL_get_error(c->ssl, ret) == SSL_ERROR_WANT_READ) {
+                c->ssl_retry_len = max(c->ssl_retry_len, len);
+            }
+            c->write_blocked = SSL_get_error(c->ssl, ret) == SSL_ERROR_WANT_WRITE;
+            return ssl_set_errno(c->ssl, ret) < 0 ? -1 : 0;
+        }
+        c->ssl_retry_len = 0;
+        return ret;
     }
     else {
-        return send(c->sock, buf, len, 0);
+        ret = send(c->sock, buf, len, 0);
+        c->write_blocked = ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        return ret;
     }
 }
 
-static size_t client_read(struct client *c, void *buf, const size_t len) {
+static ssize_t client_read(struct client *c, void *buf, const size_t len) {
+    int ret;
+
     if (c->ssl != NULL) {
-        return SSL_read(c->ssl, buf, len);
+        ERR_clear_error();
+        if ((ret = SSL_read(c->ssl, buf, len)) <= 0) {
+            return ssl_set_errno(c->ssl, ret);
+        }
+        return ret;
     }
     else {
         return recv(c->sock, buf, len, 0);
     }
 }
 
+// Only valid for plain connections and TLS connections with kernel TLS
+// enabled, see ssl_ktls_send_enabled().
+static ssize_t client_sendfile(struct client *c, int fd, off_t *offset, size_t len) {
+    ssize_t ret;
+
+    if (c->ssl != NULL) {
+#ifdef SSL_OP_ENABLE_KTLS
+        ERR_clear_error();
+        if ((ret = SSL_sendfile(c->ssl, fd, *offset, len, 0)) <= 0) {
+            c->write_blocked = SSL_get_error(c->ssl, ret) == SSL_ERROR_WANT_WRITE;
+            return ssl_set_errno(c->ssl, ret) < 0 ? -1 : 0;
+        }
+        *offset += ret;
+        return ret;
+#else
+        errno = EOPNOTSUPP;
+        return -1;
+#endif
+    }
+    else {
+        ret = sendfile(c->sock, fd, offset, len);
+        c->write_blocked = ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        return ret;
+    }
+}
+
+// Returns how much of want the egress limits let this client send now.
+// The global limit is split evenly between the clients being served this
+// round so that fast clients early in the loop cannot take all of it.
+static size_t egress_allowance(struct server *s, struct client *c, size_t want) {
+    size_t asked;
+
+    if (c->round_budget == 0) {
+        return 0; // Had its turn, others go first
+    }
+
+    want = asked = min(want, c->round_budget);
+    want = min(want, s->egress_share);
+    want = token_bucket_allowance(&s->egress, want, s->now);
+    want = token_bucket_allowance(&c->egress, want, s->now);
+
+    if (is_stream_request(c) || c->request == REQUEST_STILL || (c->request == REQUEST_MUX && c->mux_current >= 0)) {
+        want = token_bucket_allowance(&c->fb->egress, want, s->now);
+    }
+    c->egress_limited = want < asked;
+
+    if (want == 0) {
+        c->throttled = 1;
+        c->throttled_writes++;
+    }
+
+    return want;
+}
+
+static void egress_consume(struct server *s, struct client *c, size_t sent) {
+    token_bucket_consume(&s->egress, sent);
+    token_bucket_consume(&c->egress, sent);
+
+    if (is_stream_request(c) || c->request == REQUEST_STILL || (c->request == REQUEST_MUX && c->mux_current >= 0)) {
+        token_bucket_consume(&c->fb->egress, sent);
+    }
+
+    c->round_budget -= min(sent, c->round_budget);
+    c->bytes_sent += sent;
+}
+
+// How much of want to hand to client_write(). A TLS write that could not
+// go out must be retried with at least the same length, or OpenSSL fails
+// it with "bad write retry", so that goes regardless of the limits and is
+// paid for once it has been sent.
+static size_t send_allowance(struct server *s, struct client *c, size_t want) {
+    if (c->ssl_retry_len > 0) {
+        return min(want, c->ssl_retry_len);
+    }
+
+    return egress_allowance(s, c, want);
+}
+
+// client_write() subject to the egress limits. Fails with EAGAIN if the
+// client is out of budget.
+static ssize_t client_send(struct server *s, struct client *c, const void *buf, const size_t len) {
+    size_t allowed;
+    ssize_t sent;
+
+    if ((allowed = send_allowance(s, c, len)) == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if ((sent = client_write(c, buf, allowed)) > 0) {
+        egress_consume(s, c, sent);
+    }
+
+    return sent;
+}
+
+static short same_address(struct sockaddr_storage *a, struct sockaddr_storage *b) {
+    if (a->ss_family != b->ss_family) {
+        return 0;
+    }
+
+    switch (a->ss_family) {
+        case AF_INET6:
+            return memcmp(&((struct sockaddr_in6 *) a)->sin6_addr, &((struct sockaddr_in6 *) b)->sin6_addr, sizeof(struct in6_addr)) == 0;
+        case AF_INET:
+            return ((struct sockaddr_in *) a)->sin_addr.s_addr == ((struct sockaddr_in *) b)->sin_addr.s_addr;
+        default:
+            return 0;
+    }
+}
+
+// Returns 1 if the new connection may be served. Otherwise the client is
+// turned away with a canned 503 and the socket is closed.
+static short admit_client(struct server *s, int sock, struct sockaddr_storage *addr) {
+    int i, same_ip = 0;
+    char cbuf[INET6_ADDRSTRLEN];
+    const char *reason = NULL;
+
+    if (sock >= FD_SETSIZE) {
+        reason = "too many open sockets";
+    }
+    else if (s->limits.max_clients > 0 && s->client_count >= s->limits.max_clients) {
+        reason = "max-clients reached";
+    }
+    else if (s->limits.max_clients_per_ip > 0) {
+        for (i = 0; i < FD_SETSIZE; i++) {
+            if (s->clients[i] != NULL && same_address(&s->clients[i]->addr, addr)) {
+                same_ip++;
+            }
+        }
+
+        if (same_ip >= s->limits.max_clients_per_ip) {
+            reason = "max-clients-per-ip reached";
+        }
+    }
+
+    if (reason == NULL) {
+        return 1;
+    }
+
+    log_itf(LOG_WARNING, "Turning away client from %s: %s.", ntop(addr, cbuf, sizeof(cbuf)), reason);
+
+    // Best effort, the socket is fresh so this will fit in the send buffer.
+    // HTTPS clients would not understand a plain text response.
+    if (s->ssl_ctx == NULL) {
+        send(sock, HTTP_SERVICE_UNAVAILABLE, strlen(HTTP_SERVICE_UNAVAILABLE), MSG_NOSIGNAL);
+    }
+    close(sock);
+
+    return 0;
+}
+
+// Accepts every pending connection, so that a burst of clients is drained
+// in one pass rather than one per select() call.
+static void accept_clients(struct server *s, int listen_sock, struct frame_buffers *fbs) {
+    int sock;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    while (1) {
+        addr_len = sizeof(addr);
+        if ((sock = accept4(listen_sock, (struct sockaddr *) &addr, &addr_len, SOCK_NONBLOCK)) < 0) {
+            switch (errno) {
+                case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+                case EWOULDBLOCK:
+#endif
+                case EINTR:
+                    return;
+                case ECONNABORTED:
+                case EPROTO:
+                    continue;
+                case EMFILE:
+                case ENFILE:
+                case ENOBUFS:
+                case ENOMEM:
+                    log_it(LOG_WARNING, "Out of resources accepting clients.");
+                    return;
+                default:
+                    panic("accept() failed");
+            }
+        }
+
+        if (admit_client(s, sock, &addr)) {
+            add_client(s, sock, &addr, fbs);
+        }
+    }
+}
+
 static void add_client(struct server *s, int sock, struct sockaddr_storage *addr, struct frame_buffers *fbs) {
     struct client *c;
     char cbuf[INET6_ADDRSTRLEN]; // general purpose buffer for various string conversions in this function
@@ -149,124 +465,1671 @@ static void add_client(struct server *s, int sock, struct sockaddr_storage *addr
 
     c->sock = sock;
     memcpy(&c->addr, addr, sizeof(struct sockaddr_storage));
-    c->last_communication = gettime();
+    c->last_communication = c->connected_at = gettime();
     c->current_frame = 0;
     c->current_frame_pos = 0;
     c->request_header_size = 0;
+    http_parser_init(&c->parser);
     c->request = REQUEST_INCOMPLETE;
     c->resp = NULL;
     c->resp_pos = 0;
     c->resp_len = 0;
     c->fb = NULL;
     c->static_file = NULL;
+    token_bucket_init(&c->egress, s->limits.client_egress_limit, EGRESS_BURST_SECONDS);
+    c->round_budget = WRITE_BUDGET_PER_ROUND;
 
+    // The TLS handshake is driven from serve_clients() as the socket becomes ready
     if (s->ssl_ctx != NULL) {
         c->ssl = SSL_new(s->ssl_ctx);
         SSL_set_fd(c->ssl, c->sock);
+        SSL_set_accept_state(c->ssl);
+        c->ssl_want = SSL_ERROR_WANT_READ;
+    }
+
+    s->clients[c->sock] = c;
+    s->client_count++;
+
+    log_itf(LOG_INFO, "Client connected from %s.", ntop(&c->addr, cbuf, sizeof(cbuf)));
+}
+
+static void continue_handshake(struct server *s, struct client *c) {
+    int ret;
+    char cbuf[INET6_ADDRSTRLEN];
+
+    ERR_clear_error();
+    if ((ret = SSL_accept(c->ssl)) == 1) {
+        c->ssl_accepted = 1;
+        c->last_communication = gettime();
+
+        log_itf(LOG_DEBUG, "SSL handshake with %s done: %s, session %s, kernel TLS %s.",
+            ntop(&c->addr, cbuf, sizeof(cbuf)),
+            SSL_get_version(c->ssl),
+            SSL_session_reused(c->ssl) ? "resumed" : "new",
+            ssl_ktls_send_enabled(c->ssl) ? "on" : "off"
+        );
+
+        if (ssl_http2_negotiated(c->ssl)) {
+            h2_start(c);
+        }
+        return;
+    }
+
+    c->ssl_want = SSL_get_error(c->ssl, ret);
+    if (c->ssl_want == SSL_ERROR_WANT_READ || c->ssl_want == SSL_ERROR_WANT_WRITE) {
+        return;
+    }
+
+    log_itf(LOG_ERROR, "Error occured doing the SSL handshake with %s: %s", ntop(&c->addr, cbuf, sizeof(cbuf)), ERR_error_string(ERR_get_error(), NULL));
+    remove_client(s, c);
+}
+
+static void remove_client(struct server *s, struct client *c) {
+    char cbuf[INET6_ADDRSTRLEN];
+    int i;
+    log_itf(LOG_INFO, "Disconneting client from %s.", ntop(&c->addr, cbuf, sizeof(cbuf)));
+    
+    s->clients[c->sock] = NULL;
+    s->client_count--;
+    close(c->sock);
+
+    if (is_stream_request(c)) {
+        c->fb->stream_clients--;
+        c->fb->rendition_clients[c->target_rendition]--;
+    }
+    else if (c->request == REQUEST_MP4) {
+        c->fb->stream_clients--;
+    }
+    else if (c->request == REQUEST_STILL_WAIT) {
+        c->fb->still_requests--;
+    }
+
+    if (c->ws_buf != NULL) {
+        free(c->ws_buf);
+    }
+
+    if (c->mux != NULL) {
+        for (i = 0; i < c->mux_count; i++) {
+            c->mux[i].fb->stream_clients--;
+        }
+        free(c->mux);
+    }
 
-        if (SSL_accept(c->ssl) < 1) {
-            log_itf(LOG_ERROR, "Error occured doing the SSL handshake: %s", ERR_error_string(ERR_get_error(), NULL));
-            free(c);
+    if (c->h2 != NULL) {
+        h2_free(c);
+    }
+    
+    if (c->static_file != NULL) {
+        fclose(c->static_file);
+    }
+
+    if (c->resp != NULL) {
+        free(c->resp);
+    }
+    
+    if (c->ssl) {
+        SSL_free(c->ssl);
+    }
+
+    free(c);
+}
+
+// Gets a persistent connection ready for its next request. Any pipelined
+// bytes received past the end of the previous request are kept.
+static void reset_client(struct client *c) {
+    size_t leftover = 0;
+
+    if (c->request_received && c->request_header_size > c->parser.pos) {
+        leftover = c->request_header_size - c->parser.pos;
+        memmove(c->request_headers, &c->request_headers[c->parser.pos], leftover);
+    }
+
+    c->request_header_size = leftover;
+    http_parser_init(&c->parser);
+    c->request = REQUEST_INCOMPLETE;
+    c->request_received = 0;
+    c->keep_alive = 0;
+    c->resp_pos = 0;
+    c->resp_len = 0;
+    c->current_frame_pos = 0;
+    
+    if (c->static_file != NULL) {
+        fclose(c->static_file);
+    }
+    c->static_file = NULL;
+
+    if (c->resp != NULL) {
+        free(c->resp);
+    }
+    c->resp = NULL;
+}
+
+// Called once a complete response has been written.
+static void finish_response(struct server *s, struct client *c, struct frame_buffers *fbs) {
+    if (!c->keep_alive) {
+        return remove_client(s, c);
+    }
+
+    reset_client(c);
+
+    // The next request may already be waiting in the buffer, in which
+    // case the socket will not become readable again for it.
+    if (c->request_header_size > 0) {
+        process_request(s, c, fbs);
+    }
+}
+
+static void read_request(struct server *s, struct client *c, struct frame_buffers *fbs) {
+    ssize_t len;
+    char peek;
+    struct pollfd pfd = {c->sock, 0, 0};
+
+    if (c->request == REQUEST_WEBSOCKET) {
+        return ws_read(s, c);
+    }
+
+    if (c->request == REQUEST_HTTP2) {
+        return h2_read(s, c, fbs);
+    }
+
+    if (c->request_received) {
+        // Pipelined requests wait in the socket until this one is answered,
+        // but a connection that is gone need not wait for the next write to
+        // notice. One that was only half closed may still be answered. A
+        // reset hides behind unread data, such as a TLS close_notify, so
+        // poll() is asked even when there is some.
+        len = recv(c->sock, &peek, 1, MSG_PEEK);
+        if ((len < 0 && !is_transient_error()) || (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR)))) {
+            remove_client(s, c);
+        }
+        return;
+    }
+
+    // Read straight into the client's buffer; the parser picks up where it left off
+    len = client_read(c, &c->request_headers[c->request_header_size], MAX_REQUEST_HEADER_SIZE - c->request_header_size);
+    if (len < 1) {
+        if (len < 0 && is_transient_error()) {
             return;
         }
+
+        // len == 0 means that the client has disconnected
+        // len == -1 means an error occured
+        return remove_client(s, c);
     }
+    c->last_communication = gettime();
+    c->request_header_size += len;
 
-    s->clients[c->sock] = c;
+    process_request(s, c, fbs);
+}
 
-    log_itf(LOG_INFO, "Client connected from %s.", ntop(&c->addr, cbuf, sizeof(cbuf)));
+static void process_request(struct server *s, struct client *c, struct frame_buffers *fbs) {
+    int result;
+
+    result = http_parser_execute(&c->parser, c->request_headers, c->request_header_size);
+
+    if (result == HTTP_PARSE_INCOMPLETE && c->request_header_size == MAX_REQUEST_HEADER_SIZE) {
+        result = HTTP_PARSE_ERROR; // Headers are too large
+    }
+
+    if (result == HTTP_PARSE_ERROR) {
+        c->request_received = 1;
+        c->keep_alive = 0;
+        return set_client_response(c, REQUEST_BAD, HTTP_BAD_REQUEST);
+    }
+
+    if (result == HTTP_PARSE_DONE) {
+        c->request_received = 1;
+        handle_request(s, c, fbs);
+    }
+}
+
+static void set_client_response(struct client *c, int request, char *response) {
+    c->request = request;
+    c->resp = strdup(response);
+    c->resp_len = strlen(response);
+}
+
+static void set_client_responsef(struct client *c, int request, const char *fmt, ...) {
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    c->request = request;
+    c->resp = malloc(len + 1);
+    c->resp_len = len;
+
+    va_start(args, fmt);
+    vsnprintf(c->resp, len + 1, fmt, args);
+    va_end(args);
+}
+
+// For responses with a binary body, which the ones above cannot hold
+static void set_client_response_data(struct client *c, int request, const char *head, const void *body, size_t len) {
+    size_t head_len = strlen(head);
+
+    c->request = request;
+    c->resp = malloc(head_len + len);
+    c->resp_len = head_len + len;
+
+    memcpy(c->resp, head, head_len);
+    memcpy(&c->resp[head_len], body, len);
+}
+
+// Reads ?fps= and ?policy= for a stream request
+static void parse_stream_options(struct server *s, struct client *c, struct http_request *req) {
+    char value[16];
+    double fps;
+
+    c->low_latency = s->limits.low_latency;
+    if (http_query_param(req->query_string, "latency", value, sizeof(value))) {
+        c->low_latency = (strcmp(value, "low") == 0);
+    }
+
+    c->stream_policy = STREAM_POLICY_LATEST;
+    if (http_query_param(req->query_string, "policy", value, sizeof(value)) && strcmp(value, "every") == 0) {
+        c->stream_policy = STREAM_POLICY_EVERY;
+    }
+
+    c->timestamps = http_query_param(req->query_string, "timestamps", value, sizeof(value)) && strcmp(value, "1") == 0;
+    c->mux_part_header_len = 0;
+    c->mux_part_header_pos = 0;
+
+    c->frame_interval = 0;
+    if (http_query_param(req->query_string, "fps", value, sizeof(value)) && (fps = atof(value)) > 0) {
+        c->frame_interval = 1.0 / fps;
+    }
+
+    c->adaptive = s->limits.adaptive_quality;
+    c->target_rendition = RENDITION_FULL;
+    if (http_query_param(req->query_string, "quality", value, sizeof(value))) {
+        c->target_rendition = parse_quality(value, &c->adaptive);
+    }
+
+    // The first frame is already there in full size, so start with that
+    c->rendition = RENDITION_FULL;
+
+    c->next_frame_at = gettime();
+    c->frame_started_at = c->next_frame_at;
+    c->adapt_at = c->next_frame_at + ADAPT_INTERVAL;
+    c->adapt_frames_sent = 0;
+    c->adapt_camera_frame = c->fb->current_frame;
+    c->throughput = 0;
+}
+
+// Maps ?quality= to a rendition. Only "auto" leaves adaptation on.
+static short parse_quality(const char *value, short *adaptive) {
+    *adaptive = (strcmp(value, "auto") == 0);
+
+    if (strcmp(value, "medium") == 0) {
+        return RENDITION_MEDIUM;
+    }
+    else if (strcmp(value, "low") == 0) {
+        return RENDITION_LOW;
+    }
+
+    return RENDITION_FULL;
+}
+
+static void set_target_rendition(struct client *c, short target) {
+    c->fb->rendition_clients[c->target_rendition]--;
+    c->fb->rendition_clients[target]++;
+    c->target_rendition = target;
+}
+
+// Whether the newest frame of fb is from before its camera was paused, so
+// that new viewers wait for the camera to wake up instead, as stills do
+static short resuming(struct frame_buffer *fb) {
+    return fb->current_frame >= 0 && fb->current_frame == fb->paused_frame;
+}
+
+// Subscribes a client to fb, for either kind of stream
+static void start_stream(struct server *s, struct client *c, struct frame_buffer *fb, struct http_request *req) {
+    struct frame *f;
+
+    c->fb = fb;
+    c->fb->stream_clients++;
+    c->current_frame = c->fb->current_frame;
+    c->current_frame_pos = 0;
+
+    // Counted as sent, so the next frame goes out first
+    if (resuming(fb) && (f = get_frame(fb, c->current_frame)) != NULL) {
+        c->current_frame_pos = f->data_len;
+    }
+
+    parse_stream_options(s, c, req);
+    c->fb->rendition_clients[c->target_rendition]++;
+    c->next_frame_at += c->frame_interval; // The first frame goes out right away
+    if (c->low_latency) {
+        enable_low_latency(c);
+    }
+}
+
+static void ws_read(struct server *s, struct client *c) {
+    ssize_t len;
+    struct ws_frame f;
+    size_t consumed = 0;
+    int result;
+
+    len = client_read(c, &c->request_headers[c->request_header_size], MAX_REQUEST_HEADER_SIZE - c->request_header_size);
+    if (len < 1) {
+        if (len < 0 && is_transient_error()) {
+            return;
+        }
+        return remove_client(s, c);
+    }
+    c->last_communication = gettime();
+    c->request_header_size += len;
+
+    while ((result = ws_parse_frame((unsigned char *) &c->request_headers[consumed], c->request_header_size - consumed, &f)) == WS_PARSE_DONE) {
+        ws_handle_message(s, c, &f, (unsigned char *) &c->request_headers[consumed + f.header_len]);
+        consumed += f.header_len + f.payload_len;
+
+        if (c->ws_closing) {
+            break;
+        }
+    }
+
+    if (result == WS_PARSE_ERROR || (result == WS_PARSE_INCOMPLETE && consumed == 0 && c->request_header_size == MAX_REQUEST_HEADER_SIZE)) {
+        log_it(LOG_INFO, "Closing WebSocket after a malformed or oversized message.");
+        return remove_client(s, c);
+    }
+
+    memmove(c->request_headers, &c->request_headers[consumed], c->request_header_size - consumed);
+    c->request_header_size -= consumed;
+}
+
+// Any data message acknowledges the last JPEG. Text messages other than
+// "ack" carry new stream options in query string form, e.g. "fps=2".
+static void ws_handle_message(struct server *s, struct client *c, struct ws_frame *f, unsigned char *payload) {
+    ws_unmask(payload, f->payload_len, f->mask);
+
+    switch (f->opcode) {
+        case WS_OPCODE_TEXT:
+            if (f->payload_len != strlen("ack") || memcmp(payload, "ack", f->payload_len) != 0) {
+                ws_set_options(c, payload, f->payload_len);
+            }
+            // Fall through
+        case WS_OPCODE_BINARY:
+            if (!c->ws_acked && !c->ws_frame_pending) {
+                c->ws_acked = 1;
+                c->lag = gettime() - c->ws_captured_at;
+            }
+            break;
+        case WS_OPCODE_PING:
+            ws_queue(c, WS_OPCODE_PONG, payload, f->payload_len, NULL);
+            break;
+        case WS_OPCODE_CLOSE:
+            ws_queue(c, WS_OPCODE_CLOSE, payload, min(f->payload_len, 2), NULL);
+            c->ws_closing = 1;
+            break;
+        default:
+            break; // Pongs and continuations of messages we do not use
+    }
+}
+
+static void ws_set_options(struct client *c, const unsigned char *payload, size_t len) {
+    char query_string[256], value[16];
+    double fps;
+
+    len = min(len, sizeof(query_string) - 1);
+    memcpy(query_string, payload, len);
+    query_string[len] = '\0';
+
+    if (http_query_param(query_string, "fps", value, sizeof(value))) {
+        fps = atof(value);
+        c->frame_interval = (fps > 0) ? 1.0 / fps : 0;
+        c->next_frame_at = gettime();
+    }
+
+    if (http_query_param(query_string, "quality", value, sizeof(value))) {
+        set_target_rendition(c, parse_quality(value, &c->adaptive));
+    }
+}
+
+// Appends a frame to the client's outgoing WebSocket buffer. With meta, the
+// payload is preceded by the metadata header.
+static void ws_queue(struct client *c, int opcode, const void *payload, size_t len, struct ws_meta *meta) {
+    size_t meta_len = (meta != NULL) ? WS_META_SIZE : 0;
+    size_t need;
+
+    if (c->ws_pos == c->ws_len) {
+        c->ws_pos = c->ws_len = 0;
+    }
+
+    need = c->ws_len + WS_MAX_FRAME_HEADER_SIZE + meta_len + len;
+    if (need > c->ws_buf_size) {
+        c->ws_buf_size = max(need, c->ws_buf_size * 2);
+        c->ws_buf = realloc(c->ws_buf, c->ws_buf_size);
+    }
+
+    c->ws_len += ws_frame_header(&c->ws_buf[c->ws_len], opcode, meta_len + len);
+    if (meta != NULL) {
+        ws_put_meta(&c->ws_buf[c->ws_len], meta);
+        c->ws_len += meta_len;
+    }
+    memcpy(&c->ws_buf[c->ws_len], payload, len);
+    c->ws_len += len;
+}
+
+// Sends what is queued, then the newest frame once the last one was acked
+static void ws_respond(struct server *s, struct client *c) {
+    ssize_t len;
+    unsigned long prev;
+    struct frame *f;
+    struct ws_meta meta;
+    double now;
+
+    if (c->ws_pos < c->ws_len) {
+        if ((len = client_send(s, c, &c->ws_buf[c->ws_pos], c->ws_len - c->ws_pos)) < 0) {
+            if (is_transient_error()) {
+                return;
+            }
+            return remove_client(s, c);
+        }
+        c->last_communication = gettime();
+        c->ws_pos += len;
+
+        if (c->ws_pos < c->ws_len) {
+            return;
+        }
+
+        if (c->ws_closing) {
+            return remove_client(s, c);
+        }
+
+        if (c->ws_frame_pending) {
+            c->ws_frame_pending = 0;
+            c->frames_sent++;
+            now = gettime();
+            if (now > c->frame_started_at) {
+                c->throughput += THROUGHPUT_SMOOTHING * (c->last_frame_size / (now - c->frame_started_at) - c->throughput);
+            }
+        }
+        return;
+    }
+
+    if (!c->ws_acked || c->ws_closing || c->fb->current_frame < 0) {
+        return;
+    }
+
+    prev = c->current_frame;
+    select_next_frame(c, gettime());
+    if (c->current_frame == prev || (f = get_frame(get_rendition(c->fb, c->rendition), c->current_frame)) == NULL) {
+        return;
+    }
+
+    meta.rendition = c->rendition;
+    meta.frame = c->current_frame;
+    meta.captured_at = f->captured_at;
+    meta.sent_at = gettime();
+
+    ws_queue(c, WS_OPCODE_BINARY, &f->data[strlen(FRAME_HEADER)], f->data_len - strlen(FRAME_HEADER) - strlen(FRAME_FOOTER), &meta);
+
+    c->ws_acked = 0;
+    c->ws_frame_pending = 1;
+    c->ws_captured_at = f->captured_at;
+    c->last_frame_size = c->ws_len - c->ws_pos;
+}
+
+// Sets up a /streams response from ?ids=0,1,2 (all cameras if absent) and
+// ?fps=, which is either one cap for all cameras or one per camera, e.g.
+// fps=5,1,1. A camera listed more than once is sent once. Returns 0 if an id
+// is not that of a camera, -1 if a camera already has max-streams-per-camera
+// clients.
+static short start_mux(struct server *s, struct client *c, struct frame_buffers *fbs, struct http_request *req) {
+    char ids[256], fps[256];
+    char *id, *rate, *end;
+    int i;
+    long index;
+    double now = gettime(), f;
+
+    if (!http_query_param(req->query_string, "ids", ids, sizeof(ids)) || ids[0] == '\0') {
+        ids[0] = '\0';
+        for (i = 0; i < fbs->count && i < MAX_MUX_CAMERAS; i++) {
+            if (!fbs->buffers[i].h264) {
+                snprintf(&ids[strlen(ids)], sizeof(ids) - strlen(ids), ids[0] != '\0' ? ",%d" : "%d", i);
+            }
+        }
+    }
+
+    if (!http_query_param(req->query_string, "fps", fps, sizeof(fps))) {
+        fps[0] = '\0';
+    }
+
+    c->mux = calloc(MAX_MUX_CAMERAS, sizeof(struct mux_camera));
+    c->mux_count = 0;
+    c->mux_next = 0;
+    c->mux_current = -1;
+
+    rate = fps;
+    for (id = strtok(ids, ","); id != NULL && c->mux_count < MAX_MUX_CAMERAS; id = strtok(NULL, ",")) {
+        index = strtol(id, &end, 10);
+        if (end == id || *end != '\0' || index < 0 || index >= fbs->count || fbs->buffers[index].h264) {
+            free(c->mux);
+            c->mux = NULL;
+            c->mux_count = 0;
+            return 0;
+        }
+
+        // A single rate applies to every camera, a list to one each
+        f = atof(rate);
+        if (strchr(rate, ',') != NULL) {
+            rate = strchr(rate, ',') + 1;
+        }
+
+        for (i = 0; i < c->mux_count && c->mux[i].index != index; i++);
+        if (i < c->mux_count) {
+            continue;
+        }
+
+        c->mux[c->mux_count].fb = &fbs->buffers[index];
+        c->mux[c->mux_count].index = index;
+        c->mux[c->mux_count].last_frame = resuming(&fbs->buffers[index]) ? fbs->buffers[index].current_frame : -1;
+        c->mux[c->mux_count].next_frame_at = now;
+        c->mux[c->mux_count].frame_interval = (f > 0) ? 1.0 / f : 0;
+
+        c->mux_count++;
+
+        if (s->limits.max_streams_per_camera > 0 && fbs->buffers[index].stream_clients >= s->limits.max_streams_per_camera) {
+            free(c->mux);
+            c->mux = NULL;
+            c->mux_count = 0;
+            return -1;
+        }
+    }
+
+    for (i = 0; i < c->mux_count; i++) {
+        c->mux[i].fb->stream_clients++;
+    }
+
+    return c->mux_count > 0;
+}
+
+// Sends one part at a time, taking turns between the cameras with a new frame
+// due so that a busy camera cannot starve the others
+static void mux_respond(struct server *s, struct client *c) {
+    struct mux_camera *cam = NULL;
+    struct frame *f;
+    ssize_t len;
+    double now = gettime();
+    int i, n = 0;
+
+    if (c->mux_current < 0) {
+        for (i = 0; i < c->mux_count; i++) {
+            n = (c->mux_next + i) % c->mux_count;
+            cam = &c->mux[n];
+
+            if (cam->fb->current_frame > cam->last_frame && (cam->frame_interval == 0 || now >= cam->next_frame_at)) {
+                break;
+            }
+        }
+
+        if (i == c->mux_count) {
+            return; // Nothing due
+        }
+
+        if (cam->last_frame >= 0) {
+            c->frames_skipped += cam->fb->current_frame - cam->last_frame - 1;
+        }
+
+        if (cam->frame_interval > 0) {
+            cam->next_frame_at = max(cam->next_frame_at + cam->frame_interval, now);
+        }
+
+        c->mux_next = (n + 1) % c->mux_count;
+        if ((f = get_frame(cam->fb, cam->fb->current_frame)) == NULL) {
+            return; // Gone already, try again on the next pass
+        }
+
+        c->mux_current = n;
+        c->fb = cam->fb;
+        c->current_frame = cam->fb->current_frame;
+        c->current_frame_pos = 0;
+        c->frame_started_at = now;
+
+        c->mux_part_header_len = snprintf(c->mux_part_header, sizeof(c->mux_part_header), MUX_PART_HEADER_TMPL,
+            cam->index, f->captured_at, (long) (f->data_len - (strlen(FRAME_HEADER) + strlen(FRAME_FOOTER))));
+        c->mux_part_header_pos = 0;
+    }
+
+    if (c->mux_part_header_pos < c->mux_part_header_len) {
+        if ((len = client_send(s, c, &c->mux_part_header[c->mux_part_header_pos], c->mux_part_header_len - c->mux_part_header_pos)) < 0) {
+            if (is_transient_error()) {
+                return;
+            }
+            return remove_client(s, c);
+        }
+        c->last_communication = gettime();
+        c->mux_part_header_pos += len;
+        return;
+    }
+
+    if ((f = get_frame(c->fb, c->current_frame)) == NULL) {
+        // Overwritten half way through, and the part has promised a length
+        log_it(LOG_INFO, "Multiplexed stream client fell too far behind.");
+        return remove_client(s, c);
+    }
+
+    if ((len = client_send(s, c, &f->data[c->current_frame_pos], f->data_len - c->current_frame_pos)) < 0) {
+        if (is_transient_error()) {
+            return;
+        }
+        return remove_client(s, c);
+    }
+    c->last_communication = gettime();
+    c->current_frame_pos += len;
+
+    if (c->current_frame_pos == f->data_len) {
+        c->frames_sent++;
+        c->lag = gettime() - f->captured_at;
+        c->mux[c->mux_current].last_frame = c->current_frame;
+        c->mux_current = -1;
+    }
+}
+
+// Sets up a /mp4/N response, which starts at the next keyframe
+static void start_mp4(struct client *c, struct frame_buffer *fb) {
+    c->fb = fb;
+    c->fb->stream_clients++;
+    c->mp4_header_len = 0;
+    c->mp4_next_frame = -1;
+    c->mp4_last_frame = -1;
+    c->mp4_sequence = 0;
+    c->mp4_started_at = -1;
+}
+
+// Newest keyframe still in the buffer that comes after the frame numbered
+// after, or -1 if there is none
+static long find_keyframe(struct frame_buffer *fb, long after) {
+    struct frame *f;
+    long n;
+
+    for (n = fb->current_frame; n > after && n >= 0 && (f = get_frame(fb, n)) != NULL; n--) {
+        if (f->keyframe) {
+            return n;
+        }
+    }
+
+    return -1;
+}
+
+// Sends every frame as a fragment of its own. Frames depend on the ones
+// before them, so a client that has missed one waits for a keyframe. Goes
+// on to the next fragment while the socket takes it, as every frame counts.
+static void mp4_respond(struct server *s, struct client *c) {
+    struct mp4_sample sample;
+    struct frame *f;
+    ssize_t len;
+    long next;
+    double now;
+
+    for (;;) {
+        if (c->mp4_header_len == 0) {
+            next = c->mp4_next_frame;
+
+            if (next > c->fb->current_frame) {
+                return; // Not captured yet
+            }
+
+            if (next < 0 || get_frame(c->fb, next) == NULL) {
+                if ((next = find_keyframe(c->fb, c->mp4_last_frame)) < 0) {
+                    return;
+                }
+
+                if (c->mp4_last_frame >= 0) {
+                    c->frames_skipped += next - c->mp4_last_frame - 1;
+                }
+            }
+
+            f = get_frame(c->fb, next);
+            if (c->mp4_started_at < 0) {
+                c->mp4_started_at = f->captured_at;
+            }
+
+            sample.size = f->data_len;
+            sample.duration = MP4_TIMESCALE / max(c->fb->vd->fps, 1);
+            sample.keyframe = f->keyframe;
+            c->mp4_header_len = mp4_fragment_header(c->mp4_header, sizeof(c->mp4_header), ++c->mp4_sequence,
+                (uint64_t) ((f->captured_at - c->mp4_started_at) * MP4_TIMESCALE + 0.5), &sample, 1);
+            c->mp4_header_pos = 0;
+
+            c->current_frame = next;
+            c->current_frame_pos = 0;
+            c->frame_started_at = gettime();
+        }
+
+        if (c->mp4_header_pos < c->mp4_header_len) {
+            if ((len = client_send(s, c, &c->mp4_header[c->mp4_header_pos], c->mp4_header_len - c->mp4_header_pos)) < 0) {
+                if (is_transient_error()) {
+                    return;
+                }
+                return remove_client(s, c);
+            }
+            c->last_communication = gettime();
+            c->mp4_header_pos += len;
+
+            if (c->mp4_header_pos < c->mp4_header_len) {
+                return;
+            }
+        }
+
+        if ((f = get_frame(c->fb, c->current_frame)) == NULL) {
+            // Overwritten half way through, and the fragment has promised a length
+            log_it(LOG_INFO, "MP4 stream client fell too far behind.");
+            return remove_client(s, c);
+        }
+
+        if ((len = client_send(s, c, &f->data[c->current_frame_pos], f->data_len - c->current_frame_pos)) < 0) {
+            if (is_transient_error()) {
+                return;
+            }
+            return remove_client(s, c);
+        }
+        now = gettime();
+        c->last_communication = now;
+        c->current_frame_pos += len;
+
+        if (c->current_frame_pos < f->data_len) {
+            return;
+        }
+
+        c->frames_sent++;
+        c->lag = now - f->captured_at;
+        c->mp4_last_frame = c->current_frame;
+        c->mp4_next_frame = c->current_frame + 1;
+        c->mp4_header_len = 0;
+    }
+}
+
+// Answers /hls/N/index.m3u8, /hls/N/init.mp4 and the segments the playlist
+// lists, e.g. /hls/N/12.m4s
+static void handle_hls_request(struct client *c, struct frame_buffer *fb, const char *name) {
+    char playlist[HLS_MAX_PLAYLIST_SIZE], head[sizeof(HTTP_MEDIA_TMPL) + 64];
+    unsigned char init[MP4_MAX_INIT_SEGMENT_SIZE];
+    struct hls_segment *seg;
+    unsigned long sequence;
+    size_t len;
+    char *end;
+
+    // Players poll rather than stay connected, so this is all that keeps
+    // the camera from being paused
+    fb->wanted_at = gettime();
+
+    if (strcmp(name, "index.m3u8") == 0 && (len = hls_playlist(fb->hls, playlist, sizeof(playlist))) > 0) {
+        return set_client_responsef(c, REQUEST_HLS, HTTP_MEDIA_TMPL "%s", connection_header(c), HLS_PLAYLIST_TYPE, (long) len, playlist);
+    }
+
+    if (strcmp(name, "init.mp4") == 0 && fb->h264_params.sps_len > 0 && fb->h264_params.pps_len > 0 &&
+            (len = mp4_init_segment(init, sizeof(init), &fb->h264_params)) > 0) {
+        snprintf(head, sizeof(head), HTTP_MEDIA_TMPL, connection_header(c), "video/mp4", (long) len);
+        return set_client_response_data(c, REQUEST_HLS, head, init, len);
+    }
+
+    sequence = strtoul(name, &end, 10);
+    if (end != name && strcmp(end, ".m4s") == 0 && (seg = hls_get_segment(fb->hls, sequence)) != NULL) {
+        c->fb = fb;
+        c->hls_sequence = sequence;
+        c->current_frame_pos = 0;
+        return set_client_responsef(c, REQUEST_HLS_SEGMENT, HTTP_MEDIA_TMPL, connection_header(c), "video/mp4", (long) seg->len);
+    }
+
+    set_client_responsef(c, REQUEST_NOT_FOUND, HTTP_NOT_FOUND_TMPL, connection_header(c), (long) strlen(HTTP_NOT_FOUND_BODY));
+}
+
+// Segments are sent from where the camera keeps them
+static void hls_respond(struct server *s, struct client *c, struct frame_buffers *fbs) {
+    struct hls_segment *seg;
+    ssize_t len;
+
+    if ((seg = hls_get_segment(c->fb->hls, c->hls_sequence)) == NULL) {
+        // Replaced by a newer one before the client got all of it
+        log_it(LOG_INFO, "HLS client took too long to fetch a segment.");
+        return remove_client(s, c);
+    }
+
+    if ((len = client_send(s, c, &seg->data[c->current_frame_pos], seg->len - c->current_frame_pos)) < 0) {
+        if (is_transient_error()) {
+            return;
+        }
+        return remove_client(s, c);
+    }
+    c->last_communication = gettime();
+    c->current_frame_pos += len;
+
+    if (c->current_frame_pos == seg->len) {
+        finish_response(s, c, fbs);
+    }
+}
+
+// Called once TLS has negotiated h2. The connection then carries any number
+// of requests as streams until either side goes away.
+static void h2_start(struct client *c) {
+    struct h2_session *h2;
+    unsigned char settings[6];
+
+    h2 = c->h2 = calloc(1, sizeof(struct h2_session));
+    hpack_table_init(&h2->decoder, H2_DEFAULT_HEADER_TABLE_SIZE);
+    h2->header_block = malloc(H2_MAX_HEADER_BLOCK);
+    h2->window = H2_DEFAULT_WINDOW_SIZE;
+    h2->initial_window = H2_DEFAULT_WINDOW_SIZE;
+    h2->max_frame_size = H2_DEFAULT_MAX_FRAME_SIZE;
+
+    c->request = REQUEST_HTTP2;
+    c->request_received = 1;
+
+    // The server preface, sent without waiting for the client's
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    h2_put_uint32(&settings[2], H2_MAX_STREAMS);
+    h2_queue(h2, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+}
+
+static void h2_free(struct client *c) {
+    while (c->h2->stream_count > 0) {
+        h2_close_stream(c->h2, 0);
+    }
+
+    hpack_table_free(&c->h2->decoder);
+    free(c->h2->header_block);
+    free(c->h2->out);
+    free(c->h2);
+    c->h2 = NULL;
+}
+
+static void h2_read(struct server *s, struct client *c, struct frame_buffers *fbs) {
+    struct h2_session *h2 = c->h2;
+    struct h2_frame f;
+    size_t consumed = 0;
+    ssize_t len;
+    uint32_t error = H2_NO_ERROR, length;
+
+    // The rest is only read to be dropped, see h2_respond()
+    if (h2->closing) {
+        if ((len = client_read(c, h2->in, sizeof(h2->in))) == 0 || (len < 0 && !is_transient_error())) {
+            remove_client(s, c);
+        }
+        return;
+    }
+
+    len = client_read(c, &h2->in[h2->in_len], sizeof(h2->in) - h2->in_len);
+    if (len < 1) {
+        if (len < 0 && is_transient_error()) {
+            return;
+        }
+        return remove_client(s, c);
+    }
+    c->last_communication = gettime();
+    h2->in_len += len;
+
+    if (!h2->preface_received) {
+        if (memcmp(h2->in, H2_PREFACE, min(h2->in_len, H2_PREFACE_SIZE)) != 0) {
+            log_it(LOG_INFO, "Closing HTTP/2 connection that did not start with the client preface.");
+            return remove_client(s, c);
+        }
+
+        if (h2->in_len < H2_PREFACE_SIZE) {
+            return;
+        }
+
+        h2->preface_received = 1;
+        consumed = H2_PREFACE_SIZE;
+    }
+
+    while (error == H2_NO_ERROR && !h2->closing && h2->in_len - consumed >= H2_FRAME_HEADER_SIZE) {
+        h2_parse_frame_header(&h2->in[consumed], &f);
+
+        // We never raise SETTINGS_MAX_FRAME_SIZE above the default
+        if (f.length > H2_DEFAULT_MAX_FRAME_SIZE) {
+            error = H2_FRAME_SIZE_ERROR;
+            break;
+        }
+
+        if (h2->in_len - consumed < H2_FRAME_HEADER_SIZE + f.length) {
+            break;
+        }
+
+        // The handler strips padding and priority off f.length
+        length = f.length;
+        error = h2_handle_frame(s, c, fbs, &f, &h2->in[consumed + H2_FRAME_HEADER_SIZE]);
+        consumed += H2_FRAME_HEADER_SIZE + length;
+
+        // Every PING and SETTINGS gets a reply, a flood of them must not
+        // grow the output buffer without end
+        if (error == H2_NO_ERROR && h2->out_len - h2->out_pos > H2_MAX_UNSENT) {
+            error = H2_ENHANCE_YOUR_CALM;
+        }
+    }
+
+    if (error != H2_NO_ERROR) {
+        log_itf(LOG_INFO, "Closing HTTP/2 connection after a protocol error (code %u).", error);
+        h2_goaway(h2, error);
+    }
+
+    memmove(h2->in, &h2->in[consumed], h2->in_len - consumed);
+    h2->in_len -= consumed;
+}
+
+// Returns H2_NO_ERROR, or the error code of a connection error
+static uint32_t h2_handle_frame(struct server *s, struct client *c, struct frame_buffers *fbs, struct h2_frame *f, unsigned char *payload) {
+    struct h2_session *h2 = c->h2;
+    struct h2_stream *st;
+    uint32_t pad = 0, value, i;
+    int64_t window;
+    unsigned char increment[4];
+
+    // Nothing may come between the frames of a header block
+    if (h2->header_block_stream != 0 && (f->type != H2_CONTINUATION || f->stream_id != h2->header_block_stream)) {
+        return H2_PROTOCOL_ERROR;
+    }
+
+    switch (f->type) {
+        case H2_HEADERS:
+            if (f->stream_id == 0 || (f->stream_id & 1) == 0) {
+                return H2_PROTOCOL_ERROR; // Clients use odd stream ids
+            }
+
+            if (f->flags & H2_FLAG_PADDED) {
+                if (f->length < 1) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                pad = payload[0];
+                payload++;
+                f->length--;
+            }
+
+            if (f->flags & H2_FLAG_PRIORITY) {
+                if (f->length < 5) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                payload += 5; // Priorities are not used, streams simply take turns
+                f->length -= 5;
+            }
+
+            if (pad > f->length) {
+                return H2_PROTOCOL_ERROR;
+            }
+            f->length -= pad;
+
+            h2->header_block_stream = f->stream_id;
+            h2->header_block_len = 0;
+            // Fall through
+        case H2_CONTINUATION:
+            if (h2->header_block_stream == 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+
+            if (h2->header_block_len + f->length > H2_MAX_HEADER_BLOCK) {
+                return H2_PROTOCOL_ERROR;
+            }
+
+            memcpy(&h2->header_block[h2->header_block_len], payload, f->length);
+            h2->header_block_len += f->length;
+
+            if (f->flags & H2_FLAG_END_HEADERS) {
+                return h2_end_headers(s, c, fbs);
+            }
+            return H2_NO_ERROR;
+
+        case H2_DATA:
+            if (f->stream_id == 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+
+            // Request bodies are ignored, but give the connection window back
+            if (f->length > 0) {
+                h2_put_uint32(increment, f->length);
+                h2_queue(h2, H2_WINDOW_UPDATE, 0, 0, increment, sizeof(increment));
+            }
+            return H2_NO_ERROR;
+
+        case H2_PRIORITY:
+            return f->length == 5 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+
+        case H2_RST_STREAM:
+            if (f->length != 4) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+
+            if ((st = h2_find_stream(h2, f->stream_id)) != NULL) {
+                h2_close_stream(h2, st - h2->streams);
+            }
+            return H2_NO_ERROR;
+
+        case H2_SETTINGS:
+            if (f->stream_id != 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+
+            if (f->flags & H2_FLAG_ACK) {
+                return f->length == 0 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+            }
+
+            if (f->length % 6 != 0) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+
+            for (i = 0; i < f->length; i += 6) {
+                value = h2_get_uint32(&payload[i + 2]);
+
+                switch ((payload[i] << 8) | payload[i + 1]) {
+                    case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+                        if (value > H2_MAX_WINDOW_SIZE) {
+                            return H2_FLOW_CONTROL_ERROR;
+                        }
+
+                        // Applies to the streams already open too
+                        for (st = h2->streams; st < &h2->streams[h2->stream_count]; st++) {
+                            window = (int64_t) st->window + (int64_t) value - h2->initial_window;
+                            if (window > H2_MAX_WINDOW_SIZE) {
+                                return H2_FLOW_CONTROL_ERROR;
+                            }
+                            st->window = window;
+                        }
+                        h2->initial_window = value;
+                        break;
+                    case H2_SETTINGS_MAX_FRAME_SIZE:
+                        if (value < H2_DEFAULT_MAX_FRAME_SIZE || value > H2_MAX_FRAME_SIZE) {
+                            return H2_PROTOCOL_ERROR;
+                        }
+                        h2->max_frame_size = value;
+                        break;
+                    default:
+                        break; // Responses are encoded without the dynamic table
+                }
+            }
+
+            h2_queue(h2, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+            return H2_NO_ERROR;
+
+        case H2_PING:
+            if (f->stream_id != 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+
+            if (f->length != 8) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+
+            if (!(f->flags & H2_FLAG_ACK)) {
+                h2_queue(h2, H2_PING, H2_FLAG_ACK, 0, payload, f->length);
+            }
+            return H2_NO_ERROR;
+
+        case H2_GOAWAY:
+            h2->closing = 1;
+            return H2_NO_ERROR;
+
+        case H2_WINDOW_UPDATE:
+            if (f->length != 4) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+
+            if ((value = h2_get_uint32(payload) & 0x7fffffff) == 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+
+            if (f->stream_id == 0) {
+                if ((int64_t) h2->window + value > H2_MAX_WINDOW_SIZE) {
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+                h2->window += value;
+            }
+            else if ((st = h2_find_stream(h2, f->stream_id)) != NULL) {
+                if ((int64_t) st->window + value > H2_MAX_WINDOW_SIZE) {
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+                st->window += value;
+            }
+            return H2_NO_ERROR;
+
+        case H2_PUSH_PROMISE:
+            return H2_PROTOCOL_ERROR; // Only servers push
+
+        default:
+            return H2_NO_ERROR; // Unknown frame types must be ignored
+    }
+}
+
+static uint32_t h2_end_headers(struct server *s, struct client *c, struct frame_buffers *fbs) {
+    struct h2_session *h2 = c->h2;
+    struct h2_request req;
+    uint32_t id = h2->header_block_stream;
+    unsigned char error[4];
+
+    h2->header_block_stream = 0;
+
+    // Decode even what we are about to refuse, to keep the table in sync
+    memset(&req, 0, sizeof(req));
+    if (hpack_decode(&h2->decoder, h2->header_block, h2->header_block_len, h2_on_header, &req) < 0) {
+        return H2_COMPRESSION_ERROR;
+    }
+
+    if (id <= h2->last_stream_id) {
+        return H2_NO_ERROR; // Trailers, which a GET has no use for
+    }
+    h2->last_stream_id = id;
+
+    if (h2->stream_count == H2_MAX_STREAMS) {
+        h2_put_uint32(error, H2_REFUSED_STREAM);
+        h2_queue(h2, H2_RST_STREAM, 0, id, error, sizeof(error));
+        return H2_NO_ERROR;
+    }
+
+    h2_handle_request(s, c, fbs, id, &req);
+    return H2_NO_ERROR;
+}
+
+static void h2_on_header(void *arg, const char *name, const char *value) {
+    struct h2_request *req = arg;
+
+    if (strcmp(name, ":method") == 0) {
+        snprintf(req->method, sizeof(req->method), "%s", value);
+    }
+    else if (strcmp(name, ":path") == 0) {
+        snprintf(req->path, sizeof(req->path), "%s", value);
+    }
+    else if (strcmp(name, "authorization") == 0) {
+        snprintf(req->authorization, sizeof(req->authorization), "%s", value);
+        req->has_authorization = 1;
+    }
+}
+
+// The HTTP/2 counterpart of handle_request(). WebSockets and /streams are
+// left to HTTP/1.1, as streams on one connection already multiplex cameras.
+static void h2_handle_request(struct server *s, struct client *c, struct frame_buffers *fbs, uint32_t id, struct h2_request *req) {
+    struct h2_session *h2 = c->h2;
+    struct h2_stream *st = &h2->streams[h2->stream_count++];
+    char cbuf[INET6_ADDRSTRLEN];
+    char filename[PATH_MAX + 1];
+    char *query_string, *stats;
+    int index;
+    struct frame *f;
+    FILE *file;
+
+    memset(st, 0, sizeof(struct h2_stream));
+    st->id = id;
+    st->request = REQUEST_INCOMPLETE;
+    st->window = h2->initial_window;
+    st->last_frame = -1;
+
+    if ((query_string = strchr(req->path, '?')) != NULL) {
+        *query_string++ = '\0';
+    }
+    else {
+        query_string = "";
+    }
+
+    log_itf(LOG_INFO, "Client at %s requested %s %s%s%s over HTTP/2.",
+        ntop(&c->addr, cbuf, sizeof(cbuf)),
+        req->method,
+        req->path,
+        *query_string != '\0' ? "?" : "",
+        query_string
+    );
+
+    if (strcmp(req->method, "GET") != 0 || req->path[0] != '/') {
+        return h2_set_response(st, "400", "text/html; charset=utf-8", HTTP_BAD_REQUEST_BODY, strlen(HTTP_BAD_REQUEST_BODY));
+    }
+
+    if (strncmp(req->path, "/img/", 5) != 0 && !check_http_auth(req->has_authorization ? req->authorization : NULL, s->auth)) {
+        h2_set_response(st, "401", "text/html; charset=utf-8", HTTP_AUTH_REQUIRED_BODY, strlen(HTTP_AUTH_REQUIRED_BODY));
+        return h2_add_header(st, "www-authenticate", "Basic realm=\"Hawkeye\"");
+    }
+
+    if (strcmp(req->path, "/stream/info") == 0) {
+        h2_set_response(st, "200", "application/json", s->stream_info, strlen(s->stream_info));
+        h2_add_header(st, "cache-control", H2_CACHE_CONTROL);
+    }
+    else if (strncmp(req->path, "/stream/", strlen("/stream/")) == 0 || strcmp(req->path, "/mosaic") == 0) {
+        index = (req->path[1] == 's') ? atoi(&req->path[strlen("/stream/")]) : -1;
+
+        if (req->path[1] == 's' && (index < 0 || index >= fbs->count || fbs->buffers[index].h264)) {
+            h2_set_response(st, "404", "text/html; charset=utf-8", HTTP_NOT_FOUND_BODY, strlen(HTTP_NOT_FOUND_BODY));
+        }
+        else if (req->path[1] == 'm' && s->mosaic == NULL) {
+            h2_set_response(st, "404", "text/html; charset=utf-8", HTTP_NOT_FOUND_BODY, strlen(HTTP_NOT_FOUND_BODY));
+        }
+        else if (index >= 0 && s->limits.max_streams_per_camera > 0 && fbs->buffers[index].stream_clients >= s->limits.max_streams_per_camera) {
+            log_itf(LOG_WARNING, "Turning away client from %s: max-streams-per-camera reached.", ntop(&c->addr, cbuf, sizeof(cbuf)));
+            h2_set_response(st, "503", "text/html; charset=utf-8", HTTP_SERVICE_UNAVAILABLE_BODY, strlen(HTTP_SERVICE_UNAVAILABLE_BODY));
+            h2_add_header(st, "retry-after", RETRY_AFTER);
+        }
+        else {
+            h2_start_stream(st, index >= 0 ? &fbs->buffers[index] : s->mosaic, query_string);
+        }
+    }
+    else if (strcmp(req->path, "/stats") == 0) {
+        stats = build_stats(s, fbs);
+        h2_set_response(st, "200", "application/json", stats, strlen(stats));
+        h2_add_header(st, "cache-control", H2_CACHE_CONTROL);
+        free(stats);
+    }
+    else if (strncmp(req->path, "/still/", strlen("/still/")) == 0) {
+        index = atoi(&req->path[strlen("/still/")]);
+        if (index < 0 || index >= fbs->count || fbs->buffers[index].h264 || (f = get_frame(&fbs->buffers[index], fbs->buffers[index].current_frame)) == NULL) {
+            return h2_set_response(st, "404", "text/html; charset=utf-8", HTTP_NOT_FOUND_BODY, strlen(HTTP_NOT_FOUND_BODY));
+        }
+
+        h2_set_response(st, "200", "image/jpeg", &f->data[strlen(FRAME_HEADER)], f->data_len - (strlen(FRAME_HEADER) + strlen(FRAME_FOOTER)));
+        h2_add_header(st, "cache-control", H2_CACHE_CONTROL);
+    }
+    else if (!find_static_file(s, req->path, filename) || (file = fopen(filename, "rb")) == NULL) {
+        h2_set_response(st, "404", "text/html; charset=utf-8", HTTP_NOT_FOUND_BODY, strlen(HTTP_NOT_FOUND_BODY));
+    }
+    else {
+        st->file = file;
+        st->body = malloc(H2_FILE_CHUNK_SIZE);
+        st->body_len = file_size(filename);
+
+        h2_set_response(st, "200", get_mime_type(filename), NULL, st->body_len);
+    }
+}
+
+// Appends a header to the response, which must be lower case
+static void h2_add_header(struct h2_stream *st, const char *name, const char *value) {
+    st->headers_len += hpack_put_header(&st->headers[st->headers_len], sizeof(st->headers) - st->headers_len, name, value);
+}
+
+// Starts the response headers and copies body, unless it is NULL because
+// st->body was filled in already. Live streams have no length.
+static void h2_set_response(struct h2_stream *st, const char *status, const char *content_type, const void *body, size_t len) {
+    char content_length[32];
+
+    h2_add_header(st, ":status", status);
+    h2_add_header(st, "server", "hawkeye");
+    h2_add_header(st, "access-control-allow-origin", "*");
+    h2_add_header(st, "content-type", content_type);
+
+    if (st->request != REQUEST_STREAM) {
+        snprintf(content_length, sizeof(content_length), "%ld", (long) len);
+        h2_add_header(st, "content-length", content_length);
+    }
+
+    if (body != NULL) {
+        st->body = malloc(max(len, 1));
+        memcpy(st->body, body, len);
+        st->body_len = len;
+    }
+}
+
+// A multipart MJPEG stream, like /stream/N over HTTP/1.1. Honours ?fps=.
+static void h2_start_stream(struct h2_stream *st, struct frame_buffer *fb, const char *query_string) {
+    char value[16];
+    double fps;
+
+    st->request = REQUEST_STREAM;
+    st->fb = fb;
+    st->fb->stream_clients++;
+    st->next_frame_at = gettime();
+    if (resuming(fb)) {
+        st->last_frame = fb->current_frame;
+    }
+
+    if (http_query_param(query_string, "fps", value, sizeof(value)) && (fps = atof(value)) > 0) {
+        st->frame_interval = 1.0 / fps;
+    }
+
+    h2_set_response(st, "200", "multipart/x-mixed-replace;boundary=" BOUNDARY, "--" BOUNDARY "\r\n", strlen("--" BOUNDARY "\r\n"));
+    h2_add_header(st, "cache-control", H2_CACHE_CONTROL);
+}
+
+static struct h2_stream *h2_find_stream(struct h2_session *h2, uint32_t id) {
+    int i;
+
+    for (i = 0; i < h2->stream_count; i++) {
+        if (h2->streams[i].id == id) {
+            return &h2->streams[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Order does not matter, so the last stream takes the freed slot
+static void h2_close_stream(struct h2_session *h2, int n) {
+    struct h2_stream *st = &h2->streams[n];
+
+    if (st->request == REQUEST_STREAM) {
+        st->fb->stream_clients--;
+    }
+    if (st->file != NULL) {
+        fclose(st->file);
+    }
+    free(st->body);
+
+    h2->stream_count--;
+    if (n != h2->stream_count) {
+        memcpy(st, &h2->streams[h2->stream_count], sizeof(struct h2_stream));
+    }
+}
+
+// Appends a frame to the outgoing buffer
+static void h2_queue(struct h2_session *h2, int type, int flags, uint32_t id, const void *payload, size_t len) {
+    size_t need;
+
+    if (h2->out_pos == h2->out_len) {
+        h2->out_pos = h2->out_len = 0;
+    }
+
+    need = h2->out_len + H2_FRAME_HEADER_SIZE + len;
+    if (need > h2->out_size) {
+        h2->out_size = max(need, h2->out_size * 2);
+        h2->out = realloc(h2->out, h2->out_size);
+    }
+
+    h2->out_len += h2_put_frame_header(&h2->out[h2->out_len], len, type, flags, id);
+    if (len > 0) {
+        memcpy(&h2->out[h2->out_len], payload, len);
+        h2->out_len += len;
+    }
+}
+
+// Tells the client why the connection is about to be closed
+static void h2_goaway(struct h2_session *h2, uint32_t error) {
+    unsigned char payload[8];
+
+    h2_put_uint32(payload, h2->last_stream_id);
+    h2_put_uint32(&payload[4], error);
+    h2_queue(h2, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    h2->closing = 1;
+}
+
+// Copies the newest frame of a live stream into its body, once the last one
+// has gone out and the frame rate cap allows. Returns 1 if it did.
+static short h2_next_frame(struct client *c, struct h2_stream *st, double now) {
+    struct frame *f;
+    long newest = st->fb->current_frame;
+
+    if (newest <= st->last_frame || (st->frame_interval > 0 && now < st->next_frame_at)) {
+        return 0;
+    }
+
+    if ((f = get_frame(st->fb, newest)) == NULL) {
+        return 0;
+    }
+
+    if (st->last_frame >= 0) {
+        c->frames_skipped += newest - st->last_frame - 1;
+    }
+
+    free(st->body);
+    st->body = malloc(f->data_len);
+    memcpy(st->body, f->data, f->data_len);
+    st->body_len = f->data_len;
+    st->body_pos = 0;
+    st->last_frame = newest;
+    st->captured_at = f->captured_at;
+
+    if (st->frame_interval > 0) {
+        st->next_frame_at = max(st->next_frame_at + st->frame_interval, now);
+    }
+
+    return 1;
+}
+
+// Queues up to WRITE_BUDGET_PER_ROUND of response data, one DATA frame per
+// stream at a time so that the streams share the connection evenly. A
+// stream is held back by its own flow control window without holding back
+// the others.
+static void h2_fill(struct client *c) {
+    struct h2_session *h2 = c->h2;
+    struct h2_stream *st;
+    size_t budget = WRITE_BUDGET_PER_ROUND, chunk;
+    short progress = 1, last;
+    double now = gettime();
+    unsigned char error[4];
+    char *data;
+    int i;
+
+    while (progress && budget > 0 && h2->stream_count > 0) {
+        progress = 0;
+
+        for (i = 0; i < h2->stream_count && budget > 0; i++) {
+            st = &h2->streams[(h2->next_stream + i) % h2->stream_count];
+
+            if (!st->headers_sent) {
+                h2_queue(h2, H2_HEADERS, H2_FLAG_END_HEADERS | (st->body_len == 0 && st->request != REQUEST_STREAM ? H2_FLAG_END_STREAM : 0), st->id, st->headers, st->headers_len);
+                st->headers_sent = 1;
+                st->done = (st->body_len == 0 && st->request != REQUEST_STREAM);
+                progress = 1;
+            }
+
+            if (st->request == REQUEST_STREAM && st->body_pos == st->body_len) {
+                h2_next_frame(c, st, now);
+            }
+
+            if (st->body_pos == st->body_len || st->window <= 0 || h2->window <= 0) {
+                continue;
+            }
+
+            chunk = min(st->body_len - st->body_pos, budget);
+            chunk = min(chunk, h2->max_frame_size);
+            chunk = min(chunk, (size_t) st->window);
+            chunk = min(chunk, (size_t) h2->window);
+
+            data = &st->body[st->body_pos];
+            if (st->file != NULL) {
+                chunk = min(chunk, (size_t) H2_FILE_CHUNK_SIZE);
+                data = st->body;
+
+                // A file that shrank cannot be sent at the length promised
+                if (fread(data, sizeof(char), chunk, st->file) != chunk) {
+                    h2_put_uint32(error, H2_INTERNAL_ERROR);
+                    h2_queue(h2, H2_RST_STREAM, 0, st->id, error, sizeof(error));
+                    st->done = 1;
+                    progress = 1;
+                    continue;
+                }
+            }
+
+            last = (st->body_pos + chunk == st->body_len);
+            h2_queue(h2, H2_DATA, (last && st->request != REQUEST_STREAM) ? H2_FLAG_END_STREAM : 0, st->id, data, chunk);
+
+            st->body_pos += chunk;
+            st->window -= chunk;
+            h2->window -= chunk;
+            budget -= chunk;
+            progress = 1;
+
+            if (last && st->request != REQUEST_STREAM) {
+                st->done = 1;
+            }
+            else if (last && st->captured_at > 0) {
+                c->frames_sent++;
+                c->lag = now - st->captured_at;
+                st->captured_at = 0;
+            }
+        }
+
+        for (i = h2->stream_count - 1; i >= 0; i--) {
+            if (h2->streams[i].done) {
+                h2_close_stream(h2, i);
+            }
+        }
+    }
+
+    if (h2->stream_count > 0) {
+        h2->next_stream = (h2->next_stream + 1) % h2->stream_count;
+    }
+}
+
+static void h2_respond(struct server *s, struct client *c) {
+    struct h2_session *h2 = c->h2;
+    ssize_t len;
+
+    if (h2->out_pos == h2->out_len) {
+        // Closing with frames from the client still unread would reset the
+        // connection, and the GOAWAY could be lost with whatever else had
+        // not reached it yet. So only stop writing, and close once it hangs
+        // up or has had time to.
+        if (h2->closing) {
+            if (h2->shut_down_at == 0) {
+                if (c->ssl != NULL) {
+                    SSL_shutdown(c->ssl);
+                }
+                shutdown(c->sock, SHUT_WR);
+                h2->shut_down_at = s->now;
+            }
+            else if (s->now - h2->shut_down_at > H2_LINGER_TIMEOUT) {
+                remove_client(s, c);
+            }
+            return;
+        }
+
+        h2_fill(c);
+        if (h2->out_pos == h2->out_len) {
+            return;
+        }
+    }
+
+    if ((len = client_send(s, c, &h2->out[h2->out_pos], h2->out_len - h2->out_pos)) < 0) {
+        if (is_transient_error()) {
+            return;
+        }
+        return remove_client(s, c);
+    }
+    c->last_communication = gettime();
+    h2->out_pos += len;
 }
 
-static void remove_client(struct server *s, struct client *c) {
-    char cbuf[INET6_ADDRSTRLEN];
-    log_itf(LOG_INFO, "Disconneting client from %s.", ntop(&c->addr, cbuf, sizeof(cbuf)));
-    
-    s->clients[c->sock] = NULL;
-    close(c->sock);
-    
-    if (c->static_file != NULL) {
-        fclose(c->static_file);
+// Keep the socket buffer small so that stale frames cannot pile up in it
+static void enable_low_latency(struct client *c) {
+    int sockoptval;
+
+#ifdef TCP_NOTSENT_LOWAT
+    sockoptval = LOW_LATENCY_NOTSENT_LOWAT;
+    if (setsockopt(c->sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &sockoptval, sizeof(sockoptval)) < 0) {
+        log_itf(LOG_WARNING, "Could not set TCP_NOTSENT_LOWAT: %s", strerror(errno));
     }
+#endif
 
-    if (c->resp != NULL) {
-        free(c->resp);
+    sockoptval = LOW_LATENCY_SNDBUF;
+    if (setsockopt(c->sock, SOL_SOCKET, SO_SNDBUF, &sockoptval, sizeof(sockoptval)) < 0) {
+        log_itf(LOG_WARNING, "Could not set SO_SNDBUF: %s", strerror(errno));
     }
-    
-    if (c->ssl) {
-        SSL_free(c->ssl);
+}
+
+// Bytes written to the socket that the peer has not acknowledged yet
+static int unsent_bytes(struct client *c) {
+    int queued = 0;
+
+    if (ioctl(c->sock, SIOCOUTQ, &queued) < 0) {
+        return 0;
     }
 
-    free(c);
+    return queued;
 }
 
-static void reset_client(struct client *c) {
-    c->request_header_size = 0;
-    c->request = REQUEST_INCOMPLETE;
-    c->request_received = 0;
-    c->resp_pos = 0;
-    c->resp_len = 0;
-    
-    if (c->static_file != NULL) {
-        fclose(c->static_file);
-    }
-    c->static_file = NULL;
+static void appendf(char **buf, size_t *len, size_t *size, const char *fmt, ...) {
+    va_list args;
+    int n;
 
-    if (c->resp != NULL) {
-        free(c->resp);
+    va_start(args, fmt);
+    n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    if (*len + n + 1 > *size) {
+        *size = max(*size * 2, *len + n + 1);
+        *buf = realloc(*buf, *size);
     }
-    c->resp = NULL;
-}
 
-static void read_request(struct server *s, struct client *c, struct frame_buffers *fbs) {
-    size_t len;
-    char buf[SERVER_BUFFER_SIZE];
-    memset(buf, 0, sizeof(buf));
+    va_start(args, fmt);
+    vsnprintf(&(*buf)[*len], *size - *len, fmt, args);
+    va_end(args);
 
-    if (!c->request_received) {
+    *len += n;
+}
 
-        if ((len = client_read(c, buf, sizeof(buf))) < 1) {
-            if (errno == EINTR) {
-                return;
-            }
+// Per-client statistics as JSON. The caller frees the result.
+static char *build_stats(struct server *s, struct frame_buffers *fbs) {
+    int sock, i;
+    struct frame_buffer *fb;
+    size_t len = 0, size = 1024;
+    char *buf = malloc(size);
+    char cbuf[INET6_ADDRSTRLEN];
+    struct client *c;
+    short first = 1;
 
-            // len == 0 means that the client has disconnected
-            // len == -1 means an error occured
-            return remove_client(s, c);
+    appendf(&buf, &len, &size, "{\"clients\": [");
+
+    for (sock = 0; sock < FD_SETSIZE; sock++) {
+        if ((c = s->clients[sock]) == NULL) {
+            continue;
         }
-        c->last_communication = gettime();
 
-        // Check if we have the whole thing
-        strncpy(&c->request_headers[c->request_header_size], buf, MAX_REQUEST_HEADER_SIZE - c->request_header_size);
-        c->request_header_size += len;
+        appendf(&buf, &len, &size, "%s{\"address\": \"%s\", \"camera\": %d, \"streaming\": %s, \"websocket\": %s, \"http2_streams\": %d, "
+            "\"bytes_sent\": %llu, \"frames_sent\": %lu, \"frames_skipped\": %lu, \"throttled_writes\": %lu, "
+            "\"low_latency\": %s, \"lag_frames\": %ld, \"lag_ms\": %.1f, \"queued_bytes\": %d, "
+            "\"rendition\": %d, \"throughput_kbps\": %.1f}",
+            first ? "" : ", ",
+            ntop(&c->addr, cbuf, sizeof(cbuf)),
+            (is_stream_request(c) || c->request == REQUEST_STILL || c->request == REQUEST_MP4) && c->fb != s->mosaic ? (int) (c->fb - fbs->buffers) : -1,
+            (is_stream_request(c) || c->request == REQUEST_MUX || c->request == REQUEST_MP4) ? "true" : "false",
+            c->request == REQUEST_WEBSOCKET ? "true" : "false",
+            c->h2 != NULL ? c->h2->stream_count : 0,
+            c->bytes_sent,
+            c->frames_sent,
+            c->frames_skipped,
+            c->throttled_writes,
+            c->low_latency ? "true" : "false",
+            is_stream_request(c) ? c->fb->current_frame - (long) c->current_frame : 0,
+            c->lag * 1000.0,
+            unsent_bytes(c),
+            c->rendition,
+            c->throughput * 8 / 1000.0
+        );
+        first = 0;
+    }
 
-        if (strstr(c->request_headers, "\r\n\r\n") != NULL) {
-            c->request_received = 1;
-        }
+    appendf(&buf, &len, &size, "], \"cameras\": [");
+
+    for (i = 0; i < fbs->count; i++) {
+        fb = &fbs->buffers[i];
+        appendf(&buf, &len, &size, "%s{\"paused\": %s, \"failed\": %s, \"restarts\": %lu, \"buffers\": %d, \"frames_skipped\": %lu, "
+            "\"capture_latency_ms\": %.1f, \"capture_latency_avg_ms\": %.1f}",
+            i > 0 ? ", " : "",
+            fb->vd->streaming_state == STREAMING_PAUSED ? "true" : "false",
+            fb->vd->streaming_state == STREAMING_FAILED ? "true" : "false",
+            fb->vd->restarts,
+            fb->vd->buffer_count,
+            fb->vd->frames_skipped,
+            fb->capture_latency * 1000.0,
+            fb->capture_latency_avg * 1000.0
+        );
     }
 
-    // Parse request headers
-    if (c->request_received && c->request == REQUEST_INCOMPLETE) {
-        handle_request(s, c, fbs);
+    appendf(&buf, &len, &size, "]");
+
+    if (s->push != NULL) {
+        appendf(&buf, &len, &size, ", \"push\": {\"connected\": %s, \"frames_sent\": %lu, \"frames_dropped\": %lu, \"reconnects\": %lu}",
+            s->push->state == PUSH_STREAMING ? "true" : "false",
+            s->push->frames_sent,
+            s->push->frames_dropped,
+            s->push->reconnects
+        );
     }
-}
 
-static void set_client_response(struct client *c, int request, char *response) {
-    c->request = request;
-    c->resp = strdup(response);
-    c->resp_len = strlen(response);
+    appendf(&buf, &len, &size, "}");
+
+    return buf;
 }
 
 static void handle_request(struct server *s, struct client *c, struct frame_buffers *fbs) {
-    int index;
+    int index, result;
     char cbuf[INET6_ADDRSTRLEN]; // general purpose buffer for various string conversions in this function
-    char tmp_filename[PATH_MAX + 1], filename[PATH_MAX + 1]; // Need 2 of these for realpath()
+    char filename[PATH_MAX + 1];
     char resp_head[sizeof(HTTP_STATIC_FILE_HEADERS_TMPL) + 256];
+    char *stats, *name;
+    char ws_accept[WS_ACCEPT_KEY_SIZE];
+    unsigned char init[MP4_MAX_INIT_SEGMENT_SIZE];
+    size_t init_len;
     struct http_request req;
 
-    parse_request(c->request_headers, &req);
-    if (req.protocol_version == NULL) {
-        set_client_response(c, REQUEST_BAD, HTTP_BAD_REQUEST);
-        return;
-    }
+    http_parser_fill_request(&c->parser, c->request_headers, &req);
+    c->keep_alive = http_keep_alive(&req);
 
     log_itf(LOG_INFO, "Client at %s requested %s %s%s%s.", 
         ntop(&c->addr, cbuf, sizeof(cbuf)),
@@ -277,95 +2140,340 @@ static void handle_request(struct server *s, struct client *c, struct frame_buff
     );
     
     if (strcmp(req.method, "GET") != 0 || strcmp(req.protocol, "HTTP") != 0) {
+        c->keep_alive = 0;
         return set_client_response(c, REQUEST_BAD, HTTP_BAD_REQUEST);
     }
 
     if (strncmp(req.path, "/img/", 5) != 0) {
         if (!check_http_auth(req.authorization, s->auth)) {
-            return set_client_response(c, REQUEST_AUTH_REQUIRED, HTTP_AUTH_REQUIRED);
+            return set_client_responsef(c, REQUEST_AUTH_REQUIRED, HTTP_AUTH_REQUIRED_TMPL, connection_header(c), (long) strlen(HTTP_AUTH_REQUIRED_BODY));
         }
     }
 
     // /stream/
     if (strncmp(req.path, "/stream/", strlen("/stream/")) == 0) {
         if (strcmp(req.path, "/stream/info") == 0) {
-            set_client_response(c, REQUEST_STREAM_INFO, s->stream_info);
+            set_client_responsef(c, REQUEST_STREAM_INFO, HTTP_JSON_TMPL, connection_header(c), (long) strlen(s->stream_info), s->stream_info);
         }
         else {
             // /stream/0, /stream/1, etc
             index = atoi(&req.path[strlen("/stream/")]);
 
-            if (index < 0 || index >= fbs->count) {
-                set_client_response(c, REQUEST_NOT_FOUND, HTTP_NOT_FOUND);
+            if (index < 0 || index >= fbs->count || fbs->buffers[index].h264) {
+                set_client_responsef(c, REQUEST_NOT_FOUND, HTTP_NOT_FOUND_TMPL, connection_header(c), (long) strlen(HTTP_NOT_FOUND_BODY));
+            }
+            else if (s->limits.max_streams_per_camera > 0 && fbs->buffers[index].stream_clients >= s->limits.max_streams_per_camera) {
+                log_itf(LOG_WARNING, "Turning away client from %s: max-streams-per-camera reached.", ntop(&c->addr, cbuf, sizeof(cbuf)));
+                c->keep_alive = 0;
+                set_client_response(c, REQUEST_UNAVAILABLE, HTTP_SERVICE_UNAVAILABLE);
             }
             else {
+                c->keep_alive = 0; // Streams only end when the client goes away
                 set_client_response(c, REQUEST_STREAM, STREAM_HEADER);
-                
-                c->fb = &fbs->buffers[index];
-                c->current_frame = c->fb->current_frame;
-                c->current_frame_pos = 0;
+                start_stream(s, c, &fbs->buffers[index], &req);
             }
         }
     }
-    else if (strncmp(req.path, "/still/", strlen("/still/")) == 0) {
-        index = atoi(&req.path[strlen("/still/")]);
-        if (index < 0 || index >= fbs->count) {
-            set_client_response(c, REQUEST_NOT_FOUND, HTTP_NOT_FOUND);
+    // /ws/stream/0, /ws/stream/1, etc
+    else if (strncmp(req.path, "/ws/stream/", strlen("/ws/stream/")) == 0) {
+        index = atoi(&req.path[strlen("/ws/stream/")]);
+        c->keep_alive = 0;
+
+        if (!http_websocket_upgrade(&req)) {
+            set_client_response(c, REQUEST_BAD, HTTP_BAD_REQUEST);
+        }
+        else if (index < 0 || index >= fbs->count || fbs->buffers[index].h264) {
+            set_client_responsef(c, REQUEST_NOT_FOUND, HTTP_NOT_FOUND_TMPL, connection_header(c), (long) strlen(HTTP_NOT_FOUND_BODY));
+        }
+        else if (s->limits.max_streams_per_camera > 0 && fbs->buffers[index].stream_clients >= s->limits.max_streams_per_camera) {
+            log_itf(LOG_WARNING, "Turning away client from %s: max-streams-per-camera reached.", ntop(&c->addr, cbuf, sizeof(cbuf)));
+            set_client_response(c, REQUEST_UNAVAILABLE, HTTP_SERVICE_UNAVAILABLE);
         }
         else {
-            set_client_response(c, REQUEST_STILL, JPEG_HEADER);
+            ws_accept_key(req.websocket_key, ws_accept);
+            set_client_responsef(c, REQUEST_WEBSOCKET, HTTP_WEBSOCKET_ACCEPT_TMPL, ws_accept);
+            start_stream(s, c, &fbs->buffers[index], &req);
+            if (!resuming(c->fb)) {
+                c->current_frame--; // So that the newest frame goes out first
+            }
+            c->ws_acked = 1;
 
-            c->fb = &fbs->buffers[index];
-            c->current_frame = c->fb->current_frame;
-            c->current_frame_pos = 0;
+            // From here on the buffer holds WebSocket frames. Keep any the
+            // client sent right behind its request.
+            c->request_header_size -= c->parser.pos;
+            memmove(c->request_headers, &c->request_headers[c->parser.pos], c->request_header_size);
         }
     }
-    else {
+    else if (strcmp(req.path, "/mosaic") == 0) {
+        if (s->mosaic == NULL) {
+            set_client_responsef(c, REQUEST_NOT_FOUND, HTTP_NOT_FOUND_TMPL, connection_header(c), (long) strlen(HTTP_NOT_FOUND_BODY));
+        }
+        else {
+            c->keep_alive = 0;
+            set_client_response(c, REQUEST_STREAM, STREAM_HEADER);
+            start_stream(s, c, s->mosaic, &req);
+        }
+    }
+    // /streams?ids=0,1,2
+    else if (strcmp(req.path, "/streams") == 0) {
+        c->keep_alive = 0;
+        if ((result = start_mux(s, c, fbs, &req)) == 0) {
+            set_client_responsef(c, REQUEST_NOT_FOUND, HTTP_NOT_FOUND_TMPL, connection_header(c), (long) strlen(HTTP_NOT_FOUND_BODY));
+        }
+        else if (result < 0) {
+            log_itf(LOG_WARNING, "Turning away client from %s: max-streams-per-camera reached.", ntop(&c->addr, cbuf, sizeof(cbuf)));
+            set_client_response(c, REQUEST_UNAVAILABLE, HTTP_SERVICE_UNAVAILABLE);
+        }
+        else {
+            set_client_response(c, REQUEST_MUX, MUX_STREAM_HEADER);
+        }
+    }
+    // /mp4/0, /mp4/1, etc, for H.264 cameras
+    else if (strncmp(req.path, "/mp4/", strlen("/mp4/")) == 0) {
+        index = atoi(&req.path[strlen("/mp4/")]);
+        c->keep_alive = 0;
 
-        if (!strlen(s->static_root)) {
-            return set_client_response(c, REQUEST_NOT_FOUND, HTTP_NOT_FOUND);
+        if (index < 0 || index >= fbs->count || !fbs->buffers[index].h264) {
+            set_client_responsef(c, REQUEST_NOT_FOUND, HTTP_NOT_FOUND_TMPL, connection_header(c), (long) strlen(HTTP_NOT_FOUND_BODY));
         }
-                
-        // Serving static file
-        strncpy(tmp_filename, s->static_root, PATH_MAX);
-        strncat(tmp_filename, req.path, PATH_MAX);
-        if (tmp_filename[strlen(tmp_filename) - 1] == '/') {
-            strncat(tmp_filename, INDEX_FILE_NAME, PATH_MAX);
+        else if ((s->limits.max_streams_per_camera > 0 && fbs->buffers[index].stream_clients >= s->limits.max_streams_per_camera) ||
+                fbs->buffers[index].h264_params.sps_len == 0 || fbs->buffers[index].h264_params.pps_len == 0 ||
+                (init_len = mp4_init_segment(init, sizeof(init), &fbs->buffers[index].h264_params)) == 0) {
+            // Also while the camera has not sent its parameter sets yet
+            log_itf(LOG_WARNING, "Turning away client from %s: camera %d cannot take it now.", ntop(&c->addr, cbuf, sizeof(cbuf)), index);
+            set_client_response(c, REQUEST_UNAVAILABLE, HTTP_SERVICE_UNAVAILABLE);
+        }
+        else {
+            set_client_response_data(c, REQUEST_MP4, MP4_STREAM_HEADER, init, init_len);
+            start_mp4(c, &fbs->buffers[index]);
         }
+    }
+    // /hls/0/index.m3u8, etc
+    else if (strncmp(req.path, "/hls/", strlen("/hls/")) == 0) {
+        index = strtol(&req.path[strlen("/hls/")], &name, 10);
 
-        // This also checks if the file exists
-        if (NULL == realpath(tmp_filename, filename) ||
-            strncmp(filename, s->static_root, strlen(s->static_root)) != 0) {
-                return set_client_response(c, REQUEST_NOT_FOUND, HTTP_NOT_FOUND);
+        if (*name != '/' || index < 0 || index >= fbs->count || !fbs->buffers[index].h264) {
+            set_client_responsef(c, REQUEST_NOT_FOUND, HTTP_NOT_FOUND_TMPL, connection_header(c), (long) strlen(HTTP_NOT_FOUND_BODY));
+        }
+        else {
+            handle_hls_request(c, &fbs->buffers[index], name + 1);
+        }
+    }
+    else if (strcmp(req.path, "/stats") == 0) {
+        stats = build_stats(s, fbs);
+        set_client_responsef(c, REQUEST_STATS, HTTP_JSON_TMPL, connection_header(c), (long) strlen(stats), stats);
+        free(stats);
+    }
+    else if (strncmp(req.path, "/still/", strlen("/still/")) == 0) {
+        index = atoi(&req.path[strlen("/still/")]);
+        if (index < 0 || index >= fbs->count || fbs->buffers[index].h264 || fbs->buffers[index].current_frame < 0) {
+            set_client_responsef(c, REQUEST_NOT_FOUND, HTTP_NOT_FOUND_TMPL, connection_header(c), (long) strlen(HTTP_NOT_FOUND_BODY));
+        }
+        else if (fbs->buffers[index].vd->streaming_state == STREAMING_PAUSED || fbs->buffers[index].still_requests > 0) {
+            // Rather than a frame from whenever it was paused, wake the
+            // camera up for a new one
+            c->request = REQUEST_STILL_WAIT;
+            c->fb = &fbs->buffers[index];
+            c->current_frame = c->fb->current_frame + 1;
+            c->fb->still_requests++;
+        }
+        else {
+            start_still(c, &fbs->buffers[index]);
+        }
+    }
+    else {
 
+        // Serving static file
+        if (!find_static_file(s, req.path, filename)) {
+            return set_client_responsef(c, REQUEST_NOT_FOUND, HTTP_NOT_FOUND_TMPL, connection_header(c), (long) strlen(HTTP_NOT_FOUND_BODY));
         }
 
         // Fill in response template
         snprintf(resp_head, sizeof(resp_head), HTTP_STATIC_FILE_HEADERS_TMPL,
+            connection_header(c),
             (long) file_size(filename),
             get_mime_type(filename)
         );
 
         set_client_response(c, REQUEST_STATIC_FILE, resp_head);
         c->static_file = fopen(filename, "rb");
+        c->static_file_pos = 0;
+        c->static_file_size = file_size(filename);
+        c->static_file_sendfile = (c->ssl == NULL || ssl_ktls_send_enabled(c->ssl));
     }
     
 }
 
-static void respond_to_client(struct server *s, struct client *c) {
+// Resolves a request path to a file under the static root. filename must
+// hold PATH_MAX + 1 bytes. Returns 0 if there is no such file.
+static short find_static_file(struct server *s, const char *path, char *filename) {
+    char tmp_filename[PATH_MAX + 1]; // realpath() needs a second buffer
+
+    if (!strlen(s->static_root)) {
+        return 0;
+    }
+
+    strncpy(tmp_filename, s->static_root, PATH_MAX);
+    strncat(tmp_filename, path, PATH_MAX);
+    if (tmp_filename[strlen(tmp_filename) - 1] == '/') {
+        strncat(tmp_filename, INDEX_FILE_NAME, PATH_MAX);
+    }
+
+    // This also checks if the file exists
+    return realpath(tmp_filename, filename) != NULL && strncmp(filename, s->static_root, strlen(s->static_root)) == 0;
+}
+
+// Steps the rendition a stream client is subscribed to up or down once per
+// ADAPT_INTERVAL, based on how many frames it managed to receive
+static void adapt_rendition(struct client *c, double now) {
+    long wanted;
+    unsigned long delivered;
+    size_t larger_frame_size;
+    struct frame *f;
+    short target = c->target_rendition;
+
+    if (!c->adaptive || now < c->adapt_at) {
+        return;
+    }
+
+    wanted = c->fb->current_frame - c->adapt_camera_frame;
+    if (c->frame_interval > 0) {
+        wanted = min(wanted, (long) ((now - c->adapt_at + ADAPT_INTERVAL) / c->frame_interval));
+    }
+    delivered = c->frames_sent - c->adapt_frames_sent;
+
+    if (wanted > 0 && (delivered < wanted * ADAPT_DOWN_RATIO || c->lag > ADAPT_MAX_LAG)) {
+        target = min(target + 1, RENDITION_COUNT - 1);
+    }
+    else if (wanted > 0 && target > RENDITION_FULL && delivered >= wanted * ADAPT_UP_RATIO && c->lag < ADAPT_MAX_LAG / 2) {
+        // Estimate what the larger rendition needs from its last frame, or
+        // assume four times the pixels if it has not been encoded yet
+        f = get_frame(get_rendition(c->fb, target - 1), c->fb->current_frame);
+        larger_frame_size = (f != NULL && f->data_len > 0) ? f->data_len : 4 * c->last_frame_size;
+
+        if (c->throughput > ADAPT_UP_HEADROOM * larger_frame_size * wanted / ADAPT_INTERVAL) {
+            target--;
+        }
+    }
+
+    if (target != c->target_rendition) {
+        c->fb->rendition_clients[c->target_rendition]--;
+        c->fb->rendition_clients[target]++;
+        c->target_rendition = target;
+    }
+
+    c->adapt_at = now + ADAPT_INTERVAL;
+    c->adapt_frames_sent = c->frames_sent;
+    c->adapt_camera_frame = c->fb->current_frame;
+}
+
+// Moves a stream client that has finished sending its current frame on to
+// the next one, according to its policy and frame rate cap. Leaves the
+// client where it is if no frame is due yet. Constant time.
+static void select_next_frame(struct client *c, double now) {
+    unsigned long next;
+    struct frame_buffer *sb;
+
+    adapt_rendition(c, now);
+
+    // Switch once the new rendition has a frame newer than the one just sent.
+    // Until then the old one may have stopped being encoded, so wait.
+    if (c->target_rendition != c->rendition && get_rendition(c->fb, c->target_rendition)->current_frame > (long) c->current_frame) {
+        c->rendition = c->target_rendition;
+    }
+    sb = get_rendition(c->fb, c->rendition);
+
+    if ((long) c->current_frame >= sb->current_frame) {
+        return; // Nothing newer yet
+    }
+
+    if (c->frame_interval > 0 && now < c->next_frame_at) {
+        return;
+    }
+
+    // Wait for the kernel to drain rather than queue a frame behind old data.
+    // Whatever is newest once it has drained goes out next.
+    if (c->low_latency && unsent_bytes(c) > LOW_LATENCY_MAX_QUEUED) {
+        return;
+    }
+
+    // A client that ran out of egress budget skips to the newest frame
+    // instead of working through a backlog, as do low-latency clients.
+    // Reduced renditions may have gaps from before anyone watched them, so
+    // they are always sent newest first too.
+    next = sb->current_frame;
+    if (c->stream_policy == STREAM_POLICY_EVERY && !c->throttled && !c->low_latency && c->rendition == RENDITION_FULL && get_frame(sb, c->current_frame + 1) != NULL) {
+        next = c->current_frame + 1;
+    }
+
+    c->frames_skipped += next - c->current_frame - 1;
+    c->throttled = 0;
+    c->current_frame = next;
+    c->current_frame_pos = 0;
+    c->frame_started_at = now;
+
+    if (c->frame_interval > 0) {
+        c->next_frame_at += c->frame_interval;
+
+        // Do not make up for frames missed while the client was slow
+        if (c->next_frame_at < now) {
+            c->next_frame_at = now + c->frame_interval;
+        }
+    }
+}
+
+// Sends the newest frame of the camera as a JPEG
+static void start_still(struct client *c, struct frame_buffer *fb) {
+    struct frame *f;
+
+    c->fb = fb;
+    c->current_frame = fb->current_frame;
+    c->current_frame_pos = 0;
+
+    if ((f = get_frame(fb, c->current_frame)) == NULL) {
+        return set_client_response(c, REQUEST_UNAVAILABLE, HTTP_SERVICE_UNAVAILABLE);
+    }
+
+    set_client_responsef(c, REQUEST_STILL, JPEG_HEADERS_TMPL, connection_header(c),
+        (long) (f->data_len - (strlen(FRAME_HEADER) + strlen(FRAME_FOOTER))));
+}
+
+static void respond_to_client(struct server *s, struct client *c, struct frame_buffers *fbs) {
     struct frame *f;
+    struct frame_buffer *sb;
+    double now;
     ssize_t len;
     char buf[SERVER_BUFFER_SIZE];
     
     if (!c->request_received || c->request == REQUEST_INCOMPLETE) {
         return;
     }
+
+    // Once the frame is in, the still goes out in the same turn
+    if (c->request == REQUEST_STILL_WAIT) {
+        if (c->fb->current_frame >= (long) c->current_frame) {
+            c->fb->still_requests--;
+            start_still(c, c->fb);
+        }
+        else if (gettime() - c->last_communication > STILL_CAPTURE_TIMEOUT) {
+            log_it(LOG_WARNING, "Camera did not take a still in time.");
+            c->fb->still_requests--;
+            set_client_response(c, REQUEST_UNAVAILABLE, HTTP_SERVICE_UNAVAILABLE);
+        }
+        else {
+            return;
+        }
+    }
     
     // Serve response in the client's resp buffer
-    if (c->resp_pos < c->resp_len - 1) {
-        if ((len = client_write(c, &c->resp[c->resp_pos], c->resp_len - c->resp_pos)) > 0) {
-            c->resp_pos += len;
+    if (c->resp_pos < c->resp_len) {
+        if ((len = client_send(s, c, &c->resp[c->resp_pos], c->resp_len - c->resp_pos)) < 0) {
+            if (is_transient_error()) {
+                return;
+            }
+            return remove_client(s, c);
         }
+        c->resp_pos += len;
         c->last_communication = gettime();
         return;
     }
@@ -376,13 +2484,12 @@ static void respond_to_client(struct server *s, struct client *c) {
             return remove_client(s, c);
         }
 
-        f = get_frame(c->fb, c->current_frame);
         ssize_t jpeg_len = f->data_len - (strlen(FRAME_HEADER) + strlen(FRAME_FOOTER));
         char *jpeg_ptr = f->data + strlen(FRAME_HEADER);
-        len = client_write(c, jpeg_ptr, jpeg_len - c->current_frame_pos);
+        len = client_send(s, c, jpeg_ptr + c->current_frame_pos, jpeg_len - c->current_frame_pos);
 
         if (len < 0) {
-            if (errno == EINTR) {
+            if (is_transient_error()) {
                 return;
             }
             return remove_client(s, c);
@@ -391,30 +2498,58 @@ static void respond_to_client(struct server *s, struct client *c) {
         c->current_frame_pos += len;
         
         if (c->current_frame_pos == jpeg_len) {
+            return finish_response(s, c, fbs);
+        }
+        return;
+    }
+    // Serve static file straight from the page cache
+    else if (c->request == REQUEST_STATIC_FILE && c->static_file_sendfile) {
+        size_t flen;
+
+        if (c->static_file_pos >= c->static_file_size) {
+            return finish_response(s, c, fbs);
+        }
+
+        if ((flen = egress_allowance(s, c, c->static_file_size - c->static_file_pos)) == 0) {
+            return;
+        }
+
+        if ((len = client_sendfile(c, fileno(c->static_file), &c->static_file_pos, flen)) < 1) {
+            if (len < 0 && is_transient_error()) {
+                return;
+            }
             return remove_client(s, c);
         }
+        egress_consume(s, c, len);
+        c->last_communication = gettime();
+
         return;
     }
     // Serve static file
     else if (c->request == REQUEST_STATIC_FILE) {
         size_t flen;
 
-        if ((flen = fread(buf, sizeof(char), sizeof(buf), c->static_file)) < 1) {
+        if ((flen = send_allowance(s, c, sizeof(buf))) == 0) {
+            return;
+        }
+
+        if ((flen = fread(buf, sizeof(char), flen, c->static_file)) < 1) {
             // File is done, reset client for next request
             if (feof(c->static_file)) {
-                reset_client(c);
+                finish_response(s, c, fbs);
             }
 
             return;
         }
         
         if ((len = client_write(c, buf, flen)) < 0) {
-            if (errno == EINTR) {
-                fseek(c->static_file, len, SEEK_CUR); // Rewind, as if we never read the file
+            if (is_transient_error()) {
+                fseek(c->static_file, -((long) flen), SEEK_CUR); // Rewind, as if we never read the file
                 return;
             }
             return remove_client(s, c);
         }
+        egress_consume(s, c, len);
         c->last_communication = gettime();
 
         if (len < flen) {
@@ -425,24 +2560,53 @@ static void respond_to_client(struct server *s, struct client *c) {
     }
     // Serve stream
     else if (c->request == REQUEST_STREAM) {
+        sb = get_rendition(c->fb, c->rendition);
         
-        if ((f = get_frame(c->fb, c->current_frame)) == NULL) {
+        if ((f = get_frame(sb, c->current_frame)) == NULL) {
+            if (c->mux_part_header_pos > 0) {
+                // Overwritten half way through, and the part has promised a length
+                log_it(LOG_INFO, "Stream client fell too far behind.");
+                return remove_client(s, c);
+            }
+
             // The client is very far behind. Catch them up
-            c->current_frame = c->fb->current_frame;
+            c->current_frame = sb->current_frame;
             c->current_frame_pos = 0;
-            f = get_frame(c->fb, c->current_frame);
+            c->mux_part_header_len = 0;
+            f = get_frame(sb, c->current_frame);
 
             if (f == NULL) {
                 return; // This frame literally does not exist yet
             }
         }
 
-        if (c->current_frame < c->fb->current_frame || (c->current_frame == c->fb->current_frame && c->current_frame_pos < f->data_len)) {
+        if (c->timestamps && c->current_frame_pos == 0 && c->mux_part_header_len == 0) {
+            c->mux_part_header_len = snprintf(c->mux_part_header, sizeof(c->mux_part_header), STREAM_PART_HEADER_TMPL,
+                f->captured_at, (long) (f->data_len - (strlen(FRAME_HEADER) + strlen(FRAME_FOOTER))));
+            c->mux_part_header_pos = 0;
+        }
+
+        if (c->mux_part_header_pos < c->mux_part_header_len) {
+            if ((len = client_send(s, c, &c->mux_part_header[c->mux_part_header_pos], c->mux_part_header_len - c->mux_part_header_pos)) < 0) {
+                if (is_transient_error()) {
+                    return;
+                }
+                return remove_client(s, c);
+            }
+            c->last_communication = gettime();
+            c->mux_part_header_pos += len;
+            if (c->mux_part_header_pos < c->mux_part_header_len) {
+                return;
+            }
+        }
+
+        len = 0;
+        if (c->current_frame_pos < f->data_len) {
 
-            len = client_write(c, &f->data[c->current_frame_pos], f->data_len - c->current_frame_pos);
+            len = client_send(s, c, &f->data[c->current_frame_pos], f->data_len - c->current_frame_pos);
 
             if (len < 0) {
-                if (errno == EINTR) {
+                if (is_transient_error()) {
                     return;
                 }
                 return remove_client(s, c);
@@ -452,38 +2616,76 @@ static void respond_to_client(struct server *s, struct client *c) {
             c->current_frame_pos += len;
         }
 
-        if (c->current_frame_pos == f->data_len && c->current_frame < c->fb->current_frame) {
-            // We have already finished the current frame, and a new frame is available
-            c->current_frame = c->fb->current_frame;
-            c->current_frame_pos = 0;
+        if (c->current_frame_pos == f->data_len) {
+            if (len > 0) {
+                c->frames_sent++; // Just finished it
+                now = gettime();
+                c->lag = now - f->captured_at;
+                c->last_frame_size = f->data_len;
+                if (now > c->frame_started_at) {
+                    c->throughput += THROUGHPUT_SMOOTHING * (f->data_len / (now - c->frame_started_at) - c->throughput);
+                }
+            }
+
+            // We have already finished the current frame, see if another one is due
+            c->mux_part_header_len = 0;
+            c->mux_part_header_pos = 0;
+            select_next_frame(c, gettime());
         }
 
     }
+    else if (c->request == REQUEST_WEBSOCKET) {
+        return ws_respond(s, c);
+    }
+    else if (c->request == REQUEST_MUX) {
+        return mux_respond(s, c);
+    }
+    else if (c->request == REQUEST_MP4) {
+        return mp4_respond(s, c);
+    }
+    else if (c->request == REQUEST_HLS_SEGMENT) {
+        return hls_respond(s, c, fbs);
+    }
+    else if (c->request == REQUEST_HTTP2) {
+        return h2_respond(s, c);
+    }
     // Response was just in the c->resp buffer, so we are done
     else {
-        return remove_client(s, c);
+        return finish_response(s, c, fbs);
     }
 
 }
 
-struct server *create_server(char *host, unsigned short port, struct frame_buffers *fbs, char *static_root, char *auth, char *ssl_cert_file, char *ssl_key_file) {
+struct server *create_server(char *host, unsigned short port, struct frame_buffers *fbs, char *static_root, char *auth, char *ssl_cert_file, char *ssl_key_file, short ssl_ktls, short http2, struct server_limits *limits) {
     struct server *s = malloc(sizeof(struct server));
     size_t stream_info_buf_size;
+    int i;
     
     memset(s->clients, 0, sizeof(s->clients));
+    s->client_count = 0;
+    s->mosaic = NULL;
+    s->push = NULL;
+    s->round_start = 0;
+    s->more_to_send = 0;
+    memcpy(&s->limits, limits, sizeof(struct server_limits));
+
+    token_bucket_init(&s->egress, s->limits.egress_limit, EGRESS_BURST_SECONDS);
+    for (i = 0; i < fbs->count; i++) {
+        token_bucket_init(&fbs->buffers[i].egress, s->limits.camera_egress_limit, EGRESS_BURST_SECONDS);
+    }
 
-    s->sock6 = open_sock(host, port, AF_INET6, SOCK_STREAM);
-    s->sock4 = open_sock(host, port, AF_INET, SOCK_STREAM);
+    s->sock6 = open_sock(host, port, AF_INET6, SOCK_STREAM, s->limits.backlog);
+    s->sock4 = open_sock(host, port, AF_INET, SOCK_STREAM, s->limits.backlog);
     
     if (s->sock4 < 0 && s->sock6 < 0) {
         panic("Could not bind to socket.");
     }
 
-    stream_info_buf_size = sizeof(HTTP_STREAM_INFO_TEMPLATE) + 64; // Should be enough room for the data
+    stream_info_buf_size = sizeof(STREAM_INFO_TMPL) + 64; // Should be enough room for the data
     s->stream_info = malloc(stream_info_buf_size); 
     snprintf(s->stream_info,
             stream_info_buf_size,
-            HTTP_STREAM_INFO_TEMPLATE,
+            STREAM_INFO_TMPL,
             (int) fbs->count,
             fbs->buffers[0].vd->width,
             fbs->buffers[0].vd->height
@@ -499,7 +2701,7 @@ struct server *create_server(char *host, unsigned short port, struct frame_buffe
     s->ssl_ctx = NULL;
 
     if (strlen(ssl_cert_file) && strlen(ssl_key_file)) {
-        s->ssl_ctx = ssl_create_ctx();
+        s->ssl_ctx = ssl_create_ctx(ssl_ktls, http2);
         ssl_load_certs(s->ssl_ctx, ssl_cert_file, ssl_key_file);
     }
     else if (strlen(auth)) {
@@ -541,13 +2743,16 @@ void destroy_server(struct server *s) {
 
 void serve_clients(struct server *s, struct frame_buffers *fbs, double timeout) {
 	fd_set read_set, write_set;
-	int select_result, sock, client_sock, highest_sock_num = max(s->sock4, s->sock6);
-    struct sockaddr_storage client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+	int select_result, sock, highest_sock_num = max(s->sock4, s->sock6), active = 0, i, round;
+    unsigned long long bytes_sent;
+    unsigned long frame;
+    short more;
     struct client *c;
     struct timeval timeout_tv;
     double now = gettime();
 
+    s->now = now;
+
     FD_ZERO(&read_set);
     FD_ZERO(&write_set);
 
@@ -563,11 +2768,23 @@ void serve_clients(struct server *s, struct frame_buffers *fbs, double timeout)
         c = s->clients[sock];
         if (c != NULL) {
             FD_SET(c->sock, &read_set);
-            FD_SET(c->sock, &write_set);
+            if (c->ssl == NULL || c->ssl_accepted || c->ssl_want == SSL_ERROR_WANT_WRITE) {
+                FD_SET(c->sock, &write_set);
+            }
+            if (c->request_received) {
+                active++;
+            }
+            c->round_budget = WRITE_BUDGET_PER_ROUND;
             highest_sock_num = max(highest_sock_num, c->sock);
         }
     }
 
+    s->egress_share = SIZE_MAX;
+    if (!token_bucket_unlimited(&s->egress) && active > 0) {
+        s->egress_share = max((size_t) MIN_EGRESS_QUANTUM, token_bucket_allowance(&s->egress, SIZE_MAX, now) / active);
+    }
+
+    s->more_to_send = 0;
     double_to_timeval(timeout, &timeout_tv);
     if ((select_result = select(highest_sock_num + 1, &read_set, &write_set, NULL, &timeout_tv)) < 0) {
         serrchk("select() failed");
@@ -577,17 +2794,30 @@ void serve_clients(struct server *s, struct frame_buffers *fbs, double timeout)
         return;
     }
 
-    for (sock = 0; sock <= highest_sock_num; sock++) {
+    // Start each pass at a different socket so that low numbered ones are not
+    // always served first
+    s->round_start = (s->round_start + 1) % (highest_sock_num + 1);
+
+    for (i = 0; i <= highest_sock_num; i++) {
+        sock = (s->round_start + i) % (highest_sock_num + 1);
+
+        // Drive pending TLS handshakes without ever blocking on them
+        if ((c = s->clients[sock]) != NULL && c->ssl != NULL && !c->ssl_accepted) {
+            if (FD_ISSET(sock, &read_set) || FD_ISSET(sock, &write_set)) {
+                continue_handshake(s, c);
+            }
+
+            if ((c = s->clients[sock]) != NULL && !c->ssl_accepted && now - c->connected_at > SSL_HANDSHAKE_TIMEOUT) {
+                log_it(LOG_INFO, "SSL handshake timed out.");
+                remove_client(s, c);
+            }
+            continue;
+        }
 
         // Look over read_set
         if (FD_ISSET(sock, &read_set)) {
             if (sock == s->sock4 || sock == s->sock6) {
-                // Accept client
-                if ((client_sock = accept(sock, (struct sockaddr *) &client_addr, &client_addr_len)) < 0) {
-                    serrchk("accept() failed");
-                }
-
-                add_client(s, client_sock, &client_addr, fbs);
+                accept_clients(s, sock, fbs);
                 continue;
             }
             else {
@@ -597,12 +2827,27 @@ void serve_clients(struct server *s, struct frame_buffers *fbs, double timeout)
                 }
             }
         }
+        else if ((c = s->clients[sock]) != NULL && c->ssl != NULL && SSL_pending(c->ssl) > 0) {
+            // OpenSSL may hold already decrypted pipelined requests that select() cannot see
+            read_request(s, c, fbs);
+        }
 
-        // Look over write set
+        // Look over write set. Clients that got something out, or moved on
+        // to a new frame, and were neither blocked nor held back may well
+        // have more, such as the rest of a file, the end of a response or
+        // the frame, so the next pass is due straight away.
         if (FD_ISSET(sock, &write_set)) {
             c = s->clients[sock];
             if (c != NULL) {
-                respond_to_client(s, c);
+                bytes_sent = c->bytes_sent;
+                frame = c->current_frame;
+                c->write_blocked = 0;
+                c->egress_limited = 0;
+                respond_to_client(s, c, fbs);
+
+                if ((c = s->clients[sock]) != NULL && (c->bytes_sent > bytes_sent || c->current_frame != frame) && !c->write_blocked && !c->egress_limited) {
+                    s->more_to_send = 1;
+                }
             }
         }
 
@@ -611,8 +2856,80 @@ void serve_clients(struct server *s, struct frame_buffers *fbs, double timeout)
             if (now - c->last_communication > KEEP_ALIVE_TIMEOUT) {
                 remove_client(s, c);
             }
+            else if (!c->request_received && c->request_header_size == 0 && now - c->last_communication > KEEP_ALIVE_IDLE_TIMEOUT) {
+                remove_client(s, c); // Idle persistent connection
+            }
+        }
+
+    }
+
+    // The budget only makes clients take turns. Those that used all of it
+    // get further turns, in the same order, until their sockets are full or
+    // they have nothing left to send, so that a frame larger than the budget
+    // still goes out in one pass.
+    for (round = 1, more = 1; more && round < MAX_WRITE_ROUNDS; round++) {
+        more = 0;
+        for (i = 0; i <= highest_sock_num; i++) {
+            sock = (s->round_start + i) % (highest_sock_num + 1);
+            if ((c = s->clients[sock]) == NULL || c->round_budget > 0 || !FD_ISSET(sock, &write_set)) {
+                continue;
+            }
+
+            c->round_budget = WRITE_BUDGET_PER_ROUND;
+            respond_to_client(s, c, fbs);
+
+            if ((c = s->clients[sock]) != NULL && c->round_budget == 0) {
+                more = 1;
+            }
+        }
+    }
+    s->more_to_send |= more;
+}
+
+// What serve_clients() would wait for, for the main loop to wait on along
+// with the cameras: new connections, requests and, only while their sockets
+// are full, room to write. Clients with nothing to send wait for the next
+// frame like the cameras do. Returns the number of pollfds filled in, at
+// most SERVER_MAX_POLLFDS, and sets due_at to when serve_clients() must
+// run regardless, -1 if it need not.
+int server_pollfds(struct server *s, struct pollfd *pfds, double *due_at) {
+    struct client *c;
+    int sock, n = 0;
+
+    *due_at = s->more_to_send ? 0 : -1;
+
+    if (s->sock4 >= 0) {
+        pfds[n].fd = s->sock4;
+        pfds[n++].events = POLLIN;
+    }
+
+    if (s->sock6 >= 0) {
+        pfds[n].fd = s->sock6;
+        pfds[n++].events = POLLIN;
+    }
+
+    for (sock = 0; sock < FD_SETSIZE; sock++) {
+        if ((c = s->clients[sock]) == NULL) {
+            continue;
         }
 
+        pfds[n].fd = sock;
+        if (c->ssl != NULL && !c->ssl_accepted) {
+            pfds[n].events = POLLIN | (c->ssl_want == SSL_ERROR_WANT_WRITE ? POLLOUT : 0);
+        }
+        else {
+            // See read_request()
+            pfds[n].events = (!c->request_received || c->request == REQUEST_WEBSOCKET || c->request == REQUEST_HTTP2) ? POLLIN : 0;
+            if (c->write_blocked) {
+                pfds[n].events |= POLLOUT;
+            }
+            if (c->ssl != NULL && SSL_pending(c->ssl) > 0) {
+                *due_at = 0;
+            }
+        }
+        n++;
     }
+
+    return n;
 }
 
@@ -3,16 +3,23 @@
 #define SERVER_H
 
 #include <unistd.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include "openssl/ssl.h"
 
 #include "frames.h"
 #include "utils.h"
+#include "http.h"
+#include "ratelimit.h"
+#include "websocket.h"
+#include "http2.h"
+#include "mp4.h"
 
-#define MAX_SERVER_SOCKET_BACKLOG 5
 #define MAX_REQUEST_HEADER_SIZE 4096
 #define SERVER_BUFFER_SIZE 1024*16
 
+#define RETRY_AFTER "5" // Seconds clients turned away by admission control should wait
+
 #define BOUNDARY "aEjlw7DR5wcqrxG4p12AE0jGIZPlUHyi"
 
 #define STREAM_HEADER "HTTP/1.0 200 OK\r\n" \
@@ -25,63 +32,139 @@
     "Expires: Mon, 1 Jan 2000 00:00:00 GMT\r\n\r\n" \
     "--" BOUNDARY "\r\n"
 
+// /streams interleaves several cameras, so each part replaces nothing
+#define MUX_STREAM_HEADER "HTTP/1.0 200 OK\r\n" \
+    "Server: hawkeye\r\n" \
+    "Connection: close\r\n" \
+    "Access-Control-Allow-Origin: *\r\n" \
+    "Content-Type: multipart/mixed;boundary=" BOUNDARY "\r\n" \
+    "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
+    "Pragma: no-cache\r\n" \
+    "Expires: Mon, 1 Jan 2000 00:00:00 GMT\r\n\r\n" \
+    "--" BOUNDARY "\r\n"
+
+// /mp4/N, an initialization segment and then one fragment per frame
+#define MP4_STREAM_HEADER "HTTP/1.0 200 OK\r\n" \
+    "Server: hawkeye\r\n" \
+    "Connection: close\r\n" \
+    "Access-Control-Allow-Origin: *\r\n" \
+    "Content-Type: video/mp4\r\n" \
+    "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
+    "Pragma: no-cache\r\n" \
+    "Expires: Mon, 1 Jan 2000 00:00:00 GMT\r\n\r\n"
+
+// HLS playlists, initialization segments and media segments
+#define HTTP_MEDIA_TMPL "HTTP/1.1 200 OK\r\n" \
+    "Server: hawkeye\r\n" \
+    "Connection: %s\r\n" \
+    "Access-Control-Allow-Origin: *\r\n" \
+    "Content-Type: %s\r\n" \
+    "Content-Length: %ld\r\n" \
+    "Cache-Control: no-cache\r\n" \
+    "\r\n"
+
+#define HLS_PLAYLIST_TYPE "application/vnd.apple.mpegurl"
+
+// Goes in front of FRAME_HEADER to tag each part of a /streams response
+#define MUX_PART_HEADER_TMPL "X-Camera: %d\r\n" \
+    "X-Timestamp: %.3f\r\n" \
+    "Content-Length: %ld\r\n"
+
+// The same for /stream/N?timestamps=1, which relays read
+#define STREAM_PART_HEADER_TMPL "X-Timestamp: %.3f\r\n" \
+    "Content-Length: %ld\r\n"
+
 #define FRAME_HEADER "Content-Type: image/jpeg\r\n\r\n"
 
 #define FRAME_FOOTER "\r\n--" BOUNDARY "\r\n"
 
+#define HTTP_BAD_REQUEST_BODY "Bad request"
+
 #define HTTP_BAD_REQUEST "HTTP/1.1 400 BAD REQUEST\r\n" \
     "Server: hawkeye\r\n" \
     "Connection: close\r\n" \
     "Access-Control-Allow-Origin: *\r\n" \
     "Content-Type: text/html; charset=utf-8\r\n" \
+    "Content-Length: 11\r\n" \
     "\r\n" \
-    "Bad request"
+    HTTP_BAD_REQUEST_BODY
+
+#define HTTP_AUTH_REQUIRED_BODY "Password required."
 
-#define HTTP_AUTH_REQUIRED "HTTP/1.1 401 NOT AUTHORIZED\r\n" \
+#define HTTP_AUTH_REQUIRED_TMPL "HTTP/1.1 401 NOT AUTHORIZED\r\n" \
     "Server: hawkeye\r\n" \
-    "Connection: close\r\n" \
+    "Connection: %s\r\n" \
     "Access-Control-Allow-Origin: *\r\n" \
     "WWW-Authenticate: Basic realm=\"Hawkeye\"\r\n" \
     "Content-Type: text/html; charset=utf-8\r\n" \
+    "Content-Length: %ld\r\n" \
     "\r\n" \
-    "Password required."
+    HTTP_AUTH_REQUIRED_BODY
+
+#define HTTP_NOT_FOUND_BODY "Could not find resource at this URL."
 
-#define HTTP_NOT_FOUND "HTTP/1.1 404 NOT FOUND\r\n" \
+#define HTTP_NOT_FOUND_TMPL "HTTP/1.1 404 NOT FOUND\r\n" \
+    "Server: hawkeye\r\n" \
+    "Connection: %s\r\n" \
+    "Access-Control-Allow-Origin: *\r\n" \
+    "Content-Type: text/html; charset=utf-8\r\n" \
+    "Content-Length: %ld\r\n" \
+    "\r\n" \
+    HTTP_NOT_FOUND_BODY
+
+#define HTTP_SERVICE_UNAVAILABLE_BODY "Server is busy, try again later."
+
+#define HTTP_SERVICE_UNAVAILABLE "HTTP/1.1 503 SERVICE UNAVAILABLE\r\n" \
     "Server: hawkeye\r\n" \
     "Connection: close\r\n" \
     "Access-Control-Allow-Origin: *\r\n" \
+    "Retry-After: " RETRY_AFTER "\r\n" \
     "Content-Type: text/html; charset=utf-8\r\n" \
+    "Content-Length: 32\r\n" \
     "\r\n" \
-    "Could not find resource at this URL."
+    HTTP_SERVICE_UNAVAILABLE_BODY
 
 #define HTTP_STATIC_FILE_HEADERS_TMPL "HTTP/1.1 200 OK\r\n" \
     "Server: hawkeye\r\n" \
-    "Connection: keep-alive\r\n" \
+    "Connection: %s\r\n" \
     "Access-Control-Allow-Origin: *\r\n" \
     "Content-Length: %ld\r\n" \
     "Content-Type: %s\r\n" \
     "\r\n"
 
-#define HTTP_STREAM_INFO_TEMPLATE "HTTP/1.0 200 OK\r\n" \
+#define STREAM_INFO_TMPL "{\"stream_count\": %d, \"width\": %d, \"height\": %d}"
+
+#define HTTP_JSON_TMPL "HTTP/1.1 200 OK\r\n" \
     "Server: hawkeye\r\n" \
-    "Connection: close\r\n" \
+    "Connection: %s\r\n" \
     "Access-Control-Allow-Origin: *\r\n" \
     "Content-Type: application/json\r\n" \
+    "Content-Length: %ld\r\n" \
     "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
     "Pragma: no-cache\r\n" \
     "Expires: Mon, 1 Jan 2000 00:00:00 GMT\r\n" \
     "\r\n" \
-    "{\"stream_count\": %d, \"width\": %d, \"height\": %d}"
+    "%s"
 
-#define JPEG_HEADER "HTTP/1.0 200 OK\r\n" \
+#define HTTP_WEBSOCKET_ACCEPT_TMPL "HTTP/1.1 101 Switching Protocols\r\n" \
+    "Upgrade: websocket\r\n" \
+    "Connection: Upgrade\r\n" \
+    "Sec-WebSocket-Accept: %s\r\n" \
+    "\r\n"
+
+#define JPEG_HEADERS_TMPL "HTTP/1.1 200 OK\r\n" \
     "Server: hawkeye\r\n" \
-    "Connection: close\r\n" \
+    "Connection: %s\r\n" \
     "Access-Control-Allow-Origin: *\r\n" \
     "Content-Type: image/jpeg\r\n" \
+    "Content-Length: %ld\r\n" \
     "Cache-Control: no-store, no-cache, pre-check=0, post-check=0, max-age=0\r\n" \
     "Pragma: no-cache\r\n" \
     "Expires: Mon, 1 Jan 2000 00:00:00 GMT\r\n\r\n"
 
+// Value of the Connection header for persistent and non-persistent responses
+#define connection_header(c) ((c)->keep_alive ? "keep-alive" : "close")
+
 
 #define REQUEST_INCOMPLETE 0
 #define REQUEST_STREAM 1
@@ -91,47 +174,274 @@
 #define REQUEST_STATIC_FILE 5
 #define REQUEST_AUTH_REQUIRED 6
 #define REQUEST_STILL 7
+#define REQUEST_UNAVAILABLE 8
+#define REQUEST_STATS 9
+#define REQUEST_WEBSOCKET 10
+#define REQUEST_MUX 11
+#define REQUEST_HTTP2 12
+#define REQUEST_HLS 13 // Playlist or initialization segment, all in resp
+#define REQUEST_HLS_SEGMENT 14
+#define REQUEST_MP4 15
+#define REQUEST_STILL_WAIT 16 // /still of a paused camera, waiting for it to take one
+
+#define is_stream_request(c) ((c)->request == REQUEST_STREAM || (c)->request == REQUEST_WEBSOCKET)
+
+// How /stream picks the next frame, set with ?policy=
+#define STREAM_POLICY_LATEST 0 // Skip to the newest frame (default)
+#define STREAM_POLICY_EVERY 1 // Send frames in order as long as they are still buffered
+
+#define EGRESS_BURST_SECONDS 0.25 // How much unused bandwidth a token bucket may save up
+#define MIN_EGRESS_QUANTUM 1460 // Smallest fair share of the global egress limit, about one TCP segment
+#define WRITE_BUDGET_PER_ROUND (64 * 1024) // Most a client may write in one turn of a pass of serve_clients()
+#define MAX_WRITE_ROUNDS 16 // Turns a pass gives clients that still have data and room for it
+#define SERVER_MAX_POLLFDS (FD_SETSIZE + 2) // See server_pollfds()
+
+// Low-latency streams keep little data queued in the kernel so that they can
+// always jump to the newest frame
+#define LOW_LATENCY_NOTSENT_LOWAT (16 * 1024)
+#define LOW_LATENCY_SNDBUF (64 * 1024)
+#define LOW_LATENCY_MAX_QUEUED (32 * 1024) // Hold off the next frame while more than this is queued
+
+// Adaptive quality. Every ADAPT_INTERVAL seconds a stream client that got
+// fewer than ADAPT_DOWN_RATIO of the frames it asked for, or lags by more than
+// ADAPT_MAX_LAG seconds, moves to a smaller rendition. It moves back up once
+// it keeps up and its measured throughput has ADAPT_UP_HEADROOM times what the
+// larger rendition needs.
+#define ADAPT_INTERVAL 2.0
+#define ADAPT_DOWN_RATIO 0.75
+#define ADAPT_UP_RATIO 0.95
+#define ADAPT_MAX_LAG 1.0
+#define ADAPT_UP_HEADROOM 2.0
+#define THROUGHPUT_SMOOTHING 0.25 // Weight of the newest frame in the throughput average
+
+#define MAX_MUX_CAMERAS 64
+
+// HTTP/2 connections
+#define H2_MAX_STREAMS 32 // SETTINGS_MAX_CONCURRENT_STREAMS we advertise
+#define H2_MAX_HEADER_BLOCK (16 * 1024) // Largest request header block accepted
+#define H2_MAX_RESPONSE_HEADERS 512 // Room for the HPACK encoded headers of a response
+#define H2_MAX_UNSENT (4 * WRITE_BUDGET_PER_ROUND) // Unsent output at which a client that sends frames without reading the replies is cut off
+#define H2_LINGER_TIMEOUT 2.0 // Seconds a client has to hang up after the GOAWAY, see h2_respond()
+#define H2_CACHE_CONTROL "no-store, no-cache, must-revalidate, max-age=0"
+#define H2_FILE_CHUNK_SIZE H2_DEFAULT_MAX_FRAME_SIZE // Read from a static file at a time, for one DATA frame
 
 #define KEEP_ALIVE_TIMEOUT 30.0
+#define STILL_CAPTURE_TIMEOUT 10.0 // How long /still waits for a paused camera
+#define SSL_HANDSHAKE_TIMEOUT 10.0
+#define KEEP_ALIVE_IDLE_TIMEOUT 15.0 // How long a persistent connection may sit between requests
+#define MAX_RESPONSE_HEADER_SIZE 1024
+
+// One camera of a /streams response
+struct mux_camera {
+    struct frame_buffer *fb;
+    int index;
+    long last_frame;            // Last frame sent, -1 if none yet
+    double frame_interval;      // Seconds between frames, 0 for no cap
+    double next_frame_at;
+};
+
+// Fields of an HTTP/2 request that we look at
+struct h2_request {
+    char method[16];
+    char path[1024];
+    char authorization[256];
+    short has_authorization;
+};
+
+// One request/response on an HTTP/2 connection. Responses are copied into
+// body so that the camera buffers may move on while they wait for window.
+struct h2_stream {
+    uint32_t id;
+    int request;                // REQUEST_STREAM for a live camera stream, otherwise the response ends
+    int32_t window;             // What the peer lets us send on this stream, may go negative
+    short done;                 // Fully sent, to be closed
+
+    unsigned char headers[H2_MAX_RESPONSE_HEADERS];
+    size_t headers_len;
+    short headers_sent;
+
+    char *body;
+    size_t body_len;
+    size_t body_pos;
+
+    // Static files are read into body a chunk at a time as the window allows,
+    // body_len and body_pos being of the whole file
+    FILE *file;
+
+    // Live streams. A new frame is only picked once the last one has been
+    // sent, so a stream that is out of window skips to the newest frame.
+    struct frame_buffer *fb;
+    long last_frame;            // Last frame queued, -1 if none yet
+    double frame_interval;
+    double next_frame_at;
+    double captured_at;         // Of the frame being sent, 0 once it has been counted
+};
+
+struct h2_session {
+    unsigned char in[H2_FRAME_HEADER_SIZE + H2_DEFAULT_MAX_FRAME_SIZE];
+    size_t in_len;
+    short preface_received;
+
+    struct hpack_table decoder;
+    unsigned char *header_block;    // HEADERS and CONTINUATION fragments being collected
+    size_t header_block_len;
+    uint32_t header_block_stream;   // 0 unless collecting
+
+    int32_t window;                 // Connection send window
+    int32_t initial_window;         // Peer's SETTINGS_INITIAL_WINDOW_SIZE
+    uint32_t max_frame_size;        // Peer's SETTINGS_MAX_FRAME_SIZE
+    uint32_t last_stream_id;
+
+    struct h2_stream streams[H2_MAX_STREAMS];
+    int stream_count;
+    int next_stream;                // Where the round-robin over streams resumes
+
+    unsigned char *out;             // Outgoing frames
+    size_t out_size;
+    size_t out_len;
+    size_t out_pos;
+    short closing;                  // Close the connection once out has been sent
+    double shut_down_at;            // When out had been sent and writes were shut down, 0 before
+};
 
 struct client {
     int sock;
     struct sockaddr_storage addr;
     SSL *ssl;
+    char ssl_accepted;      // Set once the TLS handshake has completed
+    int ssl_want;           // SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE while handshaking
+    size_t ssl_retry_len;   // Of an SSL_write() that must be retried, 0 if none
+    short write_blocked;    // The last write found the socket full
+    double connected_at;
 
     unsigned long current_frame;
     size_t current_frame_pos;
     double last_communication;
 
+    short stream_policy;        // STREAM_POLICY_*
+    double frame_interval;      // Minimum seconds between frames, from ?fps=. 0 for no limit
+    double next_frame_at;       // When the next frame may be started
+    short low_latency;
+    short timestamps;           // Tag each part, from ?timestamps=1. Uses mux_part_header.
+
+    short rendition;            // RENDITION_* being sent
+    short target_rendition;     // RENDITION_* to switch to at the next frame boundary
+    short adaptive;             // Pick target_rendition from measured throughput and lag
+    double frame_started_at;
+    double throughput;          // Bytes per second while sending a frame, averaged
+    size_t last_frame_size;
+
+    // WebSocket streams, see /ws/stream/N
+    unsigned char *ws_buf;      // Outgoing frames
+    size_t ws_buf_size;
+    size_t ws_len;
+    size_t ws_pos;
+    short ws_acked;             // The client has acknowledged the last JPEG sent
+    short ws_frame_pending;     // ws_buf holds a JPEG that has not been fully sent
+    short ws_closing;           // Close the connection once ws_buf has been sent
+    double ws_captured_at;      // Capture time of the last JPEG sent
+
+    // Multiplexed streams, see /streams
+    struct mux_camera *mux;
+    int mux_count;
+    int mux_next;               // Where the round-robin over mux resumes
+    int mux_current;            // Camera whose frame is being sent, -1 between parts
+    char mux_part_header[128];
+    size_t mux_part_header_len;
+    size_t mux_part_header_pos;
+
+    struct h2_session *h2;      // Set on connections that negotiated HTTP/2
+
+    // Fragmented MP4 streams of H.264 cameras, see /mp4/N. Frames depend on
+    // the ones before, so after a gap the stream resumes at a keyframe.
+    unsigned char mp4_header[mp4_fragment_header_size(1)];
+    size_t mp4_header_len;      // Of the fragment being sent, 0 between fragments
+    size_t mp4_header_pos;
+    long mp4_next_frame;        // -1 while waiting for a keyframe
+    long mp4_last_frame;        // Last frame sent, -1 if none yet
+    uint32_t mp4_sequence;
+    double mp4_started_at;      // Capture time at decode time 0
+
+    unsigned long hls_sequence; // Segment being sent, see /hls/N/
+
+    double adapt_at;            // End of the current measurement window
+    unsigned long adapt_frames_sent;
+    long adapt_camera_frame;
+
+    struct token_bucket egress;
+    char throttled;             // Ran out of egress budget during the current frame
+    char egress_limited;        // The egress limits cut the last write short
+    size_t round_budget;        // What is left of WRITE_BUDGET_PER_ROUND in this pass
+
+    // Statistics, see /stats
+    unsigned long long bytes_sent;
+    unsigned long frames_sent;
+    unsigned long frames_skipped;
+    unsigned long throttled_writes;
+    double lag;                 // Age of the last frame when it was handed to the kernel
+
     char request_headers[MAX_REQUEST_HEADER_SIZE];
     size_t request_header_size;
     char request_received;
+    struct http_parser parser;
+    short keep_alive;
 
     size_t resp_pos;
     size_t resp_len;
     char *resp;
 
     FILE *static_file;
+    off_t static_file_pos;
+    off_t static_file_size;
+    short static_file_sendfile; // Send the file with sendfile() rather than read/write
 
     int request; // If non-negative: index of stream to send. If negative: serve the specific response
 
     struct frame_buffer *fb;
 };
 
+// Admission control. A limit of 0 means unlimited.
+struct server_limits {
+    int backlog;
+    int max_clients;
+    int max_clients_per_ip;
+    int max_streams_per_camera;
+
+    // Egress limits in bytes per second. A limit of 0 means unlimited.
+    double egress_limit;
+    double client_egress_limit;
+    double camera_egress_limit;
+
+    short low_latency;      // Streams default to low-latency mode
+    short adaptive_quality; // Streams default to adaptive quality
+};
+
 struct server {
     int sock4;
     int sock6;
     SSL_CTX *ssl_ctx;
 
     struct client *clients[FD_SETSIZE];
+    int client_count;
+    struct server_limits limits;
+
+    struct token_bucket egress;
+    size_t egress_share;    // Fair share of the global egress budget per client for this round
+    int round_start;        // Socket the current pass of serve_clients() started at
+    short more_to_send;     // The last pass left clients with more to send straight away
+    double now;
+
+    struct frame_buffer *mosaic;   // Composite of all cameras, NULL if disabled
+    struct push *push;             // Uplink to an ingest server, NULL if disabled
 
     char *stream_info;
     char *auth;
     char *static_root;
 };
 
-struct server *create_server(char *host, unsigned short port, struct frame_buffers *fbs, char *static_root, char *auth, char *ssl_cert_file, char *ssl_key_file);
+struct server *create_server(char *host, unsigned short port, struct frame_buffers *fbs, char *static_root, char *auth, char *ssl_cert_file, char *ssl_key_file, short ssl_ktls, short http2, struct server_limits *limits);
 void serve_clients(struct server *s, struct frame_buffers *fbs, double timeout);
+int server_pollfds(struct server *s, struct pollfd *pfds, double *due_at);
 void destroy_server(struct server *s);
 
 #endif
@@ -10,11 +10,26 @@
 #include "version.h"
 #include "config.h"
 #include "utils.h"
+#include "v4l2uvc.h"
 
 #include "settings.h"
 
 struct settings settings;
 
+// A : separates devices, except within a URL, where it only does in front
+// of a path or of the next URL
+static short is_device_separator(const char *device, const char *c) {
+    if (*c != ':') {
+        return 0;
+    }
+
+    if (strncmp(device, "http://", strlen("http://")) != 0) {
+        return 1;
+    }
+
+    return (c[1] == '/' && c[2] != '/') || strncmp(&c[1], "http://", strlen("http://")) == 0;
+}
+
 static void normalize_path(char **path, const char *error) {
     char tmp_path[PATH_MAX];
 
@@ -34,13 +49,27 @@ void print_usage() {
     fprintf(stdout, "Usage: %s [-d] [-c config] [-H host] [-p port] [-w www-root] [-P pidfile]\n", program_name);
     fprintf(stdout, "       [-l logfile] [-u user] [-g group] [-F fps] [-D video-devices] [-W width]\n");
     fprintf(stdout, "       [-G height] [-j jpeg-quality] [-L log-level] [-f format] [-A user:pass]\n");
-    fprintf(stdout, "       [-C cert-file] [-k key-file]\n");
+    fprintf(stdout, "       [-C cert-file] [-k key-file] [-K] [-2] [-b backlog] [-m max-clients]\n");
+    fprintf(stdout, "       [-i max-clients-per-ip] [-s max-streams-per-camera] [-e egress-limit]\n");
+    fprintf(stdout, "       [-E client-egress-limit] [-x camera-egress-limit] [-y]\n");
+    fprintf(stdout, "       [-q] [-M mosaic-layout] [-r mosaic-fps] [-X mosaic-width]\n");
+    fprintf(stdout, "       [-Y mosaic-height] [-R rtsp-port] [-U rtp-port] [-Z multicast-group]\n");
+    fprintf(stdout, "       [-O push-url] [-B push-backlog] [-I idle-timeout] [-n capture-buffers]\n");
+    fprintf(stdout, "       [-N]\n");
     fprintf(stdout, "\n");
     fprintf(stdout, "Usage: %s [--daemon] [--config=path] [--host=host] [--port=port]\n", program_name);
     fprintf(stdout, "       [--www-root=path] [--pid=path] [--log=path] [--user=user] [--group=group]\n");
     fprintf(stdout, "       [--fps=fps][--devices=video-devices] [--width=width] [--height=height]\n");
     fprintf(stdout, "       [--quality=quality] [--log-level=log-level] [--format=format]\n");
-    fprintf(stdout, "       [--auth=user:pass] [--cert=cert-file] [--key=key-file]\n");
+    fprintf(stdout, "       [--auth=user:pass] [--cert=cert-file] [--key=key-file] [--ktls]\n");
+    fprintf(stdout, "       [--http2] [--backlog=backlog] [--max-clients=n] [--max-clients-per-ip=n]\n");
+    fprintf(stdout, "       [--max-streams-per-camera=n] [--egress-limit=KB/s]\n");
+    fprintf(stdout, "       [--client-egress-limit=KB/s] [--camera-egress-limit=KB/s]\n");
+    fprintf(stdout, "       [--low-latency] [--fixed-quality] [--mosaic-layout=COLSxROWS|auto]\n");
+    fprintf(stdout, "       [--mosaic-fps=fps] [--mosaic-width=width] [--mosaic-height=height]\n");
+    fprintf(stdout, "       [--rtsp-port=port] [--rtp-port=port] [--rtsp-multicast=group]\n");
+    fprintf(stdout, "       [--push-url=url] [--push-backlog=frames] [--idle-timeout=seconds]\n");
+    fprintf(stdout, "       [--capture-buffers=n[,n...]] [--fresh-capture]\n");
 
     fprintf(stdout, "Usage: %s [-h]\n", program_name);
     fprintf(stdout, "Usage: %s [-v]\n", program_name);
@@ -48,12 +77,15 @@ void print_usage() {
     fprintf(stdout, "devices is a : separated list of video devices, such as\n");
     fprintf(stdout, "for example \"/dev/video0:/dev/video1\".\n");
     fprintf(stdout, "log-level can be debug, info, warning, or error.\n");
-    fprintf(stdout, "format can be mjpeg (recommended) or yuv.\n");
+    fprintf(stdout, "format can be mjpeg (recommended), yuv or h264.\n");
+    fprintf(stdout, "A device may also be an H.264, MJPEG or .yuv recording, which is played\n");
+    fprintf(stdout, "in a loop, \"pattern\" for test colour bars, or the URL of another\n");
+    fprintf(stdout, "hawkeye's stream, e.g. http://host:8000/stream/0.\n");
 }
 
 void init_settings(int argc, char *argv[]) {
     struct config *conf;
-    char *log_level, *v4l2_format, *video_device_files;
+    char *log_level, *v4l2_format, *video_device_files, *capture_buffers, *p;
     short display_version, display_usage;
     int i, video_devices_len;
 
@@ -75,6 +107,29 @@ void init_settings(int argc, char *argv[]) {
     add_config_item(conf, 'A', "auth", CONFIG_STR, &settings.auth, DEFAULT_AUTH);
     add_config_item(conf, 'C', "cert", CONFIG_STR, &settings.ssl_cert_file, DEFAULT_SSL_CERT_FILE);
     add_config_item(conf, 'k', "key", CONFIG_STR, &settings.ssl_key_file, DEFAULT_SSL_KEY_FILE);
+    add_config_item(conf, 'K', "ktls", CONFIG_BOOL, &settings.ssl_ktls, DEFAULT_SSL_KTLS);
+    add_config_item(conf, '2', "http2", CONFIG_BOOL, &settings.http2, DEFAULT_HTTP2);
+    add_config_item(conf, 'b', "backlog", CONFIG_INT, &settings.backlog, DEFAULT_BACKLOG);
+    add_config_item(conf, 'm', "max-clients", CONFIG_INT, &settings.max_clients, DEFAULT_MAX_CLIENTS);
+    add_config_item(conf, 'i', "max-clients-per-ip", CONFIG_INT, &settings.max_clients_per_ip, DEFAULT_MAX_CLIENTS_PER_IP);
+    add_config_item(conf, 's', "max-streams-per-camera", CONFIG_INT, &settings.max_streams_per_camera, DEFAULT_MAX_STREAMS_PER_CAMERA);
+    add_config_item(conf, 'e', "egress-limit", CONFIG_INT, &settings.egress_limit, DEFAULT_EGRESS_LIMIT);
+    add_config_item(conf, 'E', "client-egress-limit", CONFIG_INT, &settings.client_egress_limit, DEFAULT_CLIENT_EGRESS_LIMIT);
+    add_config_item(conf, 'x', "camera-egress-limit", CONFIG_INT, &settings.camera_egress_limit, DEFAULT_CAMERA_EGRESS_LIMIT);
+    add_config_item(conf, 'y', "low-latency", CONFIG_BOOL, &settings.low_latency, DEFAULT_LOW_LATENCY);
+    add_config_item(conf, 'q', "fixed-quality", CONFIG_BOOL, &settings.fixed_quality, DEFAULT_FIXED_QUALITY);
+    add_config_item(conf, 'M', "mosaic-layout", CONFIG_STR, &settings.mosaic_layout, DEFAULT_MOSAIC_LAYOUT);
+    add_config_item(conf, 'r', "mosaic-fps", CONFIG_INT, &settings.mosaic_fps, DEFAULT_MOSAIC_FPS);
+    add_config_item(conf, 'X', "mosaic-width", CONFIG_INT, &settings.mosaic_width, DEFAULT_MOSAIC_WIDTH);
+    add_config_item(conf, 'Y', "mosaic-height", CONFIG_INT, &settings.mosaic_height, DEFAULT_MOSAIC_HEIGHT);
+    add_config_item(conf, 'R', "rtsp-port", CONFIG_INT, &settings.rtsp_port, DEFAULT_RTSP_PORT);
+    add_config_item(conf, 'U', "rtp-port", CONFIG_INT, &settings.rtp_port, DEFAULT_RTP_PORT);
+    add_config_item(conf, 'Z', "rtsp-multicast", CONFIG_STR, &settings.rtsp_multicast, DEFAULT_RTSP_MULTICAST);
+    add_config_item(conf, 'O', "push-url", CONFIG_STR, &settings.push_url, DEFAULT_PUSH_URL);
+    add_config_item(conf, 'B', "push-backlog", CONFIG_INT, &settings.push_backlog, DEFAULT_PUSH_BACKLOG);
+    add_config_item(conf, 'I', "idle-timeout", CONFIG_INT, &settings.idle_timeout, DEFAULT_IDLE_TIMEOUT);
+    add_config_item(conf, 'n', "capture-buffers", CONFIG_STR, &capture_buffers, DEFAULT_CAPTURE_BUFFERS);
+    add_config_item(conf, 'N', "fresh-capture", CONFIG_BOOL, &settings.fresh_capture, DEFAULT_FRESH_CAPTURE);
     
     add_config_item(conf, 'L', "log-level", CONFIG_STR, &log_level, DEFAULT_LOG_LEVEL);
     add_config_item(conf, 'f', "format", CONFIG_STR, &v4l2_format, DEFAULT_V4L2_FORMAT);
@@ -119,6 +174,9 @@ void init_settings(int argc, char *argv[]) {
     if (strcmp(v4l2_format, "yuv") == 0) {
         settings.v4l2_format = V4L2_PIX_FMT_YUYV;
     }
+    else if (strcmp(v4l2_format, "h264") == 0) {
+        settings.v4l2_format = V4L2_PIX_FMT_H264;
+    }
     
     // Parse video devices
     settings.video_device_count = 0;
@@ -127,7 +185,7 @@ void init_settings(int argc, char *argv[]) {
 
     video_devices_len = strlen(video_device_files);
     for (i = 0; i < video_devices_len; i++) {
-        if (video_device_files[i] == ':') {
+        if (is_device_separator(settings.video_device_files[settings.video_device_count - 1], &video_device_files[i])) {
             video_device_files[i] = '\0';
             if (i + 1 < video_devices_len) {
                 settings.video_device_files[settings.video_device_count++] = &video_device_files[i + 1];
@@ -135,12 +193,38 @@ void init_settings(int argc, char *argv[]) {
         }
     }
 
+    // Parse queue depths, one per device in turn. The last one given goes
+    // for the devices after it.
+    settings.capture_buffers = malloc(settings.video_device_count * sizeof(int));
+    for (i = 0, p = capture_buffers; i < settings.video_device_count; i++) {
+        settings.capture_buffers[i] = (i > 0) ? settings.capture_buffers[i - 1] : NB_BUFFER;
+        if (p != NULL && *p != '\0') {
+            settings.capture_buffers[i] = atoi(p);
+            p = strchr(p, ',');
+            p = (p != NULL) ? p + 1 : NULL;
+        }
+    }
+
     free(log_level);
     free(v4l2_format);
+    free(capture_buffers);
 
     settings.port = (unsigned short) abs(settings.port);
+    settings.rtsp_port = (unsigned short) abs(settings.rtsp_port);
+    // RTP and RTCP take a pair of ports, the even one first
+    settings.rtp_port = max(1024, min(65534, settings.rtp_port)) & ~1;
     settings.jpeg_quality = max(1, min(100, settings.jpeg_quality));
     settings.fps = max(1, min(50, settings.fps));
+    settings.mosaic_fps = max(1, min(settings.fps, settings.mosaic_fps));
+    settings.mosaic_width = max(16, min(4096, settings.mosaic_width));
+    settings.mosaic_height = max(16, min(4096, settings.mosaic_height));
+    settings.backlog = max(1, settings.backlog);
+    settings.max_clients = max(0, settings.max_clients);
+    settings.max_clients_per_ip = max(0, settings.max_clients_per_ip);
+    settings.max_streams_per_camera = max(0, settings.max_streams_per_camera);
+    settings.egress_limit = max(0, settings.egress_limit);
+    settings.client_egress_limit = max(0, settings.client_egress_limit);
+    settings.camera_egress_limit = max(0, settings.camera_egress_limit);
 
     normalize_path(&settings.static_root, "The www-root you specified does not exist");
     normalize_path(&settings.ssl_cert_file, "The SSL certificate file you specified does not exist");
@@ -166,9 +250,13 @@ void cleanup_settings() {
     free(settings.group);
     free(settings.video_device_files[0]);
     free(settings.video_device_files);
+    free(settings.capture_buffers);
     free(settings.static_root);
     free(settings.auth);
     free(settings.ssl_cert_file);
     free(settings.ssl_key_file);
+    free(settings.mosaic_layout);
+    free(settings.rtsp_multicast);
+    free(settings.push_url);
 }
 
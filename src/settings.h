@@ -20,6 +20,29 @@
 #define DEFAULT_AUTH ""
 #define DEFAULT_SSL_CERT_FILE ""
 #define DEFAULT_SSL_KEY_FILE ""
+#define DEFAULT_SSL_KTLS "0"
+#define DEFAULT_HTTP2 "0"
+#define DEFAULT_BACKLOG "128"
+#define DEFAULT_MAX_CLIENTS "0"
+#define DEFAULT_MAX_CLIENTS_PER_IP "0"
+#define DEFAULT_MAX_STREAMS_PER_CAMERA "0"
+#define DEFAULT_EGRESS_LIMIT "0"
+#define DEFAULT_CLIENT_EGRESS_LIMIT "0"
+#define DEFAULT_CAMERA_EGRESS_LIMIT "0"
+#define DEFAULT_LOW_LATENCY "0"
+#define DEFAULT_FIXED_QUALITY "0"
+#define DEFAULT_MOSAIC_LAYOUT ""
+#define DEFAULT_MOSAIC_FPS "2"
+#define DEFAULT_MOSAIC_WIDTH "1280"
+#define DEFAULT_MOSAIC_HEIGHT "720"
+#define DEFAULT_RTSP_PORT "0"
+#define DEFAULT_RTP_PORT "5004"
+#define DEFAULT_RTSP_MULTICAST ""
+#define DEFAULT_PUSH_URL ""
+#define DEFAULT_PUSH_BACKLOG "2"
+#define DEFAULT_IDLE_TIMEOUT "0"
+#define DEFAULT_CAPTURE_BUFFERS "4"
+#define DEFAULT_FRESH_CAPTURE "0"
 
 struct settings {
 	short run_in_background;
@@ -35,6 +58,28 @@ struct settings {
 	char *auth;
 	char *ssl_cert_file;
 	char *ssl_key_file;
+	short ssl_ktls;
+	short http2;
+	int backlog;
+	int max_clients;
+	int max_clients_per_ip;
+	int max_streams_per_camera;
+	int egress_limit;
+	int client_egress_limit;
+	int camera_egress_limit;
+	short low_latency;
+	short fixed_quality;
+	char *mosaic_layout;
+	int mosaic_fps;
+	int mosaic_width;
+	int mosaic_height;
+	int rtsp_port;
+	int rtp_port;
+	char *rtsp_multicast;
+	char *push_url;
+	int push_backlog;
+	int idle_timeout;
+	short fresh_capture;
 	int width;
 	int height;
 	int jpeg_quality;
@@ -43,6 +88,7 @@ struct settings {
 	int v4l2_format;
 	int video_device_count;
 	char **video_device_files;
+	int *capture_buffers; // Depth of the driver's queue, per device
 };
 
 void init_settings(int argc, char *argv[]);
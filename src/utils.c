@@ -8,6 +8,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "utils.h"
+
 double gettime() {
     struct timeval tv;
     gettimeofday(&tv, NULL);
@@ -118,3 +120,86 @@ char *base64_encode(const unsigned char *data) {
     return encoded_data;
 }
 
+
+// Splits [http|https]://[user:pass@]host[:port][/path] up. Returns -1 if
+// it is not such a URL. u->auth is allocated and left to the caller.
+int parse_http_url(const char *url, struct http_url *u) {
+    const char *p, *path, *at, *host_end, *port = NULL;
+    char userinfo[256];
+
+    memset(u, 0, sizeof(struct http_url));
+
+    if (strncmp(url, "http://", strlen("http://")) == 0) {
+        p = url + strlen("http://");
+    }
+    else if (strncmp(url, "https://", strlen("https://")) == 0) {
+        p = url + strlen("https://");
+        u->tls = 1;
+    }
+    else {
+        return -1;
+    }
+
+    if ((path = strchr(p, '/')) == NULL) {
+        path = p + strlen(p);
+    }
+
+    if ((at = memchr(p, '@', path - p)) != NULL) {
+        if (at - p >= sizeof(userinfo)) {
+            return -1;
+        }
+        memcpy(userinfo, p, at - p);
+        userinfo[at - p] = '\0';
+        u->auth = base64_encode((unsigned char *) userinfo);
+        p = at + 1;
+    }
+
+    // IPv6 addresses come in brackets
+    if (*p == '[') {
+        if ((host_end = memchr(p, ']', path - p)) == NULL) {
+            return -1;
+        }
+        p++;
+        port = (host_end[1] == ':') ? host_end + 2 : NULL;
+    }
+    else if ((host_end = memchr(p, ':', path - p)) != NULL) {
+        port = host_end + 1;
+    }
+    else {
+        host_end = path;
+    }
+
+    if (host_end == p || host_end - p >= sizeof(u->host) || (port != NULL && (path - port == 0 || path - port >= sizeof(u->port)))) {
+        return -1;
+    }
+
+    memcpy(u->host, p, host_end - p);
+    u->host[host_end - p] = '\0';
+
+    if (port != NULL) {
+        memcpy(u->port, port, path - port);
+        u->port[path - port] = '\0';
+    }
+    else {
+        strcpy(u->port, u->tls ? "443" : "80");
+    }
+
+    if (*path == '\0') {
+        path = "/";
+    }
+
+    if (strlen(path) >= sizeof(u->path)) {
+        return -1;
+    }
+    strcpy(u->path, path);
+
+    snprintf(u->display, sizeof(u->display), strchr(u->host, ':') ? "%s://[%s]:%s%s" : "%s://%s:%s%s",
+        u->tls ? "https" : "http", u->host, u->port, u->path);
+
+    return 0;
+}
+
+// host:port as it goes in the Host header
+void http_url_host_header(struct http_url *u, char *buf, size_t size) {
+    snprintf(buf, size, strchr(u->host, ':') ? "[%s]:%s" : "%s:%s", u->host, u->port);
+}
@@ -21,6 +21,21 @@ int file_exists(const char *filename);
 ssize_t file_size(const char *filename);
 char *base64_encode(const unsigned char *data);
 
+#define MAX_URL_PATH 1024
+
+// An http:// or https:// URL of an upstream or of an ingest server
+struct http_url {
+    short tls;                      // https://
+    char host[256];                 // Without brackets for IPv6
+    char port[8];
+    char path[MAX_URL_PATH];        // With the query string
+    char *auth;                     // Base64 encoded user:pass, or NULL
+    char display[MAX_URL_PATH + 300]; // For the logs, without user:pass
+};
+
+int parse_http_url(const char *url, struct http_url *u);
+void http_url_host_header(struct http_url *u, char *buf, size_t size);
+
 #define is_lws(c) (c == ' ' || c == '\t')
 
 #endif
@@ -29,16 +29,26 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "huffman.h"
 #include "logger.h"
 #include "memory.h"
+#include "utils.h"
+#include "filesource.h"
+#include "relay.h"
 
 #include "v4l2uvc.h"
 
 static int xioctl(int fd, int IOCTL_X, void *arg);
+static int queue_buffers(struct video_device *vd);
 static int video_enable(struct video_device *vd);
 static int video_disable(struct video_device *vd, streaming_state disabledState);
+static void release_device(struct video_device *vd);
+static void fail_video_device(struct video_device *vd, const char *reason);
+static void restart_video_device(struct video_device *vd);
+static double buffer_time(struct v4l2_buffer *buf);
+static void skip_to_newest_buffer(struct video_device *vd);
 
 static int xioctl(int fd, int IOCTL_X, void *arg) {
     int ret = 0;
@@ -49,15 +59,15 @@ static int xioctl(int fd, int IOCTL_X, void *arg) {
     } while(ret && tries-- &&
             ((errno == EINTR) || (errno == EAGAIN) || (errno == ETIMEDOUT)));
 
+    // The caller deals with it, e.g. by restarting the device
     if (ret && tries <= 0) {
         log_itf(LOG_ERROR, "ioctl (%x) retried %i times - giving up: %s.", IOCTL_X, IOCTL_RETRY, strerror(errno));
-        user_panic("ioctl error.");
     }
 
     return (ret);
 }
 
-struct video_device *create_video_device(char *device, int width, int height, int fps, int format, int jpeg_quality) {
+struct video_device *create_video_device(char *device, int width, int height, int fps, int format, int jpeg_quality, int buffer_count, short fresh_capture) {
     struct video_device *vd;
     struct v4l2_fmtdesc fmtdesc;
     int current_width, current_height = 0;
@@ -73,8 +83,7 @@ struct video_device *create_video_device(char *device, int width, int height, in
     if (width == 0 || height == 0)
         return NULL;
 
-    vd->device_filename = (char *) calloc(MAX_DEVICE_FILENAME, sizeof(char));
-    snprintf(vd->device_filename, MAX_DEVICE_FILENAME, "%s", device);
+    vd->device_filename = strdup(device);
 
     vd->width = width;
     vd->height = height;
@@ -82,6 +91,14 @@ struct video_device *create_video_device(char *device, int width, int height, in
     vd->format_in = format;
     vd->use_streaming = 1; // Use mmap
     vd->jpeg_quality = jpeg_quality;
+    vd->buffer_count = max(2, min(MAX_NB_BUFFER, buffer_count));
+    vd->fresh_capture = fresh_capture;
+    vd->frames_skipped = 0;
+    vd->buffer_held = 0;
+    vd->last_frame_at = gettime();
+    vd->restart_at = 0;
+    vd->restart_backoff = CAPTURE_MIN_BACKOFF;
+    vd->restarts = 0;
 
     vd->format_count = 0;
     vd->formats = NULL;
@@ -89,6 +106,23 @@ struct video_device *create_video_device(char *device, int width, int height, in
     vd->resolution_count = 0;
     vd->resolutions = NULL;
 
+    vd->file_data = NULL;
+    vd->relay = NULL;
+
+    if (is_relay_source(device)) {
+        if (open_relay_source(vd) < 0) {
+            user_panic("Could not relay %s.", vd->device_filename);
+        }
+        return vd;
+    }
+
+    if (is_file_source(device)) {
+        if (open_file_source(vd) < 0) {
+            user_panic("Could not play %s.", vd->device_filename);
+        }
+        return vd;
+    }
+
     if (init_v4l2(vd) < 0) {
         user_panic("Init V4L2 failed on device %s.", vd->device_filename);
     }
@@ -165,6 +199,7 @@ struct video_device *create_video_device(char *device, int width, int height, in
             vd->framebuffer = (unsigned char *) malloc(vd->framebuffer_size);
             break;
         case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_H264:
             vd->framebuffer_size = vd->width * vd->height * 2;
             vd->framebuffer = (unsigned char *) malloc(vd->framebuffer_size);
             break;
@@ -180,10 +215,17 @@ int init_v4l2(struct video_device *vd) {
     int i;
     struct v4l2_streamparm setfps;
 
-    if ((vd->fd = OPEN_VIDEO(vd->device_filename, O_RDWR)) == -1) {
+    // Never block on a camera, the main loop polls them all at once
+    if ((vd->fd = OPEN_VIDEO(vd->device_filename, O_RDWR | O_NONBLOCK)) == -1) {
         log_itf(LOG_ERROR, "Error opening V4L2 interface on %s. errno %d", vd->device_filename, errno);
+        return -1;
     }
 
+    for (i = 0; i < MAX_NB_BUFFER; i++) {
+        vd->mem[i] = MAP_FAILED;
+    }
+    vd->buffer_held = 0;
+
     memset(&vd->cap, 0, sizeof(struct v4l2_capability));
 
     if (xioctl(vd->fd, VIDIOC_QUERYCAP, &vd->cap) < 0) {
@@ -247,6 +289,9 @@ int init_v4l2(struct video_device *vd) {
             } else if (vd->format_in == V4L2_PIX_FMT_YUYV) {
                 log_itf(LOG_ERROR, "The input device %s does not supports YUV mode.", vd->device_filename);
                 return -1;
+            } else if (vd->format_in == V4L2_PIX_FMT_H264) {
+                log_itf(LOG_ERROR, "The input device %s does not supports H.264 mode.", vd->device_filename);
+                return -1;
             }
         } else {
             vd->format_in = vd->fmt.fmt.pix.pixelformat;
@@ -267,7 +312,7 @@ int init_v4l2(struct video_device *vd) {
 
     // request buffers
     memset(&vd->rb, 0, sizeof(struct v4l2_requestbuffers));
-    vd->rb.count = NB_BUFFER;
+    vd->rb.count = vd->buffer_count;
     vd->rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     vd->rb.memory = V4L2_MEMORY_MMAP;
 
@@ -276,8 +321,18 @@ int init_v4l2(struct video_device *vd) {
         return -1;
     }
 
+    // The driver may give more or fewer than asked for
+    if (vd->rb.count < 1 || vd->rb.count > MAX_NB_BUFFER) {
+        log_itf(LOG_ERROR, "Device %s allocated %u buffers.", vd->device_filename, vd->rb.count);
+        return -1;
+    }
+    if (vd->rb.count != vd->buffer_count) {
+        log_itf(LOG_INFO, "Device %s queues %u buffers rather than %d.", vd->device_filename, vd->rb.count, vd->buffer_count);
+    }
+    vd->buffer_count = vd->rb.count;
+
     // map the buffers
-    for(i = 0; i < NB_BUFFER; i++) {
+    for(i = 0; i < vd->buffer_count; i++) {
         memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
         vd->buf.index = i;
         vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -287,6 +342,7 @@ int init_v4l2(struct video_device *vd) {
             return -1;
         }
 
+        vd->mem_length[i] = vd->buf.length;
         vd->mem[i] = mmap(0 /* start anywhere */ ,
                           vd->buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, vd->fd,
                           vd->buf.m.offset);
@@ -298,8 +354,23 @@ int init_v4l2(struct video_device *vd) {
         DBG("Buffer mapped at address %p for device %s.", vd->mem[i], vd->device_filename);
     }
 
-    // Queue the buffers.
-    for(i = 0; i < NB_BUFFER; ++i) {
+    if (queue_buffers(vd) < 0) {
+        return -1;
+    }
+
+    if (video_enable(vd)) {
+        log_itf(LOG_ERROR, "Unable to enable video for device %s.", vd->device_filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Hands all buffers to the driver, which STREAMOFF takes back
+static int queue_buffers(struct video_device *vd) {
+    int i;
+
+    for(i = 0; i < vd->buffer_count; ++i) {
         memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
         vd->buf.index = i;
         vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -311,11 +382,6 @@ int init_v4l2(struct video_device *vd) {
         }
     }
 
-    if (video_enable(vd)) {
-        log_itf(LOG_ERROR, "Unable to enable video for device %s.", vd->device_filename);
-        return -1;
-    }
-
     return 0;
 }
 
@@ -407,14 +473,43 @@ size_t copy_frame(unsigned char *dst, const size_t dst_size, unsigned char *src,
 }
 
 size_t capture_frame(struct video_device *vd) {
+    if (vd->file_data != NULL) {
+        return read_file_frame(vd);
+    }
+
+    if (vd->relay != NULL) {
+        return read_relay_frame(vd);
+    }
+
+    if (vd->streaming_state == STREAMING_FAILED) {
+        if (gettime() >= vd->restart_at) {
+            restart_video_device(vd);
+        }
+        return 0;
+    }
+
     memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
     vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     vd->buf.memory = V4L2_MEMORY_MMAP;
 
-    if (xioctl(vd->fd, VIDIOC_DQBUF, &vd->buf) < 0) {
-        log_itf(LOG_ERROR, "Unable to dequeue buffer on device %s.", vd->device_filename);
-        return -1;
+    if (IOCTL_VIDEO(vd->fd, VIDIOC_DQBUF, &vd->buf) < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            fail_video_device(vd, strerror(errno));
+        }
+        else if (gettime() - vd->last_frame_at > CAPTURE_STALL_TIMEOUT) {
+            fail_video_device(vd, "stopped sending frames");
+        }
+        return 0; // No frame yet
     }
+    vd->buffer_held = 1;
+    vd->last_frame_at = gettime();
+    vd->restart_backoff = CAPTURE_MIN_BACKOFF;
+
+    // H.264 frames need the ones before them to be decoded
+    if (vd->fresh_capture && vd->format_in != V4L2_PIX_FMT_H264) {
+        skip_to_newest_buffer(vd);
+    }
+    vd->captured_at = buffer_time(&vd->buf);
 
     switch(vd->format_in) {
         case V4L2_PIX_FMT_MJPEG:
@@ -428,6 +523,7 @@ size_t capture_frame(struct video_device *vd) {
             break;
 
         case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_H264:
             if (vd->buf.bytesused > vd->framebuffer_size)
                 memcpy(vd->framebuffer, vd->mem[vd->buf.index], vd->framebuffer_size);
             else
@@ -442,7 +538,53 @@ size_t capture_frame(struct video_device *vd) {
     return vd->buf.bytesused;
 }
 
+// When the server falls behind, the driver's queue fills with frames that
+// are already old. Hands the one just dequeued back for each newer one that
+// is ready, so that what goes out is never more than a frame old.
+static void skip_to_newest_buffer(struct video_device *vd) {
+    struct v4l2_buffer newer;
+
+    for (;;) {
+        memset(&newer, 0, sizeof(struct v4l2_buffer));
+        newer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        newer.memory = V4L2_MEMORY_MMAP;
+
+        if (IOCTL_VIDEO(vd->fd, VIDIOC_DQBUF, &newer) < 0) {
+            return; // EAGAIN once there are no more
+        }
+
+        if (requeue_device_buffer(vd) < 0) {
+            return;
+        }
+
+        vd->buf = newer;
+        vd->buffer_held = 1;
+        vd->frames_skipped++;
+    }
+}
+
+// Wall clock time the driver filled the buffer. Drivers stamp buffers with
+// the monotonic clock, so this goes by how long ago that was.
+static double buffer_time(struct v4l2_buffer *buf) {
+    struct timespec ts;
+    double stamped, now = gettime();
+
+    if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC ||
+            (buf->timestamp.tv_sec == 0 && buf->timestamp.tv_usec == 0) ||
+            clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+        return now;
+    }
+
+    stamped = buf->timestamp.tv_sec + buf->timestamp.tv_usec / 1000000.0;
+    return now - max(0.0, ts.tv_sec + ts.tv_nsec / 1000000000.0 - stamped);
+}
+
 int requeue_device_buffer(struct video_device *vd) {
+    if (!vd->buffer_held) {
+        return 0;
+    }
+
+    vd->buffer_held = 0;
     if (xioctl(vd->fd, VIDIOC_QBUF, &vd->buf) < 0) {
         log_itf(LOG_ERROR, "Unable to requeue buffer on device %s.", vd->device_filename);
         return -1;
@@ -451,13 +593,140 @@ int requeue_device_buffer(struct video_device *vd) {
     return 0;
 }
 
-void destroy_video_device(struct video_device *vd) {
+// What the main loop waits on for the device: a descriptor that becomes
+// readable with a frame, and a time it must be read by regardless. due_at
+// is negative if there is no such time.
+void capture_pollfd(struct video_device *vd, struct pollfd *pfd, double *due_at) {
+    pfd->fd = -1;
+    pfd->events = POLLIN;
+    pfd->revents = 0;
+    *due_at = -1;
+
+    if (vd->file_data != NULL) {
+        *due_at = vd->next_frame_at;
+    }
+    else if (vd->relay != NULL) {
+        relay_pollfd(vd, pfd, due_at);
+    }
+    else if (vd->streaming_state == STREAMING_FAILED) {
+        *due_at = vd->restart_at;
+    }
+    else {
+        pfd->fd = vd->fd;
+        *due_at = vd->last_frame_at + CAPTURE_STALL_TIMEOUT;
+    }
+}
+
+// Whether no frames can come until the device has been restarted or its
+// upstream is back. Paused devices have not stopped, nobody wants them.
+short capture_stopped(struct video_device *vd) {
+    if (vd->relay != NULL) {
+        return vd->streaming_state == STREAMING_ON && !relay_receiving(vd);
+    }
+
+    return vd->streaming_state == STREAMING_FAILED;
+}
+
+// Lets go of the buffers and the descriptor, without minding errors from a
+// camera that may be gone
+static void release_device(struct video_device *vd) {
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int i;
+
+    if (vd->fd < 0) {
+        return;
+    }
+
     if (vd->streaming_state == STREAMING_ON) {
-        video_disable(vd, STREAMING_OFF);
+        IOCTL_VIDEO(vd->fd, VIDIOC_STREAMOFF, &type);
+    }
+
+    for (i = 0; i < vd->buffer_count; i++) {
+        if (vd->mem[i] != MAP_FAILED) {
+            munmap(vd->mem[i], vd->mem_length[i]);
+            vd->mem[i] = MAP_FAILED;
+        }
     }
 
-    if (CLOSE_VIDEO(vd->fd) != 0) {
-        log_itf(LOG_ERROR, "Failed to close device %s.", vd->device_filename);
+    CLOSE_VIDEO(vd->fd);
+    vd->fd = -1;
+    vd->buffer_held = 0;
+}
+
+// Closes a camera that errs or has stopped sending frames, e.g. after it
+// was unplugged or its firmware hung. Its viewers keep the last frame until
+// restart_video_device() has it going again.
+static void fail_video_device(struct video_device *vd, const char *reason) {
+    log_itf(LOG_WARNING, "Device %s %s. Restarting it in %.1f seconds.", vd->device_filename, reason, vd->restart_backoff);
+
+    release_device(vd);
+    vd->streaming_state = STREAMING_FAILED;
+    vd->restart_at = gettime() + vd->restart_backoff;
+    vd->restart_backoff = min(2 * vd->restart_backoff, CAPTURE_MAX_BACKOFF);
+}
+
+static void restart_video_device(struct video_device *vd) {
+    if (init_v4l2(vd) < 0) {
+        fail_video_device(vd, "could not be reopened");
+        return;
+    }
+
+    vd->restarts++;
+    log_itf(LOG_INFO, "Restarted device %s.", vd->device_filename);
+    vd->last_frame_at = gettime();
+}
+
+// Stops capturing while nobody is watching. The device stays open and
+// configured so that resume_video_device() is quick.
+int pause_video_device(struct video_device *vd) {
+    if (vd->streaming_state != STREAMING_ON) {
+        return 0;
+    }
+
+    if (vd->file_data != NULL) {
+        vd->streaming_state = STREAMING_PAUSED;
+        return 0;
+    }
+
+    if (vd->relay != NULL) {
+        pause_relay_source(vd);
+        vd->streaming_state = STREAMING_PAUSED;
+        return 0;
+    }
+
+    return video_disable(vd, STREAMING_PAUSED);
+}
+
+int resume_video_device(struct video_device *vd) {
+    if (vd->streaming_state != STREAMING_PAUSED) {
+        return 0;
+    }
+
+    if (vd->file_data != NULL || vd->relay != NULL) {
+        vd->next_frame_at = gettime();
+        vd->streaming_state = STREAMING_ON;
+        return 0;
+    }
+
+    vd->last_frame_at = gettime();
+
+    if (queue_buffers(vd) < 0 || video_enable(vd) < 0) {
+        fail_video_device(vd, "could not be resumed");
+        return -1;
+    }
+
+    return 0;
+}
+
+void destroy_video_device(struct video_device *vd) {
+    if (vd->file_data != NULL) {
+        close_file_source(vd);
+    }
+    else if (vd->relay != NULL) {
+        close_relay_source(vd);
+    }
+    else {
+        release_device(vd);
     }
 
     free(vd->framebuffer);
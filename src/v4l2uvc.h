@@ -39,14 +39,18 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <linux/videodev2.h>
 
-#define MAX_DEVICE_FILENAME 32
-
-#define NB_BUFFER 4
+#define NB_BUFFER 4 // Default depth of the driver's queue
+#define MAX_NB_BUFFER 32
 
 #define IOCTL_RETRY 4
 
+#define CAPTURE_STALL_TIMEOUT 5.0   // Seconds without a frame before a camera is restarted
+#define CAPTURE_MIN_BACKOFF 0.5     // Seconds before restarting, doubled after each failure
+#define CAPTURE_MAX_BACKOFF 30.0
+
 #ifdef DISABLE_LIBV4L2
 #define IOCTL_VIDEO(fd, req, value) ioctl(fd, req, value)
 #define OPEN_VIDEO(fd, flags) open(fd, flags)
@@ -78,6 +82,7 @@ enum _streaming_state {
     STREAMING_OFF = 0,
     STREAMING_ON = 1,
     STREAMING_PAUSED = 2,
+    STREAMING_FAILED = 3, // Closed after an error or a stall, to be restarted
 };
 typedef enum _streaming_state streaming_state;
 
@@ -94,7 +99,12 @@ struct video_device {
     struct v4l2_format fmt;
     struct v4l2_buffer buf;
     struct v4l2_requestbuffers rb;
-    void *mem[NB_BUFFER];
+    void *mem[MAX_NB_BUFFER];
+    size_t mem_length[MAX_NB_BUFFER];
+    int buffer_count;   // Asked of the driver, then what it gave
+    short fresh_capture; // Skip to the newest completed buffer
+    unsigned long frames_skipped; // Completed buffers passed over for a newer one
+    short buffer_held;  // buf is dequeued and is to be requeued
     unsigned char *framebuffer;
     size_t framebuffer_size;
     streaming_state streaming_state;
@@ -113,15 +123,38 @@ struct video_device {
     unsigned int resolution_count;
     unsigned int current_resolution_index;
 
+    double captured_at; // Of the frame in framebuffer
+
+    // Watchdog, which closes and reopens a camera that errs or stalls
+    double last_frame_at;
+    double restart_at;
+    double restart_backoff;
+    unsigned long restarts;
+
+    // Set if device_filename is a recording or a test pattern rather than a
+    // device, see filesource.h
+    int file_type;      // FILE_SOURCE_*
+    unsigned char *file_data;
+    size_t file_size;
+    size_t file_pos;
+    double next_frame_at;
+
+    // Set if device_filename is the URL of an upstream stream, see relay.h
+    struct relay *relay;
 };
 
 int init_v4l2(struct video_device *vd);
 
-struct video_device *create_video_device(char *device, int width, int height, int fps, int format, int jpeg_quality);
+struct video_device *create_video_device(char *device, int width, int height, int fps, int format, int jpeg_quality, int buffer_count, short fresh_capture);
 void destroy_video_device(struct video_device *vd);
 
+int is_huffman(unsigned char *buf);
 size_t copy_frame(unsigned char *dst, const size_t dst_size, unsigned char *src, const size_t src_size);
 size_t capture_frame(struct video_device *vd);
 int requeue_device_buffer(struct video_device *vd);
+void capture_pollfd(struct video_device *vd, struct pollfd *pfd, double *due_at);
+short capture_stopped(struct video_device *vd);
+int pause_video_device(struct video_device *vd);
+int resume_video_device(struct video_device *vd);
 
 #endif
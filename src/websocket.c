@@ -0,0 +1,124 @@
+
+#include <string.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+#include "websocket.h"
+
+static void put_be(unsigned char *buf, uint64_t value, int bytes);
+
+static void put_be(unsigned char *buf, uint64_t value, int bytes) {
+    int i;
+
+    for (i = bytes - 1; i >= 0; i--) {
+        buf[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+// Sec-WebSocket-Accept for the client's Sec-WebSocket-Key. accept must hold
+// WS_ACCEPT_KEY_SIZE bytes.
+void ws_accept_key(const char *key, char *accept) {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    unsigned char digest[SHA_DIGEST_LENGTH];
+
+    EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+    EVP_DigestUpdate(ctx, key, strlen(key));
+    EVP_DigestUpdate(ctx, WS_GUID, strlen(WS_GUID));
+    EVP_DigestFinal_ex(ctx, digest, NULL);
+    EVP_MD_CTX_free(ctx);
+
+    EVP_EncodeBlock((unsigned char *) accept, digest, SHA_DIGEST_LENGTH);
+}
+
+// Writes the header of a single, final, unmasked frame into buf, which must
+// hold WS_MAX_FRAME_HEADER_SIZE bytes. Returns the header length.
+size_t ws_frame_header(unsigned char *buf, int opcode, size_t payload_len) {
+    buf[0] = 0x80 | (opcode & 0x0f);
+
+    if (payload_len < 126) {
+        buf[1] = payload_len;
+        return 2;
+    }
+
+    if (payload_len <= 0xffff) {
+        buf[1] = 126;
+        put_be(&buf[2], payload_len, 2);
+        return 4;
+    }
+
+    buf[1] = 127;
+    put_be(&buf[2], payload_len, 8);
+    return 10;
+}
+
+// Parses the header of a client frame at the start of buf. DONE only once
+// the whole payload is in buf as well.
+int ws_parse_frame(const unsigned char *buf, size_t len, struct ws_frame *f) {
+    size_t i, n;
+
+    if (len < 2) {
+        return WS_PARSE_INCOMPLETE;
+    }
+
+    f->fin = (buf[0] & 0x80) != 0;
+    f->opcode = buf[0] & 0x0f;
+
+    if ((buf[0] & 0x70) != 0 || (buf[1] & 0x80) == 0) {
+        return WS_PARSE_ERROR; // No extensions were negotiated, and clients must mask
+    }
+
+    f->payload_len = buf[1] & 0x7f;
+    f->header_len = 2;
+
+    if (f->payload_len >= 126) {
+        n = (f->payload_len == 126) ? 2 : 8;
+        if (len < f->header_len + n) {
+            return WS_PARSE_INCOMPLETE;
+        }
+
+        f->payload_len = 0;
+        for (i = 0; i < n; i++) {
+            f->payload_len = (f->payload_len << 8) | buf[f->header_len + i];
+        }
+        f->header_len += n;
+    }
+
+    if (len < f->header_len + 4) {
+        return WS_PARSE_INCOMPLETE;
+    }
+
+    memcpy(f->mask, &buf[f->header_len], 4);
+    f->header_len += 4;
+
+    if (len - f->header_len < f->payload_len) {
+        return WS_PARSE_INCOMPLETE;
+    }
+
+    return WS_PARSE_DONE;
+}
+
+void ws_unmask(unsigned char *payload, size_t len, const unsigned char *mask) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        payload[i] ^= mask[i % 4];
+    }
+}
+
+// Writes WS_META_SIZE bytes:
+//   0  version (1 byte)
+//   1  rendition (1 byte)
+//   2  header length, i.e. where the JPEG starts (2 bytes)
+//   4  frame number (4 bytes)
+//   8  capture time, milliseconds since the epoch (8 bytes)
+//   16 send time, milliseconds since the epoch (8 bytes)
+void ws_put_meta(unsigned char *buf, struct ws_meta *meta) {
+    buf[0] = WS_META_VERSION;
+    buf[1] = meta->rendition;
+    put_be(&buf[2], WS_META_SIZE, 2);
+    put_be(&buf[4], meta->frame & 0xffffffff, 4);
+    put_be(&buf[8], (uint64_t) (meta->captured_at * 1000.0), 8);
+    put_be(&buf[16], (uint64_t) (meta->sent_at * 1000.0), 8);
+}
@@ -0,0 +1,51 @@
+
+#ifndef __WEBSOCKET_H
+#define __WEBSOCKET_H
+
+#include <sys/types.h>
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_VERSION "13"
+#define WS_ACCEPT_KEY_SIZE 29 // Base64 of a SHA-1 digest, plus NUL
+
+#define WS_OPCODE_CONTINUATION 0x0
+#define WS_OPCODE_TEXT 0x1
+#define WS_OPCODE_BINARY 0x2
+#define WS_OPCODE_CLOSE 0x8
+#define WS_OPCODE_PING 0x9
+#define WS_OPCODE_PONG 0xA
+
+#define WS_MAX_FRAME_HEADER_SIZE 10 // Server frames are never masked
+
+// Return values of ws_parse_frame()
+#define WS_PARSE_INCOMPLETE 0
+#define WS_PARSE_DONE 1
+#define WS_PARSE_ERROR 2
+
+// A frame received from a client
+struct ws_frame {
+    short fin;
+    int opcode;
+    size_t header_len;
+    size_t payload_len;
+    unsigned char mask[4];
+};
+
+// Binary metadata sent ahead of each JPEG on /ws/stream/N, big endian
+#define WS_META_VERSION 1
+#define WS_META_SIZE 24
+
+struct ws_meta {
+    int rendition;
+    unsigned long frame;    // Frame number, low 32 bits
+    double captured_at;     // Unix time in seconds
+    double sent_at;
+};
+
+void ws_accept_key(const char *key, char *accept);
+size_t ws_frame_header(unsigned char *buf, int opcode, size_t payload_len);
+int ws_parse_frame(const unsigned char *buf, size_t len, struct ws_frame *f);
+void ws_unmask(unsigned char *payload, size_t len, const unsigned char *mask);
+void ws_put_meta(unsigned char *buf, struct ws_meta *meta);
+
+#endif
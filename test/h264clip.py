@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+# Writes an Annex B H.264 clip that needs no encoder: IDR pictures of I_PCM
+# macroblocks and P pictures that skip every macroblock.
+#
+# Usage: h264clip.py out.h264 frames gop [baseline|high|bad-sps]
+#
+# high gives a High profile SPS with chroma_format_idc and bit depths, and
+# bad-sps one whose Exp-Golomb codes never end.
+
+import sys
+
+
+class BitWriter:
+    def __init__(self):
+        self.bits = []
+
+    def u(self, n, value):
+        for i in range(n - 1, -1, -1):
+            self.bits.append((value >> i) & 1)
+
+    def ue(self, value):
+        value += 1
+        n = value.bit_length()
+        self.u(n - 1, 0)
+        self.u(n, value)
+
+    def se(self, value):
+        self.ue(2 * value - 1 if value > 0 else -2 * value)
+
+    def align(self):
+        while len(self.bits) % 8:
+            self.bits.append(0)
+
+    def trailing(self):
+        self.bits.append(1)
+        self.align()
+
+    def bytes(self):
+        return bytes(int("".join(map(str, self.bits[i:i + 8])), 2) for i in range(0, len(self.bits), 8))
+
+
+def emulation_prevention(rbsp):
+    out, zeros = bytearray(), 0
+    for b in rbsp:
+        if zeros >= 2 and b <= 3:
+            out.append(3)
+            zeros = 0
+        out.append(b)
+        zeros = zeros + 1 if b == 0 else 0
+    return bytes(out)
+
+
+def nal(ref, type, rbsp):
+    return b"\x00\x00\x00\x01" + bytes([(ref << 5) | type]) + emulation_prevention(rbsp)
+
+
+def sps(kind, width_mbs, height_mbs):
+    b = BitWriter()
+    if kind == "bad-sps":
+        b.u(8, 66)
+        b.u(16, 0xc01e)
+        b.u(64, 0)
+        return b.bytes()
+
+    b.u(8, 100 if kind == "high" else 66)
+    b.u(8, 0 if kind == "high" else 0xc0)
+    b.u(8, 30)
+    b.ue(0)
+    if kind == "high":
+        b.ue(1)  # 4:2:0
+        b.ue(0)  # 8 bit
+        b.ue(0)
+        b.u(1, 0)
+        b.u(1, 0)
+    b.ue(0)
+    b.ue(2)
+    b.ue(1)
+    b.u(1, 0)
+    b.ue(width_mbs - 1)
+    b.ue(height_mbs - 1)
+    b.u(1, 1)
+    b.u(1, 1)
+    b.u(1, 0)
+    b.u(1, 0)
+    b.trailing()
+    return b.bytes()
+
+
+def pps():
+    b = BitWriter()
+    b.ue(0)
+    b.ue(0)
+    b.u(1, 0)
+    b.u(1, 0)
+    b.ue(0)
+    b.ue(0)
+    b.ue(0)
+    b.u(1, 0)
+    b.u(2, 0)
+    b.se(0)
+    b.se(0)
+    b.se(0)
+    b.u(1, 1)
+    b.u(1, 0)
+    b.u(1, 0)
+    b.trailing()
+    return b.bytes()
+
+
+def main():
+    out, frames, gop = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+    kind = sys.argv[4] if len(sys.argv) > 4 else "baseline"
+    width_mbs, height_mbs = 4, 3
+
+    data = bytearray()
+    for i in range(frames):
+        data += b"\x00\x00\x00\x01\x09\xf0"  # Access unit delimiter
+        if i % gop == 0:
+            data += nal(3, 7, sps(kind, width_mbs, height_mbs)) + nal(3, 8, pps())
+            b = BitWriter()
+            b.ue(0)
+            b.ue(7)
+            b.ue(0)
+            b.u(4, 0)
+            b.ue(i // gop % 65536)
+            b.u(1, 0)
+            b.u(1, 0)
+            b.se(0)
+            b.ue(1)  # No deblocking
+            for m in range(width_mbs * height_mbs):
+                b.ue(25)  # I_PCM
+                b.align()
+                for k in range(384):
+                    b.u(8, 16 + (i * 7 + m * 13 + k) % 200)
+            b.trailing()
+            data += nal(3, 5, b.bytes())
+        else:
+            b = BitWriter()
+            b.ue(0)
+            b.ue(5)
+            b.ue(0)
+            b.u(4, i % gop % 16)
+            b.u(1, 0)
+            b.u(1, 0)
+            b.u(1, 0)
+            b.se(0)
+            b.ue(1)
+            b.ue(width_mbs * height_mbs)  # mb_skip_run
+            b.trailing()
+            data += nal(2, 1, b.bytes())
+
+    with open(out, "wb") as f:
+        f.write(data)
+
+
+main()
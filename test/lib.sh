@@ -0,0 +1,81 @@
+# Sourced by the tests. Starts servers and stops them again when the test
+# exits, and fails the test with a message and the logs.
+#
+# HAWKEYE and PORT can be set in the environment. A test that needs more
+# than one port uses PORT and the ones above it.
+
+HAWKEYE=${HAWKEYE:-../src/hawkeye}
+PORT=${PORT:-8091}
+
+TMP=$(mktemp -d)
+PIDS=
+
+cleanup() {
+    for pid in $PIDS; do
+        kill "$pid" 2>/dev/null || true
+    done
+    rm -rf "$TMP"
+}
+trap cleanup EXIT INT TERM
+
+fail() {
+    echo "FAIL: $*" >&2
+    for log in "$TMP"/*.log; do
+        [ -f "$log" ] && { echo "--- $log" >&2; tail -20 "$log" >&2; }
+    done
+    exit 1
+}
+
+# background command...: runs a helper that is stopped on exit, and whose
+# pid is left in LAST
+background() {
+    "$@" &
+    LAST=$!
+    PIDS="$PIDS $LAST"
+}
+
+# start_hawkeye name options...: starts hawkeye logging to $TMP/name.log and
+# waits until it listens
+start_hawkeye() {
+    name=$1
+    shift
+
+    background "$HAWKEYE" -c /dev/null -l "$TMP/$name.log" "$@"
+    wait_for_log "$TMP/$name.log" "Listening on" || fail "$name did not start"
+}
+
+# wait_for_log file text [seconds]
+wait_for_log() {
+    i=0
+    while ! grep -q "$2" "$1" 2>/dev/null; do
+        i=$((i + 1))
+        [ $i -gt $((${3:-5} * 10)) ] && return 1
+        sleep 0.1
+    done
+    return 0
+}
+
+# A self-signed certificate in $TMP/cert.pem and $TMP/key.pem
+make_cert() {
+    openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+        -keyout "$TMP/key.pem" -out "$TMP/cert.pem" 2>/dev/null || fail "openssl req"
+}
+
+# is_jpeg file
+is_jpeg() {
+    [ "$(head -c 2 "$1" | od -An -tx1 | tr -d ' \n')" = "ffd8" ]
+}
+
+# Fetches a still into file with curl and the arguments given, waiting up
+# to 2 seconds for the camera to have captured one
+fetch_still() {
+    file=$1
+    shift
+    i=0
+
+    while ! { curl -s -o "$file" "$@" && is_jpeg "$file"; }; do
+        i=$((i + 1))
+        [ $i -gt 20 ] && return 1
+        sleep 0.1
+    done
+}
@@ -0,0 +1,311 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <jpeglib.h>
+
+#include "huffman.h"
+#include "rtp.h"
+
+// Sends JPEGs through rtp_parse_jpeg() and rtp_send_jpeg(), puts them back
+// together the way RFC 2435 receivers do (appendix A) and checks that they
+// decode to the same pixels as the originals. JPEGs that receivers would
+// decode wrongly must be turned away instead. Linked against hawkeye's own
+// objects, see the Makefile.
+
+#define MAX_PACKETS 4096
+#define QUALITY 80
+
+struct packets {
+    unsigned char *data[MAX_PACKETS];
+    size_t len[MAX_PACKETS];
+    int count;
+};
+
+struct variant {
+    const char *name;
+    int width;
+    int height;
+    int h_sampling;             // Of Y, 2x2 is 4:2:0 and 2x1 4:2:2
+    int v_sampling;
+    int restart_interval;
+    int optimize_coding;        // Tables other than the standard ones
+    short sendable;
+};
+
+static unsigned char *make_image(int width, int height);
+static size_t encode(struct variant *v, unsigned char *rgb, unsigned char **jpeg);
+static unsigned char *decode(unsigned char *jpeg, size_t len, int *width, int *height);
+static void collect(void *arg, const unsigned char *packet, size_t len);
+static size_t depacketize(struct packets *p, unsigned char *jpeg, size_t size);
+static short check(struct variant *v);
+
+static unsigned char *make_image(int width, int height) {
+    unsigned char *rgb = malloc(width * height * 3);
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            rgb[(y * width + x) * 3] = x * 255 / width;
+            rgb[(y * width + x) * 3 + 1] = y * 255 / height;
+            rgb[(y * width + x) * 3 + 2] = ((x / 8 + y / 8) % 2) ? 200 : 40;
+        }
+    }
+
+    return rgb;
+}
+
+static size_t encode(struct variant *v, unsigned char *rgb, unsigned char **jpeg) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW row_pointer[1];
+    unsigned long len = 0;
+
+    *jpeg = NULL;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, jpeg, &len);
+
+    cinfo.image_width = v->width;
+    cinfo.image_height = v->height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, QUALITY, TRUE);
+    cinfo.comp_info[0].h_samp_factor = v->h_sampling;
+    cinfo.comp_info[0].v_samp_factor = v->v_sampling;
+    cinfo.restart_interval = v->restart_interval;
+    cinfo.optimize_coding = v->optimize_coding;
+
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        row_pointer[0] = &rgb[cinfo.next_scanline * v->width * 3];
+        jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    return len;
+}
+
+static unsigned char *decode(unsigned char *jpeg, size_t len, int *width, int *height) {
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW row_pointer[1];
+    unsigned char *rgb;
+
+    dinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&dinfo);
+    jpeg_mem_src(&dinfo, jpeg, len);
+    jpeg_read_header(&dinfo, TRUE);
+    dinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&dinfo);
+
+    *width = dinfo.output_width;
+    *height = dinfo.output_height;
+    rgb = malloc(*width * *height * 3);
+
+    while (dinfo.output_scanline < dinfo.output_height) {
+        row_pointer[0] = &rgb[dinfo.output_scanline * *width * 3];
+        jpeg_read_scanlines(&dinfo, row_pointer, 1);
+    }
+    jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_decompress(&dinfo);
+
+    return rgb;
+}
+
+static void collect(void *arg, const unsigned char *packet, size_t len) {
+    struct packets *p = arg;
+
+    if (p->count == MAX_PACKETS) {
+        return;
+    }
+
+    p->data[p->count] = malloc(len);
+    memcpy(p->data[p->count], packet, len);
+    p->len[p->count] = len;
+    p->count++;
+}
+
+// Rebuilds a JPEG from the packets of one frame, checking their headers on
+// the way. Returns its length, 0 if a packet is not as RFC 2435 wants it.
+static size_t depacketize(struct packets *p, unsigned char *jpeg, size_t size) {
+    unsigned char qtables[128], *scan = malloc(size);
+    const unsigned char *pkt, *payload;
+    size_t offset, scan_len = 0, n = 0, payload_len;
+    int i, type = -1, width = 0, height = 0, restart_interval = 0;
+
+    for (i = 0; i < p->count; i++) {
+        pkt = p->data[i];
+
+        if (p->len[i] < RTP_HEADER_SIZE + RTP_JPEG_HEADER_SIZE || (pkt[0] >> 6) != RTP_VERSION ||
+                (pkt[1] & 0x7f) != RTP_PAYLOAD_TYPE_JPEG ||
+                ((pkt[2] << 8) | pkt[3]) != (((p->data[0][2] << 8) | p->data[0][3]) + i) % 65536 ||
+                memcmp(&pkt[4], &p->data[0][4], 8) != 0 ||
+                ((pkt[1] & 0x80) != 0) != (i == p->count - 1)) {
+            fprintf(stderr, "Bad RTP header in packet %d\n", i);
+            goto fail;
+        }
+
+        payload = &pkt[RTP_HEADER_SIZE];
+        payload_len = p->len[i] - RTP_HEADER_SIZE;
+        offset = (payload[1] << 16) | (payload[2] << 8) | payload[3];
+
+        if (i == 0) {
+            type = payload[4];
+            width = payload[6] * 8;
+            height = payload[7] * 8;
+        }
+        if (offset != scan_len || payload[4] != type || payload[5] != RTP_JPEG_Q_DYNAMIC) {
+            fprintf(stderr, "Bad JPEG header in packet %d\n", i);
+            goto fail;
+        }
+        payload += RTP_JPEG_HEADER_SIZE;
+        payload_len -= RTP_JPEG_HEADER_SIZE;
+
+        if (type & RTP_JPEG_TYPE_RESTART) {
+            restart_interval = (payload[0] << 8) | payload[1];
+            payload += RTP_RESTART_HEADER_SIZE;
+            payload_len -= RTP_RESTART_HEADER_SIZE;
+        }
+
+        if (offset == 0) {
+            if (payload[1] != 0 || ((payload[2] << 8) | payload[3]) != sizeof(qtables)) {
+                fprintf(stderr, "Bad quantization table header\n");
+                goto fail;
+            }
+            memcpy(qtables, &payload[RTP_QTABLE_HEADER_SIZE], sizeof(qtables));
+            payload += RTP_QTABLE_HEADER_SIZE + sizeof(qtables);
+            payload_len -= RTP_QTABLE_HEADER_SIZE + sizeof(qtables);
+        }
+
+        memcpy(&scan[scan_len], payload, payload_len);
+        scan_len += payload_len;
+    }
+
+    // SOI, DQT
+    memcpy(&jpeg[n], "\xff\xd8\xff\xdb\x00\x84", 6);
+    n += 6;
+    jpeg[n++] = 0;
+    memcpy(&jpeg[n], qtables, 64);
+    n += 64;
+    jpeg[n++] = 1;
+    memcpy(&jpeg[n], &qtables[64], 64);
+    n += 64;
+
+    if (restart_interval > 0) {
+        memcpy(&jpeg[n], "\xff\xdd\x00\x04", 4);
+        jpeg[n + 4] = restart_interval >> 8;
+        jpeg[n + 5] = restart_interval & 0xff;
+        n += 6;
+    }
+
+    // SOF0 with Y at 2x1 or 2x2 on tables 0, U and V at 1x1 on tables 1
+    memcpy(&jpeg[n], "\xff\xc0\x00\x11\x08", 5);
+    jpeg[n + 5] = height >> 8;
+    jpeg[n + 6] = height & 0xff;
+    jpeg[n + 7] = width >> 8;
+    jpeg[n + 8] = width & 0xff;
+    jpeg[n + 9] = 3;
+    memcpy(&jpeg[n + 10], "\x01\x00\x00\x02\x11\x01\x03\x11\x01", 9);
+    jpeg[n + 11] = ((type & ~RTP_JPEG_TYPE_RESTART) == RTP_JPEG_TYPE_422) ? 0x21 : 0x22;
+    n += 19;
+
+    memcpy(&jpeg[n], dht_data, sizeof(dht_data));
+    n += sizeof(dht_data);
+
+    memcpy(&jpeg[n], "\xff\xda\x00\x0c\x03\x01\x00\x02\x11\x03\x11\x00\x3f\x00", 14);
+    n += 14;
+
+    memcpy(&jpeg[n], scan, scan_len);
+    n += scan_len;
+    jpeg[n++] = 0xff;
+    jpeg[n++] = 0xd9;
+
+    free(scan);
+    return n;
+
+fail:
+    free(scan);
+    return 0;
+}
+
+static short check(struct variant *v) {
+    struct rtp_stream st;
+    struct rtp_jpeg j;
+    struct packets p;
+    unsigned char *rgb = make_image(v->width, v->height), *jpeg, *rebuilt = NULL, *a = NULL, *b = NULL;
+    size_t len, rebuilt_len;
+    int aw, ah, bw, bh, i;
+    short ok = 0;
+
+    len = encode(v, rgb, &jpeg);
+    memset(&p, 0, sizeof(p));
+
+    if (rtp_parse_jpeg(jpeg, len, &j) < 0) {
+        ok = !v->sendable;
+        if (!ok) {
+            fprintf(stderr, "%s: turned away\n", v->name);
+        }
+        goto done;
+    }
+    if (!v->sendable) {
+        fprintf(stderr, "%s: taken, but receivers would decode it wrongly\n", v->name);
+        goto done;
+    }
+
+    rtp_stream_init(&st);
+    rtp_send_jpeg(&st, &j, 12345, collect, &p);
+
+    rebuilt = malloc(len + 1024);
+    if ((rebuilt_len = depacketize(&p, rebuilt, len + 1024)) == 0) {
+        fprintf(stderr, "%s: could not depacketize\n", v->name);
+        goto done;
+    }
+
+    a = decode(jpeg, len, &aw, &ah);
+    b = decode(rebuilt, rebuilt_len, &bw, &bh);
+    if (aw != bw || ah != bh || memcmp(a, b, aw * ah * 3) != 0) {
+        fprintf(stderr, "%s: decodes differently after the round trip\n", v->name);
+        goto done;
+    }
+
+    ok = 1;
+
+done:
+    for (i = 0; i < p.count; i++) {
+        free(p.data[i]);
+    }
+    free(rgb);
+    free(jpeg);
+    free(rebuilt);
+    free(a);
+    free(b);
+
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    struct variant variants[] = {
+        { "4:2:0 640x480", 640, 480, 2, 2, 0, 0, 1 },
+        { "4:2:2 640x480", 640, 480, 2, 1, 0, 0, 1 },
+        { "4:2:0 1920x1088", 1920, 1088, 2, 2, 0, 0, 1 },
+        { "4:2:0 with restart markers", 320, 240, 2, 2, 4, 0, 1 },
+        { "optimized Huffman tables", 640, 480, 2, 2, 0, 1, 0 },
+        { "4:4:4", 640, 480, 1, 1, 0, 0, 0 },
+        { "wider than 2040", 2048, 64, 2, 2, 0, 0, 0 },
+    };
+    int i, failed = 0;
+
+    for (i = 0; i < (int) (sizeof(variants) / sizeof(variants[0])); i++) {
+        if (check(&variants[i])) {
+            printf("%s: ok\n", variants[i].name);
+        }
+        else {
+            failed++;
+        }
+    }
+
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Runs every test_*.sh, each against servers of its own, and reports which
+# failed. Arguments select tests by name, e.g. ./run.sh http2.
+
+cd "$(dirname "$0")"
+
+tests=$*
+[ -z "$tests" ] && tests=$(ls test_*.sh | sed 's/^test_//; s/\.sh$//')
+
+failed=
+for t in $tests; do
+    echo "$t..." >&2
+    if sh "./test_$t.sh"; then
+        echo "$t: ok" >&2
+    else
+        failed="$failed $t"
+    fi
+done
+
+if [ -n "$failed" ]; then
+    echo "Failed:$failed" >&2
+    exit 1
+fi
+echo "All tests passed" >&2
@@ -0,0 +1,97 @@
+#!/bin/sh
+# H.264 recordings played as cameras: the init segment describes the stream,
+# Baseline and High profile alike, /mp4/N and HLS carry its access units,
+# no HLS segment is longer than the playlist's target duration, and a
+# recording whose SPS cannot be parsed is turned away.
+
+. ./lib.sh
+
+# check.py source.h264 init.mp4 [fragments.mp4...]
+cat > "$TMP/check.py" <<'PY'
+import struct, sys
+
+def nal_units(data):
+    starts, i = [], 0
+    while (i := data.find(b"\x00\x00\x01", i)) >= 0:
+        i += 3
+        starts.append(i)
+    for k, start in enumerate(starts):
+        end = starts[k + 1] - 3 if k + 1 < len(starts) else len(data)
+        while end > start and data[end - 1] == 0:
+            end -= 1
+        yield data[start:end]
+
+def boxes(data, pos, end):
+    while pos + 8 <= end:
+        size, type = struct.unpack(">I4s", data[pos:pos + 8])
+        assert size >= 8 and pos + size <= end, "bad box"
+        yield type.decode(), pos, size
+        pos += size
+
+def find(data, pos, end, path):
+    for type, start, size in boxes(data, pos, end):
+        if type == path[0]:
+            if len(path) == 1:
+                return data[start + 8:start + size]
+            header = {"stsd": 16, "avc1": 86}.get(type, 8)
+            return find(data, start + header, start + size, path[1:])
+    raise AssertionError("no " + path[0])
+
+source = list(nal_units(open(sys.argv[1], "rb").read()))
+sps = [n for n in source if n[0] & 0x1f == 7][0]
+pps = [n for n in source if n[0] & 0x1f == 8][0]
+
+init = open(sys.argv[2], "rb").read()
+avcc = find(init, 0, len(init), ["moov", "trak", "mdia", "minf", "stbl", "stsd", "avc1", "avcC"])
+assert avcc[1:4] == sps[1:4], "profile and level"
+sps_len = struct.unpack(">H", avcc[6:8])[0]
+assert avcc[8:8 + sps_len] == sps, "SPS"
+pos = 8 + sps_len
+pps_len = struct.unpack(">H", avcc[pos + 1:pos + 3])[0]
+assert avcc[pos] == 1 and avcc[pos + 3:pos + 3 + pps_len] == pps, "PPS"
+rest = avcc[pos + 3 + pps_len:]
+if sps[1] in (100, 110, 122, 144):
+    assert rest == b"\xfd\xf8\xf8\x00", "High profile fields %r" % rest
+else:
+    assert rest == b"", "trailing bytes in avcC"
+
+samples = 0
+for name in sys.argv[3:]:
+    data = open(name, "rb").read()
+    for type, start, size in boxes(data, 0, len(data)):
+        if type != "mdat":
+            continue
+        pos = start + 8
+        while pos < start + size:
+            n = struct.unpack(">I", data[pos:pos + 4])[0]
+            assert data[pos + 4:pos + 4 + n] in source, "NAL unit not from the recording"
+            pos += 4 + n
+        samples += 1
+assert len(sys.argv) == 3 or samples > 0, "no samples"
+PY
+
+for profile in baseline high; do
+    python3 h264clip.py "$TMP/$profile.h264" 50 10 "$profile"
+    start_hawkeye "$profile" -p "$PORT" -D "$TMP/$profile.h264" -F 25
+    URL=http://127.0.0.1:$PORT
+
+    curl -s -o "$TMP/init.mp4" "$URL/hls/0/init.mp4" || fail "$profile: init.mp4"
+    curl -s -m 2 -o "$TMP/stream.mp4" "$URL/mp4/0"
+    python3 "$TMP/check.py" "$TMP/$profile.h264" "$TMP/init.mp4" || fail "$profile: init segment"
+    python3 "$TMP/check.py" "$TMP/$profile.h264" "$TMP/stream.mp4" "$TMP/stream.mp4" || fail "$profile: /mp4/0"
+
+    sleep 1
+    curl -s -o "$TMP/index.m3u8" "$URL/hls/0/index.m3u8" || fail "$profile: playlist"
+    segment=$(grep -m 1 '\.m4s' "$TMP/index.m3u8") || fail "$profile: no segments in the playlist"
+    awk -F '[:,]' '/^#EXT-X-TARGETDURATION:/ { target = $2 } /^#EXTINF:/ && $2 > target { long = 1 } END { exit long || target < 1 }' "$TMP/index.m3u8" \
+        || fail "$profile: a segment is longer than the target duration"
+    curl -s -o "$TMP/segment.m4s" "$URL/hls/0/$segment" || fail "$profile: $segment"
+    python3 "$TMP/check.py" "$TMP/$profile.h264" "$TMP/init.mp4" "$TMP/segment.m4s" || fail "$profile: $segment"
+
+    kill "$LAST"
+    PORT=$((PORT + 1))
+done
+
+python3 h264clip.py "$TMP/bad.h264" 10 10 bad-sps
+background "$HAWKEYE" -c /dev/null -p "$PORT" -D "$TMP/bad.h264" -l "$TMP/bad.log" 2> /dev/null
+wait_for_log "$TMP/bad.log" "no H.264 sequence parameter set" || fail "a recording with a bad SPS was taken"
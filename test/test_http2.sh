@@ -0,0 +1,97 @@
+#!/bin/sh
+# HTTP/2 over TLS: requests from curl and nghttp, a large file read slowly
+# by several clients, which must not be held in memory whole, and a client
+# that floods the server with PINGs without reading the replies, which must
+# get a GOAWAY(ENHANCE_YOUR_CALM) rather than unbounded buffering.
+
+. ./lib.sh
+
+make_cert
+start_hawkeye hawkeye -p "$PORT" -D pattern -F 10 -w ../www -2 -C "$TMP/cert.pem" -k "$TMP/key.pem"
+URL=https://localhost:$PORT
+
+result=$(curl -sk --http2 -o /dev/null -w '%{http_version} %{http_code}' "$URL/index.html")
+[ "$result" = "2 200" ] || fail "index.html over HTTP/2: $result"
+
+fetch_still "$TMP/still.jpg" -k --http2 "$URL/still/0" || fail "no still over HTTP/2"
+
+curl -sk --http2 -m 2 -o "$TMP/stream" "$URL/stream/0"
+[ "$(grep -ac 'Content-Type: image/jpeg' "$TMP/stream")" -ge 2 ] || fail "stream has fewer than 2 frames"
+
+# Several requests multiplexed on one connection
+if command -v nghttp > /dev/null; then
+    nghttp -ns "$URL/still/0" "$URL/stats" "$URL/index.html" > "$TMP/nghttp" 2>&1 || fail "nghttp"
+    [ "$(grep -c ' 200 ' "$TMP/nghttp")" -eq 3 ] || fail "nghttp did not get three 200s"
+fi
+
+python3 - "$PORT" <<'PY' || fail "PING flood"
+import socket, ssl, struct, sys
+
+ctx = ssl.create_default_context()
+ctx.check_hostname = False
+ctx.verify_mode = ssl.CERT_NONE
+ctx.set_alpn_protocols(["h2"])
+sock = ctx.wrap_socket(socket.create_connection(("127.0.0.1", int(sys.argv[1]))), server_hostname="localhost")
+assert sock.selected_alpn_protocol() == "h2"
+
+def frame(type, flags, payload):
+    return struct.pack(">I", len(payload))[1:] + bytes([type, flags]) + struct.pack(">I", 0) + payload
+
+sock.sendall(b"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" + frame(4, 0, b""))
+
+# Up to 64 MB of PINGs, until the server stops reading them
+pings = frame(6, 0, b"12345678") * 4096
+sock.settimeout(3)
+try:
+    for _ in range(64 * 1024 * 1024 // len(pings)):
+        sock.sendall(pings)
+except (socket.timeout, OSError):
+    pass
+
+# Everything the server queued must end in a GOAWAY(ENHANCE_YOUR_CALM)
+data = b""
+try:
+    while True:
+        chunk = sock.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+except (socket.timeout, OSError):
+    pass
+
+pos, error = 0, None
+while pos + 9 <= len(data):
+    length = struct.unpack(">I", b"\0" + data[pos:pos + 3])[0]
+    if data[pos + 3] == 7 and pos + 9 + length <= len(data):
+        error = struct.unpack(">I", data[pos + 13:pos + 17])[0]
+    pos += 9 + length
+
+print("%d bytes of replies, GOAWAY error %s" % (len(data), error), file=sys.stderr)
+sys.exit(0 if error == 0xb and len(data) < 16 * 1024 * 1024 else 1)
+PY
+
+# And the server carries on
+curl -sk --http2 -o /dev/null "$URL/still/0" || fail "server gone after the flood"
+
+# Eight slow downloads of an 8 MB file at once
+mkdir "$TMP/www"
+head -c 8388608 /dev/urandom > "$TMP/www/large.bin"
+start_hawkeye files -p "$((PORT + 1))" -D pattern -w "$TMP/www" -2 -C "$TMP/cert.pem" -k "$TMP/key.pem"
+files=$LAST
+rss_before=$(awk '/^VmRSS/ { print $2 }' "/proc/$files/status")
+i=0
+downloads=
+while [ $i -lt 8 ]; do
+    curl -sk --http2 --limit-rate 2M -o "$TMP/large.$i" "https://localhost:$((PORT + 1))/large.bin" &
+    downloads="$downloads $!"
+    i=$((i + 1))
+done
+sleep 1
+rss=$(awk '/^VmRSS/ { print $2 }' "/proc/$files/status")
+for pid in $downloads; do
+    wait "$pid"
+done
+[ $((rss - rss_before)) -lt 16384 ] || fail "serving the file took $((rss - rss_before)) KB"
+for f in "$TMP"/large.[0-7]; do
+    cmp -s "$f" "$TMP/www/large.bin" || fail "large file arrived different over HTTP/2"
+done
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Requests to a camera at 1 fps, which must be answered straight away rather
+# than at the rate the camera has frames, and a viewer that hangs up with
+# data still unread, which must not keep the loop busy.
+
+. ./lib.sh
+
+start_hawkeye hawkeye -p "$PORT" -R "$((PORT + 1))" -U "$((PORT + 2))" -D pattern -F 1
+hawkeye=$LAST
+
+# Five requests on one connection, each of which used to wait for a frame
+URL=http://127.0.0.1:$PORT/stream/info
+took=$(curl -s -o /dev/null -w '%{time_total}\n' "$URL" "$URL" "$URL" "$URL" "$URL" | awk '{ t += $1 } END { print t }')
+awk "BEGIN { exit !($took < 0.5) }" || fail "five HTTP requests took ${took}s"
+
+python3 - "$((PORT + 1))" <<'PY' || fail "RTSP"
+import socket, sys, time
+
+sock = socket.create_connection(("127.0.0.1", int(sys.argv[1])))
+started = time.time()
+for cseq in range(5):
+    sock.sendall(b"OPTIONS * RTSP/1.0\r\nCSeq: %d\r\n\r\n" % cseq)
+    reply = b""
+    while b"\r\n\r\n" not in reply:
+        reply += sock.recv(4096)
+took = time.time() - started
+print("five RTSP requests took %.3fs" % took, file=sys.stderr)
+sys.exit(0 if took < 0.5 else 1)
+PY
+
+# Sends more after its request, as a TLS close_notify would be, then hangs
+# up, which the next frame is reset by
+python3 - "$PORT" <<'PY' || fail "stream client"
+import socket, sys
+
+sock = socket.create_connection(("127.0.0.1", int(sys.argv[1])))
+sock.sendall(b"GET /stream/0 HTTP/1.1\r\nHost: localhost\r\n\r\n")
+while b"\xff\xd9" not in sock.recv(65536):
+    pass
+sock.sendall(b"x")
+sock.close()
+PY
+before=$(awk '{ print $14 + $15 }' "/proc/$hawkeye/stat")
+sleep 1
+after=$(awk '{ print $14 + $15 }' "/proc/$hawkeye/stat")
+[ $((after - before)) -lt 20 ] || fail "$((after - before)) ticks of CPU in a second after a viewer hung up"
@@ -0,0 +1,21 @@
+#!/bin/sh
+# /streams with ids that are not those of a camera, which must be turned
+# away, and with a camera listed more than once, which must only count once
+# against max-streams-per-camera.
+
+. ./lib.sh
+
+start_hawkeye hawkeye -p "$PORT" -D pattern:pattern -s 2
+
+# status path: the HTTP status of a request, streams being cut off early
+status() {
+    curl -s -o /dev/null -m 1 -w '%{http_code}' "http://127.0.0.1:$PORT$1" || true
+}
+
+for ids in abc 1x 2 -1 0,abc; do
+    [ "$(status "/streams?ids=$ids")" = 404 ] || fail "/streams?ids=$ids was not turned away"
+done
+
+background curl -s -o /dev/null "http://127.0.0.1:$PORT/streams?ids=0,0,0,0"
+sleep 0.5
+[ "$(status /stream/0)" = 200 ] || fail "camera listed four times by one viewer counted more than once"
@@ -0,0 +1,14 @@
+#!/bin/sh
+# A viewer of a camera that has been paused for want of viewers, which must
+# be sent the frames it takes once woken up rather than the one from before.
+
+. ./lib.sh
+
+start_hawkeye hawkeye -p "$PORT" -D pattern -F 10 -I 1
+wait_for_log "$TMP/hawkeye.log" "Pausing camera 0" || fail "camera was not paused"
+
+started=$(date +%s.%N)
+curl -s -m 1 -o "$TMP/stream" "http://127.0.0.1:$PORT/stream/0?timestamps=1"
+first=$(grep -a '^X-Timestamp:' "$TMP/stream" | head -1 | tr -d '\r' | awk '{ print $2 }')
+[ -n "$first" ] || fail "no frames once the camera was woken up"
+awk "BEGIN { exit !($first >= $started) }" || fail "first frame was from before the camera was paused"
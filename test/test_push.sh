@@ -0,0 +1,42 @@
+#!/bin/sh
+# Pushing to a stub ingest server named by a host name, and to one whose
+# name does not resolve, which must not hold up serving clients.
+
+. ./lib.sh
+
+INGEST=$((PORT + 1))
+
+# Keeps whatever the camera pushes, answers nothing
+python3 - "$INGEST" "$TMP/pushed" <<'PY' &
+import socket, sys
+
+listener = socket.socket()
+listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+listener.bind(("127.0.0.1", int(sys.argv[1])))
+listener.listen(1)
+conn, _ = listener.accept()
+with open(sys.argv[2], "wb") as out:
+    while True:
+        data = conn.recv(65536)
+        if not data:
+            break
+        out.write(data)
+        out.flush()
+PY
+PIDS="$PIDS $!"
+sleep 0.5
+
+start_hawkeye push -p "$PORT" -D pattern -F 10 -O "http://localhost:$INGEST/ingest"
+
+i=0
+while [ "$(cat "$TMP/pushed" 2>/dev/null | grep -ac 'Content-Type: image/jpeg')" -lt 5 ]; do
+    i=$((i + 1))
+    [ $i -gt 50 ] && fail "fewer than 5 frames pushed"
+    sleep 0.1
+done
+head -1 "$TMP/pushed" | grep -aq '^POST /ingest HTTP/1.1' || fail "push did not start with a POST"
+curl -s "http://127.0.0.1:$PORT/stats" | grep -q '"push": {"connected": true' || fail "/stats does not report pushing"
+
+start_hawkeye unresolvable -p "$((PORT + 2))" -D pattern -F 10 -O "http://ingest.invalid/ingest"
+wait_for_log "$TMP/unresolvable.log" "Ingest server" || fail "unresolvable ingest server not reported"
+curl -s -o /dev/null -m 1 "http://127.0.0.1:$((PORT + 2))/stream/info" || fail "not serving while looking the ingest server up"
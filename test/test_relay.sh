@@ -0,0 +1,47 @@
+#!/bin/sh
+# A hawkeye relaying another one on loopback, looked up by name, and an
+# upstream with a part that has no Content-Length and is larger than any
+# frame, which must be dropped rather than overflow the frame buffer.
+
+. ./lib.sh
+
+UPSTREAM=$PORT
+RELAY=$((PORT + 1))
+BAD=$((PORT + 2))
+
+start_hawkeye upstream -p "$UPSTREAM" -D pattern -F 10
+start_hawkeye relay -p "$RELAY" -D "http://localhost:$UPSTREAM/stream/0" -F 10
+
+# The relay only pulls the upstream while somebody watches
+curl -s -m 2 -o "$TMP/stream" "http://127.0.0.1:$RELAY/stream/0" &
+viewer=$!
+wait_for_log "$TMP/relay.log" "Connected to upstream" || fail "relay did not connect"
+
+fetch_still "$TMP/still.jpg" "http://127.0.0.1:$RELAY/still/0" || fail "no still from the relay"
+wait "$viewer"
+[ "$(grep -ac 'Content-Type: image/jpeg' "$TMP/stream")" -ge 5 ] || fail "relayed stream has fewer than 5 frames"
+
+# Short enough to fit the receive buffer, too long for the frame buffer
+python3 - "$BAD" <<'PY' &
+import socket, sys
+
+listener = socket.socket()
+listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+listener.bind(("127.0.0.1", int(sys.argv[1])))
+listener.listen(1)
+conn, _ = listener.accept()
+conn.recv(4096)
+try:
+    conn.sendall(b"HTTP/1.0 200 OK\r\nContent-Type: multipart/x-mixed-replace;boundary=xyz\r\n\r\n"
+                 b"--xyz\r\nContent-Type: image/jpeg\r\n\r\n\xff\xd8" + b"\x55" * (1024 * 1024 + 20000) + b"\r\n--xyz\r\n")
+    conn.recv(1)
+except OSError:
+    pass
+PY
+PIDS="$PIDS $!"
+sleep 0.5
+
+start_hawkeye bad -p "$((PORT + 3))" -D "http://127.0.0.1:$BAD/" -F 10
+curl -s -o /dev/null -m 1 "http://127.0.0.1:$((PORT + 3))/stream/0"
+wait_for_log "$TMP/bad.log" "not an MJPEG stream hawkeye understands" || fail "oversized part was not turned away"
+curl -s -o /dev/null "http://127.0.0.1:$((PORT + 3))/stream/info" || fail "relay gone after an oversized part"
@@ -0,0 +1,7 @@
+#!/bin/sh
+# RFC 2435 packetization, through a depacketizer and back, see rtp_roundtrip.c
+
+. ./lib.sh
+
+[ -x ./rtp_roundtrip ] || fail "rtp_roundtrip is not built, see the Makefile"
+./rtp_roundtrip > "$TMP/roundtrip.log" 2>&1 || { cat "$TMP/roundtrip.log" >&2; fail "round trip"; }
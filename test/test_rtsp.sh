@@ -0,0 +1,41 @@
+#!/bin/sh
+# RTSP requests with a body, which must be skipped, and with a Content-Length
+# that is negative, too large or not a number, which must be answered with a
+# 400 and the connection closed.
+
+. ./lib.sh
+
+start_hawkeye hawkeye -p "$PORT" -R "$((PORT + 1))" -U "$((PORT + 2))" -D pattern
+
+python3 - "$((PORT + 1))" <<'PY' || fail "RTSP Content-Length"
+import socket, sys
+
+def connect():
+    sock = socket.create_connection(("127.0.0.1", int(sys.argv[1])))
+    sock.settimeout(2)
+    return sock
+
+def replies(sock):
+    data = b""
+    try:
+        while chunk := sock.recv(4096):
+            data += chunk
+    except socket.timeout:
+        return data, False
+    return data, True
+
+sock = connect()
+sock.sendall(b"SET_PARAMETER * RTSP/1.0\r\nCSeq: 1\r\nContent-Length: 10\r\n\r\nOPTIONS * "
+             b"OPTIONS * RTSP/1.0\r\nCSeq: 2\r\n\r\n")
+sock.shutdown(socket.SHUT_WR)
+data, _ = replies(sock)
+assert data.count(b"RTSP/1.0 ") == 2 and b"CSeq: 2\r\n" in data, "body was not skipped: %r" % data
+
+for length in (b"-1", b"-4000", b"100000", b"99999999999999999999", b"abc", b"12x"):
+    sock = connect()
+    sock.sendall(b"OPTIONS * RTSP/1.0\r\nCSeq: 1\r\nContent-Length: " + length + b"\r\n\r\n"
+                 b"OPTIONS * RTSP/1.0\r\nCSeq: 2\r\n\r\n")
+    data, closed = replies(sock)
+    assert data.startswith(b"RTSP/1.0 400 "), "Content-Length %s: %r" % (length, data)
+    assert data.count(b"RTSP/1.0 ") == 1 and closed, "Content-Length %s: connection kept open" % length
+PY
@@ -0,0 +1,78 @@
+#!/bin/sh
+# The last frame of a relayed camera whose upstream has gone is sent again
+# now and then, while one whose upstream is merely slow only sends its own,
+# and one whose upstream never answered sends nothing.
+
+. ./lib.sh
+
+UPSTREAM=$PORT
+RELAY=$((PORT + 1))
+SLOW=$((PORT + 2))
+
+# timestamps file: the X-Timestamp of each part, one per line
+timestamps() {
+    grep -a '^X-Timestamp:' "$1" | tr -d '\r' | awk '{ print $2 }'
+}
+
+start_hawkeye upstream -p "$UPSTREAM" -D pattern -F 10
+upstream=$LAST
+start_hawkeye relay -p "$RELAY" -D "http://localhost:$UPSTREAM/stream/0" -F 10
+
+curl -s -m 6 -o "$TMP/relayed" "http://127.0.0.1:$RELAY/stream/0?timestamps=1" &
+viewer=$!
+wait_for_log "$TMP/relay.log" "Connected to upstream" || fail "relay did not connect"
+fetch_still "$TMP/still.jpg" "http://127.0.0.1:$RELAY/still/0" || fail "no still from the relay"
+kill "$upstream"
+wait "$viewer"
+
+last=$(timestamps "$TMP/relayed" | tail -1)
+[ "$(timestamps "$TMP/relayed" | grep -c "^$last\$")" -ge 3 ] || fail "last frame was not repeated after the upstream went"
+
+# Enough frames to fill the ring quickly, then one every 1.5 seconds, to
+# each connection in turn
+python3 - "$SLOW" "$TMP/still.jpg" <<'PY' &
+import socket, sys, time
+
+listener = socket.socket()
+listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+listener.bind(("127.0.0.1", int(sys.argv[1])))
+listener.listen(1)
+jpeg = open(sys.argv[2], "rb").read()
+while True:
+    conn, _ = listener.accept()
+    conn.recv(4096)
+    try:
+        conn.sendall(b"HTTP/1.0 200 OK\r\nContent-Type: multipart/x-mixed-replace;boundary=xyz\r\n\r\n--xyz\r\n")
+        for i in range(20):
+            conn.sendall(b"Content-Type: image/jpeg\r\nX-Timestamp: %.3f\r\nContent-Length: %d\r\n\r\n"
+                         % (time.time(), len(jpeg)) + jpeg + b"\r\n--xyz\r\n")
+            time.sleep(0.1 if i < 10 else 1.5)
+    except OSError:
+        pass
+    conn.close()
+PY
+PIDS="$PIDS $!"
+sleep 0.5
+
+start_hawkeye slow -p "$((PORT + 3))" -D "http://127.0.0.1:$SLOW/" -F 10
+curl -s -m 6 -o "$TMP/slow" "http://127.0.0.1:$((PORT + 3))/stream/0?timestamps=1"
+[ "$(timestamps "$TMP/slow" | wc -l)" -ge 3 ] || fail "slow upstream sent fewer than 3 frames"
+[ -z "$(timestamps "$TMP/slow" | uniq -d)" ] || fail "frame of a slow upstream was sent twice"
+
+# An upstream that never answers leaves nothing to repeat, and empty parts
+# must not be sent in the meantime
+python3 - "$((PORT + 4))" <<'PY' &
+import socket, sys, time
+
+listener = socket.socket()
+listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+listener.bind(("127.0.0.1", int(sys.argv[1])))
+listener.listen(5)
+time.sleep(30)
+PY
+PIDS="$PIDS $!"
+sleep 0.5
+
+start_hawkeye silent -p "$((PORT + 5))" -D "http://127.0.0.1:$((PORT + 4))/" -F 10
+curl -s -m 2 -o "$TMP/silent" "http://127.0.0.1:$((PORT + 5))/stream/0?timestamps=1"
+[ "$(timestamps "$TMP/silent" | wc -l)" -eq 0 ] || fail "parts were sent before the upstream had any"
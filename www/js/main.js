@@ -329,6 +329,71 @@ jQuery(document).ready(function($) {
         });
     }
 
+    // Streams one camera over /ws/stream/N. Each message is a small binary
+    // header followed by a JPEG; see ws_put_meta() in the server. The next
+    // frame is only sent after this one has been decoded and acknowledged,
+    // so a slow browser never has frames piling up.
+    function streamOverWebSocket($img, baseURL, index) {
+        var url = new URL(baseURL + 'ws/stream/' + index, window.location.href),
+            objectURL = null,
+            ws;
+
+        url.protocol = (url.protocol == 'https:') ? 'wss:' : 'ws:';
+
+        ws = new WebSocket(url.href);
+        ws.binaryType = 'arraybuffer';
+
+        ws.onmessage = function(ev) {
+            var view = new DataView(ev.data),
+                headerLength = view.getUint16(2),
+                capturedAt = view.getUint32(8) * 4294967296 + view.getUint32(12),
+                blob = new Blob([new Uint8Array(ev.data, headerLength)], {type: 'image/jpeg'});
+
+            // A frame that cannot be decoded fires error rather than load.
+            // It is acknowledged all the same, or the server would wait
+            // for the ack forever, and the last good frame stays up.
+            $img.off('.websocket').on('load.websocket error.websocket', function(e) {
+                var src = $img.attr('src');
+
+                $img.off('.websocket');
+
+                if (e.type == 'load') {
+                    if (objectURL !== null) {
+                        URL.revokeObjectURL(objectURL);
+                    }
+                    objectURL = src;
+
+                    $img.data('frame', view.getUint32(4));
+                    $img.data('latency', Date.now() - capturedAt);
+                }
+                else {
+                    URL.revokeObjectURL(src);
+                    if (objectURL !== null) {
+                        $img.attr('src', objectURL);
+                    }
+                }
+
+                if (ws.readyState == WebSocket.OPEN) {
+                    ws.send('ack');
+                }
+            });
+
+            $img.attr('src', URL.createObjectURL(blob));
+        };
+
+        ws.onclose = function() {
+            setTimeout(function() {
+                streamOverWebSocket($img, baseURL, index);
+            }, RECONNECT_TIMEOUT);
+        };
+
+        $img.data('websocket', ws);
+    }
+
+    function supportsWebSocketStreams() {
+        return window.WebSocket && window.URL && window.Blob && window.DataView;
+    }
+
     function addSlide($carousel, $node) {
         var $indicator = $('<li></li>'),
             $item = $('<div class="item"></div>').append($node);
@@ -344,8 +409,14 @@ jQuery(document).ready(function($) {
         var i, $img;
 
         for (i = 0; i < streamInfo.stream_count; i++) {
-            $img = $('<img class="mjpeg" />').attr('src', baseURL + 'stream/' + i);
-            $img.data('src', $img.attr('src'));
+            if (supportsWebSocketStreams()) {
+                $img = $('<img class="ws-stream" />');
+                streamOverWebSocket($img, baseURL, i);
+            }
+            else {
+                $img = $('<img class="mjpeg" />').attr('src', baseURL + 'stream/' + i);
+                $img.data('src', $img.attr('src'));
+            }
 
             HAWKEYE_WIDTH = Math.max(HAWKEYE_WIDTH, streamInfo.width);
             HAWKEYE_HEIGHT = Math.max(HAWKEYE_HEIGHT, streamInfo.height);